@@ -5,6 +5,9 @@
 //	Handle serial communication with Arduino
 //
 // Description:
+//	Frames scripts and responses, pipelines scripts and sends them again after
+//	transmission errors. Bytes go through a transport (see CTransport.h): a serial
+//	port, a socket or a simulated Arduino.
 //
 // Coding Conventions:
 //	- Variable names use the "InterCaps" convention
@@ -26,6 +29,23 @@
 //	03.04.17 PK	Adapt for use with Arduino MEGA 2560
 //	21.08.17 PK	Define WAIT_FOR_ARDUINO_REBOOT for Windows
 //	25.05.20 PK	Add __CYGWIN__ for MSYS2
+//	17.10.26 MB	Split WriteAndRead into SendScript and ReceiveResponse for streaming
+//	17.10.26 MB	Add Submit/Complete to pipeline scripts
+//	17.10.26 MB	Add baud rate negotiation (NegotiateBaudRate), Ping, read timeout
+//	17.10.26 MB	Zero-copy I/O: responses are read into a receive buffer and returned as
+//				frame views, scripts are written with gathered writes
+//	17.10.26 MB	Non-blocking I/O with per-transaction deadlines, TryComplete and
+//				TryReceiveResponse for event loops (see CEventLoop.h)
+//	17.10.26 MB	Frames delimited by FRAME_FLAG with CRC-16/CCITT, resynchronize after errors
+//	17.10.26 MB	Number the scripts, send a submitted script again when its response is lost
+//				or corrupted (MAX_SCRIPT_RETRIES, GetNbRetransmissions)
+//	17.10.26 MB	Add WaitForReboot to the constructor and GetResponseTimeOut for CDevicePool
+//	17.10.26 MB	Move serial port handling to CSerialTransport, send bytes through a CTransport
+//	17.10.26 MB	Replace WaitForReboot by an eOpenMode: kOpenNoReset finds the Arduino left
+//				running with pings (Reconnect) instead of rebooting it
+//	17.10.26 MB	Assemble the chunks of a response (RESPONSE_FLAG_CHUNK) into one response
+//	17.10.26 MB	ReceiveResponse and TryReceiveResponse skip corrupted or truncated frames
+//				(GetNbDroppedFrames)
 //
 // Copyright (c) 2016 Metrolab Technology SA, Geneva,
 //	Switzerland
@@ -33,40 +53,36 @@
 #ifndef CARDUINO_SERIAL_PORT_H
 #define CARDUINO_SERIAL_PORT_H
 
-#if defined(_WIN32) || defined(_WIN32_WCE) || defined(__WIN32__) || defined(__CYGWIN__)
-#  ifndef WIN32
-#    define WIN32
-#  endif
-#endif
-
 // Include files
 #include <vector>
+#include <CTransport.h>
 
 // Set up to use Arduino MEGA 2560 - worst-case for memory usage
 #define __AVR_ATmega2560__
 
 #include <MV2HostConstants.h>
 
-#ifdef WIN32
-	#include <windows.h>
-#else
-	#include <unistd.h>
-	#include <fcntl.h>
-	#include <errno.h>
-	#include <termios.h>
-#endif
-
-#ifdef WIN32
-	#define WAIT_FOR_ARDUINO_REBOOT 2000
-	typedef HANDLE File_t;
-	typedef DWORD NoOfBytes_t;
-#else
-	#define WAIT_FOR_ARDUINO_REBOOT 2
-	typedef int File_t;
-	typedef ssize_t NoOfBytes_t;
-#endif
+// Time (ms) allowed for a response on top of the script duration and transfer time
+#define RESPONSE_TIMEOUT_MARGIN				1000
+// Number of times a submitted script is sent again before its error is reported
+#define MAX_SCRIPT_RETRIES					3
+// Time out (ms) of the ping confirming a new baud rate
+#define BAUD_RATE_PING_TIMEOUT				200
+// Time (ms) given to the Arduino to switch baud rate
+#define BAUD_RATE_SWITCH_DELAY				5
+// Highest baud rate proposed to the Arduino
+#define MAX_BAUD_RATE						2000000
+// Time (ms) allowed to find an Arduino left running, long enough for it to reboot if it did
+#define RECONNECT_TIMEOUT					3000
+// Time out (ms) of each ping looking for an Arduino left running
+#define RECONNECT_PING_TIMEOUT				50
+// Receive buffer length (16-bit words): room for a decoded response and the bytes read after it
+#define RX_BUFFER_LENGTH					(2 * MAX_RESPONSE_LENGTH)
+// Transmit buffer length (bytes): every byte of the script escaped, and two flags
+#define TX_BUFFER_LENGTH					(2 * SCRIPT_BUFFER_LENGTH * sizeof(unsigned short) + 2)
 
 #include <CMV2HostException.h>
+#include <CDeadline.h>
 #include <CHostScript.h>
 
 using namespace std;
@@ -74,51 +90,239 @@ using namespace std;
 // Our namespace
 namespace MV2Host
 {
+	// View on a decoded frame (header, data, status, CRC) in the receive buffer.
+	// It is valid until the next frame is read.
+	// The chunks of a chunked response (see RESPONSE_FLAG_CHUNK) are assembled into one response,
+	// results decoded, with the header and status of its last frame: its length word only holds
+	// the low 16 bits of the length, Size is exact.
+	typedef struct FrameView
+	{
+		const tResult				*pData;				// First word of the frame
+		unsigned int				Size;				// Number of words
+	} tFrameView;
+
 	class CArduinoSerialPort
 	{
 	public:
-		// Constructor
+		// Constructor: open the transport of a port name (see CTransport::Create).
+		// kOpenReset reboots the Arduino and waits until it is ready, kOpenResetNoWait lets
+		// the caller open several ports and wait once. kOpenNoReset leaves the Arduino running
+		// and pings it until it answers: this takes milliseconds instead of seconds. If it
+		// does not answer within RECONNECT_TIMEOUT, it is rebooted.
 		CArduinoSerialPort (
-									const char 					*pPortName);				// Port name
+									const char 					*pPortName,					// Port name
+									eOpenMode					OpenMode = kOpenReset);		// How to open a serial port
+		// Constructor: use a transport, deleted with this object
+		CArduinoSerialPort (
+									CTransport					*pTransport);				// Transport
 		// Destructor
 		~CArduinoSerialPort ();
 
-		// Write commands buffer to the serial port and read response
+		// Write commands buffer to the serial port and read response.
+		// ExpectedDuration is the time the Arduino needs to execute the script.
 		void WriteAndRead (
-									vector<unsigned short>		&rCommandsBuffer,			// Commands buffer
-									tResult						*pResponseBuffer,			// Response buffer
-									unsigned int				&rResponseBufferSize);		// Size of response buffer
+									const vector<unsigned short>	&rCommandsBuffer,		// Commands buffer
+									tFrameView					&rResponse,					// Response
+									unsigned int				ExpectedDuration = 0);		// Execution time (ms)
+
+		// Submit a script: write it to the serial port without waiting for its response.
+		// Up to SCRIPT_BUFFER_COUNT scripts may be submitted before calling Complete.
+		// Its response is due ExpectedDuration plus transfer time and RESPONSE_TIMEOUT_MARGIN
+		// after the expected end of the previous pending scripts.
+		void Submit (
+									const vector<unsigned short>	&rCommandsBuffer,		// Commands buffer
+									unsigned int				ExpectedDuration = 0);		// Execution time (ms)
+
+		// Complete the oldest submitted script: wait for its response until its deadline.
+		// If the response is lost or corrupted, or the Arduino did not receive the script correctly,
+		// the script is sent again up to MAX_SCRIPT_RETRIES times. The Arduino answers with the
+		// response it kept if it has not executed another script since, otherwise it executes the
+		// script again. Scripts that start a stream or switch the baud rate are only sent again
+		// if the Arduino did not receive them correctly.
+		void Complete (
+									tFrameView					&rResponse);				// Response
+
+		// Complete the oldest submitted script if its response is already received, without waiting.
+		// Returns false if the response is not complete yet, throws once it has been sent
+		// MAX_SCRIPT_RETRIES times and its deadline has expired again.
+		bool TryComplete (
+									tFrameView					&rResponse);				// Response
+
+		// Get number of submitted scripts not completed yet
+		unsigned int GetNbPendingScripts ()
+		{
+			return m_NbPendingScripts;
+		}
+
+		// Get number of times a submitted script has been sent again
+		unsigned long GetNbRetransmissions ()
+		{
+			return m_NbRetransmissions;
+		}
+
+		// Get number of corrupted or truncated frames dropped by ReceiveResponse and TryReceiveResponse
+		unsigned long GetNbDroppedFrames ()
+		{
+			return m_NbDroppedFrames;
+		}
+
+		// Write commands buffer to the serial port
+		void SendScript (
+									const vector<unsigned short>	&rCommandsBuffer);		// Commands buffer
+
+		// Read a response and check its CRC.
+		// ExpectedDuration is the time the Arduino needs to produce the response.
+		// A corrupted or truncated frame is dropped and the next one is read: a stream goes on.
+		void ReceiveResponse (
+									tFrameView					&rResponse,					// Response
+									unsigned int				ExpectedDuration = 0);		// Execution time (ms)
+
+		// Read a response if it is already received, without waiting, and check its CRC.
+		// Returns false if the response is not complete yet. Drops frames like ReceiveResponse.
+		bool TryReceiveResponse (
+									tFrameView					&rResponse);				// Response
+
+		// Ask the Arduino to stop a stream
+		void SendStreamStopRequest ();
+
+		// Switch both ends to the highest baud rate up to MaxBaudRate that works.
+		// Falls back to the default baud rate if no higher baud rate works.
+		void NegotiateBaudRate (
+									unsigned long				MaxBaudRate);				// Highest baud rate to try
+
+		// Get current baud rate
+		unsigned long GetBaudRate ()
+		{
+			return m_BaudRate;
+		}
+
+		// Check that the Arduino answers within TimeOut, return its firmware version.
+		// Responses to other scripts, e.g. of a previous session, are skipped.
+		unsigned short Ping (
+									unsigned int				TimeOut = RESPONSE_TIMEOUT_MARGIN);	// Time out (ms)
+
+		// Get time out (ms) of a response, given the time the Arduino needs to produce it
+		unsigned int GetResponseTimeOut (
+									unsigned int				ExpectedDuration);			// Execution time (ms)
+
+		// Get port handle, e.g. to wait for it in an event loop
+		File_t GetHandle ()
+		{
+			return m_pTransport->GetHandle();
+		}
+
+		// Get transport
+		CTransport *GetTransport ()
+		{
+			return m_pTransport;
+		}
 
 	private:
-		File_t						m_PortHandle;											// Port handle
+		CTransport					*m_pTransport;											// Transport
+		unsigned int				m_NbPendingScripts;										// Submitted scripts not completed yet
+		unsigned int				m_FirstScript;											// Index of the oldest pending script
+		vector<unsigned short>		m_Scripts[SCRIPT_BUFFER_COUNT];							// Commands of the pending scripts, to send them again
+		unsigned short				m_Sequences[SCRIPT_BUFFER_COUNT];						// Sequence numbers of the pending scripts
+		CDeadline					m_Deadlines[SCRIPT_BUFFER_COUNT];						// Deadlines of the pending scripts
+		unsigned int				m_Durations[SCRIPT_BUFFER_COUNT];						// Expected durations (ms) of the pending scripts
+		unsigned int				m_Retries[SCRIPT_BUFFER_COUNT];							// Retries left for the pending scripts
+		bool						m_Repeatable[SCRIPT_BUFFER_COUNT];						// Pending script may be executed twice
+		vector<unsigned short>		m_Responses[SCRIPT_BUFFER_COUNT];						// Responses received before the oldest one
+		bool						m_Received[SCRIPT_BUFFER_COUNT];						// Response is in m_Responses
+		unsigned short				m_NextSequence;											// Sequence number of the next script
+		unsigned long				m_NbRetransmissions;									// Number of scripts sent again
+		unsigned long				m_NbDroppedFrames;										// Number of frames dropped by the stream reads
+		unsigned long				m_BaudRate;												// Current baud rate
+		unsigned short				m_RxBuffer[RX_BUFFER_LENGTH];							// Receive buffer, decoded in place
+		unsigned int				m_RxDecoded;											// Number of decoded bytes of the current frame
+		unsigned int				m_RawStart;												// Index of the first byte not decoded yet
+		unsigned int				m_RawEnd;												// Index after the last byte read
+		bool						m_InFrame;												// A FRAME_FLAG started a frame
+		bool						m_Escaped;												// Previous byte was FRAME_ESCAPE
+		unsigned char				m_TxBuffer[TX_BUFFER_LENGTH];							// Transmit buffer
+		vector<unsigned short>		m_Chunks;												// Header and decoded results of the chunks assembled
+		vector<unsigned short>		m_DecodedChunk;											// Chunk being assembled, decoded
+		unsigned short				m_NbChunks;												// Number of chunks assembled
+		bool						m_ChunksValid;											// No chunk was lost since the first one
+
+		// Initialize the protocol state
+		void Initialize ();
+
+		// Find the Arduino left running by a previous session: ping it at the default baud rate
+		// and at those a previous session may have negotiated, until RECONNECT_TIMEOUT.
+		// Reboot it if it does not answer.
+		void Reconnect ();
+
+		// Set baud rate of the transport
+		void SetBaudRate (
+									unsigned long				BaudRate);					// Baud rate
+
+		// Get time (ms) needed to transfer NbWords 16-bit words at the current baud rate
+		unsigned int GetTransferTime (
+									unsigned int				NbWords);					// Number of words
+
+		// Flush anything already received
+		void Flush ();
 
-		// Set serial port settings
-		void SetSerialPortSettings ();
+		// Get error code of a response
+		unsigned short GetResponseError (
+									const tFrameView			&rResponse);				// Response
 
-		// Write to the serial port
+		// Write to the transport
 		void Write (
-									unsigned short				*pBuffer,					// Buffer to write
+									const void					*pBuffer,					// Buffer to write
 									unsigned int				Size);						// Size of buffer
 
-		// Read serial port (low-level)
-		void LowLevelRead (
-									unsigned char				*pBuffer,					// Buffer
-									NoOfBytes_t					NoOfBytesToRead,			// Number of bytes to read
-									NoOfBytes_t					&rNoOfBytesRead);			// Number of bytes read
-
-		// Read serial port
-		void Read (
-									unsigned short				*pBuffer,					// Buffer
-									NoOfBytes_t					&rNoOfBytesRead);			// Number of bytes read
-
-		// Generate CRC
-		unsigned short GenerateCrc (
-									unsigned short				Size,						// Size of message
-									unsigned short				*pMessage);					// Message
-		// Check CRC
-		bool CheckCrc (
-									int Size,												// Size of message
-									unsigned short				*pMessage);					// Message
+		// Write a frame: flag, header, payload and CRC escaped, flag
+		void WriteFrame (
+									const unsigned short		*pPayload,					// Payload
+									unsigned int				PayloadLength,				// Number of words
+									unsigned short				Sequence);					// Sequence number
+
+		// Get the time out (ms) of a response that comes after those of all pending scripts
+		unsigned int GetPendingTimeOut ();
+
+		// Complete the oldest submitted script, wait for its response if Wait is true
+		bool CompleteScript (
+									tFrameView					&rResponse,					// Response
+									bool						Wait);						// Wait until the deadline
+
+		// Send a pending script again. Returns false if it must not be sent again.
+		bool RetryScript (
+									unsigned int				Index,						// Index of the pending script
+									bool						MayBeExecuted);				// The Arduino may have executed it
+
+		// Find the pending script a response belongs to, -1 if none
+		int FindPendingScript (
+									const tFrameView			&rResponse);				// Response
+
+		// Read available bytes after the decoded ones, wait for at least one until the deadline.
+		// Without deadline, returns false if no byte is available.
+		bool ReadRxBuffer (
+									const CDeadline				*pDeadline);				// Deadline, or NULL
+
+		// Decode next frame in the receive buffer. Bytes outside frames are discarded.
+		// Without deadline, returns false if the frame is not complete yet.
+		// A frame of a bad length throws, or is counted and skipped if DropBadFrames is true.
+		bool ReadFrame (
+									tFrameView					&rFrame,					// Frame
+									const CDeadline				*pDeadline,					// Deadline, or NULL
+									bool						DropBadFrames = false);		// Skip frames of a bad length
+
+		// Read a response and check its CRC, wait for it until the deadline if Wait is true.
+		// Otherwise, returns false if the response is not complete yet.
+		// Each chunk of a chunked response restarts the deadline.
+		// A corrupted or truncated frame throws, or is counted and skipped if DropBadFrames is true.
+		bool ReadResponse (
+									tFrameView					&rResponse,					// Response
+									CDeadline					*pDeadline,					// Deadline, or NULL
+									bool						Wait = true,				// Wait until the deadline
+									bool						DropBadFrames = false);		// Skip corrupted or truncated frames
+
+		// Assemble a frame of a chunked response. Returns true if it is the last frame and all the
+		// chunks were assembled: rFrame is then the assembled response.
+		bool AssembleChunk (
+									tFrameView					&rFrame);					// Frame, assembled response
 	}; // CArduinoSerialPort
 } // namespace MV2Host
 #endif // CARDUINO_SERIAL_PORT_H
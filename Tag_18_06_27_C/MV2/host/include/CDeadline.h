@@ -0,0 +1,78 @@
+// Name:
+//	CDeadline.h
+//
+// Purpose:
+//	Point in time by which an operation must complete.
+//
+// Description:
+//	A deadline is created with a time out (ms) counted from now. It reports
+//	the time remaining before it expires and the time elapsed since it was
+//	created, e.g. to report precise timeouts.
+//
+// Coding Conventions:
+//	- Variable names use the "InterCaps" convention
+//	- Local variables are prefixed with an underscore, '_'
+//	- Private class members are prefixed with 'm_'
+//	- Private class methods are prefixed with an underscore, '_'
+//	- Pointer variables are prefixed with 'p'
+//	- Reference variables are prefixed with 'r'
+//	- Enumerated types are prefixed with 'e'
+//	- Enumerated type values are prefixed with 'k'
+//	- Classes are prefixed with 'C'
+//	- Constants are all uppercase
+//	The above conventions can also be combined:
+//	- A local pointer variable would be prefixed '_p'
+//	- A private class pointer member would be prefixed 'm_p'
+//
+// Change log:
+//	17.10.26 MB	Original version
+//
+// Copyright (c) 2016 Metrolab Technology SA, Geneva,
+//	Switzerland
+
+#ifndef CDEADLINE_H
+#define CDEADLINE_H
+
+// Include files
+#include <chrono>
+
+// Our namespace
+namespace MV2Host
+{
+	class CDeadline
+	{
+		private :
+			typedef std::chrono::steady_clock	tClock;
+
+			tClock::time_point	m_Start;		// Creation time
+			tClock::time_point	m_End;			// Expiration time
+
+		public :
+			// Expire TimeOut ms after now
+			CDeadline(unsigned int TimeOut = 0)		// Time out (ms)
+				: m_Start (tClock::now()), m_End (m_Start + std::chrono::milliseconds(TimeOut))
+			{}
+
+			// Check whether the deadline has expired
+			bool IsExpired() const
+			{	return tClock::now() >= m_End;	}
+
+			// Get time remaining (ms, rounded up) before the deadline expires, 0 once expired
+			unsigned int GetRemainingMs() const
+			{
+				tClock::duration _Remaining = m_End - tClock::now();
+				if (_Remaining <= tClock::duration::zero())
+					return 0;
+				return static_cast<unsigned int>((std::chrono::duration_cast<std::chrono::microseconds>(_Remaining).count() + 999) / 1000);
+			}
+
+			// Get time elapsed (ms) since the deadline was created
+			unsigned int GetElapsedMs() const
+			{	return static_cast<unsigned int>(std::chrono::duration_cast<std::chrono::milliseconds>(tClock::now() - m_Start).count());	}
+
+			// Get time (ms) between creation and expiration
+			unsigned int GetTimeOutMs() const
+			{	return static_cast<unsigned int>(std::chrono::duration_cast<std::chrono::milliseconds>(m_End - m_Start).count());	}
+	};
+} // namespace MV2Host
+#endif // CDEADLINE_H
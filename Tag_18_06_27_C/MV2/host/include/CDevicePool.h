@@ -0,0 +1,160 @@
+// Name:
+//	CDevicePool.h
+//
+// Purpose:
+//	Acquire measurements from several MV2 devices at once
+//
+// Description:
+//	Each device has its own serial port and script. The measurement scripts of all
+//	devices are submitted (or streamed) at the same time and a single event loop
+//	completes them as their responses arrive, so the throughput grows with the
+//	number of devices until the host's serial links saturate.
+//	The measurements of all devices are merged into one stream, in the order they
+//	were received. Each line of results is prefixed with the index of the device and
+//	the time it was received.
+//	Not available on Windows (see CEventLoop.h).
+//
+// Coding Conventions:
+//	- Variable names use the "InterCaps" convention
+//	- Local variables are prefixed with an underscore, '_'
+//	- Private class members are prefixed with 'm_'
+//	- Private class methods are prefixed with an underscore, '_'
+//	- Pointer variables are prefixed with 'p'
+//	- Reference variables are prefixed with 'r'
+//	- Enumerated types are prefixed with 'e'
+//	- Enumerated type values are prefixed with 'k'
+//	- Classes are prefixed with 'C'
+//	- Constants are all uppercase
+//	The above conventions can also be combined:
+//	- A local pointer variable would be prefixed '_p'
+//	- A private class pointer member would be prefixed 'm_p'
+//
+// Change log:
+//	17.10.26 MB	Original version
+//	17.10.26 MB	Add OpenMode to the constructor
+//
+// Copyright (c) 2016 Metrolab Technology SA, Geneva,
+//	Switzerland
+
+#ifndef CDEVICE_POOL_H
+#define CDEVICE_POOL_H
+
+#include <CEventLoop.h>
+
+#ifndef WIN32
+
+// Include files
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <CArduinoSerialPort.h>
+#include <CHostScript.h>
+
+// Headings of the columns added to the results
+#define POOL_DEVICE_HEADING					"device"
+#define POOL_TIME_HEADING					"time"
+
+// Time (ms) between two checks of the response deadlines of all devices
+#define POOL_POLL_PERIOD					100
+
+using namespace std;
+
+// Our namespace
+namespace MV2Host
+{
+	// Measurement of the merged stream
+	typedef struct PoolSample
+	{
+		unsigned int				Device;				// Index of the device
+		double						Time;				// Time (s) the measurement was received, since Start
+		string						CsvResults;			// Results in CSV format, prefixed with device and time
+		string						CsvHeadings;		// Headings in CSV format, prefixed with device and time
+	} tPoolSample;
+
+	class CDevicePool : public CEventHandler
+	{
+	public:
+		// Constructor: open all ports and read the script of every device.
+		// With kOpenReset, the Arduinos reboot together and are waited for once.
+		CDevicePool (
+									const vector<string>		&rPortNames,				// Port names
+									const char					*pScriptFileName,			// Script filename
+									const char					*pSchemaFileName,			// Schema filename
+									eOpenMode					OpenMode = kOpenReset);		// How to open the serial ports
+		// Destructor
+		~CDevicePool ();
+
+		// Negotiate the baud rate and execute the initialization script of every device
+		void Initialize (
+									unsigned long				MaxBaudRate);				// Highest baud rate to try
+
+		// Start the measurement script on every device
+		void Start ();
+
+		// Wait up to POOL_POLL_PERIOD for measurements and add them to the merged stream.
+		// Returns false once every device has executed its measurement script repeat times.
+		bool Run ();
+
+		// Get the oldest measurement of the merged stream. Returns false if there is none.
+		bool GetSample (
+									tPoolSample					&rSample);					// Measurement
+
+		// Stop the measurement of every device and discard pending measurements
+		void Stop ();
+
+		// Get number of devices
+		unsigned int GetNbDevices ()
+		{
+			return m_Devices.size();
+		}
+
+		// Called by the event loop when a serial port is ready
+		virtual void OnEvent (
+									File_t						FileDescriptor,				// File descriptor
+									unsigned int				Events);					// Ready events
+
+	private:
+		// State of a device
+		typedef struct PoolDevice
+		{
+			string					PortName;			// Port name
+			CArduinoSerialPort		*pArduino;			// Serial port
+			CHostScript				*pHostScript;		// Scripts and results
+			int						NbSubmitted;		// Number of measurement scripts submitted
+			int						NbCompleted;		// Number of measurements received
+			bool					Stopping;			// Stream stop requested
+			bool					Done;				// All measurements received
+		} tPoolDevice;
+
+		vector<tPoolDevice>			m_Devices;											// Devices
+		map<File_t, unsigned int>	m_DeviceIndexes;									// Device indexes by port handle
+		CEventLoop					m_EventLoop;										// Waits for all ports
+		deque<tPoolSample>			m_Samples;											// Merged stream
+		chrono::steady_clock::time_point	m_StartTime;								// Time of Start
+		CDeadline					m_NextDeadlineCheck;								// Next check of all response deadlines
+		unsigned int				m_NbRunning;										// Devices not done yet
+
+		// Check whether a device must execute its measurement script more than Count times
+		bool IsRepeating (
+									const tPoolDevice			&rDevice,					// Device
+									int							Count);						// Number of executions
+
+		// Complete the measurements of a device already received and submit the next ones
+		void Service (
+									unsigned int				Device);					// Index of the device
+
+		// Add the results of a device to the merged stream
+		void AddSample (
+									unsigned int				Device);					// Index of the device
+
+		// Stop waiting for a device once all its measurements are received
+		void Finish (
+									unsigned int				Device);					// Index of the device
+	}; // CDevicePool
+
+} // namespace MV2Host
+
+#endif // WIN32
+#endif // CDEVICE_POOL_H
@@ -0,0 +1,126 @@
+// Name:
+//	CEventLoop.h
+//
+// Purpose:
+//	Wait for several file descriptors at once and dispatch their events
+//
+// Description:
+//	File descriptors are registered with the events to wait for and a handler.
+//	RunOnce waits until at least one of them is ready or a deadline expires and
+//	calls the handlers of the ready file descriptors, so one thread can drive
+//	many serial ports without blocking on any of them.
+//	Uses epoll on Linux and poll on other POSIX systems. Not available on Windows.
+//
+// Coding Conventions:
+//	- Variable names use the "InterCaps" convention
+//	- Local variables are prefixed with an underscore, '_'
+//	- Private class members are prefixed with 'm_'
+//	- Private class methods are prefixed with an underscore, '_'
+//	- Pointer variables are prefixed with 'p'
+//	- Reference variables are prefixed with 'r'
+//	- Enumerated types are prefixed with 'e'
+//	- Enumerated type values are prefixed with 'k'
+//	- Classes are prefixed with 'C'
+//	- Constants are all uppercase
+//	The above conventions can also be combined:
+//	- A local pointer variable would be prefixed '_p'
+//	- A private class pointer member would be prefixed 'm_p'
+//
+// Change log:
+//	17.10.26 MB	Original version
+//
+// Copyright (c) 2016 Metrolab Technology SA, Geneva,
+//	Switzerland
+
+#ifndef CEVENT_LOOP_H
+#define CEVENT_LOOP_H
+
+#include <CArduinoSerialPort.h>
+
+#ifndef WIN32
+
+// Include files
+#include <map>
+#include <vector>
+#include <CDeadline.h>
+
+#ifdef __linux__
+	#include <sys/epoll.h>
+#else
+	#include <poll.h>
+#endif
+
+// Events
+#define EVENT_READABLE						0x01
+#define EVENT_WRITABLE						0x02
+// Error or hang up, always reported
+#define EVENT_ERROR							0x04
+
+// Maximum number of events dispatched by one call of RunOnce
+#define MAX_DISPATCHED_EVENTS				32
+
+using namespace std;
+
+// Our namespace
+namespace MV2Host
+{
+	// Handler of the events of a file descriptor
+	class CEventHandler
+	{
+	public:
+		virtual ~CEventHandler ()
+		{}
+
+		// Called when the file descriptor is ready
+		virtual void OnEvent (
+									File_t						FileDescriptor,				// File descriptor
+									unsigned int				Events) = 0;				// Ready events
+	}; // CEventHandler
+
+	class CEventLoop
+	{
+	public:
+		// Constructor
+		CEventLoop ();
+		// Destructor
+		~CEventLoop ();
+
+		// Wait for events of a file descriptor
+		void Add (
+									File_t						FileDescriptor,				// File descriptor
+									unsigned int				Events,						// Events to wait for
+									CEventHandler				*pHandler);					// Handler
+
+		// Change the events to wait for
+		void Modify (
+									File_t						FileDescriptor,				// File descriptor
+									unsigned int				Events);					// Events to wait for
+
+		// Stop waiting for a file descriptor
+		void Remove (
+									File_t						FileDescriptor);			// File descriptor
+
+		// Wait for events until Deadline and dispatch them.
+		// Returns the number of dispatched events, 0 if the deadline expired.
+		int RunOnce (
+									const CDeadline				&rDeadline);				// Deadline
+
+		// Get number of registered file descriptors
+		unsigned int GetNbFileDescriptors ()
+		{
+			return m_Handlers.size();
+		}
+
+	private:
+		map<File_t, CEventHandler *>	m_Handlers;											// Handlers by file descriptor
+#ifdef __linux__
+		int								m_EpollHandle;										// epoll instance
+#else
+		map<File_t, unsigned int>		m_Events;											// Events by file descriptor
+#endif
+	}; // CEventLoop
+
+} // namespace MV2Host
+
+#endif // WIN32
+#endif // CEVENT_LOOP_H
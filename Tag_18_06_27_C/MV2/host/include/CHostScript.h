@@ -25,6 +25,22 @@
 //	16.08.16 SD	Original version
 //	12.09.16 SD - Fix member function name
 //				- Change type of Loop in ResultInfos typedef
+//	17.10.26 MB	Add streaming measurement (StartMeasurementStream, ReadMeasurementStream,
+//				StopMeasurementStream)
+//	17.10.26 MB	Add pipelined measurement (SubmitMeasurementScript, CompleteMeasurementScript)
+//	17.10.26 MB	Build the measurement commands buffer once, parse responses in place
+//	17.10.26 MB	Estimate script durations for the response deadlines (EstimateDuration)
+//	17.10.26 MB	Add TryCompleteMeasurementScript, TryReadMeasurementStream for event loops
+//	17.10.26 MB	Add capture measurement: streamed, Data Ready captured by interrupt (PrepareStream)
+//	17.10.26 MB	Nested loops: a loop is an entry of the results informations (ParseResultsInfos)
+//	17.10.26 MB	Store the measurement script in a script slot once, then only run the slot
+//	17.10.26 MB	Encoded measurement results (ChooseEncoding, DecodeResults)
+//	17.10.26 MB	Timestamps of the Arduino as time columns (GetTimes)
+//	17.10.26 MB	DecodeResults is public for the chunks of a response (see CArduinoSerialPort.h)
+//	17.10.26 MB	Sample timer started after the initialization script (GetSamplePeriod, ReadSampleOverruns)
+//	17.10.26 MB	Add trigger measurement: streamed, windows of samples around each trigger (GetTriggerTime)
+//	17.10.26 MB	Read the performance counters of the Arduino (ReadDiagnostics, ResetDiagnostics)
+//	17.10.26 MB	Add burst measurement: samples taken back to back into the RAM of the Arduino (GetBurst)
 //
 // Copyright (c) 2016 Metrolab Technology SA, Geneva,
 //	Switzerland
@@ -44,6 +60,7 @@
 #include <vector>
 
 #include <CMV2HostException.h>
+#include <CDeadline.h>
 
 using namespace std;
 
@@ -51,20 +68,42 @@ using namespace std;
 namespace MV2Host
 {
 	// Type definitions
+	// A command returning a value has an entry with NbCommands = 0. A loop has an entry followed by
+	// the NbCommands entries of its commands and nested loops.
 	typedef struct ResultInfos
 	{
-		bool Average;				// Indicate that commands inside a loop are averaged. Useful only if Loop > 0
-		unsigned char Loop;			// Indicate that next commands are inside a loop (Useful when averaging is enabled)
-		int NbCommands;				// Indicate number of commands inside a loop. Useful only if Loop > 0.
-		int OutputIndex;			// Indicate output index
-		string OutputName;			// indicate output name
-		ResultInfos(bool Average, bool Loop, int NbCommands, int OutputIndex, string OutputName) :
-			Average(Average), Loop(Loop), NbCommands(NbCommands), OutputIndex(OutputIndex), OutputName(OutputName) {}
+		bool Average;				// Indicate that commands inside a loop are averaged. Useful only for a loop
+		unsigned short Loop;		// Loop count. Useful only for a loop
+		int NbCommands;				// Indicate number of entries inside a loop. 0 for a command
+		int OutputIndex;			// Indicate output index. Useful only for a command
+		string OutputName;			// indicate output name. Useful only for a command
+		int TimestampShift;			// Unit of a timestamp: 2^TimestampShift us. -1 if not a timestamp
+		ResultInfos(bool Average, unsigned short Loop, int NbCommands, int OutputIndex, string OutputName, int TimestampShift = -1) :
+			Average(Average), Loop(Loop), NbCommands(NbCommands), OutputIndex(OutputIndex), OutputName(OutputName), TimestampShift(TimestampShift) {}
 	}tResultInfos;
 
 	// Result type
 	typedef unsigned short tResult;
 
+	// Time of the Arduino clock (us)
+	typedef unsigned long long tTime;
+
+	// Performance counters of the Arduino (DIAG_* in MV2HostConstants.h): times (us) since it
+	// started or since the last ResetDiagnostics, then high-water marks
+	typedef struct Diagnostics
+	{
+		unsigned long SpiTime;			// SPI transfers
+		unsigned long DataReadyTime;	// Waits for Data Ready
+		unsigned long AdcTime;			// Waits for the ADC
+		unsigned long TxTime;			// Waits for room in the serial transmit buffer
+		unsigned long IdleTime;			// Waits for a script or for the sample timer
+		unsigned long DispatchTime;		// Rest of the handling of the scripts
+		unsigned int RamFreeMin;		// Lowest free RAM (bytes)
+		unsigned int TxQueuedMax;		// Most bytes queued in the serial transmit buffer
+		unsigned int ResponseMax;		// Most results in a response
+		unsigned int TxEmpty;			// Results sent while the serial transmit buffer had run empty
+	}tDiagnostics;
+
 	// Forward declaration
 	class CArduinoSerialPort;
 
@@ -81,28 +120,145 @@ namespace MV2Host
 		// Destructor
 		~CHostScript();
 
-		// Execute initialization script
+		// Execute initialization script, then start the sample timer if the measurement script
+		// has a sample period
 		void ExecuteInitializationScript();
 
+		// Get the sample period the Arduino achieved (us), 0 if the sample timer is not started
+		unsigned int GetSamplePeriod ()
+		{
+			return m_AchievedSamplePeriod;
+		}
+
+		// Read the number of sample timer ticks missed since the sample timer started. Call it
+		// while no measurement script is pending and no stream is running.
+		unsigned int ReadSampleOverruns();
+
+		// Read the performance counters of the Arduino. Call it while no measurement script is
+		// pending and no stream is running.
+		tDiagnostics ReadDiagnostics();
+
+		// Clear the performance counters of the Arduino. Same restrictions as ReadDiagnostics.
+		void ResetDiagnostics();
+
+		// Convert performance counters to text: the share of each time, and what bounds the
+		// acquisition: the sensor, the serial link, the firmware or the host
+		static string ConvertDiagnosticsToText (
+								const tDiagnostics			&rDiagnostics);		// Performance counters
+
 		// Execute measurement script
 		void ExecuteMeasurementScript();
 
+		// Submit measurement script without waiting for its results
+		void SubmitMeasurementScript();
+
+		// Wait for the results of the oldest submitted measurement script
+		void CompleteMeasurementScript();
+
+		// Get the results of the oldest submitted measurement script if they are already received.
+		// Returns false if they are not complete yet.
+		bool TryCompleteMeasurementScript();
+
+		// Get number of submitted measurement scripts not completed yet
+		unsigned int GetNbPendingMeasurementScripts();
+
 		// Get repeat measurement script
 		int GetRepeatMeasurementScript ()
 		{
 			return m_RepeatMeasurementScript;
 		}
 
+		// Get stream measurement script. A capture or trigger measurement script is streamed too.
+		bool GetStreamMeasurementScript ()
+		{
+			return m_StreamMeasurementScript || m_CaptureMeasurementScript || m_TriggerMeasurementScript;
+		}
+
+		// Get trigger measurement script: each measurement of the stream is the samples before
+		// and from a trigger on
+		bool GetTriggerMeasurementScript ()
+		{
+			return m_TriggerMeasurementScript;
+		}
+
+		// Check whether the last read of a trigger stream only told the trigger is still armed
+		bool IsTriggerArmed ()
+		{
+			return m_TriggerArmed;
+		}
+
+		// Get the time of the trigger of the last measurement of a trigger stream: the 32-bit
+		// clock of the Arduino (us) when the sample that fired was started
+		unsigned long GetTriggerTime ()
+		{
+			return m_TriggerTime;
+		}
+
+		// Get burst measurement script: each measurement is a block of samples the Arduino takes
+		// back to back, then sends at once
+		bool GetBurstMeasurementScript ()
+		{
+			return m_BurstMeasurementScript;
+		}
+
+		// Get the samples of the last burst, one after the other, each with the results of the
+		// measurement script in their order
+		const vector<tResult> &GetBurst ()
+		{
+			return m_Burst;
+		}
+
+		// Get the number of results of a sample of a burst
+		unsigned int GetBurstSampleLength ()
+		{
+			return m_BurstSampleLength;
+		}
+
+		// Get the interval of the samples of the last burst (us), timed by the Arduino from the
+		// first sample to the last. 0 if the burst has less than two samples.
+		double GetBurstSampleInterval ()
+		{
+			return m_BurstSampleInterval;
+		}
+
+		// Start executing the measurement script continuously on the Arduino
+		void StartMeasurementStream();
+
+		// Read next measurement of the stream. Returns false once the stream has ended.
+		// A trigger stream also returns, without results, each time the Arduino tells its
+		// trigger is still armed (see IsTriggerArmed).
+		bool ReadMeasurementStream();
+
+		// Read next measurement of the stream if it is already received. Returns false if it is
+		// not complete yet or if the stream has ended (see IsMeasurementStreaming).
+		bool TryReadMeasurementStream();
+
+		// Check whether the measurement stream is running
+		bool IsMeasurementStreaming ()
+		{
+			return m_Streaming;
+		}
+
+		// Stop the stream and discard pending measurements
+		void StopMeasurementStream();
+
 		// Get results
 		vector< vector<tResult> > GetResults ()
 		{
 			return m_Results;
 		}
 
-		// Get results in CSV format
+		// Get the time of the timestamps (us), one vector per output like GetResults. The outputs
+		// without timestamps are empty. The time starts at the first timestamp received.
+		vector< vector<tTime> > GetTimes ()
+		{
+			return m_Times;
+		}
+
+		// Get results in CSV format. The outputs of timestamps hold their time.
 		string GetCsvResults ()
 		{
-			return this->ConvertResultsToCSV(this->m_Results);
+			return this->ConvertResultsToCSV(this->m_Results, this->m_Times);
 		}
 
 		// Get headings in CSV format
@@ -111,6 +267,13 @@ namespace MV2Host
 			return this->ConvertHeadingsToCSV(m_Headings);
 		}
 
+		// Decode the encoded results of a response, into a response with raw results.
+		// Also used by CArduinoSerialPort to assemble the chunks of a response.
+		static void DecodeResults (
+								const tResult				*pResponseBuffer,	// Response buffer
+								int							ResponseSize,		// Response size
+								vector<tResult>				&rDecodedResponse);	// Decoded response
+
 	private:
 		CArduinoSerialPort*			m_pArduino;
 		xmlXPathContextPtr 			m_pXPathCtx;
@@ -118,21 +281,114 @@ namespace MV2Host
 		int							m_RepeatInitializationScript;
 		xmlNodePtr					m_pMeasurementScriptNode;
 		int							m_RepeatMeasurementScript;
+		bool						m_StreamMeasurementScript;
+		bool						m_CaptureMeasurementScript;
+		bool						m_TriggerMeasurementScript;
+		unsigned char				m_Trigger;
+		unsigned int				m_TriggerLevel;
+		unsigned int				m_PreTrigger;
+		unsigned int				m_PostTrigger;
+		unsigned long				m_TriggerTime;
+		bool						m_TriggerArmed;
+		bool						m_BurstMeasurementScript;
+		unsigned int				m_BurstSamples;
+		unsigned int				m_BurstSampleLength;
+		double						m_BurstSampleInterval;
+		vector<tResult>				m_Burst;
+		bool						m_Streaming;
+		CDeadline					m_StreamDeadline;
+		vector<unsigned short>		m_MeasurementCommandsBuffer;
+		vector<tResultInfos>		m_MeasurementResultsInfos;
+		unsigned int				m_MeasurementDuration;
+		vector<unsigned short>		m_MeasurementTrigger;
+		bool						m_MeasurementScriptStored;
+		unsigned char				m_MeasurementEncoding;
+		vector<tResult>				m_DecodedResponse;
+		vector<unsigned short>		m_StreamCommandsBuffer;
+		vector<tResultInfos>		m_StreamResultsInfos;
+		unsigned int				m_StreamDuration;
 		vector< vector<tResult> > 	m_Results;
+		vector< vector<tTime> >		m_Times;
+		tTime						m_DeviceTime;
+		bool						m_DeviceTimeStarted;
+		unsigned int				m_SamplePeriod;
+		unsigned int				m_AchievedSamplePeriod;
 		vector<string>				m_Headings;
 
+		// Handle a response of the measurement stream. Returns false if it ends the stream.
+		bool HandleStreamResponse (
+								const tResult				*pResponseBuffer,	// Response buffer
+								int							ResponseSize);		// Response size
+
+		// Build the commands sent to start the measurement stream, capture or trigger
+		void PrepareStream ();
+
+		// Read the trigger attributes of the measurement script
+		void ReadTriggerAttributes ();
+
+		// Read the burst attributes of the measurement script
+		void ReadBurstAttributes ();
+
+		// Build the commands that take a burst, and the informations about its results
+		void PrepareBurst ();
+
+		// Parse a response of the measurement script, and the burst it holds if any
+		void ParseMeasurementResponse (
+								const tResult				*pResponseBuffer,	// Response buffer
+								int							ResponseSize);		// Response size
+
+		// Find the position of the first result of an output among the results of the entries
+		// [Begin, End) of the results informations. Returns false if the output has no result,
+		// rPosition is then increased by the number of results.
+		bool FindResultPosition (
+								const vector<tResultInfos>	&rResultsInfos,		// Informations about results
+								unsigned int				Begin,				// First entry
+								unsigned int				End,				// Entry after the last one
+								int							OutputIndex,		// Output index
+								unsigned int				&rPosition);		// Position of the result
+
+		// Add a command with a 16-bit value: its high byte, if any, is given by MV2_CMD_SET_LOOP_COUNT_HIGH
+		void PushValueCommand (
+								vector<unsigned short>		&rCommandsBuffer,	// Commands buffer
+								unsigned char				CommandType,		// Command type
+								unsigned int				CommandValue);		// Command value
+
+		// Store the measurement script in its script slot on the first execution. Returns the
+		// commands that execute it: the slot, or the script itself if it doesn't fit in a slot.
+		const vector<unsigned short> &GetMeasurementCommands ();
+
 		// Execute a script
 		void Execute (
 								vector<tResultInfos> 		&rResultsInfos,		// Informations about results
-								vector<unsigned short>		&rCommandsBuffer);	// Commands buffer
+								const vector<unsigned short>	&rCommandsBuffer);	// Commands buffer
+
+		// Execute a script returning one value
+		tResult ExecuteValue (
+								const vector<unsigned short>	&rCommandsBuffer);	// Commands buffer
+
+		// Estimate the worst case time (ms) the Arduino needs to execute a script
+		unsigned int EstimateDuration (
+								const vector<unsigned short>	&rCommandsBuffer);	// Commands buffer
+
+		// Generate headings for the current results
+		void UpdateHeadings (
+								vector<tResultInfos> 		&rResultsInfos);	// Informations about results
 
 		// According to ScriptXPath, check script node
 		void CheckScriptNode (
 								const xmlChar*				pScriptXPath,		// Pointer to the XPath
 								xmlXPathContextPtr			pXPathCtx,			// Pointer to the XPath context
 								int							&rRepeat,			// Repeat attribute
+								bool						&rStream,			// Stream attribute
+								bool						&rCapture,			// Capture attribute
+								string						&rEncoding,			// Encoding attribute
+								unsigned int				&rSamplePeriod,		// Sample period attribute
 								xmlNodePtr					&rpScriptNode);		// Pointer to the script node
 
+		// Choose the encoding of the measurement results (RESULT_ENCODING_*) from the encoding attribute
+		unsigned char ChooseEncoding (
+								const string				&rEncoding);		// Encoding attribute
+
 		// Compute response index
 		void ComputeResponseIndex (
 								int							ResponseSize,		// Response size
@@ -173,10 +429,22 @@ namespace MV2Host
 
 		// Parse results
 		void ParseResults (
-								tResult						*pResponseBuffer,	// Response buffer
+								const tResult				*pResponseBuffer,	// Response buffer
 								int							ResponseSize,		// Response size
-								vector<tResultInfos>		ResultsInfos,		// Informations about results
-								vector< vector<tResult> >	&rResults);			// Results
+								const vector<tResultInfos>	&rResultsInfos,		// Informations about results
+								vector< vector<tResult> >	&rResults,			// Results
+								vector< vector<tTime> >		&rTimes);			// Time of the timestamps
+
+		// Parse the results of the entries [Begin, End) of the results informations
+		void ParseResultsInfos (
+								const tResult				*pResponseBuffer,	// Response buffer
+								const vector<tResultInfos>	&rResultsInfos,		// Informations about results
+								unsigned int				Begin,				// First entry
+								unsigned int				End,				// Entry after the last one
+								int							&rResponseDataIndex,// Index of the next result in the response
+								int							EndDataIndex,		// Index after the last result
+								vector< vector<tResult> >	&rResults,			// Results
+								vector< vector<tTime> >		&rTimes);			// Time of the timestamps
 
 		// Convert Headings in CSV format
 		string ConvertHeadingsToCSV (
@@ -184,7 +452,8 @@ namespace MV2Host
 
 		// Convert results in CSV format
 		string ConvertResultsToCSV (
-								vector< vector<tResult> >	Results);			// Results
+								vector< vector<tResult> >	Results,			// Results
+								const vector< vector<tTime> >	&rTimes);		// Time of the timestamps
 	}; // CHostScript
 
 } // namespace MV2Host
@@ -0,0 +1,203 @@
+// Name:
+//	CLoopbackTransport.h
+//
+// Purpose:
+//	Transport to a simulated Arduino running in this process
+//
+// Description:
+//	CLoopbackDevice answers scripts like the MV2 firmware, over one end of a socket
+//	pair, in its own thread. Measurements return consecutive values instead of
+//	reading a sensor and take no time, so the host runs as fast as it can: this
+//	benchmarks the host without a board. Not available on Windows.
+//
+// Coding Conventions:
+//	- Variable names use the "InterCaps" convention
+//	- Local variables are prefixed with an underscore, '_'
+//	- Private class members are prefixed with 'm_'
+//	- Private class methods are prefixed with an underscore, '_'
+//	- Pointer variables are prefixed with 'p'
+//	- Reference variables are prefixed with 'r'
+//	- Enumerated types are prefixed with 'e'
+//	- Enumerated type values are prefixed with 'k'
+//	- Classes are prefixed with 'C'
+//	- Constants are all uppercase
+//	The above conventions can also be combined:
+//	- A local pointer variable would be prefixed '_p'
+//	- A private class pointer member would be prefixed 'm_p'
+//
+// Change log:
+//	17.10.26 MB	Original version
+//	17.10.26 MB	Average loops started with MV2_CMD_SET_AVERAGE_LOOP_START
+//	17.10.26 MB	Capture started with MV2_CMD_START_CAPTURE
+//	17.10.26 MB	Script slots (MV2_CMD_STORE_SCRIPT, MV2_CMD_RUN_SCRIPT)
+//	17.10.26 MB	Encoded results (MV2_CMD_SET_RESULT_ENCODING)
+//	17.10.26 MB	Timestamps (MV2_CMD_GET_TIMESTAMP)
+//	17.10.26 MB	Chunked responses (RESPONSE_FLAG_CHUNK)
+//	17.10.26 MB	Sample timer (MV2_CMD_START_SAMPLE_TIMER, MV2_CMD_WAIT_FOR_SAMPLE_TICK)
+//	17.10.26 MB	Trigger (MV2_CMD_START_TRIGGER)
+//	17.10.26 MB	Burst (MV2_CMD_START_BURST)
+//	17.10.26 MB	Mode a stored script must be started in
+//
+// Copyright (c) 2016 Metrolab Technology SA, Geneva,
+//	Switzerland
+
+#ifndef CLOOPBACK_TRANSPORT_H
+#define CLOOPBACK_TRANSPORT_H
+
+// Include files
+#include <CSocketTransport.h>
+
+#ifndef WIN32
+
+#include <chrono>
+#include <thread>
+#include <vector>
+
+// Our namespace
+namespace MV2Host
+{
+	// Simulated Arduino
+	class CLoopbackDevice
+	{
+	public:
+		// Constructor
+		CLoopbackDevice (
+									File_t						SocketHandle);				// Device end of the socket pair
+
+		// Answer scripts until the host closes its end
+		void Run ();
+
+	private:
+		File_t						m_SocketHandle;											// Device end of the socket pair
+		vector<unsigned char>		m_Script;												// Script being received, unescaped
+		bool						m_InFrame;												// A FRAME_FLAG started a frame
+		bool						m_Escaped;												// Previous byte was FRAME_ESCAPE
+		unsigned char				m_RxBuffer[256];										// Bytes received
+		unsigned int				m_RxStart;												// Index of the next byte to read
+		unsigned int				m_RxEnd;												// Index after the last byte received
+		vector<unsigned short>		m_Response;												// Response buffer, grows with the results
+		vector<unsigned char>		m_TxBuffer;												// Response frame, escaped
+		bool						m_AnalogMode;											// Analog or digital mode
+		unsigned short				m_NextValue;											// Value of the next measurement
+		vector< vector<unsigned short> >	m_ScriptSlots;									// Stored scripts, checked when executed
+		vector<bool>				m_ScriptStored;											// The slot holds a script
+		vector<int>					m_ScriptModes;											// Mode the stored script must be started in, LOOPBACK_ANY_MODE if any
+		chrono::steady_clock::time_point	m_StartTime;									// Origin of the timestamps
+		unsigned long				m_LastTimestamp;										// Time of the last timestamp (us)
+		unsigned int				m_SamplePeriod;											// Period of the sample timer (us), 0 if stopped
+		chrono::steady_clock::time_point	m_SampleTimerStart;								// Time the sample timer started
+		unsigned long				m_SampleTicksTaken;										// Index of the last tick taken
+		bool						m_SampleTickTaken;										// A tick was taken since the start
+		unsigned short				m_SampleOverruns;										// Ticks missed since the start
+
+		// Read a byte, wait for it if Wait is true. Returns false if none or the host closed.
+		bool ReadByte (
+									unsigned char				&rByte,						// Byte read
+									bool						Wait);						// Wait for it
+
+		// Handle a received frame. Returns false if the host closed.
+		bool HandleScript ();
+
+		// Execute a stream until the host sends anything. Returns false if the host closed.
+		bool StreamScript (
+									const unsigned short		*pCommands,					// Commands
+									unsigned int				NbCommands,					// Number of commands
+									unsigned short				Sequence);					// Sequence number
+
+		// Execute a capture until the host sends anything. Returns false if the host closed.
+		bool CaptureScript (
+									const unsigned short		*pCommands,					// Register writes
+									unsigned int				NbCommands,					// Number of commands
+									unsigned int				NbSets,						// Number of Data Ready per response
+									unsigned short				Sequence);					// Sequence number
+
+		// Execute the trigger until the host sends anything. Returns false if the host closed.
+		bool TriggerScript (
+									const unsigned short		*pCommands,					// Commands of a sample
+									unsigned int				NbCommands,					// Number of commands
+									unsigned int				Trigger,					// Kind of trigger or'ed with the index of the result watched
+									unsigned short				Sequence);					// Sequence number
+
+		// Take a burst and send it in one response. Returns false if the host closed.
+		bool BurstScript (
+									const unsigned short		*pCommands,					// Commands of a sample
+									unsigned int				NbCommands,					// Number of commands
+									unsigned short				Sequence);					// Sequence number
+
+		// Execute commands, append results to the response buffer
+		unsigned short ExecuteScript (
+									const unsigned short		*pCommands,					// Commands
+									unsigned int				NbCommands,					// Number of commands
+									unsigned int				&rNbResults,				// Number of results
+									unsigned short				&rFlags,					// Response flags
+									unsigned short				&rIndexCommandError);		// Index of the command in error
+
+		// Execute an averaged loop, append the average of each result to the response buffer
+		unsigned short ExecuteAverageLoop (
+									const unsigned short		*pCommands,					// Commands of the loop
+									unsigned int				NbCommands,					// Number of commands
+									unsigned int				Count,						// Number of iterations
+									unsigned int				&rNbResults,				// Number of results
+									unsigned short				&rFlags,					// Response flags
+									unsigned short				&rIndexCommandError);		// Index of the command in error
+
+		// Time since the start (us), like the 32-bit micros() of the Arduino
+		unsigned long GetMicros ();
+
+		// Execute one command
+		unsigned short ExecuteCommand (
+									unsigned int				Command,					// Index in MV2_CMD_INFO
+									unsigned short				CommandValue,				// Parameter, 16 bits for MV2_CMD_START_SAMPLE_TIMER and the trigger settings
+									unsigned short				&rValue);					// Returned value
+
+		// Send the response buffer, results encoded, in chunks if they don't fit in a response.
+		// Returns false if the host closed.
+		bool SendResponse (
+									unsigned short				Sequence,					// Sequence number
+									unsigned short				Flags,						// Response flags
+									unsigned int				NbResults,					// Number of results
+									unsigned short				Error,						// Error code
+									unsigned short				ErrorDesc,					// Error description
+									unsigned char				Encoding = 0);				// Results encoding (RESULT_ENCODING_*), raw by default
+
+		// Send a response frame, results encoded. Returns false if the host closed.
+		bool SendFrame (
+									unsigned short				Sequence,					// Sequence number
+									unsigned short				Flags,						// Response flags
+									const unsigned short		*pResults,					// Results
+									unsigned int				NbResults,					// Number of results
+									unsigned short				Error,						// Error code
+									unsigned short				ErrorDesc,					// Error description
+									unsigned char				Encoding);					// Results encoding (RESULT_ENCODING_*)
+	}; // CLoopbackDevice
+
+	class CLoopbackTransport : public CSocketTransport
+	{
+	public:
+		// Start a simulated Arduino
+		static CLoopbackTransport *Create ();
+
+		// Destructor: stop the simulated Arduino
+		virtual ~CLoopbackTransport ();
+
+		// Any baud rate: it only sets the time outs
+		virtual bool IsBaudRateSupported (
+									unsigned long				BaudRate)					// Baud rate
+		{
+			return true;
+		}
+
+	private:
+		File_t						m_DeviceHandle;											// Device end of the socket pair
+		CLoopbackDevice				*m_pDevice;												// Simulated Arduino
+		thread						m_DeviceThread;											// Runs the simulated Arduino
+
+		// Constructor: start the simulated Arduino on the device end of a socket pair
+		CLoopbackTransport (
+									File_t						HostHandle,					// Host end
+									File_t						DeviceHandle);				// Device end
+	}; // CLoopbackTransport
+} // namespace MV2Host
+
+#endif // WIN32
+#endif // CLOOPBACK_TRANSPORT_H
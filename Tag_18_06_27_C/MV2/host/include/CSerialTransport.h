@@ -0,0 +1,122 @@
+// Name:
+//	CSerialTransport.h
+//
+// Purpose:
+//	Serial port transport
+//
+// Description:
+//	Serial port 8N1, non-blocking on POSIX systems. Also used for pseudo-terminals,
+//	e.g. of a device simulator, which accept the same settings but do not reboot
+//	anything when opened.
+//	The Arduino reboots when DTR rises, and DTR drops when the port is closed. To leave
+//	it running (kOpenNoReset), DTR is kept when the port is closed (HUPCL cleared), so
+//	that the next open does not reboot it. Windows always drops DTR on close.
+//
+// Coding Conventions:
+//	- Variable names use the "InterCaps" convention
+//	- Local variables are prefixed with an underscore, '_'
+//	- Private class members are prefixed with 'm_'
+//	- Private class methods are prefixed with an underscore, '_'
+//	- Pointer variables are prefixed with 'p'
+//	- Reference variables are prefixed with 'r'
+//	- Enumerated types are prefixed with 'e'
+//	- Enumerated type values are prefixed with 'k'
+//	- Classes are prefixed with 'C'
+//	- Constants are all uppercase
+//	The above conventions can also be combined:
+//	- A local pointer variable would be prefixed '_p'
+//	- A private class pointer member would be prefixed 'm_p'
+//
+// Change log:
+//	17.10.26 MB	Original version, moved from CArduinoSerialPort
+//	17.10.26 MB	Open with an eOpenMode, keep DTR to leave the Arduino running, add Reset
+//
+// Copyright (c) 2016 Metrolab Technology SA, Geneva,
+//	Switzerland
+
+#ifndef CSERIAL_TRANSPORT_H
+#define CSERIAL_TRANSPORT_H
+
+// Include files
+#include <CTransport.h>
+
+// Our namespace
+namespace MV2Host
+{
+	class CSerialTransport : public CTransport
+	{
+	public:
+		// Constructor. Opening a serial port reboots the Arduino unless OpenMode is kOpenNoReset:
+		// with kOpenReset, wait until it is ready.
+		CSerialTransport (
+									const char 					*pPortName,					// Port name
+									bool						DtrResets,					// DTR reboots the Arduino
+									eOpenMode					OpenMode);					// How to open the port
+		// Destructor
+		virtual ~CSerialTransport ();
+
+		// Check whether opening the port reboots the Arduino
+		virtual bool RebootsOnOpen ()
+		{
+			return m_RebootsOnOpen;
+		}
+
+		// Reboot the Arduino by clearing DTR, wait until it is ready.
+		// Returns false if DTR does not reboot anything.
+		virtual bool Reset ();
+
+		// Read available bytes, wait for at least one until the deadline
+		virtual unsigned int Read (
+									void						*pBuffer,					// Buffer
+									unsigned int				Size,						// Size of buffer
+									const CDeadline				*pDeadline);				// Deadline, or NULL
+
+		// Write a buffer, wait for room until the deadline
+		virtual unsigned int Write (
+									const void					*pBuffer,					// Buffer to write
+									unsigned int				Size,						// Size of buffer
+									const CDeadline				&rDeadline);				// Deadline
+
+		// Discard bytes received and not read yet
+		virtual void Flush ();
+
+		// Check whether the serial port supports a baud rate
+		virtual bool IsBaudRateSupported (
+									unsigned long				BaudRate);					// Baud rate
+
+		// Set serial port baud rate
+		virtual void SetBaudRate (
+									unsigned long				BaudRate);					// Baud rate
+
+		// Get port handle
+		virtual File_t GetHandle ()
+		{
+			return m_PortHandle;
+		}
+
+	private:
+		File_t						m_PortHandle;											// Port handle
+		bool						m_DtrResets;											// DTR reboots the Arduino
+		bool						m_RebootsOnOpen;										// Opening reboots the Arduino
+#ifdef WIN32
+		unsigned int				m_ReadTimeout;											// Current read time out (ms)
+#endif
+
+		// Set serial port settings
+		void SetSerialPortSettings (
+									eOpenMode					OpenMode);					// How to open the port
+
+		// Clear DTR for DTR_RESET_PULSE, then set it again. Returns false if DTR cannot be changed.
+		bool PulseDtr ();
+
+		// Wait until the Arduino is ready after a reboot
+		void WaitForReboot ();
+
+#ifdef WIN32
+		// Set read timeout: wait up to TimeOut for the first byte, 0 to return at once
+		void SetReadTimeout (
+									unsigned int				TimeOut);					// Time out (ms)
+#endif
+	}; // CSerialTransport
+} // namespace MV2Host
+#endif // CSERIAL_TRANSPORT_H
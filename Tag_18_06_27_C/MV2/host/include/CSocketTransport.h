@@ -0,0 +1,100 @@
+// Name:
+//	CSocketTransport.h
+//
+// Purpose:
+//	Socket transport to a serial bridge
+//
+// Description:
+//	Connects to a Unix or TCP socket of a serial bridge, e.g.
+//		socat TCP-LISTEN:5000,reuseaddr FILE:/dev/ttyACM0,raw,b57600
+//	so that a host without the sensor can use it. The bridge owns the serial link:
+//	the baud rate stays the default one. Not available on Windows.
+//
+// Coding Conventions:
+//	- Variable names use the "InterCaps" convention
+//	- Local variables are prefixed with an underscore, '_'
+//	- Private class members are prefixed with 'm_'
+//	- Private class methods are prefixed with an underscore, '_'
+//	- Pointer variables are prefixed with 'p'
+//	- Reference variables are prefixed with 'r'
+//	- Enumerated types are prefixed with 'e'
+//	- Enumerated type values are prefixed with 'k'
+//	- Classes are prefixed with 'C'
+//	- Constants are all uppercase
+//	The above conventions can also be combined:
+//	- A local pointer variable would be prefixed '_p'
+//	- A private class pointer member would be prefixed 'm_p'
+//
+// Change log:
+//	17.10.26 MB	Original version
+//
+// Copyright (c) 2016 Metrolab Technology SA, Geneva,
+//	Switzerland
+
+#ifndef CSOCKET_TRANSPORT_H
+#define CSOCKET_TRANSPORT_H
+
+// Include files
+#include <CTransport.h>
+
+#ifndef WIN32
+
+// Our namespace
+namespace MV2Host
+{
+	class CSocketTransport : public CTransport
+	{
+	public:
+		// Connect to a Unix socket
+		static CSocketTransport *CreateUnix (
+									const char					*pPath);					// Socket path
+
+		// Connect to a TCP socket
+		static CSocketTransport *CreateTcp (
+									const char					*pAddress);					// "<host>:<port>"
+
+		// Destructor
+		virtual ~CSocketTransport ();
+
+		// Read available bytes, wait for at least one until the deadline
+		virtual unsigned int Read (
+									void						*pBuffer,					// Buffer
+									unsigned int				Size,						// Size of buffer
+									const CDeadline				*pDeadline);				// Deadline, or NULL
+
+		// Write a buffer, wait for room until the deadline
+		virtual unsigned int Write (
+									const void					*pBuffer,					// Buffer to write
+									unsigned int				Size,						// Size of buffer
+									const CDeadline				&rDeadline);				// Deadline
+
+		// Discard bytes received and not read yet
+		virtual void Flush ();
+
+		// Check whether the link supports a baud rate: only the default one
+		virtual bool IsBaudRateSupported (
+									unsigned long				BaudRate);					// Baud rate
+
+		// Set baud rate of the link: nothing to do
+		virtual void SetBaudRate (
+									unsigned long				BaudRate)					// Baud rate
+		{}
+
+		// Get socket handle
+		virtual File_t GetHandle ()
+		{
+			return m_SocketHandle;
+		}
+
+	protected:
+		// Constructor: take a connected socket, make it non-blocking
+		CSocketTransport (
+									File_t						SocketHandle);				// Socket handle
+
+	private:
+		File_t						m_SocketHandle;											// Socket handle
+	}; // CSocketTransport
+} // namespace MV2Host
+
+#endif // WIN32
+#endif // CSOCKET_TRANSPORT_H
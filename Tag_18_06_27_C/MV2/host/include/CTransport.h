@@ -0,0 +1,166 @@
+// Name:
+//	CTransport.h
+//
+// Purpose:
+//	Byte link between the host and an Arduino
+//
+// Description:
+//	CArduinoSerialPort frames scripts and responses and sends them over a transport.
+//	A transport only moves bytes: it is opened from a port name (see Create), reads
+//	and writes bytes until a deadline, and sets the baud rate if the link has one.
+//	Backends:
+//	- CSerialTransport: serial port, or pseudo-terminal of a device simulator
+//	- CSocketTransport: Unix or TCP socket of a serial bridge sharing a remote Arduino
+//	- CLoopbackTransport: simulated Arduino in this process, e.g. to benchmark the host
+//	Only serial ports are available on Windows.
+//
+// Coding Conventions:
+//	- Variable names use the "InterCaps" convention
+//	- Local variables are prefixed with an underscore, '_'
+//	- Private class members are prefixed with 'm_'
+//	- Private class methods are prefixed with an underscore, '_'
+//	- Pointer variables are prefixed with 'p'
+//	- Reference variables are prefixed with 'r'
+//	- Enumerated types are prefixed with 'e'
+//	- Enumerated type values are prefixed with 'k'
+//	- Classes are prefixed with 'C'
+//	- Constants are all uppercase
+//	The above conventions can also be combined:
+//	- A local pointer variable would be prefixed '_p'
+//	- A private class pointer member would be prefixed 'm_p'
+//
+// Change log:
+//	17.10.26 MB	Original version, OS definitions moved from CArduinoSerialPort.h
+//	17.10.26 MB	Add eOpenMode and Reset to reconnect without rebooting the Arduino
+//
+// Copyright (c) 2016 Metrolab Technology SA, Geneva,
+//	Switzerland
+
+#ifndef CTRANSPORT_H
+#define CTRANSPORT_H
+
+#if defined(_WIN32) || defined(_WIN32_WCE) || defined(__WIN32__) || defined(__CYGWIN__)
+#  ifndef WIN32
+#    define WIN32
+#  endif
+#endif
+
+// Include files
+#include <string>
+
+#ifdef WIN32
+	#include <windows.h>
+#else
+	#include <unistd.h>
+	#include <fcntl.h>
+	#include <errno.h>
+	#include <termios.h>
+	#include <poll.h>
+#endif
+
+#ifdef WIN32
+	#define WAIT_FOR_ARDUINO_REBOOT 2000
+	typedef HANDLE File_t;
+	typedef DWORD NoOfBytes_t;
+#else
+	#define WAIT_FOR_ARDUINO_REBOOT 2
+	typedef int File_t;
+	typedef ssize_t NoOfBytes_t;
+#endif
+
+// Port name prefixes selecting a transport (see CTransport::Create)
+#define PTY_PORT_PREFIX						"pty:"
+#define UNIX_PORT_PREFIX					"unix:"
+#define TCP_PORT_PREFIX						"tcp:"
+#define LOOPBACK_PORT_NAME					"loopback"
+
+#include <CDeadline.h>
+
+using namespace std;
+
+// Our namespace
+namespace MV2Host
+{
+	// Create a string with last error message
+	string GetLastErrorStdStr ();
+
+	// How to open a serial port
+	typedef enum
+	{
+		kOpenReset = 0,				// Reboot the Arduino and wait until it is ready
+		kOpenResetNoWait,			// Reboot the Arduino, the caller waits until it is ready
+		kOpenNoReset				// Leave the Arduino running: the caller checks that it answers
+	} eOpenMode;
+
+	class CTransport
+	{
+	public:
+		// Destructor
+		virtual ~CTransport ()
+		{}
+
+		// Open the transport of a port name:
+		//	"pty:<path>"			pseudo-terminal, e.g. of a device simulator
+		//	"unix:<path>"			Unix socket of a serial bridge
+		//	"tcp:<host>:<port>"		TCP socket of a serial bridge
+		//	"loopback"				simulated Arduino in this process
+		//	anything else			serial port
+		// Opening a serial port reboots the Arduino unless OpenMode is kOpenNoReset.
+		static CTransport *Create (
+									const char					*pPortName,					// Port name
+									eOpenMode					OpenMode);					// How to open a serial port
+
+		// Check whether opening the transport reboots the Arduino
+		virtual bool RebootsOnOpen ()
+		{
+			return false;
+		}
+
+		// Reboot the Arduino and wait until it is ready.
+		// Returns false if the transport cannot reboot it.
+		virtual bool Reset ()
+		{
+			return false;
+		}
+
+		// Read available bytes, wait for at least one until the deadline.
+		// Returns 0 once the deadline has expired, or at once without deadline, if no byte is available.
+		virtual unsigned int Read (
+									void						*pBuffer,					// Buffer
+									unsigned int				Size,						// Size of buffer
+									const CDeadline				*pDeadline) = 0;			// Deadline, or NULL
+
+		// Write a buffer, wait for room until the deadline.
+		// Returns the number of bytes written, less than Size if the deadline has expired.
+		virtual unsigned int Write (
+									const void					*pBuffer,					// Buffer to write
+									unsigned int				Size,						// Size of buffer
+									const CDeadline				&rDeadline) = 0;			// Deadline
+
+		// Discard bytes received and not read yet
+		virtual void Flush () = 0;
+
+		// Check whether the link supports a baud rate
+		virtual bool IsBaudRateSupported (
+									unsigned long				BaudRate) = 0;				// Baud rate
+
+		// Set baud rate of the link
+		virtual void SetBaudRate (
+									unsigned long				BaudRate) = 0;				// Baud rate
+
+		// Get handle, e.g. to wait for it in an event loop
+		virtual File_t GetHandle () = 0;
+
+	protected:
+#ifndef WIN32
+		// Wait until a file descriptor is ready or the deadline expires.
+		// Throws if it hung up.
+		static void WaitForHandle (
+									File_t						Handle,						// File descriptor
+									short						Events,						// poll events
+									const CDeadline				&rDeadline,					// Deadline
+									const char					*pHungUpMessage);			// Exception message if hung up
+#endif
+	}; // CTransport
+} // namespace MV2Host
+#endif // CTRANSPORT_H
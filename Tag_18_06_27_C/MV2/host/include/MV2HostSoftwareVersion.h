@@ -26,10 +26,27 @@
 //	03.04.17 PK	Bump the version: Adapt for use with Arduino MEGA 2560
 //	03.04.17 PK	Bump the version: Catch ^C and close serial port cleanly; open COMx for x>9
 //	21.08.17 PK Bump the version: Reset Arduino by enabling DTR in Windows
+//	17.10.26 MB Bump the version: Add streaming measurement
+//	17.10.26 MB Bump the version: Pipeline measurement scripts, negotiate baud rate
+//	17.10.26 MB Bump the version: Frames with flags and CRC-16/CCITT
+//	17.10.26 MB Bump the version: Send scripts again after transmission errors
+//	17.10.26 MB Bump the version: Acquire from several devices
+//	17.10.26 MB Bump the version: Serial, socket and loopback transports
+//	17.10.26 MB Bump the version: Reconnect without rebooting the Arduino
+//	17.10.26 MB Bump the version: Loops averaged by the Arduino
+//	17.10.26 MB Bump the version: Capture measurement
+//	17.10.26 MB Bump the version: Nested loops, 16-bit loop counts
+//	17.10.26 MB Bump the version: Script slots, encoded results
+//	17.10.26 MB Bump the version: Time columns
+//	17.10.26 MB Bump the version: Chunked responses
+//	17.10.26 MB Bump the version: Sample timer
+//	17.10.26 MB Bump the version: Trigger
+//	17.10.26 MB Bump the version: Diagnostics
+//	17.10.26 MB Bump the version: Burst
 //
 // Copyright (c) 2016 Metrolab Technology SA, Geneva,
 //	Switzerland
 
 
 #define MV2HOST_SOFTWARE_VERSION_MAJOR	1
-#define MV2HOST_SOFTWARE_VERSION_MINOR	3
+#define MV2HOST_SOFTWARE_VERSION_MINOR	20
@@ -26,318 +26,702 @@
 //	12.09.16 SD Improve exception description message with GetLastErrorStdStr function
 //	12.07.17 PK	Allow for serial ports larger than COM9 (Windows)
 //	21.08.17 PK Reset Arduino by enabling DTR in Windows
+//	17.10.26 MB Split WriteAndRead into SendScript and ReceiveResponse for streaming
+//	17.10.26 MB Add Submit/Complete to pipeline scripts
+//	17.10.26 MB Add baud rate negotiation: termios2 on Linux for non-standard baud rates
+//				Throw an exception on read timeout, check response length
+//	17.10.26 MB Zero-copy I/O: read as many bytes as available into a receive buffer and
+//				return frame views, write header, script and CRC with a gathered write
+//	17.10.26 MB Open the port non-blocking and wait with poll until per-transaction deadlines,
+//				report timeouts with the elapsed time
+//	17.10.26 MB Frames delimited by FRAME_FLAG with CRC-16/CCITT: resynchronize on the next
+//				frame after an error instead of resetting the Arduino
+//	17.10.26 MB Number the scripts, send a pending script again when its response is lost or
+//				corrupted, keep responses received out of order until their script is completed
+//	17.10.26 MB Optionally do not wait for the reboot in the constructor, add GetResponseTimeOut
+//	17.10.26 MB Move serial port handling to CSerialTransport, send bytes through a CTransport
+//	17.10.26 MB Reconnect to an Arduino left running instead of rebooting it (kOpenNoReset),
+//				skip responses to other scripts in Ping
+//	17.10.26 MB Assemble the chunks of a response, restart the deadline on each chunk
+//	17.10.26 MB ReceiveResponse and TryReceiveResponse drop corrupted or truncated frames and
+//				count them (GetNbDroppedFrames) instead of throwing
 //
 // Copyright (c) 2016 Metrolab Technology SA, Geneva,
 //	Switzerland
 
 // Include files
 #include <CArduinoSerialPort.h>
+#include <MV2HostCommands.h>
+#include <MV2Crc.h>
 #include <iostream>
+#include <stdio.h>
 #include <string.h>
+#include <time.h>
 
 // Exceptions messages
-#define OPENING_SERIAL_PORT_EXCEPTION_MSG		"CArduinoSerialPort: Unable to open serial port."
-#define GET_SERIAL_PORT_SETTINGS_EXCEPTION_MSG	"CArduinoSerialPort: Unable to get serial port settings."
-#define SET_SERIAL_PORT_SETTINGS_EXCEPTION_MSG	"CArduinoSerialPort: Unable to set serial port settings."
-#define FLUSH_SERIAL_PORT_EXCEPTION_MSG			"CArduinoSerialPort: Unable to flush serial port settings."
-#define WRITE_SERIAL_PORT_EXCEPTION_MSG			"CArduinoSerialPort: Unable to write to the serial port."
-#define READ_SERIAL_PORT_EXCEPTION_MSG			"CArduinoSerialPort: Unable to read serial port."
 #define BAD_CRC_EXCEPTION_MSG					"CArduinoSerialPort: Bad CRC."
+#define TOO_MANY_SCRIPTS_EXCEPTION_MSG			"CArduinoSerialPort: Too many scripts submitted."
+#define NO_SCRIPT_SUBMITTED_EXCEPTION_MSG		"CArduinoSerialPort: No script submitted."
+#define READ_TIMEOUT_EXCEPTION_MSG				"CArduinoSerialPort: Timeout reading serial port: "
+#define WRITE_TIMEOUT_EXCEPTION_MSG				"CArduinoSerialPort: Timeout writing to the serial port: "
+#define BAD_RESPONSE_LENGTH_EXCEPTION_MSG		"CArduinoSerialPort: Bad response length."
+#define PING_EXCEPTION_MSG						"CArduinoSerialPort: Arduino does not answer."
+#define SCRIPT_TOO_LONG_EXCEPTION_MSG			"CArduinoSerialPort: Script too long."
 
 // Our namespace
 namespace MV2Host
 {
 
-// Create a string with last error message
-string GetLastErrorStdStr()
+// Wait (ms)
+static void WaitMs(unsigned int Delay)
 {
 	#ifdef WIN32
-		DWORD _Error = GetLastError();
-		if (_Error)
-		{
-			LPVOID lpMsgBuf;
-			DWORD bufLen = FormatMessage(
-				FORMAT_MESSAGE_ALLOCATE_BUFFER |
-				FORMAT_MESSAGE_FROM_SYSTEM |
-				FORMAT_MESSAGE_IGNORE_INSERTS,
-				NULL,
-				_Error,
-				MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),
-				(LPTSTR) &lpMsgBuf,
-				0, NULL );
-			if (bufLen)
-			{
-			  LPCSTR lpMsgStr = (LPCSTR)lpMsgBuf;
-			  string result(lpMsgStr, lpMsgStr+bufLen);
-
-			  LocalFree(lpMsgBuf);
-
-			  return result;
-			}
-		}
-		return string();
+		Sleep(Delay);
 	#else
-		return string (strerror(errno));
+		usleep(Delay * 1000);
 	#endif
 }
 
+// Throw a timeout exception telling how long the operation waited
+static void ThrowTimeout(	const char			*pMessage,		// Exception message
+							const CDeadline		&rDeadline)		// Expired deadline
+{
+	char _Buffer[64];
+	snprintf(_Buffer, sizeof(_Buffer), "gave up after %u ms (time out %u ms).", rDeadline.GetElapsedMs(), rDeadline.GetTimeOutMs());
+	throw CMV2HostException(string(pMessage) + _Buffer);
+}
+
 // Constructor
-CArduinoSerialPort::CArduinoSerialPort(const char *pPortName)
+CArduinoSerialPort::CArduinoSerialPort(	const char	*pPortName,			// Port name
+										eOpenMode	OpenMode)			// How to open a serial port
 {
-	#ifdef WIN32
-		// Prefix portname with "\\\\.\\".
-		// (see https://support.microsoft.com/en-us/help/115831/howto-specify-serial-ports-larger-than-com9)
-		char _PortName[20] = "\\\\.\\";				// 20 allows for portnames up to COM999999999
-		strncat(_PortName, pPortName, 12);
-		
-		m_PortHandle = CreateFile(_PortName,		// Specify port device
-			GENERIC_READ | GENERIC_WRITE,			// Specify mode that open device.
-			0,										// the device isn't shared.
-			0,										// the object gets a default security.
-			OPEN_EXISTING,							// Specify which action to take on file.
-			FILE_ATTRIBUTE_NORMAL,					// default.
-			0);										// default.
-		if (m_PortHandle == INVALID_HANDLE_VALUE)
+	m_pTransport = CTransport::Create(pPortName, OpenMode);
+	Initialize();
+
+	if (OpenMode == kOpenNoReset)
+	{
+		try
 		{
-			string _ErrorMsg = OPENING_SERIAL_PORT_EXCEPTION_MSG + GetLastErrorStdStr();
-			throw CMV2HostException(_ErrorMsg);
+			Reconnect();
 		}
-	#else
-		m_PortHandle = open(pPortName, O_RDWR | O_NOCTTY );
-		if (m_PortHandle < 0)
+		catch (CMV2HostException &)
 		{
-			string _ErrorMsg = OPENING_SERIAL_PORT_EXCEPTION_MSG + GetLastErrorStdStr();
-			throw CMV2HostException(_ErrorMsg);
+			delete m_pTransport;
+			throw;
 		}
-		// *NIX OS reboot Arduino so we have to wait
-		sleep(WAIT_FOR_ARDUINO_REBOOT);
-	#endif
+	}
+} // Constructor
 
-		// Set serial port settings
-		SetSerialPortSettings();
+// Constructor
+CArduinoSerialPort::CArduinoSerialPort(CTransport *pTransport)		// Transport
+{
+	m_pTransport = pTransport;
+	Initialize();
 } // Constructor
 
 // Destructor
 CArduinoSerialPort::~CArduinoSerialPort()
 {
-#ifdef WIN32
-	CloseHandle(m_PortHandle);
-#else
-	close(m_PortHandle);
-#endif
+	delete m_pTransport;
 } // Destructor
 
-// Set serial port settings 8N1, 57600 bauds
-void CArduinoSerialPort::SetSerialPortSettings()
+// Initialize the protocol state
+void CArduinoSerialPort::Initialize()
 {
-#ifdef WIN32
-	DCB _DcbSerialParams;
+	m_NbPendingScripts = 0;
+	m_FirstScript = 0;
+	m_NbRetransmissions = 0;
+	m_NbDroppedFrames = 0;
+	// The Arduino may still hold the response of a previous session's script: do not start
+	// the sequence numbers at the same value every time
+	m_NextSequence = static_cast<unsigned short>(time(NULL));
+	m_NbChunks = 0;
+	m_ChunksValid = false;
+	m_RxDecoded = 0;
+	m_RawStart = 0;
+	m_RawEnd = 0;
+	m_InFrame = false;
+	m_Escaped = false;
+	m_BaudRate = MV2_BAUD_RATES[MV2_DEFAULT_BAUD_RATE_INDEX];
+} // Initialize
+
+// Find the Arduino left running by a previous session
+void CArduinoSerialPort::Reconnect()
+{
+	CDeadline _Deadline(RECONNECT_TIMEOUT);
 
-	// Get serial port settings
-	if (!GetCommState(m_PortHandle, &_DcbSerialParams))
+	// Opening the port may have rebooted it anyway: keep trying until it is ready
+	do
 	{
-		string _ErrorMsg = GET_SERIAL_PORT_SETTINGS_EXCEPTION_MSG + GetLastErrorStdStr();
-		throw CMV2HostException(_ErrorMsg);
-	}
+		// Default baud rate first, then the others from the highest
+		for (unsigned int _n = 0; _n < NB_MV2_BAUD_RATES; _n++)
+		{
+			unsigned int _i = (_n == 0) ? MV2_DEFAULT_BAUD_RATE_INDEX : NB_MV2_BAUD_RATES - _n;
+			if (((_n > 0) && (_i == MV2_DEFAULT_BAUD_RATE_INDEX)) || !m_pTransport->IsBaudRateSupported(MV2_BAUD_RATES[_i]))
+				continue;
+
+			SetBaudRate(MV2_BAUD_RATES[_i]);
+			try
+			{
+				Ping(RECONNECT_PING_TIMEOUT);
+				return;
+			}
+			catch (CMV2HostException &)
+			{
+				// Drop the garbage received at a wrong baud rate
+				Flush();
+			}
+		}
+	} while (!_Deadline.IsExpired());
+
+	// No answer: reboot it, as if the port had been opened with kOpenReset
+	SetBaudRate(MV2_BAUD_RATES[MV2_DEFAULT_BAUD_RATE_INDEX]);
+	if (!m_pTransport->Reset())
+		throw CMV2HostException(PING_EXCEPTION_MSG);
+	Flush();
+	Ping();
+} // Reconnect
+
+// Set baud rate of the transport
+void CArduinoSerialPort::SetBaudRate(unsigned long BaudRate)		// Baud rate
+{
+	m_pTransport->SetBaudRate(BaudRate);
+	m_BaudRate = BaudRate;
+} // SetBaudRate
 
-	_DcbSerialParams.fDtrControl = DTR_CONTROL_ENABLE;
-	_DcbSerialParams.BaudRate = CBR_57600;
-	_DcbSerialParams.ByteSize = 8;
-	_DcbSerialParams.StopBits = ONESTOPBIT;
-	_DcbSerialParams.Parity = NOPARITY;
+// Get time (ms) needed to transfer NbWords 16-bit words at the current baud rate
+unsigned int CArduinoSerialPort::GetTransferTime(unsigned int NbWords)		// Number of words
+{
+	// 10 bits per byte: start, 8 data, stop
+	unsigned long long _Bits = static_cast<unsigned long long>(NbWords) * sizeof(unsigned short) * 10;
+	return static_cast<unsigned int>((_Bits * 1000 + m_BaudRate - 1) / m_BaudRate);
+} // GetTransferTime
 
-	// Set serial port settings. Resets Arduino, because DTR is set.
-	if (!SetCommState(m_PortHandle, &_DcbSerialParams))
+// Flush anything already received
+void CArduinoSerialPort::Flush()
+{
+	// Discard unread bytes of the receive buffer
+	m_RxDecoded = 0;
+	m_RawStart = 0;
+	m_RawEnd = 0;
+	m_InFrame = false;
+	m_Escaped = false;
+
+	m_pTransport->Flush();
+} // Flush
+
+// Write to the transport
+void CArduinoSerialPort::Write (	const void		*pBuffer,		// Buffer to write
+									unsigned int	Size)			// Size of buffer
+{
+	CDeadline _Deadline(GetTransferTime((Size + 1) / 2) + RESPONSE_TIMEOUT_MARGIN);
+
+	if (m_pTransport->Write(pBuffer, Size, _Deadline) < Size)
+		ThrowTimeout(WRITE_TIMEOUT_EXCEPTION_MSG, _Deadline);
+} // Write
+
+// Write a frame: flag, header, payload and CRC escaped, flag. The payload is not modified.
+void CArduinoSerialPort::WriteFrame (	const unsigned short	*pPayload,			// Payload
+										unsigned int			PayloadLength,		// Number of words
+										unsigned short			Sequence)			// Sequence number
+{
+	// The Arduino rejects longer scripts
+	if (PayloadLength + SCRIPT_BUFFER_ADDITIONAL_INFOS_LENGTH > SCRIPT_BUFFER_LENGTH)
+		throw CMV2HostException(SCRIPT_TOO_LONG_EXCEPTION_MSG);
+
+	// Header is the frame size in bytes and the sequence number, CRC covers header and payload
+	unsigned short _Header[SCRIPT_BUFFER_HEADER_LENGTH];
+	_Header[0] = (PayloadLength + SCRIPT_BUFFER_ADDITIONAL_INFOS_LENGTH) * sizeof(unsigned short);
+	_Header[SCRIPT_SEQUENCE_INDEX] = Sequence;
+	unsigned short _Crc = CRC16_INIT;
+	unsigned int _Size = 0;
+
+	// Escape header, payload and CRC into the transmit buffer
+	m_TxBuffer[_Size++] = FRAME_FLAG;
+	for (unsigned int _i = 0; _i < PayloadLength + SCRIPT_BUFFER_ADDITIONAL_INFOS_LENGTH; _i++)
 	{
-		string _ErrorMsg = SET_SERIAL_PORT_SETTINGS_EXCEPTION_MSG + GetLastErrorStdStr();
-		throw CMV2HostException(_ErrorMsg);
+		unsigned short _Word;
+		if (_i < SCRIPT_BUFFER_HEADER_LENGTH)
+			_Word = _Header[_i];
+		else if (_i < SCRIPT_BUFFER_HEADER_LENGTH + PayloadLength)
+			_Word = pPayload[_i - SCRIPT_BUFFER_HEADER_LENGTH];
+		else
+			_Word = _Crc;
+
+		unsigned char _Bytes[2] = { static_cast<unsigned char>(_Word), static_cast<unsigned char>(_Word >> 8) };
+		for (int _j = 0; _j < 2; _j++)
+		{
+			_Crc = Crc16Update(_Crc, _Bytes[_j]);
+			if ((_Bytes[_j] == FRAME_FLAG) || (_Bytes[_j] == FRAME_ESCAPE))
+			{
+				m_TxBuffer[_Size++] = FRAME_ESCAPE;
+				m_TxBuffer[_Size++] = _Bytes[_j] ^ FRAME_ESCAPE_MASK;
+			}
+			else
+				m_TxBuffer[_Size++] = _Bytes[_j];
+		}
 	}
-	
-	// Wait for the reset.
-	Sleep(WAIT_FOR_ARDUINO_REBOOT);
+	m_TxBuffer[_Size++] = FRAME_FLAG;
 
-	// Flush anything already in the serial buffer
-	if (!PurgeComm(m_PortHandle, PURGE_RXABORT | PURGE_RXCLEAR | PURGE_TXABORT | PURGE_TXCLEAR))
+	Write(m_TxBuffer, _Size);
+} // WriteFrame
+
+// Read available bytes after the decoded ones, wait for at least one until the deadline
+bool CArduinoSerialPort::ReadRxBuffer (const CDeadline *pDeadline)		// Deadline, or NULL
+{
+	unsigned char *_pRxBuffer = reinterpret_cast<unsigned char *>(m_RxBuffer);
+
+	unsigned int _BytesRead = m_pTransport->Read(&_pRxBuffer[m_RawEnd], sizeof(m_RxBuffer) - m_RawEnd, pDeadline);
+	if (_BytesRead > 0)
 	{
-		string _ErrorMsg = FLUSH_SERIAL_PORT_EXCEPTION_MSG + GetLastErrorStdStr();
-		throw CMV2HostException(_ErrorMsg);
+		m_RawEnd += _BytesRead;
+		return true;
 	}
-#else
-	struct termios _PortSettings;
 
-	// Get serial port settings
-	if (tcgetattr(m_PortHandle, &_PortSettings) != 0)
+	// Nothing available yet
+	if (pDeadline == NULL)
+		return false;
+	ThrowTimeout(READ_TIMEOUT_EXCEPTION_MSG, *pDeadline);
+	return false;
+} // ReadRxBuffer
+
+// Decode next frame in the receive buffer
+bool CArduinoSerialPort::ReadFrame (	tFrameView			&rFrame,			// Frame
+										const CDeadline		*pDeadline,			// Deadline, or NULL
+										bool				DropBadFrames)		// Skip frames of a bad length
+{
+	unsigned char *_pRxBuffer = reinterpret_cast<unsigned char *>(m_RxBuffer);
+
+	for (;;)
 	{
-		string _ErrorMsg = GET_SERIAL_PORT_SETTINGS_EXCEPTION_MSG + GetLastErrorStdStr();
-		throw CMV2HostException(_ErrorMsg);
+		// Decode in place: decoded bytes never overtake the bytes read
+		while (m_RawStart < m_RawEnd)
+		{
+			unsigned char _Byte = _pRxBuffer[m_RawStart++];
+
+			// Frame boundary
+			if (_Byte == FRAME_FLAG)
+			{
+				unsigned int _FrameLength = m_RxDecoded;
+				m_InFrame = true;
+				m_Escaped = false;
+				m_RxDecoded = 0;
+
+				// Start of frame: discard anything decoded before
+				if (_FrameLength == 0)
+					continue;
+
+				// End of frame: check length
+				if ((_FrameLength < RESPONSE_MINIMUM_LENGTH * sizeof(unsigned short)) ||
+					(_FrameLength % sizeof(unsigned short) != 0) ||
+					(m_RxBuffer[0] != _FrameLength))
+				{
+					if (!DropBadFrames)
+						throw CMV2HostException(BAD_RESPONSE_LENGTH_EXCEPTION_MSG);
+					m_NbDroppedFrames++;
+					continue;
+				}
+
+				// Frame stays in the receive buffer until the next read
+				rFrame.pData = m_RxBuffer;
+				rFrame.Size = _FrameLength / sizeof(unsigned short);
+				return true;
+			}
+
+			// Ignore anything outside frames
+			if (!m_InFrame)
+				continue;
+
+			// Unescape
+			if (_Byte == FRAME_ESCAPE)
+			{
+				m_Escaped = true;
+				continue;
+			}
+			if (m_Escaped)
+			{
+				_Byte ^= FRAME_ESCAPE_MASK;
+				m_Escaped = false;
+			}
+
+			// Frame too long: resynchronize on the next flag
+			if (m_RxDecoded >= MAX_RESPONSE_LENGTH * sizeof(unsigned short))
+			{
+				m_InFrame = false;
+				m_RxDecoded = 0;
+				if (!DropBadFrames)
+					throw CMV2HostException(BAD_RESPONSE_LENGTH_EXCEPTION_MSG);
+				m_NbDroppedFrames++;
+				continue;
+			}
+			_pRxBuffer[m_RxDecoded++] = _Byte;
+		}
+
+		// All bytes decoded: read next bytes after the decoded ones
+		m_RawStart = m_RxDecoded;
+		m_RawEnd = m_RxDecoded;
+		if (!ReadRxBuffer(pDeadline))
+			return false;
 	}
-	 // Set baud rates
-	cfsetispeed(&_PortSettings, B57600);
-	cfsetospeed(&_PortSettings, B57600);
-
-	// Set 8N1
-	_PortSettings.c_cflag &= ~PARENB;
-	_PortSettings.c_cflag &= ~CSTOPB;
-	_PortSettings.c_cflag &= ~CSIZE;
-	_PortSettings.c_cflag |= CS8;
-
-	// Enable receiver, ignore status line
-	_PortSettings.c_cflag |= (CREAD | CLOCAL | CRTSCTS);
-	// Diable canonical input, disable echo, disable visually erase chars,
-	// disable terminal-generated signals
-	_PortSettings.c_lflag &= ~(ICANON | ECHO | ECHOE | ISIG);
-	// Disable hardware flow control
-	_PortSettings.c_cflag &= ~CRTSCTS;
-	// Disable input/output flow control, disable restart chars
-	_PortSettings.c_iflag &= ~(IXON | IXOFF | IXANY);
-	// Disable output processing
-	_PortSettings.c_oflag &= ~OPOST;
-	// Configured timed read
-	_PortSettings.c_cc[VMIN] = 0;
-	// 20s
-	_PortSettings.c_cc[VTIME] = 200;
-	// Set serial port settings
-	if (tcsetattr(m_PortHandle, TCSANOW, &_PortSettings) != 0)
+} // ReadFrame
+
+// Write commands buffer to the serial port and read response
+void CArduinoSerialPort::WriteAndRead(	const vector<unsigned short>	&rCommandsBuffer,		// Commands buffer
+										tFrameView						&rResponse,				// Response
+										unsigned int					ExpectedDuration)		// Execution time (ms)
+{
+	Submit(rCommandsBuffer, ExpectedDuration);
+	Complete(rResponse);
+} // WriteAndRead
+
+// Submit a script: write it to the serial port without waiting for its response
+void CArduinoSerialPort::Submit(const vector<unsigned short>	&rCommandsBuffer,		// Commands buffer
+								unsigned int					ExpectedDuration)		// Execution time (ms)
+{
+	// The Arduino can only hold SCRIPT_BUFFER_COUNT scripts
+	if (m_NbPendingScripts >= SCRIPT_BUFFER_COUNT)
+		throw CMV2HostException(TOO_MANY_SCRIPTS_EXCEPTION_MSG);
+
+	unsigned int _Index = (m_FirstScript + m_NbPendingScripts) % SCRIPT_BUFFER_COUNT;
+	m_Sequences[_Index] = m_NextSequence++;
+	WriteFrame(rCommandsBuffer.data(), rCommandsBuffer.size(), m_Sequences[_Index]);
+
+	// Keep the script to send it again if needed. Starting a stream or switching the baud rate
+	// twice would break the link: such scripts are only sent again if they were not executed.
+	m_Scripts[_Index].assign(rCommandsBuffer.begin(), rCommandsBuffer.end());
+	m_Retries[_Index] = MAX_SCRIPT_RETRIES;
+	m_Repeatable[_Index] = true;
+	for (unsigned int _i = 0; _i < rCommandsBuffer.size(); _i++)
+		if (((rCommandsBuffer[_i] >> 8) == MV2_CMD_START_STREAM) || ((rCommandsBuffer[_i] >> 8) == MV2_CMD_SET_BAUD_RATE))
+			m_Repeatable[_Index] = false;
+	m_Received[_Index] = false;
+
+	// The Arduino executes the script once the previous ones are completed
+	m_Durations[_Index] = ExpectedDuration +
+						  GetTransferTime(rCommandsBuffer.size() + SCRIPT_BUFFER_ADDITIONAL_INFOS_LENGTH + MAX_RESPONSE_LENGTH);
+	m_NbPendingScripts++;
+	m_Deadlines[_Index] = CDeadline(GetPendingTimeOut());
+} // Submit
+
+// Get the time out (ms) of a response that comes after those of all pending scripts
+unsigned int CArduinoSerialPort::GetPendingTimeOut()
+{
+	unsigned int _TimeOut = RESPONSE_TIMEOUT_MARGIN;
+	for (unsigned int _i = 0; _i < m_NbPendingScripts; _i++)
+		_TimeOut += m_Durations[(m_FirstScript + _i) % SCRIPT_BUFFER_COUNT];
+	return _TimeOut;
+} // GetPendingTimeOut
+
+// Complete the oldest submitted script: wait for its response until its deadline
+void CArduinoSerialPort::Complete(tFrameView &rResponse)		// Response
+{
+	CompleteScript(rResponse, true);
+} // Complete
+
+// Complete the oldest submitted script if its response is already received
+bool CArduinoSerialPort::TryComplete(tFrameView &rResponse)		// Response
+{
+	return CompleteScript(rResponse, false);
+} // TryComplete
+
+// Complete the oldest submitted script, wait for its response if Wait is true
+bool CArduinoSerialPort::CompleteScript(	tFrameView		&rResponse,		// Response
+											bool			Wait)			// Wait until the deadline
+{
+	if (m_NbPendingScripts == 0)
+		throw CMV2HostException(NO_SCRIPT_SUBMITTED_EXCEPTION_MSG);
+
+	unsigned int _First = m_FirstScript;
+	try
 	{
-		string _ErrorMsg = SET_SERIAL_PORT_SETTINGS_EXCEPTION_MSG + GetLastErrorStdStr();
-		throw CMV2HostException(_ErrorMsg);
+		for (;;)
+		{
+			// Response received while waiting for a previous one
+			if (m_Received[_First])
+			{
+				rResponse.pData = m_Responses[_First].data();
+				rResponse.Size = m_Responses[_First].size();
+				break;
+			}
+
+			// Read next response
+			tFrameView _Frame;
+			try
+			{
+				if (!ReadResponse(_Frame, &m_Deadlines[_First], Wait))
+				{
+					if (!m_Deadlines[_First].IsExpired())
+						return false;
+					ThrowTimeout(READ_TIMEOUT_EXCEPTION_MSG, m_Deadlines[_First]);
+				}
+			}
+			catch (CMV2HostException &)
+			{
+				// Response lost or corrupted: responses come in order, so the oldest script is
+				// the first one not answered yet. At worst, it is answered twice.
+				if (!RetryScript(_First, true))
+					throw;
+				continue;
+			}
+
+			// Arduino did not receive a script correctly and did not execute it
+			unsigned short _Error = GetResponseError(_Frame);
+			bool _NotExecuted = (_Error == kBadCrcError) || (_Error == kScriptLengthTooLargeError) ||
+								(_Error == kNoValidDataFromHostError) || (_Error == kTransmissionError);
+
+			// The sequence number of a script not received correctly may be wrong: it is then
+			// the oldest script not answered yet
+			int _Index = FindPendingScript(_Frame);
+			if ((_Index < 0) && _NotExecuted)
+				_Index = _First;
+
+			// Response of a script already completed, e.g. answered twice
+			if (_Index < 0)
+				continue;
+
+			if (_NotExecuted && RetryScript(_Index, false))
+				continue;
+
+			if (static_cast<unsigned int>(_Index) == _First)
+			{
+				rResponse = _Frame;
+				break;
+			}
+
+			// Response of a later script: keep it until that script is completed
+			m_Responses[_Index].assign(_Frame.pData, _Frame.pData + _Frame.Size);
+			m_Received[_Index] = true;
+		}
 	}
-	// Flush anything already in the serial buffer
-	if (tcflush(m_PortHandle, TCIFLUSH) != 0)
+	catch (CMV2HostException &)
 	{
-		string _ErrorMsg = FLUSH_SERIAL_PORT_EXCEPTION_MSG + GetLastErrorStdStr();
-		throw CMV2HostException(_ErrorMsg);
-	}	
+		// The script is completed even if its response is not valid
+		m_FirstScript = (m_FirstScript + 1) % SCRIPT_BUFFER_COUNT;
+		m_NbPendingScripts--;
+		throw;
+	}
 
-#endif
-} // SetSerialPortSettings
+	m_FirstScript = (m_FirstScript + 1) % SCRIPT_BUFFER_COUNT;
+	m_NbPendingScripts--;
+	return true;
+} // CompleteScript
 
-// Write script buffer to Arduino
-void CArduinoSerialPort::Write (	unsigned short	*pBuffer,		// Buffer to write
-									unsigned int	Size)			// Size of buffer
+// Send a pending script again
+bool CArduinoSerialPort::RetryScript(	unsigned int	Index,				// Index of the pending script
+										bool			MayBeExecuted)		// The Arduino may have executed it
 {
-	NoOfBytes_t _NoOfBytesWritten = 0;
-#ifdef WIN32
-	if (!WriteFile(m_PortHandle, pBuffer, Size, &_NoOfBytesWritten, NULL))
+	if ((m_Retries[Index] == 0) || (MayBeExecuted && !m_Repeatable[Index]))
+		return false;
+	m_Retries[Index]--;
+	m_NbRetransmissions++;
+
+	// Same sequence number: the Arduino sends its response again if it still has it
+	WriteFrame(m_Scripts[Index].data(), m_Scripts[Index].size(), m_Sequences[Index]);
+
+	// Its response comes after those of the other pending scripts
+	m_Deadlines[Index] = CDeadline(GetPendingTimeOut());
+	return true;
+} // RetryScript
+
+// Find the pending script a response belongs to
+int CArduinoSerialPort::FindPendingScript(const tFrameView &rResponse)		// Response
+{
+	for (unsigned int _i = 0; _i < m_NbPendingScripts; _i++)
 	{
-		string _ErrorMsg = WRITE_SERIAL_PORT_EXCEPTION_MSG + GetLastErrorStdStr();
-		throw CMV2HostException(_ErrorMsg);
+		unsigned int _Index = (m_FirstScript + _i) % SCRIPT_BUFFER_COUNT;
+		if ((m_Sequences[_Index] == rResponse.pData[RESPONSE_SEQUENCE_INDEX]) && !m_Received[_Index])
+			return _Index;
 	}
-#else
-	_NoOfBytesWritten = write(m_PortHandle, pBuffer, Size);
-	if (_NoOfBytesWritten < 0)
+	return -1;
+} // FindPendingScript
+
+// Write commands buffer to the serial port
+void CArduinoSerialPort::SendScript(const vector<unsigned short>	&rCommandsBuffer)		// Commands buffer
+{
+	WriteFrame(rCommandsBuffer.data(), rCommandsBuffer.size(), m_NextSequence++);
+} // SendScript
+
+// Read a response and check its CRC
+void CArduinoSerialPort::ReceiveResponse(	tFrameView		&rResponse,				// Response
+											unsigned int	ExpectedDuration)		// Execution time (ms)
+{
+	CDeadline _Deadline(GetResponseTimeOut(ExpectedDuration));
+	ReadResponse(rResponse, &_Deadline, true, true);
+} // ReceiveResponse
+
+// Get time out (ms) of a response, given the time the Arduino needs to produce it
+unsigned int CArduinoSerialPort::GetResponseTimeOut(unsigned int ExpectedDuration)		// Execution time (ms)
+{
+	return ExpectedDuration + GetTransferTime(MAX_RESPONSE_LENGTH) + RESPONSE_TIMEOUT_MARGIN;
+} // GetResponseTimeOut
+
+// Read a response if it is already received and check its CRC
+bool CArduinoSerialPort::TryReceiveResponse(tFrameView &rResponse)		// Response
+{
+	return ReadResponse(rResponse, NULL, false, true);
+} // TryReceiveResponse
+
+// Read a response and check its CRC, wait for it until the deadline if Wait is true
+bool CArduinoSerialPort::ReadResponse(	tFrameView			&rResponse,			// Response
+										CDeadline			*pDeadline,			// Deadline, or NULL
+										bool				Wait,				// Wait until the deadline
+										bool				DropBadFrames)		// Skip corrupted or truncated frames
+{
+	for (;;)
 	{
-		string _ErrorMsg = WRITE_SERIAL_PORT_EXCEPTION_MSG + GetLastErrorStdStr();
-		throw CMV2HostException(_ErrorMsg);
+		// Read response from Arduino
+		if (!ReadFrame(rResponse, Wait ? pDeadline : NULL, DropBadFrames))
+			return false;
+
+		// Check CRC
+		if (!Crc16CheckFrame(rResponse.pData, rResponse.Size))
+		{
+			if (!DropBadFrames)
+				throw CMV2HostException(BAD_CRC_EXCEPTION_MSG);
+			m_NbDroppedFrames++;
+			continue;
+		}
+
+		// Response in one frame
+		if (!(rResponse.pData[RESPONSE_FLAGS_INDEX] & (RESPONSE_FLAG_CHUNK | RESPONSE_FLAG_CHUNK_END)))
+			return true;
+		if (AssembleChunk(rResponse))
+			return true;
+
+		// The Arduino goes on with the script: the next chunk is due a time out later
+		if ((pDeadline != NULL) && (rResponse.pData[RESPONSE_FLAGS_INDEX] & RESPONSE_FLAG_CHUNK))
+			*pDeadline = CDeadline(pDeadline->GetTimeOutMs());
 	}
-#endif
-} // Write
+} // ReadResponse
 
-// Low level read
-void CArduinoSerialPort::LowLevelRead (	unsigned char	*pBuffer,
-										NoOfBytes_t		NoOfBytesToRead,
-										NoOfBytes_t		&rNoOfBytesRead)
+// Assemble a frame of a chunked response
+bool CArduinoSerialPort::AssembleChunk(tFrameView &rFrame)		// Frame, assembled response
 {
-	NoOfBytes_t _BytesRead = 0;
-	rNoOfBytesRead = 0;
-	NoOfBytes_t _RemainingBytes = NoOfBytesToRead;
+	const unsigned short *_pFrame = rFrame.pData;
+	unsigned int _StatusIndex = rFrame.Size - RESPONSE_CRC_LENGTH - RESPONSE_STATUS_LENGTH;
+	unsigned short _Flags = _pFrame[RESPONSE_FLAGS_INDEX];
 
-	// Loop until all the bytes are received
-	while (rNoOfBytesRead < NoOfBytesToRead)
+	// Chunk: its index is the error description. The first one starts the response.
+	if (_Flags & RESPONSE_FLAG_CHUNK)
 	{
-#ifdef WIN32
-		if(!ReadFile(m_PortHandle, &pBuffer[rNoOfBytesRead], _RemainingBytes, &_BytesRead, NULL))
+		unsigned short _Index = _pFrame[_StatusIndex + 1];
+		if (_Index == 0)
 		{
-			string _ErrorMsg = READ_SERIAL_PORT_EXCEPTION_MSG + GetLastErrorStdStr();
-			throw CMV2HostException(_ErrorMsg);
+			m_Chunks.assign(_pFrame, _pFrame + RESPONSE_HEADER_LENGTH);
+			m_NbChunks = 0;
+			m_ChunksValid = true;
 		}
-#else
-		_BytesRead = read(m_PortHandle, &pBuffer[rNoOfBytesRead], _RemainingBytes);
-		// Check error
-		if (_BytesRead < 0)
+		// A chunk was lost, or belongs to another response: the response is incomplete
+		else if ((_Index != m_NbChunks) || (_pFrame[RESPONSE_SEQUENCE_INDEX] != m_Chunks[RESPONSE_SEQUENCE_INDEX]))
+			m_ChunksValid = false;
+		if (!m_ChunksValid)
+			return false;
+
+		// Each chunk is encoded on its own
+		if ((_Flags >> RESPONSE_FLAGS_ENCODING_SHIFT) != RESULT_ENCODING_RAW)
 		{
-			string _ErrorMsg = READ_SERIAL_PORT_EXCEPTION_MSG + GetLastErrorStdStr();
-			throw CMV2HostException(_ErrorMsg);
+			CHostScript::DecodeResults(_pFrame, rFrame.Size, m_DecodedChunk);
+			_pFrame = m_DecodedChunk.data();
+			_StatusIndex = m_DecodedChunk.size() - RESPONSE_CRC_LENGTH - RESPONSE_STATUS_LENGTH;
 		}
-#endif
-		rNoOfBytesRead += _BytesRead;
-		_RemainingBytes -= _BytesRead;
+		m_Chunks.insert(m_Chunks.end(), _pFrame + RESPONSE_HEADER_LENGTH, _pFrame + _StatusIndex);
+		m_NbChunks++;
+		return false;
 	}
-} // Low level read
 
-// Read response buffer from Arduino
-void CArduinoSerialPort::Read (	unsigned short	*pBuffer,
-								NoOfBytes_t		&rNoOfBytesRead)
+	// Last frame: number of chunks, status. If a chunk was lost, it is ignored: the response
+	// is lost and the script is sent again.
+	if (_StatusIndex != RESPONSE_HEADER_LENGTH + 1)
+		throw CMV2HostException(BAD_RESPONSE_LENGTH_EXCEPTION_MSG);
+	unsigned short _NbChunks = _pFrame[RESPONSE_HEADER_LENGTH];
+	if (_NbChunks == 0)
+		m_Chunks.resize(RESPONSE_HEADER_LENGTH);
+	else if (!m_ChunksValid || (m_NbChunks != _NbChunks) ||
+			 (_pFrame[RESPONSE_SEQUENCE_INDEX] != m_Chunks[RESPONSE_SEQUENCE_INDEX]))
+		return false;
+	m_ChunksValid = false;
+
+	// Header and status of the last frame, the CRC of each frame has been checked
+	m_Chunks[RESPONSE_SEQUENCE_INDEX] = _pFrame[RESPONSE_SEQUENCE_INDEX];
+	m_Chunks[RESPONSE_FLAGS_INDEX] = _Flags & ~RESPONSE_FLAG_CHUNK_END;
+	m_Chunks.insert(m_Chunks.end(), _pFrame + _StatusIndex, _pFrame + rFrame.Size);
+	m_Chunks[0] = static_cast<unsigned short>(m_Chunks.size() * sizeof(unsigned short));
+	rFrame.pData = m_Chunks.data();
+	rFrame.Size = m_Chunks.size();
+	return true;
+} // AssembleChunk
+
+// Ask the Arduino to stop a stream: a frame flag ends it
+void CArduinoSerialPort::SendStreamStopRequest()
 {
-	unsigned char *_pTmpBuffer = (unsigned char *)pBuffer;
-	NoOfBytes_t _BytesRead = 0;
-	rNoOfBytesRead = 0;
+	unsigned char _StopRequest = FRAME_FLAG;
 
-	// Get header
-	LowLevelRead(&_pTmpBuffer[0], RESPONSE_HEADER_LENGTH * sizeof(unsigned short), _BytesRead);
+	Write(&_StopRequest, 1);
+} // SendStreamStopRequest
 
-	// Update bytes read
-	rNoOfBytesRead = _BytesRead;
-
-	// Compute bytes to read according to pBuffer[0]
-	int _BytesToRead = pBuffer[0] - _BytesRead;
-
-	// Get remaining response according to header pBuffer[0]
-	LowLevelRead(&_pTmpBuffer[_BytesRead], _BytesToRead, _BytesRead);
+// Check that the Arduino answers within TimeOut, return its firmware version
+unsigned short CArduinoSerialPort::Ping(unsigned int TimeOut)		// Time out (ms)
+{
+	vector<unsigned short> _CommandsBuffer(1, MV2_CMD_GET_FW_VERSION << 8);
+	tFrameView _Response;
+	unsigned short _Sequence = m_NextSequence;
+
+	SendScript(_CommandsBuffer);
+	CDeadline _Deadline(TimeOut);
+	do
+		ReadResponse(_Response, &_Deadline);
+	while (_Response.pData[RESPONSE_SEQUENCE_INDEX] != _Sequence);
+
+	// Response contains the firmware version only
+	if ((_Response.Size != RESPONSE_MINIMUM_LENGTH + 1) ||
+		(GetResponseError(_Response) != kNoError))
+		throw CMV2HostException(PING_EXCEPTION_MSG);
+
+	return _Response.pData[RESPONSE_HEADER_LENGTH];
+} // Ping
+
+// Switch both ends to the highest baud rate up to MaxBaudRate that works
+void CArduinoSerialPort::NegotiateBaudRate(unsigned long MaxBaudRate)		// Highest baud rate to try
+{
+	tFrameView _Response;
 
-	// Update bytes read
-	rNoOfBytesRead += _BytesRead;
-} // Read
+	// Try from the highest baud rate
+	for (int _i = NB_MV2_BAUD_RATES - 1; _i > MV2_DEFAULT_BAUD_RATE_INDEX; _i--)
+	{
+		if ((MV2_BAUD_RATES[_i] > MaxBaudRate) || !m_pTransport->IsBaudRateSupported(MV2_BAUD_RATES[_i]))
+			continue;
 
-// Write commands buffer to the serial port and read response
-void CArduinoSerialPort::WriteAndRead(	vector<unsigned short>	&rCommandsBuffer,			// Commands buffer
-										tResult					*pResponseBuffer,			// Response buffer
-										unsigned int			&rResponseBufferSize)		// Size of response buffer
-{
-	// Insert size at index 0
-	rCommandsBuffer.insert(rCommandsBuffer.begin(), (rCommandsBuffer.size()  +
-														SCRIPT_BUFFER_HEADER_LENGTH +
-															SCRIPT_BUFFER_CRC_LENGTH)
-																* sizeof(unsigned short));
-	// Generate and insert CRC
-	rCommandsBuffer.push_back(GenerateCrc(rCommandsBuffer.size(), &rCommandsBuffer[0]));
-
-	// Write command buffer to the Arduino
-	Write(&rCommandsBuffer[0], rCommandsBuffer[0]);
-
-	// Read response from Arduino
-	NoOfBytes_t _BytesRead;
-	Read(pResponseBuffer, _BytesRead);
-
-	// Compute size of response buffer
-	rResponseBufferSize = _BytesRead/sizeof(tResult);
-
-	// Check CRC
-	if (!CheckCrc(_BytesRead/sizeof(tResult), pResponseBuffer))
-		throw CMV2HostException(BAD_CRC_EXCEPTION_MSG);
-} // WriteAndRead
+		// Ask the Arduino to switch baud rate once it has sent the response
+		vector<unsigned short> _CommandsBuffer(1, MV2_CMD_SET_BAUD_RATE << 8 | _i);
+		WriteAndRead(_CommandsBuffer, _Response);
 
-// Generate CRC
-unsigned short CArduinoSerialPort::GenerateCrc (unsigned short	Size,			// Size of message
-												unsigned short	*pMessage)		// Message
-{
-	unsigned short _Result = 0;
+		// Firmware doesn't support baud rate negotiation: keep the default baud rate
+		if (GetResponseError(_Response) != kNoError)
+			return;
 
-	for (unsigned short _i=0; _i<Size; _i++)
-		_Result ^= pMessage[_i];
-
-	return _Result;
-} // GenerateCrc
+		// Switch and confirm the baud rate with a ping
+		SetBaudRate(MV2_BAUD_RATES[_i]);
+		WaitMs(BAUD_RATE_SWITCH_DELAY);
+		try
+		{
+			Ping(BAUD_RATE_PING_TIMEOUT);
+			return;
+		}
+		catch (CMV2HostException &)
+		{
+			// Link is not reliable: the Arduino restores the default baud rate
+			// after BAUD_RATE_CONFIRM_TIMEOUT
+			SetBaudRate(MV2_BAUD_RATES[MV2_DEFAULT_BAUD_RATE_INDEX]);
+			WaitMs(BAUD_RATE_CONFIRM_TIMEOUT);
+			Flush();
+		}
+	}
+} // NegotiateBaudRate
 
-// Check CRC
-bool CArduinoSerialPort::CheckCrc (	int				Size,		// Size of message
-									unsigned short	*pMessage)	// Message
+// Get error code of a response
+unsigned short CArduinoSerialPort::GetResponseError(const tFrameView &rResponse)		// Response
 {
-	unsigned short _Result = 0;
-
-	for (int _i=0; _i<Size; _i++)
-		_Result ^= pMessage[_i];
+	return rResponse.pData[rResponse.Size - RESPONSE_CRC_LENGTH - RESPONSE_STATUS_LENGTH];
+} // GetResponseError
 
-	return (_Result == 0);
-} // CheckCrc
 } // namespace MV2Host
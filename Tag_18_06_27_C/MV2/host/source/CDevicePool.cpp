@@ -0,0 +1,339 @@
+// Name:
+//	CDevicePool.cpp
+//
+// Purpose:
+//	See CDevicePool.h
+//
+// Description:
+//
+// Coding Conventions:
+//	- Variable names use the "InterCaps" convention
+//	- Local variables are prefixed with an underscore, '_'
+//	- Private class members are prefixed with 'm_'
+//	- Private class methods are prefixed with an underscore, '_'
+//	- Pointer variables are prefixed with 'p'
+//	- Reference variables are prefixed with 'r'
+//	- Enumerated types are prefixed with 'e'
+//	- Enumerated type values are prefixed with 'k'
+//	- Classes are prefixed with 'C'
+//	- Constants are all uppercase
+//	The above conventions can also be combined:
+//	- A local pointer variable would be prefixed '_p'
+//	- A private class pointer member would be prefixed 'm_p'
+//
+// Change log:
+//	17.10.26 MB	Original version
+//	17.10.26 MB	Only wait for the reboot if a port reboots its Arduino
+//	17.10.26 MB	Leave the Arduinos running with kOpenNoReset
+//
+// Copyright (c) 2016 Metrolab Technology SA, Geneva,
+//	Switzerland
+
+// Include files
+#include <CDevicePool.h>
+
+#ifndef WIN32
+
+#include <stdio.h>
+#include <sstream>
+
+// Exceptions messages
+#define NO_DEVICE_EXCEPTION_MSG					"CDevicePool: No serial port."
+#define HUNG_UP_EXCEPTION_MSG					"CDevicePool: Serial port hung up."
+
+// Our namespace
+namespace MV2Host
+{
+
+// Constructor: open all ports and read the script of every device
+CDevicePool::CDevicePool(	const vector<string>	&rPortNames,			// Port names
+							const char				*pScriptFileName,		// Script filename
+							const char				*pSchemaFileName,		// Schema filename
+							eOpenMode				OpenMode)				// How to open the serial ports
+{
+	if (rPortNames.empty())
+		throw CMV2HostException(NO_DEVICE_EXCEPTION_MSG);
+
+	m_NbRunning = 0;
+
+	try
+	{
+		// Opening a serial port reboots its Arduino: open all of them, then wait once.
+		// Arduinos left running are pinged when their port is opened.
+		if (OpenMode == kOpenReset)
+			OpenMode = kOpenResetNoWait;
+		bool _Reboot = false;
+		for (unsigned int _i = 0; _i < rPortNames.size(); _i++)
+		{
+			tPoolDevice _Device;
+			_Device.PortName = rPortNames[_i];
+			_Device.pArduino = NULL;
+			_Device.pHostScript = NULL;
+			_Device.NbSubmitted = 0;
+			_Device.NbCompleted = 0;
+			_Device.Stopping = false;
+			_Device.Done = false;
+			m_Devices.push_back(_Device);
+			m_Devices.back().pArduino = new CArduinoSerialPort(rPortNames[_i].c_str(), OpenMode);
+			if (m_Devices.back().pArduino->GetTransport()->RebootsOnOpen())
+				_Reboot = true;
+		}
+		if (_Reboot)
+			sleep(WAIT_FOR_ARDUINO_REBOOT);
+
+		for (unsigned int _i = 0; _i < m_Devices.size(); _i++)
+			m_Devices[_i].pHostScript = new CHostScript(m_Devices[_i].pArduino, pScriptFileName, pSchemaFileName);
+	}
+	catch (...)
+	{
+		for (unsigned int _i = 0; _i < m_Devices.size(); _i++)
+		{
+			delete m_Devices[_i].pHostScript;
+			delete m_Devices[_i].pArduino;
+		}
+		throw;
+	}
+} // Constructor
+
+// Destructor
+CDevicePool::~CDevicePool()
+{
+	for (unsigned int _i = 0; _i < m_Devices.size(); _i++)
+	{
+		delete m_Devices[_i].pHostScript;
+		delete m_Devices[_i].pArduino;
+	}
+} // Destructor
+
+// Negotiate the baud rate and execute the initialization script of every device
+void CDevicePool::Initialize(unsigned long MaxBaudRate)		// Highest baud rate to try
+{
+	for (unsigned int _i = 0; _i < m_Devices.size(); _i++)
+	{
+		try
+		{
+			m_Devices[_i].pArduino->NegotiateBaudRate(MaxBaudRate);
+			m_Devices[_i].pHostScript->ExecuteInitializationScript();
+		}
+		catch (CMV2HostException &rE)
+		{
+			throw CMV2HostException(m_Devices[_i].PortName + ": " + rE.what());
+		}
+	}
+} // Initialize
+
+// Start the measurement script on every device
+void CDevicePool::Start()
+{
+	m_StartTime = chrono::steady_clock::now();
+	m_NextDeadlineCheck = CDeadline(POOL_POLL_PERIOD);
+
+	for (unsigned int _i = 0; _i < m_Devices.size(); _i++)
+	{
+		tPoolDevice &_rDevice = m_Devices[_i];
+		CHostScript *_pHostScript = _rDevice.pHostScript;
+
+		// Nothing to measure
+		if (!IsRepeating(_rDevice, 0))
+		{
+			_rDevice.Done = true;
+			continue;
+		}
+
+		try
+		{
+			// Stream the measurement script, or keep the next one on the Arduino while it
+			// executes the current one
+			if (_pHostScript->GetStreamMeasurementScript())
+				_pHostScript->StartMeasurementStream();
+			else
+			{
+				while ((_pHostScript->GetNbPendingMeasurementScripts() < SCRIPT_BUFFER_COUNT) &&
+						IsRepeating(_rDevice, _rDevice.NbSubmitted))
+				{
+					_pHostScript->SubmitMeasurementScript();
+					_rDevice.NbSubmitted++;
+				}
+			}
+		}
+		catch (CMV2HostException &rE)
+		{
+			throw CMV2HostException(_rDevice.PortName + ": " + rE.what());
+		}
+
+		// Wait for its responses
+		m_DeviceIndexes[_rDevice.pArduino->GetHandle()] = _i;
+		m_EventLoop.Add(_rDevice.pArduino->GetHandle(), EVENT_READABLE, this);
+		m_NbRunning++;
+	}
+} // Start
+
+// Wait up to POOL_POLL_PERIOD for measurements and add them to the merged stream
+bool CDevicePool::Run()
+{
+	if (m_NbRunning == 0)
+		return false;
+
+	m_EventLoop.RunOnce(m_NextDeadlineCheck);
+
+	// A device that does not answer has no event: check its deadlines from time to time
+	if (m_NextDeadlineCheck.IsExpired())
+	{
+		for (unsigned int _i = 0; _i < m_Devices.size(); _i++)
+			Service(_i);
+		m_NextDeadlineCheck = CDeadline(POOL_POLL_PERIOD);
+	}
+
+	return m_NbRunning > 0;
+} // Run
+
+// Get the oldest measurement of the merged stream
+bool CDevicePool::GetSample(tPoolSample &rSample)		// Measurement
+{
+	if (m_Samples.empty())
+		return false;
+
+	rSample = m_Samples.front();
+	m_Samples.pop_front();
+	return true;
+} // GetSample
+
+// Stop the measurement of every device and discard pending measurements
+void CDevicePool::Stop()
+{
+	for (unsigned int _i = 0; _i < m_Devices.size(); _i++)
+	{
+		tPoolDevice &_rDevice = m_Devices[_i];
+		CHostScript *_pHostScript = _rDevice.pHostScript;
+
+		if (_rDevice.Done)
+			continue;
+
+		try
+		{
+			if (_pHostScript->GetStreamMeasurementScript())
+				_pHostScript->StopMeasurementStream();
+			else
+				while (_pHostScript->GetNbPendingMeasurementScripts() > 0)
+					_pHostScript->CompleteMeasurementScript();
+		}
+		catch (CMV2HostException &rE)
+		{
+			throw CMV2HostException(_rDevice.PortName + ": " + rE.what());
+		}
+		Finish(_i);
+	}
+} // Stop
+
+// Called by the event loop when a serial port is ready
+void CDevicePool::OnEvent(	File_t			FileDescriptor,		// File descriptor
+							unsigned int	Events)				// Ready events
+{
+	map<File_t, unsigned int>::iterator _it = m_DeviceIndexes.find(FileDescriptor);
+	if (_it == m_DeviceIndexes.end())
+		return;
+
+	if (Events & EVENT_ERROR)
+		throw CMV2HostException(m_Devices[_it->second].PortName + ": " + HUNG_UP_EXCEPTION_MSG);
+
+	Service(_it->second);
+} // OnEvent
+
+// Check whether a device must execute its measurement script more than Count times
+bool CDevicePool::IsRepeating(	const tPoolDevice	&rDevice,		// Device
+								int					Count)			// Number of executions
+{
+	// Repeat 0 means forever
+	int _Repeat = rDevice.pHostScript->GetRepeatMeasurementScript();
+	return (_Repeat == 0) || (Count < _Repeat);
+} // IsRepeating
+
+// Complete the measurements of a device already received and submit the next ones
+void CDevicePool::Service(unsigned int Device)		// Index of the device
+{
+	tPoolDevice &_rDevice = m_Devices[Device];
+	CHostScript *_pHostScript = _rDevice.pHostScript;
+
+	if (_rDevice.Done)
+		return;
+
+	try
+	{
+		if (_pHostScript->GetStreamMeasurementScript())
+		{
+			while (_pHostScript->TryReadMeasurementStream())
+			{
+				// Measurements sent before the Arduino received the stop request are discarded
+				if (_rDevice.Stopping)
+					continue;
+
+				AddSample(Device);
+				_rDevice.NbCompleted++;
+				if (!IsRepeating(_rDevice, _rDevice.NbCompleted))
+				{
+					_rDevice.pArduino->SendStreamStopRequest();
+					_rDevice.Stopping = true;
+				}
+			}
+			if (!_pHostScript->IsMeasurementStreaming())
+				Finish(Device);
+		}
+		else
+		{
+			while ((_pHostScript->GetNbPendingMeasurementScripts() > 0) &&
+					_pHostScript->TryCompleteMeasurementScript())
+			{
+				AddSample(Device);
+				_rDevice.NbCompleted++;
+
+				// Keep the pipeline full
+				if (IsRepeating(_rDevice, _rDevice.NbSubmitted))
+				{
+					_pHostScript->SubmitMeasurementScript();
+					_rDevice.NbSubmitted++;
+				}
+			}
+			if (_pHostScript->GetNbPendingMeasurementScripts() == 0)
+				Finish(Device);
+		}
+	}
+	catch (CMV2HostException &rE)
+	{
+		throw CMV2HostException(_rDevice.PortName + ": " + rE.what());
+	}
+} // Service
+
+// Add the results of a device to the merged stream
+void CDevicePool::AddSample(unsigned int Device)		// Index of the device
+{
+	CHostScript *_pHostScript = m_Devices[Device].pHostScript;
+	tPoolSample _Sample;
+
+	_Sample.Device = Device;
+	_Sample.Time = chrono::duration<double>(chrono::steady_clock::now() - m_StartTime).count();
+
+	// Prefix every line of results with the device and the time
+	char _Prefix[32];
+	snprintf(_Prefix, sizeof(_Prefix), "%u,%.6f,", Device, _Sample.Time);
+	istringstream _Lines(_pHostScript->GetCsvResults());
+	string _Line;
+	while (getline(_Lines, _Line))
+		_Sample.CsvResults += _Prefix + _Line + "\n";
+	_Sample.CsvHeadings = string(POOL_DEVICE_HEADING) + "," + POOL_TIME_HEADING + "," + _pHostScript->GetCsvHeadings();
+
+	m_Samples.push_back(_Sample);
+} // AddSample
+
+// Stop waiting for a device once all its measurements are received
+void CDevicePool::Finish(unsigned int Device)		// Index of the device
+{
+	tPoolDevice &_rDevice = m_Devices[Device];
+
+	_rDevice.Done = true;
+	m_EventLoop.Remove(_rDevice.pArduino->GetHandle());
+	m_NbRunning--;
+} // Finish
+
+} // namespace MV2Host
+
+#endif // WIN32
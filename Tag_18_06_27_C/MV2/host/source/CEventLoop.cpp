@@ -0,0 +1,243 @@
+// Name:
+//	CEventLoop.cpp
+//
+// Purpose:
+//	See CEventLoop.h
+//
+// Description:
+//
+// Coding Conventions:
+//	- Variable names use the "InterCaps" convention
+//	- Local variables are prefixed with an underscore, '_'
+//	- Private class members are prefixed with 'm_'
+//	- Private class methods are prefixed with an underscore, '_'
+//	- Pointer variables are prefixed with 'p'
+//	- Reference variables are prefixed with 'r'
+//	- Enumerated types are prefixed with 'e'
+//	- Enumerated type values are prefixed with 'k'
+//	- Classes are prefixed with 'C'
+//	- Constants are all uppercase
+//	The above conventions can also be combined:
+//	- A local pointer variable would be prefixed '_p'
+//	- A private class pointer member would be prefixed 'm_p'
+//
+// Change log:
+//	17.10.26 MB	Original version
+//
+// Copyright (c) 2016 Metrolab Technology SA, Geneva,
+//	Switzerland
+
+// Include files
+#include <CEventLoop.h>
+
+#ifndef WIN32
+
+#include <string.h>
+
+// Exceptions messages
+#define CREATE_EVENT_LOOP_EXCEPTION_MSG			"CEventLoop: Unable to create event loop."
+#define ADD_FILE_DESCRIPTOR_EXCEPTION_MSG		"CEventLoop: Unable to add file descriptor."
+#define MODIFY_FILE_DESCRIPTOR_EXCEPTION_MSG	"CEventLoop: Unable to modify file descriptor."
+#define UNKNOWN_FILE_DESCRIPTOR_EXCEPTION_MSG	"CEventLoop: Unknown file descriptor."
+#define WAIT_EXCEPTION_MSG						"CEventLoop: Unable to wait for events."
+
+// Our namespace
+namespace MV2Host
+{
+
+#ifdef __linux__
+// Convert events to epoll events
+static uint32_t ToEpollEvents(unsigned int Events)
+{
+	uint32_t _EpollEvents = 0;
+	if (Events & EVENT_READABLE)
+		_EpollEvents |= EPOLLIN;
+	if (Events & EVENT_WRITABLE)
+		_EpollEvents |= EPOLLOUT;
+	return _EpollEvents;
+}
+
+// Convert epoll events to events
+static unsigned int FromEpollEvents(uint32_t EpollEvents)
+{
+	unsigned int _Events = 0;
+	if (EpollEvents & EPOLLIN)
+		_Events |= EVENT_READABLE;
+	if (EpollEvents & EPOLLOUT)
+		_Events |= EVENT_WRITABLE;
+	if (EpollEvents & (EPOLLERR | EPOLLHUP))
+		_Events |= EVENT_ERROR;
+	return _Events;
+}
+#else
+// Convert events to poll events
+static short ToPollEvents(unsigned int Events)
+{
+	short _PollEvents = 0;
+	if (Events & EVENT_READABLE)
+		_PollEvents |= POLLIN;
+	if (Events & EVENT_WRITABLE)
+		_PollEvents |= POLLOUT;
+	return _PollEvents;
+}
+
+// Convert poll events to events
+static unsigned int FromPollEvents(short PollEvents)
+{
+	unsigned int _Events = 0;
+	if (PollEvents & POLLIN)
+		_Events |= EVENT_READABLE;
+	if (PollEvents & POLLOUT)
+		_Events |= EVENT_WRITABLE;
+	if (PollEvents & (POLLERR | POLLHUP | POLLNVAL))
+		_Events |= EVENT_ERROR;
+	return _Events;
+}
+#endif
+
+// Constructor
+CEventLoop::CEventLoop()
+{
+#ifdef __linux__
+	m_EpollHandle = epoll_create1(EPOLL_CLOEXEC);
+	if (m_EpollHandle < 0)
+	{
+		string _ErrorMsg = CREATE_EVENT_LOOP_EXCEPTION_MSG + GetLastErrorStdStr();
+		throw CMV2HostException(_ErrorMsg);
+	}
+#endif
+} // Constructor
+
+// Destructor
+CEventLoop::~CEventLoop()
+{
+#ifdef __linux__
+	close(m_EpollHandle);
+#endif
+} // Destructor
+
+// Wait for events of a file descriptor
+void CEventLoop::Add(	File_t				FileDescriptor,		// File descriptor
+						unsigned int		Events,				// Events to wait for
+						CEventHandler		*pHandler)			// Handler
+{
+#ifdef __linux__
+	struct epoll_event _Event;
+	memset(&_Event, 0, sizeof(_Event));
+	_Event.events = ToEpollEvents(Events);
+	_Event.data.fd = FileDescriptor;
+	if (epoll_ctl(m_EpollHandle, EPOLL_CTL_ADD, FileDescriptor, &_Event) != 0)
+	{
+		string _ErrorMsg = ADD_FILE_DESCRIPTOR_EXCEPTION_MSG + GetLastErrorStdStr();
+		throw CMV2HostException(_ErrorMsg);
+	}
+#else
+	if (m_Handlers.count(FileDescriptor) != 0)
+		throw CMV2HostException(ADD_FILE_DESCRIPTOR_EXCEPTION_MSG);
+	m_Events[FileDescriptor] = Events;
+#endif
+	m_Handlers[FileDescriptor] = pHandler;
+} // Add
+
+// Change the events to wait for
+void CEventLoop::Modify(	File_t			FileDescriptor,		// File descriptor
+							unsigned int	Events)				// Events to wait for
+{
+	if (m_Handlers.count(FileDescriptor) == 0)
+		throw CMV2HostException(UNKNOWN_FILE_DESCRIPTOR_EXCEPTION_MSG);
+#ifdef __linux__
+	struct epoll_event _Event;
+	memset(&_Event, 0, sizeof(_Event));
+	_Event.events = ToEpollEvents(Events);
+	_Event.data.fd = FileDescriptor;
+	if (epoll_ctl(m_EpollHandle, EPOLL_CTL_MOD, FileDescriptor, &_Event) != 0)
+	{
+		string _ErrorMsg = MODIFY_FILE_DESCRIPTOR_EXCEPTION_MSG + GetLastErrorStdStr();
+		throw CMV2HostException(_ErrorMsg);
+	}
+#else
+	m_Events[FileDescriptor] = Events;
+#endif
+} // Modify
+
+// Stop waiting for a file descriptor
+void CEventLoop::Remove(File_t FileDescriptor)		// File descriptor
+{
+#ifdef __linux__
+	// The file descriptor may already be closed: ignore errors
+	struct epoll_event _Event;
+	epoll_ctl(m_EpollHandle, EPOLL_CTL_DEL, FileDescriptor, &_Event);
+#else
+	m_Events.erase(FileDescriptor);
+#endif
+	m_Handlers.erase(FileDescriptor);
+} // Remove
+
+// Wait for events until Deadline and dispatch them
+int CEventLoop::RunOnce(const CDeadline &rDeadline)		// Deadline
+{
+	// Ready file descriptors and their events
+	File_t _ReadyFileDescriptors[MAX_DISPATCHED_EVENTS];
+	unsigned int _ReadyEvents[MAX_DISPATCHED_EVENTS];
+	int _NbReady = 0;
+	int _Ret;
+
+#ifdef __linux__
+	struct epoll_event _Events[MAX_DISPATCHED_EVENTS];
+	do
+		_Ret = epoll_wait(m_EpollHandle, _Events, MAX_DISPATCHED_EVENTS, rDeadline.GetRemainingMs());
+	while ((_Ret < 0) && (errno == EINTR));
+	if (_Ret < 0)
+	{
+		string _ErrorMsg = WAIT_EXCEPTION_MSG + GetLastErrorStdStr();
+		throw CMV2HostException(_ErrorMsg);
+	}
+	for (int _i = 0; _i < _Ret; _i++)
+	{
+		_ReadyFileDescriptors[_NbReady] = _Events[_i].data.fd;
+		_ReadyEvents[_NbReady++] = FromEpollEvents(_Events[_i].events);
+	}
+#else
+	vector<struct pollfd> _PollFds;
+	_PollFds.reserve(m_Events.size());
+	for (map<File_t, unsigned int>::iterator _it = m_Events.begin(); _it != m_Events.end(); _it++)
+	{
+		struct pollfd _PollFd;
+		_PollFd.fd = _it->first;
+		_PollFd.events = ToPollEvents(_it->second);
+		_PollFd.revents = 0;
+		_PollFds.push_back(_PollFd);
+	}
+	do
+		_Ret = poll(_PollFds.data(), _PollFds.size(), rDeadline.GetRemainingMs());
+	while ((_Ret < 0) && (errno == EINTR));
+	if (_Ret < 0)
+	{
+		string _ErrorMsg = WAIT_EXCEPTION_MSG + GetLastErrorStdStr();
+		throw CMV2HostException(_ErrorMsg);
+	}
+	for (unsigned int _i = 0; (_i < _PollFds.size()) && (_NbReady < MAX_DISPATCHED_EVENTS); _i++)
+	{
+		if (_PollFds[_i].revents == 0)
+			continue;
+		_ReadyFileDescriptors[_NbReady] = _PollFds[_i].fd;
+		_ReadyEvents[_NbReady++] = FromPollEvents(_PollFds[_i].revents);
+	}
+#endif
+
+	// Dispatch. A handler may remove any file descriptor, look each one up again.
+	int _NbDispatched = 0;
+	for (int _i = 0; _i < _NbReady; _i++)
+	{
+		map<File_t, CEventHandler *>::iterator _it = m_Handlers.find(_ReadyFileDescriptors[_i]);
+		if (_it == m_Handlers.end())
+			continue;
+		_it->second->OnEvent(_ReadyFileDescriptors[_i], _ReadyEvents[_i]);
+		_NbDispatched++;
+	}
+	return _NbDispatched;
+} // RunOnce
+
+} // namespace MV2Host
+
+#endif // WIN32
@@ -27,6 +27,24 @@
 //				and Execute()
 //				- Fix truncation error in Average method
 //	03.04.17 PK	Adapt for use with Arduino MEGA 2560
+//	17.10.26 MB	Add streaming measurement
+//	17.10.26 MB	Add pipelined measurement
+//	17.10.26 MB	Move RESPONSE_MINIMUM_LENGTH to MV2HostConstants.h
+//	17.10.26 MB	Build the measurement commands buffer once, parse responses in place
+//	17.10.26 MB	Estimate script durations for the response deadlines
+//	17.10.26 MB	Results start after the response header, which now holds a sequence number
+//	17.10.26 MB	Add TryCompleteMeasurementScript and TryReadMeasurementStream
+//	17.10.26 MB	Loops with average="true" are averaged by the Arduino (RESPONSE_FLAG_AVERAGED)
+//	17.10.26 MB	Add capture measurement (capture="true", MV2_CMD_START_CAPTURE)
+//	17.10.26 MB	Nested loops and 16-bit loop counts (MV2_CMD_SET_LOOP_COUNT_HIGH)
+//	17.10.26 MB	Send the measurement script once to a script slot, then MV2_CMD_RUN_SCRIPT only
+//	17.10.26 MB	Encode the measurement results (encoding attribute, MV2_CMD_SET_RESULT_ENCODING)
+//	17.10.26 MB	Time columns from the timestamps of the Arduino (MV2_CMD_GET_TIMESTAMP)
+//	17.10.26 MB	Start the sample timer of the Arduino (samplePeriod attribute, MV2_CMD_START_SAMPLE_TIMER)
+//	17.10.26 MB	Add trigger measurement (trigger attributes, MV2_CMD_START_TRIGGER)
+//	17.10.26 MB	Read and clear the performance counters of the Arduino (MV2_CMD_GET_DIAGNOSTICS)
+//	17.10.26 MB	Add burst measurement (burst attributes, MV2_CMD_START_BURST)
+//	17.10.26 MB	Read DIAG_TX_EMPTY
 //
 // Copyright (c) 2016 Metrolab Technology SA, Geneva,
 //	Switzerland
@@ -43,6 +61,7 @@
 #include <sstream>
 #include <iostream>
 #include <map>
+#include <algorithm>
 
 // Exception messages
 #define COUNT_ATTR_EXCEPTION_MSG				"CHostScript: Attribute count doesn't exists for loop element.\n"
@@ -60,6 +79,15 @@
 #define COMMAND_TYPE_EXCEPTION_MSG				"CHostScript: Command type doesn't exist: "
 #define MV2_EXCEPTION_MSG						"CHostScript: MV2 error: "
 #define COMPUTE_RESPONSE_INDEX_EXCEPTION_MSG	"CHostScript: Unable to compute response index.\n"
+#define STREAM_NOT_STARTED_EXCEPTION_MSG		"CHostScript: Measurement stream is not started.\n"
+#define STREAM_TIMEOUT_EXCEPTION_MSG			"CHostScript: Timeout reading measurement stream.\n"
+#define AVERAGE_LOOP_EXCEPTION_MSG				"CHostScript: An averaged loop can't contain loops.\n"
+#define TIMESTAMP_AVERAGE_EXCEPTION_MSG			"CHostScript: An averaged loop can't contain timestamps.\n"
+#define CAPTURE_SCRIPT_EXCEPTION_MSG			"CHostScript: A capture measurement script only waits for Data Ready and writes registers.\n"
+#define TRIGGER_CAPTURE_EXCEPTION_MSG			"CHostScript: A trigger measurement script can't be a capture.\n"
+#define TRIGGER_OUTPUT_EXCEPTION_MSG			"CHostScript: The trigger output must be one of the first 16 results of the measurement script.\n"
+#define BURST_STREAM_EXCEPTION_MSG				"CHostScript: A burst measurement script can't be a stream, a capture or a trigger.\n"
+#define BURST_LOOP_EXCEPTION_MSG				"CHostScript: A burst measurement script can't contain loops.\n"
 
 // Error messages from Arduino
 static map<unsigned int, string> gResponseErrorCodes =
@@ -69,11 +97,14 @@ static map<unsigned int, string> gResponseErrorCodes =
 				{kOutOfMemoryError,				"Out of memory"				},
 				{kNestedLoopError,				"Nested loop"				},
 				{kUnspecifiedLoopError,			"Unspecified loop error"	},
+				{kScriptSlotError,				"Script slot error"			},
 				{kBadCrcError,					"Bad CRC"					},
 				{kScriptLengthTooLargeError,	"Script length too large"	},
 				{kNoValidDataFromHostError,		"No valid data from host"	},
 				{kTransmissionError,			"Transmission error"		},
-				{kAdcTimeOutError,				"ADC timeout"				}
+				{kAdcTimeOutError,				"ADC timeout"				},
+				{kCaptureOverrunError,			"Capture overrun"			},
+				{kSampleTimerError,				"Sample timer not started"	}
 		};
 
 
@@ -87,6 +118,17 @@ static map<unsigned int, string> gResponseErrorCodes =
 #define COMMAND_VALUE_XPATH						".//value"
 #define COMMAND_TYPE_XPATH						".//type"
 #define REPEAT_ATTIBUTE_NAME					"repeat"
+#define STREAM_ATTIBUTE_NAME					"stream"
+#define CAPTURE_ATTIBUTE_NAME					"capture"
+#define ENCODING_ATTIBUTE_NAME					"encoding"
+#define SAMPLE_PERIOD_ATTIBUTE_NAME				"samplePeriod"
+#define TRIGGER_ATTIBUTE_NAME					"trigger"
+#define TRIGGER_OUTPUT_ATTIBUTE_NAME			"triggerOutput"
+#define TRIGGER_LEVEL_ATTIBUTE_NAME				"triggerLevel"
+#define PRE_TRIGGER_ATTIBUTE_NAME				"preTrigger"
+#define POST_TRIGGER_ATTIBUTE_NAME				"postTrigger"
+#define BURST_ATTIBUTE_NAME						"burst"
+#define BURST_SAMPLES_ATTIBUTE_NAME				"burstSamples"
 
 // XPath constants for XML script
 #define INITIALIZATION_SCRIPT_XPATH				"/scripts/initialization"
@@ -95,10 +137,23 @@ static map<unsigned int, string> gResponseErrorCodes =
 // Miscellaneous constants
 #define HEADING_DEFAULT_PREFIX_NAME				"unknown"
 
-// Response Buffer constants
-#define RESPONSE_MINIMUM_LENGTH 				(RESPONSE_HEADER_LENGTH + \
-													RESPONSE_STATUS_LENGTH + \
-														RESPONSE_CRC_LENGTH)
+// Worst case execution times (us) on the Arduino
+// Conversion or data ready: A_D_CONVERSION_TIMEOUT in MV2Hal.h
+#define CONVERSION_MAX_DURATION					5000
+#define COMMAND_MAX_DURATION					100
+
+// Number of Data Ready per response of a capture: fewer responses, but the first results come later
+#define CAPTURE_SETS_PER_RESPONSE				32
+
+// Script slot of the measurement script
+#define MEASUREMENT_SCRIPT_SLOT					0
+
+// Low bits always 0 in analog results: ANALOG_SHIFT in MV2Hal.h
+#define ANALOG_RESULT_SHIFT						6
+
+// Largest stride of delta coded results, and number of bytes of a delta coded result
+#define MAX_ENCODING_STRIDE						((0xFF >> RESULT_ENCODING_STRIDE_SHIFT) + 1)
+#define MAX_DELTA_BYTES							3
 
 // Our namespace
 namespace MV2Host
@@ -155,8 +210,48 @@ CHostScript::CHostScript(
 	if(m_pXPathCtx == NULL)
 		throw CMV2HostException(CREATE_XPATH_EVAL_CONTEXT_EXCEPTION_MSG);
 
-	CheckScriptNode((const xmlChar*)INITIALIZATION_SCRIPT_XPATH, m_pXPathCtx, m_RepeatInitializationScript, m_pInitializationScriptNode);
-	CheckScriptNode((const xmlChar*)MEASUREMENT_SCRIPT_XPATH, m_pXPathCtx, m_RepeatMeasurementScript, m_pMeasurementScriptNode);
+	bool _StreamInitializationScript;
+	bool _CaptureInitializationScript;
+	string _InitializationEncoding;
+	string _MeasurementEncoding;
+	unsigned int _InitializationSamplePeriod;
+	CheckScriptNode((const xmlChar*)INITIALIZATION_SCRIPT_XPATH, m_pXPathCtx, m_RepeatInitializationScript, _StreamInitializationScript, _CaptureInitializationScript, _InitializationEncoding, _InitializationSamplePeriod, m_pInitializationScriptNode);
+	CheckScriptNode((const xmlChar*)MEASUREMENT_SCRIPT_XPATH, m_pXPathCtx, m_RepeatMeasurementScript, m_StreamMeasurementScript, m_CaptureMeasurementScript, _MeasurementEncoding, m_SamplePeriod, m_pMeasurementScriptNode);
+	m_AchievedSamplePeriod = 0;
+
+	// Measurement script is executed many times: build its commands buffer once
+	FillCommandsBufferFromXmlNodes(m_pMeasurementScriptNode, m_pXPathCtx, m_MeasurementCommandsBuffer, m_MeasurementResultsInfos);
+	ReadTriggerAttributes();
+	ReadBurstAttributes();
+
+	// The encoding command is the last one, so that the indexes of the commands in error don't change.
+	// A capture only writes registers, its results are always raw.
+	m_MeasurementEncoding = m_CaptureMeasurementScript ? RESULT_ENCODING_RAW : ChooseEncoding(_MeasurementEncoding);
+	if (m_MeasurementEncoding != RESULT_ENCODING_RAW)
+		m_MeasurementCommandsBuffer.push_back(CreateCommand(MV2_CMD_SET_RESULT_ENCODING, m_MeasurementEncoding));
+	m_MeasurementDuration = EstimateDuration(m_MeasurementCommandsBuffer);
+	PrepareStream();
+
+	// The measurement script is stored on its first execution, if it fits in a script with MV2_CMD_STORE_SCRIPT.
+	// Otherwise it is sent each time, like a burst.
+	m_MeasurementScriptStored = m_BurstMeasurementScript ||
+			(m_MeasurementCommandsBuffer.size() + 1 > SCRIPT_BUFFER_LENGTH - SCRIPT_BUFFER_ADDITIONAL_INFOS_LENGTH);
+	if (m_BurstMeasurementScript)
+		PrepareBurst();
+	else if (m_MeasurementScriptStored)
+		m_MeasurementTrigger = m_MeasurementCommandsBuffer;
+	else
+		m_MeasurementTrigger.push_back(CreateCommand(MV2_CMD_RUN_SCRIPT, MEASUREMENT_SCRIPT_SLOT));
+
+	// No stream is running
+	m_Streaming = false;
+	m_TriggerArmed = false;
+	m_TriggerTime = 0;
+	m_BurstSampleInterval = 0;
+
+	// The time starts at the first timestamp received
+	m_DeviceTime = 0;
+	m_DeviceTimeStarted = false;
 } // Constructor
 
 // Destructor
@@ -171,6 +266,10 @@ void CHostScript::CheckScriptNode(
 									const xmlChar*		pScriptXPath,		// Pointer to the XPath script
 									xmlXPathContextPtr	pXPathCtx,			// Pointer to the XPath context
 									int					&rRepeat,			// Repeat attribute
+									bool				&rStream,			// Stream attribute
+									bool				&rCapture,			// Capture attribute
+									string				&rEncoding,			// Encoding attribute
+									unsigned int		&rSamplePeriod,		// Sample period attribute
 									xmlNodePtr			&rpScriptNode)		// Pointer to the script node
 {
 	xmlXPathObjectPtr _pXPathObj;
@@ -196,6 +295,26 @@ void CHostScript::CheckScriptNode(
 		rRepeat = -1;
 	xmlFree(_TempRepeat);
 
+	// Get stream attribute if it exists
+	xmlChar *_TempStream = xmlGetProp(_ScriptNode, (const xmlChar*)STREAM_ATTIBUTE_NAME);
+	rStream = (_TempStream != NULL) && (strcmp((const char*)_TempStream, "true") == 0);
+	xmlFree(_TempStream);
+
+	// Get capture attribute if it exists
+	xmlChar *_TempCapture = xmlGetProp(_ScriptNode, (const xmlChar*)CAPTURE_ATTIBUTE_NAME);
+	rCapture = (_TempCapture != NULL) && (strcmp((const char*)_TempCapture, "true") == 0);
+	xmlFree(_TempCapture);
+
+	// Get encoding attribute if it exists
+	xmlChar *_TempEncoding = xmlGetProp(_ScriptNode, (const xmlChar*)ENCODING_ATTIBUTE_NAME);
+	rEncoding = (_TempEncoding != NULL) ? string((const char*)_TempEncoding) : string("packed");
+	xmlFree(_TempEncoding);
+
+	// Get sample period attribute if it exists
+	xmlChar *_TempSamplePeriod = xmlGetProp(_ScriptNode, (const xmlChar*)SAMPLE_PERIOD_ATTIBUTE_NAME);
+	rSamplePeriod = (_TempSamplePeriod != NULL) ? strtoul((char*)_TempSamplePeriod, NULL, 10) : 0;
+	xmlFree(_TempSamplePeriod);
+
 	// Get script children
 	rpScriptNode = _ScriptNode->children;
 
@@ -203,6 +322,191 @@ void CHostScript::CheckScriptNode(
 	xmlXPathFreeObject(_pXPathObj);
 } // CheckScriptNode
 
+// Read the trigger attributes of the measurement script
+void CHostScript::ReadTriggerAttributes()
+{
+	// Kinds of trigger of the trigger attribute
+	static const map<string, unsigned char> _Triggers =
+		{
+				{"rising",			TRIGGER_RISING			},
+				{"falling",			TRIGGER_FALLING			},
+				{"slopeRising",		TRIGGER_SLOPE_RISING	},
+				{"slopeFalling",	TRIGGER_SLOPE_FALLING	}
+		};
+
+	xmlXPathObjectPtr _pXPathObj = xmlXPathEvalExpression((const xmlChar*)MEASUREMENT_SCRIPT_XPATH, m_pXPathCtx);
+	if (_pXPathObj == NULL)
+		throw CMV2HostException(EVAL_XPATH_EXPR_EXCEPTION_MSG);
+	xmlNodePtr _ScriptNode = _pXPathObj->nodesetval->nodeTab[0];
+	xmlXPathFreeObject(_pXPathObj);
+
+	// Get trigger attribute if it exists
+	xmlChar *_TempTrigger = xmlGetProp(_ScriptNode, (const xmlChar*)TRIGGER_ATTIBUTE_NAME);
+	map<string, unsigned char>::const_iterator _Trigger = _Triggers.end();
+	if (_TempTrigger != NULL)
+		_Trigger = _Triggers.find((const char*)_TempTrigger);
+	xmlFree(_TempTrigger);
+	m_TriggerMeasurementScript = (_Trigger != _Triggers.end());
+	m_Trigger = m_TriggerMeasurementScript ? _Trigger->second : TRIGGER_RISING;
+
+	// Get the other attributes if they exist
+	xmlChar *_TempLevel = xmlGetProp(_ScriptNode, (const xmlChar*)TRIGGER_LEVEL_ATTIBUTE_NAME);
+	m_TriggerLevel = (_TempLevel != NULL) ? strtoul((char*)_TempLevel, NULL, 10) : 0;
+	xmlFree(_TempLevel);
+	xmlChar *_TempPre = xmlGetProp(_ScriptNode, (const xmlChar*)PRE_TRIGGER_ATTIBUTE_NAME);
+	m_PreTrigger = (_TempPre != NULL) ? strtoul((char*)_TempPre, NULL, 10) : 0;
+	xmlFree(_TempPre);
+	xmlChar *_TempPost = xmlGetProp(_ScriptNode, (const xmlChar*)POST_TRIGGER_ATTIBUTE_NAME);
+	m_PostTrigger = (_TempPost != NULL) ? strtoul((char*)_TempPost, NULL, 10) : 1;
+	xmlFree(_TempPost);
+	xmlChar *_TempOutput = xmlGetProp(_ScriptNode, (const xmlChar*)TRIGGER_OUTPUT_ATTIBUTE_NAME);
+	int _Output = (_TempOutput != NULL) ? strtol((char*)_TempOutput, NULL, 10) : 0;
+	xmlFree(_TempOutput);
+
+	if (!m_TriggerMeasurementScript)
+		return;
+	if (m_CaptureMeasurementScript)
+		throw CMV2HostException(TRIGGER_CAPTURE_EXCEPTION_MSG);
+
+	// The Arduino watches a result by its position in a sample
+	unsigned int _Position = 0;
+	if (!FindResultPosition(m_MeasurementResultsInfos, 0, m_MeasurementResultsInfos.size(), _Output, _Position) ||
+		(_Position > TRIGGER_RESULT_MASK))
+		throw CMV2HostException(TRIGGER_OUTPUT_EXCEPTION_MSG);
+	m_Trigger |= _Position;
+} // ReadTriggerAttributes
+
+// Read the burst attributes of the measurement script
+void CHostScript::ReadBurstAttributes()
+{
+	xmlXPathObjectPtr _pXPathObj = xmlXPathEvalExpression((const xmlChar*)MEASUREMENT_SCRIPT_XPATH, m_pXPathCtx);
+	if (_pXPathObj == NULL)
+		throw CMV2HostException(EVAL_XPATH_EXPR_EXCEPTION_MSG);
+	xmlNodePtr _ScriptNode = _pXPathObj->nodesetval->nodeTab[0];
+	xmlXPathFreeObject(_pXPathObj);
+
+	// Get burst attributes if they exist
+	xmlChar *_TempBurst = xmlGetProp(_ScriptNode, (const xmlChar*)BURST_ATTIBUTE_NAME);
+	m_BurstMeasurementScript = (_TempBurst != NULL) && (strcmp((const char*)_TempBurst, "true") == 0);
+	xmlFree(_TempBurst);
+	xmlChar *_TempSamples = xmlGetProp(_ScriptNode, (const xmlChar*)BURST_SAMPLES_ATTIBUTE_NAME);
+	m_BurstSamples = (_TempSamples != NULL) ? strtoul((char*)_TempSamples, NULL, 10) : 0;
+	xmlFree(_TempSamples);
+	m_BurstSampleLength = 0;
+
+	if (!m_BurstMeasurementScript)
+		return;
+	if (m_StreamMeasurementScript || m_CaptureMeasurementScript || m_TriggerMeasurementScript)
+		throw CMV2HostException(BURST_STREAM_EXCEPTION_MSG);
+
+	// A sample is the measurement script executed once, without loops
+	for (unsigned int _i = 0; _i < m_MeasurementCommandsBuffer.size(); _i++)
+	{
+		unsigned char _Command = m_MeasurementCommandsBuffer[_i] >> 8;
+		if ((_Command == MV2_CMD_SET_LOOP_START) || (_Command == MV2_CMD_SET_AVERAGE_LOOP_START))
+			throw CMV2HostException(BURST_LOOP_EXCEPTION_MSG);
+	}
+	m_BurstSampleLength = m_MeasurementResultsInfos.size();
+} // ReadBurstAttributes
+
+// Build the commands that take a burst, and the informations about its results
+void CHostScript::PrepareBurst()
+{
+	// The measurement script takes a sample. The number of samples follows it, so that the indexes
+	// of the commands in error don't change.
+	m_MeasurementTrigger.push_back(CreateCommand(MV2_CMD_START_BURST, 0));
+	m_MeasurementTrigger.insert(m_MeasurementTrigger.end(), m_MeasurementCommandsBuffer.begin(), m_MeasurementCommandsBuffer.end());
+	if (m_BurstSamples != 0)
+		PushValueCommand(m_MeasurementTrigger, MV2_CMD_SET_BURST_SAMPLES, m_BurstSamples);
+
+	// The time of the burst, then the samples like a loop over the measurement script. The count of
+	// the loop is the number of samples of each response (see ParseMeasurementResponse).
+	unsigned int _NbSamples = m_BurstSamples;
+	if ((_NbSamples == 0) && (m_BurstSampleLength > 0))
+		_NbSamples = (MAX_RESULTS_LENGTH - BURST_TIME_LENGTH) / m_BurstSampleLength;
+	vector<tResultInfos> _SampleInfos = m_MeasurementResultsInfos;
+	m_MeasurementResultsInfos.assign(BURST_TIME_LENGTH, tResultInfos(false, 0, 0, -1, ""));
+	m_MeasurementResultsInfos.push_back(tResultInfos(false, _NbSamples, _SampleInfos.size(), -1, ""));
+	m_MeasurementResultsInfos.insert(m_MeasurementResultsInfos.end(), _SampleInfos.begin(), _SampleInfos.end());
+	m_MeasurementDuration *= max(_NbSamples, 1u);
+} // PrepareBurst
+
+// Parse a response of the measurement script, and the burst it holds if any
+void CHostScript::ParseMeasurementResponse(	const tResult	*pResponseBuffer,	// Response buffer
+											int				ResponseSize)		// Response size
+{
+	// Burst: the samples the response holds, after the time. Encoded results are preceded by their number.
+	bool _Encoded = (ResponseSize > RESPONSE_MINIMUM_LENGTH) &&
+			((pResponseBuffer[RESPONSE_FLAGS_INDEX] >> RESPONSE_FLAGS_ENCODING_SHIFT) != RESULT_ENCODING_RAW);
+	unsigned int _NbSamples = 0;
+	if (m_BurstMeasurementScript && (ResponseSize > RESPONSE_MINIMUM_LENGTH))
+	{
+		unsigned int _NbResults = _Encoded ? pResponseBuffer[RESPONSE_HEADER_LENGTH] : ResponseSize - RESPONSE_MINIMUM_LENGTH;
+		if ((_NbResults > BURST_TIME_LENGTH) && (m_BurstSampleLength > 0))
+			_NbSamples = (_NbResults - BURST_TIME_LENGTH) / m_BurstSampleLength;
+		m_MeasurementResultsInfos[BURST_TIME_LENGTH].Loop = _NbSamples;
+	}
+
+	// Parse results
+	ParseResults(pResponseBuffer, ResponseSize, m_MeasurementResultsInfos, m_Results, m_Times);
+
+	// Keep the samples of the burst one after the other, in the decoded response if encoded
+	if (m_BurstMeasurementScript)
+	{
+		const tResult *_pResults = _Encoded ? &m_DecodedResponse[RESPONSE_HEADER_LENGTH] : &pResponseBuffer[RESPONSE_HEADER_LENGTH];
+		unsigned long _Time = _pResults[0] | (static_cast<unsigned long>(_pResults[1]) << 16);
+		m_Burst.assign(&_pResults[BURST_TIME_LENGTH], &_pResults[BURST_TIME_LENGTH + _NbSamples * m_BurstSampleLength]);
+		m_BurstSampleInterval = (_NbSamples > 1) ? static_cast<double>(_Time) / (_NbSamples - 1) : 0;
+	}
+
+	// Update headings
+	UpdateHeadings(m_MeasurementResultsInfos);
+} // ParseMeasurementResponse
+
+// Find the position of the first result of an output among the results of the entries [Begin, End)
+bool CHostScript::FindResultPosition(	const vector<tResultInfos>	&rResultsInfos,		// Informations about results
+										unsigned int				Begin,				// First entry
+										unsigned int				End,				// Entry after the last one
+										int							OutputIndex,		// Output index
+										unsigned int				&rPosition)			// Position of the result
+{
+	unsigned int _i = Begin;
+
+	while (_i < End)
+	{
+		// A loop: the first iteration, then the results of all of them
+		if (rResultsInfos[_i].NbCommands > 0)
+		{
+			unsigned int _Iteration = 0;
+			if (FindResultPosition(rResultsInfos, _i + 1, _i + 1 + rResultsInfos[_i].NbCommands, OutputIndex, _Iteration))
+			{
+				rPosition += _Iteration;
+				return true;
+			}
+			rPosition += _Iteration * (rResultsInfos[_i].Average ? 1 : rResultsInfos[_i].Loop);
+			_i += rResultsInfos[_i].NbCommands + 1;
+		}
+		else
+		{
+			if (rResultsInfos[_i].OutputIndex == OutputIndex)
+				return true;
+			rPosition++;
+			_i++;
+		}
+	}
+	return false;
+} // FindResultPosition
+
+// Add a command with a 16-bit value
+void CHostScript::PushValueCommand(	vector<unsigned short>	&rCommandsBuffer,	// Commands buffer
+									unsigned char			CommandType,		// Command type
+									unsigned int			CommandValue)		// Command value
+{
+	if (CommandValue > 0xFF)
+		rCommandsBuffer.push_back(CreateCommand(MV2_CMD_SET_LOOP_COUNT_HIGH, CommandValue >> 8));
+	rCommandsBuffer.push_back(CreateCommand(CommandType, CommandValue & 0xFF));
+} // PushValueCommand
+
 // Execute initialization script
 void CHostScript::ExecuteInitializationScript()
 {
@@ -213,38 +517,538 @@ void CHostScript::ExecuteInitializationScript()
 	FillCommandsBufferFromXmlNodes(m_pInitializationScriptNode, m_pXPathCtx, _CommandsBuffer, _ResultsInfos);
 
 	Execute(_ResultsInfos, _CommandsBuffer);
+
+	// The measurement script waits for the ticks of the sample timer
+	if (m_SamplePeriod > 0)
+	{
+		vector<unsigned short> _TimerCommands;
+		PushValueCommand(_TimerCommands, MV2_CMD_START_SAMPLE_TIMER, m_SamplePeriod);
+		m_AchievedSamplePeriod = ExecuteValue(_TimerCommands);
+	}
 } // ExecuteInitializationScript
 
+// Read the number of sample timer ticks missed since the sample timer started
+unsigned int CHostScript::ReadSampleOverruns()
+{
+	return ExecuteValue(vector<unsigned short>(1, CreateCommand(MV2_CMD_GET_SAMPLE_OVERRUNS, 0)));
+} // ReadSampleOverruns
+
+// Read the performance counters of the Arduino
+tDiagnostics CHostScript::ReadDiagnostics()
+{
+	// One command per word: the first one takes the snapshot the others read
+	vector<unsigned short> _CommandsBuffer;
+	for (unsigned char _i = 0; _i < DIAG_LENGTH; _i++)
+		_CommandsBuffer.push_back(CreateCommand(MV2_CMD_GET_DIAGNOSTICS, _i));
+
+	tFrameView _Response;
+	vector< vector<tResult> > _Results;
+	vector< vector<tTime> > _Times;
+	m_pArduino->WriteAndRead(_CommandsBuffer, _Response, EstimateDuration(_CommandsBuffer));
+	ParseResults(_Response.pData, _Response.Size, vector<tResultInfos>(DIAG_LENGTH, tResultInfos(false, 0, 0, 0, "")), _Results, _Times);
+	const vector<tResult> &_rWords = _Results[0];
+	if (_rWords.size() != DIAG_LENGTH)
+		throw CMV2HostException(PARSE_EXCEPTION_MSG);
+
+	// Times are 32 bits, low word first
+	tDiagnostics _Diagnostics;
+	_Diagnostics.SpiTime = _rWords[DIAG_SPI] | (static_cast<unsigned long>(_rWords[DIAG_SPI + 1]) << 16);
+	_Diagnostics.DataReadyTime = _rWords[DIAG_DATA_READY] | (static_cast<unsigned long>(_rWords[DIAG_DATA_READY + 1]) << 16);
+	_Diagnostics.AdcTime = _rWords[DIAG_ADC] | (static_cast<unsigned long>(_rWords[DIAG_ADC + 1]) << 16);
+	_Diagnostics.TxTime = _rWords[DIAG_TX] | (static_cast<unsigned long>(_rWords[DIAG_TX + 1]) << 16);
+	_Diagnostics.IdleTime = _rWords[DIAG_IDLE] | (static_cast<unsigned long>(_rWords[DIAG_IDLE + 1]) << 16);
+	_Diagnostics.DispatchTime = _rWords[DIAG_DISPATCH] | (static_cast<unsigned long>(_rWords[DIAG_DISPATCH + 1]) << 16);
+	_Diagnostics.RamFreeMin = _rWords[DIAG_RAM_FREE_MIN];
+	_Diagnostics.TxQueuedMax = _rWords[DIAG_TX_QUEUED_MAX];
+	_Diagnostics.ResponseMax = _rWords[DIAG_RESPONSE_MAX];
+	_Diagnostics.TxEmpty = _rWords[DIAG_TX_EMPTY];
+	return _Diagnostics;
+} // ReadDiagnostics
+
+// Clear the performance counters of the Arduino
+void CHostScript::ResetDiagnostics()
+{
+	ExecuteValue(vector<unsigned short>(1, CreateCommand(MV2_CMD_GET_DIAGNOSTICS, DIAG_RESET)));
+} // ResetDiagnostics
+
+// Convert performance counters to text
+string CHostScript::ConvertDiagnosticsToText(const tDiagnostics &rDiagnostics)	// Performance counters
+{
+	static const char *TIME_NAMES[] = { "SPI transfers", "Data Ready waits", "ADC waits", "TX waits", "Idle", "Firmware" };
+	unsigned long _Times[] = {	rDiagnostics.SpiTime, rDiagnostics.DataReadyTime, rDiagnostics.AdcTime,
+								rDiagnostics.TxTime, rDiagnostics.IdleTime, rDiagnostics.DispatchTime };
+	const unsigned int _NbTimes = sizeof(_Times) / sizeof(_Times[0]);
+
+	// The times add up to the time elapsed
+	unsigned long long _Total = 0;
+	for (unsigned int _i = 0; _i < _NbTimes; _i++)
+		_Total += _Times[_i];
+
+	ostringstream _Text;
+	_Text << fixed;
+	_Text.precision(1);
+	for (unsigned int _i = 0; _i < _NbTimes; _i++)
+	{
+		_Text << TIME_NAMES[_i] << ": " << _Times[_i] << " us";
+		if (_Total > 0)
+			_Text << " (" << 100.0 * _Times[_i] / _Total << " %)";
+		_Text << endl;
+	}
+	_Text << "Lowest free RAM: " << rDiagnostics.RamFreeMin << " bytes" << endl;
+	_Text << "Most bytes queued for TX: " << rDiagnostics.TxQueuedMax << endl;
+	_Text << "Most results in a response: " << rDiagnostics.ResponseMax << endl;
+	_Text << "TX buffer found empty: " << rDiagnostics.TxEmpty << endl;
+
+	// The largest share bounds the acquisition: SPI transfers are the firmware talking to the sensor
+	unsigned long long _Sensor = static_cast<unsigned long long>(rDiagnostics.DataReadyTime) + rDiagnostics.AdcTime;
+	unsigned long long _Firmware = static_cast<unsigned long long>(rDiagnostics.SpiTime) + rDiagnostics.DispatchTime;
+	const char *_pBound = "host";
+	unsigned long long _Largest = rDiagnostics.IdleTime;
+	if (_Sensor > _Largest)
+	{
+		_pBound = "sensor";
+		_Largest = _Sensor;
+	}
+	if (rDiagnostics.TxTime > _Largest)
+	{
+		_pBound = "serial link";
+		_Largest = rDiagnostics.TxTime;
+	}
+	if (_Firmware > _Largest)
+		_pBound = "firmware";
+	if (_Total > 0)
+		_Text << "Bound by: " << _pBound << endl;
+	return _Text.str();
+} // ConvertDiagnosticsToText
+
+// Execute a script returning one value
+tResult CHostScript::ExecuteValue(const vector<unsigned short> &rCommandsBuffer)	// Commands buffer
+{
+	// Response, parsed in the receive buffer of the serial port
+	tFrameView _Response;
+	vector< vector<tResult> > _Results;
+	vector< vector<tTime> > _Times;
+
+	m_pArduino->WriteAndRead(rCommandsBuffer, _Response, EstimateDuration(rCommandsBuffer));
+	ParseResults(_Response.pData, _Response.Size, vector<tResultInfos>(1, tResultInfos(false, 0, 0, 0, "")), _Results, _Times);
+	return _Results[0][0];
+} // ExecuteValue
+
 // ExecuteMeasurementScript
 void CHostScript::ExecuteMeasurementScript()
 {
-	vector<unsigned short> _CommandsBuffer;
-	vector<tResultInfos> _ResultsInfos;
+	// Response, parsed in the receive buffer of the serial port
+	tFrameView _Response;
 
-	FillCommandsBufferFromXmlNodes(m_pMeasurementScriptNode, m_pXPathCtx, _CommandsBuffer, _ResultsInfos);
+	// Clear results
+	m_Results.clear();
 
-	Execute(_ResultsInfos, _CommandsBuffer);
+	// Execute the script and wait for the response
+	m_pArduino->WriteAndRead(GetMeasurementCommands(), _Response, m_MeasurementDuration);
+
+	// Parse results
+	ParseMeasurementResponse(_Response.pData, _Response.Size);
 } // ExecuteMeasurementScript
 
+// Submit measurement script without waiting for its results
+void CHostScript::SubmitMeasurementScript()
+{
+	m_pArduino->Submit(GetMeasurementCommands(), m_MeasurementDuration);
+} // SubmitMeasurementScript
+
+// Store the measurement script in its script slot on the first execution
+const vector<unsigned short> &CHostScript::GetMeasurementCommands()
+{
+	if (!m_MeasurementScriptStored)
+	{
+		// Response, parsed in the receive buffer of the serial port
+		tFrameView _Response;
+		vector< vector<tResult> > _Results;
+		vector< vector<tTime> > _Times;
+
+		// Nothing is executed: the Arduino checks the commands and keeps them
+		vector<unsigned short> _CommandsBuffer(1, CreateCommand(MV2_CMD_STORE_SCRIPT, MEASUREMENT_SCRIPT_SLOT));
+		_CommandsBuffer.insert(_CommandsBuffer.end(), m_MeasurementCommandsBuffer.begin(), m_MeasurementCommandsBuffer.end());
+		m_pArduino->WriteAndRead(_CommandsBuffer, _Response, EstimateDuration(vector<unsigned short>()));
+
+		// Throw the error of the script, if any
+		ParseResults(_Response.pData, _Response.Size, vector<tResultInfos>(), _Results, _Times);
+		m_MeasurementScriptStored = true;
+	}
+	return m_MeasurementTrigger;
+} // GetMeasurementCommands
+
+// Wait for the results of the oldest submitted measurement script
+void CHostScript::CompleteMeasurementScript()
+{
+	// Response, parsed in the receive buffer of the serial port
+	tFrameView _Response;
+
+	// Clear results
+	m_Results.clear();
+
+	// Wait for the response
+	m_pArduino->Complete(_Response);
+
+	// Parse results
+	ParseMeasurementResponse(_Response.pData, _Response.Size);
+} // CompleteMeasurementScript
+
+// Get the results of the oldest submitted measurement script if they are already received
+bool CHostScript::TryCompleteMeasurementScript()
+{
+	// Response, parsed in the receive buffer of the serial port
+	tFrameView _Response;
+
+	if (!m_pArduino->TryComplete(_Response))
+		return false;
+
+	// Parse results
+	ParseMeasurementResponse(_Response.pData, _Response.Size);
+
+	return true;
+} // TryCompleteMeasurementScript
+
+// Get number of submitted measurement scripts not completed yet
+unsigned int CHostScript::GetNbPendingMeasurementScripts()
+{
+	return m_pArduino->GetNbPendingScripts();
+} // GetNbPendingMeasurementScripts
+
 // Execute a script
 void CHostScript::Execute(	vector<tResultInfos> 		&rResultsInfos,		// Informations about results
-							vector<unsigned short>		&rCommandsBuffer)	// Commands buffer
+							const vector<unsigned short>	&rCommandsBuffer)	// Commands buffer
 {
-	// Response buffer
-	tResult _ResponseBuffer[MAX_RESPONSE_LENGTH];
+	// Response, parsed in the receive buffer of the serial port
+	tFrameView _Response;
 
 	// Clear results
 	m_Results.clear();
 
-	// Response buffer size
-	unsigned int _ResponseBufferSize;
-
 	// Send script to the Arduino and wait for the response
-	m_pArduino->WriteAndRead(rCommandsBuffer, _ResponseBuffer, _ResponseBufferSize);
+	m_pArduino->WriteAndRead(rCommandsBuffer, _Response, EstimateDuration(rCommandsBuffer));
 
 	// Parse results
-	ParseResults(_ResponseBuffer, _ResponseBufferSize, rResultsInfos, m_Results);
+	ParseResults(_Response.pData, _Response.Size, rResultsInfos, m_Results, m_Times);
+
+	// Update headings
+	UpdateHeadings(rResultsInfos);
+} // Execute
+
+// Build the commands sent to start the measurement stream, capture or trigger
+void CHostScript::PrepareStream()
+{
+	// Trigger: the measurement script takes a sample. The settings follow it, so that the indexes
+	// of the commands in error don't change.
+	if (m_TriggerMeasurementScript)
+	{
+		m_StreamCommandsBuffer.push_back(CreateCommand(MV2_CMD_START_TRIGGER, m_Trigger));
+		m_StreamCommandsBuffer.insert(m_StreamCommandsBuffer.end(), m_MeasurementCommandsBuffer.begin(), m_MeasurementCommandsBuffer.end());
+		if (m_TriggerLevel != 0)
+			PushValueCommand(m_StreamCommandsBuffer, MV2_CMD_SET_TRIGGER_LEVEL, m_TriggerLevel);
+		if (m_PreTrigger != 0)
+			PushValueCommand(m_StreamCommandsBuffer, MV2_CMD_SET_PRE_TRIGGER, m_PreTrigger);
+		if (m_PostTrigger != 1)
+			PushValueCommand(m_StreamCommandsBuffer, MV2_CMD_SET_POST_TRIGGER, m_PostTrigger);
+
+		// The time of the trigger, then the samples like a loop over the measurement script
+		m_StreamResultsInfos.assign(TRIGGER_TIME_LENGTH, tResultInfos(false, 0, 0, -1, ""));
+		m_StreamResultsInfos.push_back(tResultInfos(false, m_PreTrigger + m_PostTrigger, m_MeasurementResultsInfos.size(), -1, ""));
+		m_StreamResultsInfos.insert(m_StreamResultsInfos.end(), m_MeasurementResultsInfos.begin(), m_MeasurementResultsInfos.end());
+
+		// The Arduino tells it is still armed while no trigger fires
+		m_StreamDuration = TRIGGER_HEARTBEAT_PERIOD + m_MeasurementDuration;
+		return;
+	}
+
+	// Stream: the measurement script executed over and over
+	if (!m_CaptureMeasurementScript)
+	{
+		// Stream command must be the first command
+		m_StreamCommandsBuffer.push_back(CreateCommand(MV2_CMD_START_STREAM, 0));
+		m_StreamCommandsBuffer.insert(m_StreamCommandsBuffer.end(), m_MeasurementCommandsBuffer.begin(), m_MeasurementCommandsBuffer.end());
+		m_StreamResultsInfos = m_MeasurementResultsInfos;
+		m_StreamDuration = m_MeasurementDuration;
+		return;
+	}
 
+	// Capture: the Arduino writes the registers on each Data Ready, the waits are implicit
+	vector<unsigned short> _Writes;
+	for (unsigned int _i = 0; _i < m_MeasurementCommandsBuffer.size(); _i++)
+	{
+		eCommand _Command;
+		GetCommand(m_MeasurementCommandsBuffer[_i] >> 8, &_Command);
+		if ((_Command == kWriteRegister0) || (_Command == kWriteRegister1) || (_Command == kWriteRegister2))
+			_Writes.push_back(m_MeasurementCommandsBuffer[_i]);
+		else if (_Command != kWaitForDrInterrupt)
+			throw CMV2HostException(CAPTURE_SCRIPT_EXCEPTION_MSG);
+	}
+	if (_Writes.empty() || (_Writes.size() > CAPTURE_MAX_WORDS))
+		throw CMV2HostException(CAPTURE_SCRIPT_EXCEPTION_MSG);
+
+	// Several Data Ready per response, like a loop over the measurement script
+	unsigned int _NbSets = min<unsigned int>(CAPTURE_SETS_PER_RESPONSE, MAX_RESULTS_LENGTH / _Writes.size());
+	m_StreamCommandsBuffer.push_back(CreateCommand(MV2_CMD_START_CAPTURE, _NbSets));
+	m_StreamCommandsBuffer.insert(m_StreamCommandsBuffer.end(), _Writes.begin(), _Writes.end());
+	m_StreamResultsInfos = m_MeasurementResultsInfos;
+	m_StreamResultsInfos.insert(m_StreamResultsInfos.begin(), tResultInfos(false, _NbSets, m_StreamResultsInfos.size(), -1, ""));
+	m_StreamDuration = _NbSets * m_MeasurementDuration;
+} // PrepareStream
+
+// Start executing the measurement script continuously on the Arduino
+void CHostScript::StartMeasurementStream()
+{
+	// Send script to the Arduino, responses are read by ReadMeasurementStream
+	m_pArduino->SendScript(m_StreamCommandsBuffer);
+	m_Streaming = true;
+	m_StreamDeadline = CDeadline(m_pArduino->GetResponseTimeOut(m_StreamDuration));
+} // StartMeasurementStream
+
+// Check whether a response of a trigger stream only tells the trigger is still armed
+static bool IsTriggerArmedResponse(	const tResult	*pResponseBuffer,	// Response buffer
+									int				ResponseSize)		// Response size
+{
+	return (ResponseSize == RESPONSE_MINIMUM_LENGTH) &&
+			(pResponseBuffer[ResponseSize - RESPONSE_CRC_LENGTH - RESPONSE_STATUS_LENGTH] == kNoError) &&
+			(pResponseBuffer[ResponseSize - RESPONSE_CRC_LENGTH - 1] == TRIGGER_ARMED_ERROR_DESC);
+} // IsTriggerArmedResponse
+
+// Read next measurement of the stream. Returns false once the stream has ended.
+bool CHostScript::ReadMeasurementStream()
+{
+	// Response, parsed in the receive buffer of the serial port
+	tFrameView _Response;
+
+	if (!m_Streaming)
+		throw CMV2HostException(STREAM_NOT_STARTED_EXCEPTION_MSG);
+
+	// Clear results
+	m_Results.clear();
+
+	// Wait for the next response
+	m_pArduino->ReceiveResponse(_Response, m_StreamDuration);
+
+	// A trigger tells it is still armed: no results, the caller can check for interrupts
+	m_TriggerArmed = IsTriggerArmedResponse(_Response.pData, _Response.Size);
+	if (m_TriggerArmed)
+		return true;
+
+	return HandleStreamResponse(_Response.pData, _Response.Size);
+} // ReadMeasurementStream
+
+// Read next measurement of the stream if it is already received
+bool CHostScript::TryReadMeasurementStream()
+{
+	// Response, parsed in the receive buffer of the serial port
+	tFrameView _Response;
+
+	if (!m_Streaming)
+		throw CMV2HostException(STREAM_NOT_STARTED_EXCEPTION_MSG);
+
+	// A trigger tells it is still armed while no trigger fires: the caller gets control back anyway
+	m_TriggerArmed = false;
+	do
+	{
+		if (!m_pArduino->TryReceiveResponse(_Response))
+		{
+			if (m_StreamDeadline.IsExpired())
+				throw CMV2HostException(STREAM_TIMEOUT_EXCEPTION_MSG);
+			return false;
+		}
+
+		// The next response is due one measurement later
+		m_StreamDeadline = CDeadline(m_pArduino->GetResponseTimeOut(m_StreamDuration));
+	} while (IsTriggerArmedResponse(_Response.pData, _Response.Size));
+
+	// Clear results
+	m_Results.clear();
+
+	return HandleStreamResponse(_Response.pData, _Response.Size);
+} // TryReadMeasurementStream
+
+// Handle a response of the measurement stream. Returns false if it ends the stream.
+bool CHostScript::HandleStreamResponse(	const tResult	*pResponseBuffer,	// Response buffer
+										int				ResponseSize)		// Response size
+{
+	// Check end of stream
+	int _StatusIndex;
+	int _StatusDescIndex;
+	int _CrcIndex;
+	int _FirstDataIndex;
+	unsigned int _NbResults;
+	ComputeResponseIndex(ResponseSize, _StatusIndex, _CrcIndex, _StatusDescIndex, _FirstDataIndex, _NbResults);
+	if ((ResponseSize == RESPONSE_MINIMUM_LENGTH) &&
+		(pResponseBuffer[_StatusIndex] == kNoError) &&
+		(pResponseBuffer[_StatusDescIndex] == STREAM_END_ERROR_DESC))
+	{
+		m_Streaming = false;
+		return false;
+	}
+
+	// An error response ends the stream as well
+	if (pResponseBuffer[_StatusIndex] != kNoError)
+		m_Streaming = false;
+
+	// The samples of a trigger don't follow the previous ones: the time starts at the first one
+	if (m_TriggerMeasurementScript)
+	{
+		m_DeviceTime = 0;
+		m_DeviceTimeStarted = false;
+	}
+
+	// Parse results
+	ParseResults(pResponseBuffer, ResponseSize, m_StreamResultsInfos, m_Results, m_Times);
+
+	// The time of the trigger precedes the samples, in the decoded response if encoded
+	if (m_TriggerMeasurementScript)
+	{
+		const tResult *_pResults = ((pResponseBuffer[RESPONSE_FLAGS_INDEX] >> RESPONSE_FLAGS_ENCODING_SHIFT) != RESULT_ENCODING_RAW) ?
+				&m_DecodedResponse[RESPONSE_HEADER_LENGTH] : &pResponseBuffer[RESPONSE_HEADER_LENGTH];
+		m_TriggerTime = _pResults[0] | (static_cast<unsigned long>(_pResults[1]) << 16);
+	}
+
+	// Update headings
+	UpdateHeadings(m_StreamResultsInfos);
+
+	return true;
+} // HandleStreamResponse
+
+// Stop the stream and discard pending measurements
+void CHostScript::StopMeasurementStream()
+{
+	if (!m_Streaming)
+		return;
+
+	m_pArduino->SendStreamStopRequest();
+
+	// Discard measurements sent before the Arduino received the request
+	while (ReadMeasurementStream())
+		;
+} // StopMeasurementStream
+
+// Choose the encoding of the measurement results from the encoding attribute
+unsigned char CHostScript::ChooseEncoding(const string &rEncoding)		// Encoding attribute
+{
+	if (rEncoding == "raw")
+		return RESULT_ENCODING_RAW;
+
+	// Analog results have low bits always 0, unless averaged: the average is rounded
+	bool _Analog = true;
+	bool _HasResults = false;
+	for (unsigned int _i = 0; _i < m_MeasurementCommandsBuffer.size(); _i++)
+	{
+		eCommand _Command;
+		if (GetCommand(m_MeasurementCommandsBuffer[_i] >> 8, &_Command) != kNoError)
+			continue;
+		if (_Command == kSetAverageLoopStart)
+			_Analog = false;
+		else if (MV2_CMD_INFO[_Command].ReturnsValue)
+		{
+			_HasResults = true;
+			if ((_Command != kDigitizeBx) && (_Command != kDigitizeBy) && (_Command != kDigitizeBz) && (_Command != kDigitizeTemp))
+				_Analog = false;
+		}
+	}
+	if (!_HasResults)
+		return RESULT_ENCODING_RAW;
+	unsigned char _Shift = _Analog ? ANALOG_RESULT_SHIFT : 0;
+
+	// Packed without shift: nothing to gain
+	if (rEncoding != "delta")
+		return _Shift;
+
+	// Delta: a result is compared to the same measurement of the previous iteration of the innermost
+	// loop holding the first result. Its stride is the number of results of one iteration.
+	vector<unsigned int> _LoopStarts;
+	unsigned int _First = 0;
+	for (; _First < m_MeasurementCommandsBuffer.size(); _First++)
+	{
+		eCommand _Command;
+		if (GetCommand(m_MeasurementCommandsBuffer[_First] >> 8, &_Command) != kNoError)
+			continue;
+		if ((_Command == kSetLoopStart) || (_Command == kSetAverageLoopStart))
+			_LoopStarts.push_back(_First);
+		else if ((_Command == kSetLoopEnd) && !_LoopStarts.empty())
+			_LoopStarts.pop_back();
+		else if (MV2_CMD_INFO[_Command].ReturnsValue)
+			break;
+	}
+	unsigned int _Stride = 0;
+	unsigned int _Depth = 0;
+	for (unsigned int _i = _LoopStarts.empty() ? 0 : _LoopStarts.back() + 1; _i < m_MeasurementCommandsBuffer.size(); _i++)
+	{
+		eCommand _Command;
+		if (GetCommand(m_MeasurementCommandsBuffer[_i] >> 8, &_Command) != kNoError)
+			continue;
+		if ((_Command == kSetLoopStart) || (_Command == kSetAverageLoopStart))
+			_Depth++;
+		else if (_Command == kSetLoopEnd)
+		{
+			if (_Depth == 0)
+				break;
+			_Depth--;
+		}
+		else if ((_Depth == 0) && MV2_CMD_INFO[_Command].ReturnsValue)
+			_Stride++;
+	}
+	_Stride = max<unsigned int>(1, min<unsigned int>(_Stride, MAX_ENCODING_STRIDE));
+	return RESULT_ENCODING_DELTA | _Shift | ((_Stride - 1) << RESULT_ENCODING_STRIDE_SHIFT);
+} // ChooseEncoding
+
+// Estimate the worst case time (ms) the Arduino needs to execute a script
+unsigned int CHostScript::EstimateDuration(const vector<unsigned short> &rCommandsBuffer)		// Commands buffer
+{
+	unsigned long long _Duration = 0;
+	vector<unsigned long long> _LoopCounts(1, 1);		// Iterations of the commands at each loop depth
+	unsigned int _CountHigh = 0;
+
+	for (unsigned int _i = 0; _i < rCommandsBuffer.size(); _i++)
+	{
+		eCommand _Command;
+		if (GetCommand(rCommandsBuffer[_i] >> 8, &_Command) != kNoError)
+			continue;
+
+		switch (_Command)
+		{
+			// Commands of a loop are executed count times the iterations of the enclosing loops
+			case kSetLoopCountHigh:
+				_CountHigh = rCommandsBuffer[_i] & 0xFF;
+				break;
+			case kStartSampleTimer:
+				_CountHigh = 0;
+				_Duration += COMMAND_MAX_DURATION;
+				break;
+			// A tick is at most one sample period away
+			case kWaitForSampleTick:
+				_Duration += _LoopCounts.back() * (m_SamplePeriod + COMMAND_MAX_DURATION);
+				break;
+			case kSetLoopStart:
+			case kSetAverageLoopStart:
+				_LoopCounts.push_back(_LoopCounts.back() * ((_CountHigh << 8) | (rCommandsBuffer[_i] & 0xFF)));
+				_CountHigh = 0;
+				break;
+			case kSetLoopEnd:
+				if (_LoopCounts.size() > 1)
+					_LoopCounts.pop_back();
+				break;
+			case kWaitForDrInterrupt:
+			case kDigitizeBx:
+			case kDigitizeBy:
+			case kDigitizeBz:
+			case kDigitizeTemp:
+				_Duration += _LoopCounts.back() * CONVERSION_MAX_DURATION;
+				break;
+			default:
+				_Duration += _LoopCounts.back() * COMMAND_MAX_DURATION;
+				break;
+		}
+	}
+	return static_cast<unsigned int>((_Duration + 999) / 1000);
+} // EstimateDuration
+
+// Generate headings for the current results
+void CHostScript::UpdateHeadings(vector<tResultInfos> &rResultsInfos)		// Informations about results
+{
 	// Make sure headings are initialized
 	m_Headings.clear();
 	m_Headings.reserve(m_Results.size());
@@ -265,7 +1069,7 @@ void CHostScript::Execute(	vector<tResultInfos> 		&rResultsInfos,		// Informatio
 			m_Headings[rResultsInfos[_i].OutputIndex] = rResultsInfos[_i].OutputName;
 		}
 	}
-} // Execute
+} // UpdateHeadings
 
 // Create command according to type and value
 unsigned short CHostScript::CreateCommand(	unsigned char CommandType,		// Command type
@@ -377,7 +1181,7 @@ int CHostScript::FillCommandsBufferFromXmlNodes (
 					{
 						// If command returns a value, save _OutputIndex to handle results from MV2
 						if (MV2_CMD_INFO[_Cmd].ReturnsValue)
-							rResultsInfos.push_back(tResultInfos(false, 0, 0, _OutputIndex, _OutputName));
+							rResultsInfos.push_back(tResultInfos(false, 0, 0, _OutputIndex, _OutputName, (_Cmd == kGetTimestamp) ? _CommandValue : -1));
 						// Add command to the buffer
 						rCommandsBuffer.push_back(CreateCommand(_CommandType, _CommandValue));
 					}
@@ -417,21 +1221,33 @@ int CHostScript::FillCommandsBufferFromXmlNodes (
     			// free memory
     			xmlFree(_AverageAttribute);
 
-    			// Add loop start command to the buffer
-    			rCommandsBuffer.push_back(CreateCommand(MV2_CMD_SET_LOOP_START, _LoopCount));
+    			// The Arduino averages only the innermost loops
+    			for (xmlNodePtr _pChild = xmlFirstElementChild(pRootNode); _Average && (_pChild != NULL); _pChild = xmlNextElementSibling(_pChild))
+    				if (!xmlStrcmp(_pChild->name, (const xmlChar *)LOOP_NODE_NAME))
+    					throw CMV2HostException(AVERAGE_LOOP_EXCEPTION_MSG);
 
+    			// Add loop start command to the buffer: the Arduino averages the loop itself.
+    			// The high byte of a count above 255 is set by the command before.
+    			if (_LoopCount > 0xFF)
+    				rCommandsBuffer.push_back(CreateCommand(MV2_CMD_SET_LOOP_COUNT_HIGH, _LoopCount >> 8));
+    			rCommandsBuffer.push_back(CreateCommand(_Average ? MV2_CMD_SET_AVERAGE_LOOP_START : MV2_CMD_SET_LOOP_START, _LoopCount & 0xFF));
+
+    			// The loop entry is followed by the entries of its commands and nested loops
     			int _ResultsIndexOldSize = rResultsInfos.size();
+    			rResultsInfos.push_back(tResultInfos(_Average, _LoopCount, 0, -1, ""));
 
     			// Fill command buffer
     			FillCommandsBufferFromXmlNodes (pRootNode->children, pXPathCtx, rCommandsBuffer, rResultsInfos);
 
-    			// Check
-    			if (rResultsInfos.size() > 0)
-    			{
-    				rResultsInfos[_ResultsIndexOldSize].Loop = _LoopCount;
-    				rResultsInfos[_ResultsIndexOldSize].Average = _Average;
-    				rResultsInfos[_ResultsIndexOldSize].NbCommands = rResultsInfos.size() - _ResultsIndexOldSize;
-    			}
+    			// Averaged timestamps would lose the time between them
+    			for (unsigned int _i = _ResultsIndexOldSize + 1; _Average && (_i < rResultsInfos.size()); _i++)
+    				if (rResultsInfos[_i].TimestampShift >= 0)
+    					throw CMV2HostException(TIMESTAMP_AVERAGE_EXCEPTION_MSG);
+
+    			// A loop without results has no entry
+    			rResultsInfos[_ResultsIndexOldSize].NbCommands = rResultsInfos.size() - _ResultsIndexOldSize - 1;
+    			if (rResultsInfos[_ResultsIndexOldSize].NbCommands == 0)
+    				rResultsInfos.pop_back();
     			// Add loop end command to the buffer
     			rCommandsBuffer.push_back(CreateCommand(MV2_CMD_SET_LOOP_END, 0));
 
@@ -461,7 +1277,7 @@ void CHostScript::ComputeResponseIndex (
 		rStatusIndex		= rStatusDescIndex - 1;
 		if (ResponseSize > RESPONSE_MINIMUM_LENGTH)
 		{
-			rFirstDataIndex = 1;
+			rFirstDataIndex = RESPONSE_HEADER_LENGTH;
 			rNbResults = rStatusIndex - rFirstDataIndex;
 		}
 		else
@@ -476,13 +1292,24 @@ void CHostScript::ComputeResponseIndex (
 } // ComputeResponseIndex
 
 // Parse response buffer and fill results buffer according to ResultsInfos vector
-void CHostScript::ParseResults (	tResult									*pResponseBuffer,	// Response buffer
+void CHostScript::ParseResults (	const tResult							*pResponseBuffer,	// Response buffer
 									int										ResponseSize,		// Response size
-									vector<tResultInfos>					ResultsInfos,		// Informations about results
-									vector< vector<tResult> >				&rResults)			// Results
+									const vector<tResultInfos>				&rResultsInfos,		// Informations about results
+									vector< vector<tResult> >				&rResults,			// Results
+									vector< vector<tTime> >					&rTimes)			// Time of the timestamps
 {
 	// Make sure results buffer is empty
 	rResults.clear();
+	rTimes.clear();
+
+	// Encoded results: parse them decoded. Responses sent raw, e.g. errors, have no encoding.
+	if ((ResponseSize > RESPONSE_MINIMUM_LENGTH) &&
+		((pResponseBuffer[RESPONSE_FLAGS_INDEX] >> RESPONSE_FLAGS_ENCODING_SHIFT) != RESULT_ENCODING_RAW))
+	{
+		DecodeResults(pResponseBuffer, ResponseSize, m_DecodedResponse);
+		pResponseBuffer = m_DecodedResponse.data();
+		ResponseSize = m_DecodedResponse.size();
+	}
 
 	// Compute response index
 	int _StatusIndex;
@@ -504,7 +1331,7 @@ void CHostScript::ParseResults (	tResult									*pResponseBuffer,	// Response b
 	}
 
 	// Find maximum output index
-	int _MaxOutputIndex = FindMaxOutputIndex(ResultsInfos);
+	int _MaxOutputIndex = FindMaxOutputIndex(rResultsInfos);
 
 	// If there is no output index, there is no reason to continue
 	if (_MaxOutputIndex < 0)
@@ -520,74 +1347,157 @@ void CHostScript::ParseResults (	tResult									*pResponseBuffer,	// Response b
 		_Tmp.reserve(1);
 		rResults.push_back(_Tmp);
 	}
+	rTimes.resize(rResults.size());
 
-	unsigned int _i = 0;
+	// Parse all results informations
 	int _ResponseDataIndex = _FirstDataIndex;
+	ParseResultsInfos(pResponseBuffer, rResultsInfos, 0, rResultsInfos.size(), _ResponseDataIndex, _StatusIndex, rResults, rTimes);
+} // ParseResults
+
+// Read bits of encoded results, low bits first
+static unsigned int ReadBits(	const unsigned short	*pResponseBuffer,	// Response buffer
+								int						&rIndex,			// Index of the next word to read
+								int						EndIndex,			// Index after the last word
+								unsigned long			&rBits,				// Bits read and not used yet
+								unsigned int			&rNbBits,			// Number of bits read and not used yet
+								unsigned int			NbBits)				// Number of bits, at most 16
+{
+	while (rNbBits < NbBits)
+	{
+		if (rIndex >= EndIndex)
+			throw CMV2HostException(PARSE_EXCEPTION_MSG);
+		rBits |= static_cast<unsigned long>(pResponseBuffer[rIndex++]) << rNbBits;
+		rNbBits += 16;
+	}
+	unsigned int _Value = rBits & ((1UL << NbBits) - 1);
+	rBits >>= NbBits;
+	rNbBits -= NbBits;
+	return _Value;
+} // ReadBits
+
+// Decode the encoded results of a response (see RESULT_ENCODING_* in MV2HostConstants.h)
+void CHostScript::DecodeResults (	const tResult							*pResponseBuffer,	// Response buffer
+									int										ResponseSize,		// Response size
+									vector<tResult>							&rDecodedResponse)	// Decoded response
+{
+	unsigned char _Encoding = pResponseBuffer[RESPONSE_FLAGS_INDEX] >> RESPONSE_FLAGS_ENCODING_SHIFT;
+	unsigned int _Shift = _Encoding & RESULT_ENCODING_SHIFT_MASK;
+	unsigned int _Stride = (_Encoding >> RESULT_ENCODING_STRIDE_SHIFT) + 1;
+
+	// Results are between their number and the status
+	int _StatusIndex = ResponseSize - RESPONSE_CRC_LENGTH - RESPONSE_STATUS_LENGTH;
+	unsigned int _NbResults = pResponseBuffer[RESPONSE_HEADER_LENGTH];
+	int _Index = RESPONSE_HEADER_LENGTH + 1;
+	unsigned long _Bits = 0;
+	unsigned int _NbBits = 0;
+
+	// Same header, without encoding
+	rDecodedResponse.assign(pResponseBuffer, pResponseBuffer + RESPONSE_HEADER_LENGTH);
+	rDecodedResponse[RESPONSE_FLAGS_INDEX] &= (1 << RESPONSE_FLAGS_ENCODING_SHIFT) - 1;
+	for (unsigned int _i = 0; _i < _NbResults; _i++)
+	{
+		if (!(_Encoding & RESULT_ENCODING_DELTA))
+		{
+			rDecodedResponse.push_back(ReadBits(pResponseBuffer, _Index, _StatusIndex, _Bits, _NbBits, 16 - _Shift) << _Shift);
+			continue;
+		}
+
+		// Varint of the zigzag coded difference
+		unsigned long _Zigzag = 0;
+		unsigned int _Byte = 0x80;
+		for (unsigned int _j = 0; _Byte & 0x80; _j++)
+		{
+			if (_j == MAX_DELTA_BYTES)
+				throw CMV2HostException(PARSE_EXCEPTION_MSG);
+			_Byte = ReadBits(pResponseBuffer, _Index, _StatusIndex, _Bits, _NbBits, 8);
+			_Zigzag |= static_cast<unsigned long>(_Byte & 0x7F) << (7 * _j);
+		}
+		long _Delta = (_Zigzag & 1) ? -static_cast<long>((_Zigzag + 1) >> 1) : static_cast<long>(_Zigzag >> 1);
+		long _Previous = (_i >= _Stride) ? (rDecodedResponse[RESPONSE_HEADER_LENGTH + _i - _Stride] >> _Shift) : 0;
+		rDecodedResponse.push_back(static_cast<tResult>((_Previous + _Delta) << _Shift));
+	}
+
+	// Status and CRC
+	rDecodedResponse.insert(rDecodedResponse.end(), pResponseBuffer + _StatusIndex, pResponseBuffer + ResponseSize);
+} // DecodeResults
+
+// Parse the results of the entries [Begin, End) of the results informations
+void CHostScript::ParseResultsInfos (	const tResult							*pResponseBuffer,	// Response buffer
+										const vector<tResultInfos>				&rResultsInfos,		// Informations about results
+										unsigned int							Begin,				// First entry
+										unsigned int							End,				// Entry after the last one
+										int										&rResponseDataIndex,// Index of the next result in the response
+										int										EndDataIndex,		// Index after the last result
+										vector< vector<tResult> >				&rResults,			// Results
+										vector< vector<tTime> >					&rTimes)			// Time of the timestamps
+{
+	unsigned int _i = Begin;
 
 	// Loop over results informations
-	while (_i<ResultsInfos.size())
+	while (_i<End)
 	{
 		// Handle loop commands
-		if (ResultsInfos[_i].Loop > 0)
+		if (rResultsInfos[_i].NbCommands > 0)
 		{
-			// Initialize temp results
-			vector< vector<tResult> > _ResultsTemp;
-			// Allocate memory for _MaxOutputIndex elements
-			_ResultsTemp.reserve(_MaxOutputIndex);
-			// Allocate memory for all sub vectors
-			for (int _n=0; _n<=_MaxOutputIndex; _n++)
-			{
-				vector<tResult> _Tmp;
-				// Allocate memory at least for one element
-				_Tmp.reserve(1);
-				// Add vector
-				_ResultsTemp.push_back(_Tmp);
-			}
+			// Initialize temp results, one vector per output
+			vector< vector<tResult> > _ResultsTemp(rResults.size());
+			vector< vector<tTime> > _TimesTemp(rTimes.size());
 
-			// Handle all results inside the loop
-			for (int _LoopCounter=0; _LoopCounter<ResultsInfos[_i].Loop; _LoopCounter++)
-			{
-				// For all commands inside the loop, get result in response buffer and store result only if necessary
-				for (unsigned int _j=_i; _j<ResultsInfos[_i].NbCommands+_i; _j++)
-				{
-					// Store result only if necessary
-					if(ResultsInfos[_j].OutputIndex >= 0)
-						_ResultsTemp[ResultsInfos[_j].OutputIndex].push_back(pResponseBuffer[_ResponseDataIndex]);
-					_ResponseDataIndex++;
-				}
-			} // Handle all results inside the loop
+			// Averaged by the Arduino: one result per command inside the loop
+			unsigned int _NbIterations = rResultsInfos[_i].Loop;
+			if (rResultsInfos[_i].Average && (pResponseBuffer[RESPONSE_FLAGS_INDEX] & RESPONSE_FLAG_AVERAGED))
+				_NbIterations = min<unsigned int>(_NbIterations, 1);
+
+			// Handle all results inside the loop, nested loops included
+			for (unsigned int _LoopCounter=0; _LoopCounter<_NbIterations; _LoopCounter++)
+				ParseResultsInfos(pResponseBuffer, rResultsInfos, _i + 1, _i + 1 + rResultsInfos[_i].NbCommands, rResponseDataIndex, EndDataIndex, _ResultsTemp, _TimesTemp);
 
 			// Update _Results
 			for (unsigned int _k=0; _k<_ResultsTemp.size(); _k++)
 			{
-				// If results are averaged
-				if (ResultsInfos[_i].Average)
+				// If results are averaged. Outputs without results inside the loop have no average.
+				if (rResultsInfos[_i].Average)
 				{
+					if (_ResultsTemp[_k].empty())
+						continue;
 					rResults[_k].push_back(Average(_ResultsTemp[_k]));
 				}
 				else
-				{
-					for (unsigned int _l=0; _l<_ResultsTemp[_k].size(); _l++)
-					{
-						rResults[_k].push_back(_ResultsTemp[_k][_l]);
-					}
-				}
+					rResults[_k].insert(rResults[_k].end(), _ResultsTemp[_k].begin(), _ResultsTemp[_k].end());
 			} // End update _Results
 
-			// Update _i according to commands inside the loop
-			_i += ResultsInfos[_i].NbCommands;
+			// Timestamps are never averaged
+			for (unsigned int _k=0; _k<_TimesTemp.size(); _k++)
+				rTimes[_k].insert(rTimes[_k].end(), _TimesTemp[_k].begin(), _TimesTemp[_k].end());
+
+			// Update _i according to entries inside the loop
+			_i += rResultsInfos[_i].NbCommands + 1;
 
 		} // Handle loop commands
 		else
 		{
+			// The response must hold a result for each command
+			if (rResponseDataIndex >= EndDataIndex)
+				throw CMV2HostException(PARSE_EXCEPTION_MSG);
+
+			// Timestamp: the time since the previous one
+			if (rResultsInfos[_i].TimestampShift >= 0)
+			{
+				if (m_DeviceTimeStarted)
+					m_DeviceTime += static_cast<tTime>(pResponseBuffer[rResponseDataIndex]) << rResultsInfos[_i].TimestampShift;
+				m_DeviceTimeStarted = true;
+				if (rResultsInfos[_i].OutputIndex >= 0)
+					rTimes[rResultsInfos[_i].OutputIndex].push_back(m_DeviceTime);
+			}
+
 			// Store result only if necessary
-			if(ResultsInfos[_i].OutputIndex >= 0)
-				rResults[ResultsInfos[_i].OutputIndex].push_back(pResponseBuffer[_ResponseDataIndex]);
-			_ResponseDataIndex++;
+			if(rResultsInfos[_i].OutputIndex >= 0)
+				rResults[rResultsInfos[_i].OutputIndex].push_back(pResponseBuffer[rResponseDataIndex]);
+			rResponseDataIndex++;
 			_i++;
 		}
-	} // while (_i<ResultsInfos.size())
-} // ParseResults
+	} // while (_i<End)
+} // ParseResultsInfos
 
 int CHostScript::FindMaxOutputIndex (std::vector<tResultInfos> ResultsInfos)
 {
@@ -619,7 +1529,8 @@ int CHostScript::Average (vector<tResult> Vector)
 } // Mean
 
 // Convert results to CSV
-string CHostScript::ConvertResultsToCSV (vector< vector<tResult> > Results)	// Results
+string CHostScript::ConvertResultsToCSV (vector< vector<tResult> > Results,		// Results
+										const vector< vector<tTime> > &rTimes)		// Time of the timestamps
 {
 	stringstream _Ss;
 	unsigned int _LineIndex = 0;
@@ -637,8 +1548,11 @@ string CHostScript::ConvertResultsToCSV (vector< vector<tResult> > Results)	// R
 			// Result available ?
 			if (Results[_ColumnIndex].size() > _LineIndex)
 			{
-				// Add current result to the string stream
-				_Ss << Results[_ColumnIndex][_LineIndex];
+				// Add current result to the string stream, the time for a timestamp
+				if ((_ColumnIndex < rTimes.size()) && (rTimes[_ColumnIndex].size() > _LineIndex))
+					_Ss << rTimes[_ColumnIndex][_LineIndex];
+				else
+					_Ss << Results[_ColumnIndex][_LineIndex];
 				// Check if there is one more element to add comma to the string stream 
 				// according to CSV format
 				if (_ColumnIndex < Results.size()-1)
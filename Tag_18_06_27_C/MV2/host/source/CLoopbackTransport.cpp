@@ -0,0 +1,969 @@
+// Name:
+//	CLoopbackTransport.cpp
+//
+// Purpose:
+//	See CLoopbackTransport.h
+//
+// Description:
+//	CLoopbackDevice follows MV2.ino, MV2HostInput.cpp, MV2HostOutput.cpp and
+//	MV2ScriptUtility.cpp. Baud rate switches are acknowledged but change nothing,
+//	and the link being reliable, responses are never sent again.
+//
+// Coding Conventions:
+//	- Variable names use the "InterCaps" convention
+//	- Local variables are prefixed with an underscore, '_'
+//	- Private class members are prefixed with 'm_'
+//	- Private class methods are prefixed with an underscore, '_'
+//	- Pointer variables are prefixed with 'p'
+//	- Reference variables are prefixed with 'r'
+//	- Enumerated types are prefixed with 'e'
+//	- Enumerated type values are prefixed with 'k'
+//	- Classes are prefixed with 'C'
+//	- Constants are all uppercase
+//	The above conventions can also be combined:
+//	- A local pointer variable would be prefixed '_p'
+//	- A private class pointer member would be prefixed 'm_p'
+//
+// Change log:
+//	17.10.26 MB	Original version
+//	17.10.26 MB	Average loops started with MV2_CMD_SET_AVERAGE_LOOP_START
+//	17.10.26 MB	Capture started with MV2_CMD_START_CAPTURE
+//	17.10.26 MB	Nested loops, 16-bit loop counts (MV2_CMD_SET_LOOP_COUNT_HIGH)
+//	17.10.26 MB	Script slots (MV2_CMD_STORE_SCRIPT, MV2_CMD_RUN_SCRIPT)
+//	17.10.26 MB	Encoded results (MV2_CMD_SET_RESULT_ENCODING)
+//	17.10.26 MB	Timestamps (MV2_CMD_GET_TIMESTAMP) from the clock of the process
+//	17.10.26 MB	Trigger started with MV2_CMD_START_TRIGGER
+//	17.10.26 MB	Results that don't fit in a response are sent in chunks (RESPONSE_FLAG_CHUNK)
+//	17.10.26 MB	Sample timer (MV2_CMD_START_SAMPLE_TIMER...) from the clock of the process
+//	17.10.26 MB	Diagnostics (MV2_CMD_GET_DIAGNOSTICS), nothing is timed
+//	17.10.26 MB	Burst started with MV2_CMD_START_BURST
+//	17.10.26 MB	Reject MV2_CMD_SET_DIGITAL_ANALOG_MODE inside a loop like the firmware
+//	17.10.26 MB	Flag the trigger responses of averaged samples
+//	17.10.26 MB	Run a stored script only in the mode its first commands depend on, like the firmware
+//
+// Copyright (c) 2016 Metrolab Technology SA, Geneva,
+//	Switzerland
+
+// Include files
+#include <CLoopbackTransport.h>
+
+#ifndef WIN32
+
+#include <CArduinoSerialPort.h>
+#include <MV2HostCommands.h>
+#include <MV2FirmwareVersion.h>
+#include <MV2Crc.h>
+#include <string.h>
+#include <algorithm>
+#include <sys/socket.h>
+
+// A closed peer must not raise SIGPIPE
+#ifndef MSG_NOSIGNAL
+	#define MSG_NOSIGNAL	0
+#endif
+
+// Low bits always 0 in analog values: ANALOG_SHIFT in MV2Hal.h
+#define LOOPBACK_ANALOG_SHIFT					6
+
+// Clock of the sample timer: F_CPU (MHz) and the timer clocks of MV2Hal.h
+#define LOOPBACK_CPU_MHZ						16
+#define LOOPBACK_SAMPLE_SHIFT_FAST				3
+#define LOOPBACK_SAMPLE_SHIFT_SLOW				6
+
+// Mode of a script that doesn't depend on the mode it is started in: SCRIPT_ANY_MODE in MV2ScriptUtility.h
+#define LOOPBACK_ANY_MODE						-1
+
+// Exceptions messages
+#define CREATE_SOCKET_PAIR_EXCEPTION_MSG		"CLoopbackTransport: Unable to create socket pair."
+
+// Our namespace
+namespace MV2Host
+{
+
+//----------------------------------------------------------------------------
+// CLoopbackDevice
+
+// Results encoding of a script: value of its last MV2_CMD_SET_RESULT_ENCODING, like GetScriptEncoding
+static unsigned char GetScriptEncoding(	const unsigned short	*pCommands,		// Commands
+										unsigned int			NbCommands)		// Number of commands
+{
+	unsigned char _Encoding = RESULT_ENCODING_RAW;
+
+	for (unsigned int _i = 0; _i < NbCommands; _i++)
+		if ((pCommands[_i] >> 8) == MV2_CMD_SET_RESULT_ENCODING)
+			_Encoding = pCommands[_i] & 0xFF;
+	return _Encoding;
+} // GetScriptEncoding
+
+// Mode a script must be started in: mode of the first digital or analog command before its first
+// MV2_CMD_SET_DIGITAL_ANALOG_MODE, LOOPBACK_ANY_MODE if none, like GetScriptMode
+static int GetScriptMode(	const unsigned short	*pCommands,		// Commands
+							unsigned int			NbCommands)		// Number of commands
+{
+	for (unsigned int _i = 0; _i < NbCommands; _i++)
+	{
+		eCommand _Command;
+		if (GetCommand(pCommands[_i] >> 8, &_Command) != kNoError)
+			continue;
+		if (_Command == kSetDigitalAnalogMode)
+			break;
+		if (GetCommandType(_Command) == kDigital)
+			return kDigitalMode;
+		if (GetCommandType(_Command) == kAnalog)
+			return kAnalogMode;
+	}
+	return LOOPBACK_ANY_MODE;
+} // GetScriptMode
+
+// Trigger settings of a script: values of its last MV2_CMD_SET_TRIGGER_LEVEL, MV2_CMD_SET_PRE_TRIGGER and
+// MV2_CMD_SET_POST_TRIGGER with their high byte, like GetScriptTrigger
+static void GetScriptTrigger(	const unsigned short	*pCommands,		// Commands
+								unsigned int			NbCommands,		// Number of commands
+								unsigned int			&rLevel,		// Trigger level
+								unsigned int			&rPre,			// Samples before the trigger
+								unsigned int			&rPost)			// Samples from the trigger on
+{
+	rLevel = 0;
+	rPre = 0;
+	rPost = 1;
+	for (unsigned int _i = 0; _i < NbCommands; _i++)
+	{
+		unsigned int _Value = pCommands[_i] & 0xFF;
+		if ((_i > 0) && ((pCommands[_i - 1] >> 8) == MV2_CMD_SET_LOOP_COUNT_HIGH))
+			_Value |= (pCommands[_i - 1] & 0xFF) << 8;
+		switch (pCommands[_i] >> 8)
+		{
+			case MV2_CMD_SET_TRIGGER_LEVEL:	rLevel = _Value;	break;
+			case MV2_CMD_SET_PRE_TRIGGER:	rPre = _Value;		break;
+			case MV2_CMD_SET_POST_TRIGGER:	rPost = _Value;		break;
+		}
+	}
+} // GetScriptTrigger
+
+// Number of samples of a burst: value of its last MV2_CMD_SET_BURST_SAMPLES with its high byte, like GetScriptBurstSamples
+static unsigned int GetScriptBurstSamples(	const unsigned short	*pCommands,		// Commands
+											unsigned int			NbCommands)		// Number of commands
+{
+	unsigned int _NbSamples = 0;
+
+	for (unsigned int _i = 0; _i < NbCommands; _i++)
+	{
+		if ((pCommands[_i] >> 8) != MV2_CMD_SET_BURST_SAMPLES)
+			continue;
+		_NbSamples = pCommands[_i] & 0xFF;
+		if ((_i > 0) && ((pCommands[_i - 1] >> 8) == MV2_CMD_SET_LOOP_COUNT_HIGH))
+			_NbSamples |= (pCommands[_i - 1] & 0xFF) << 8;
+	}
+	return _NbSamples;
+} // GetScriptBurstSamples
+
+// Check whether the result of a sample fires the trigger, like IsTriggered
+static bool IsTriggered(	unsigned int			Trigger,		// Kind of trigger (TRIGGER_*)
+							long					Previous,		// Result of the previous sample
+							long					Value,			// Result of the sample
+							long					Level)			// Level crossed, or rise or fall of a slope
+{
+	switch (Trigger & TRIGGER_KIND_MASK)
+	{
+		case TRIGGER_RISING:			return (Previous < Level) && (Value >= Level);
+		case TRIGGER_FALLING:			return (Previous > Level) && (Value <= Level);
+		case TRIGGER_SLOPE_RISING:		return Value - Previous >= Level;
+		case TRIGGER_SLOPE_FALLING:		return Previous - Value >= Level;
+		default:						return false;
+	}
+} // IsTriggered
+
+// Constructor
+CLoopbackDevice::CLoopbackDevice(File_t SocketHandle)		// Device end of the socket pair
+{
+	m_SocketHandle = SocketHandle;
+	m_Script.reserve(SCRIPT_BUFFER_LENGTH * sizeof(unsigned short));
+	m_InFrame = false;
+	m_Escaped = false;
+	m_RxStart = 0;
+	m_RxEnd = 0;
+	m_Response.resize(MAX_RESPONSE_LENGTH);
+	m_TxBuffer.reserve(2 * MAX_RESPONSE_LENGTH * sizeof(unsigned short) + 2);
+	// At startup MV2 mode is set to digital
+	m_AnalogMode = false;
+	m_NextValue = 0;
+	m_StartTime = chrono::steady_clock::now();
+	m_LastTimestamp = 0;
+	m_SamplePeriod = 0;
+	m_SampleTicksTaken = 0;
+	m_SampleTickTaken = false;
+	m_SampleOverruns = 0;
+	m_ScriptSlots.resize(SCRIPT_SLOT_COUNT);
+	m_ScriptStored.assign(SCRIPT_SLOT_COUNT, false);
+	m_ScriptModes.assign(SCRIPT_SLOT_COUNT, LOOPBACK_ANY_MODE);
+} // Constructor
+
+// Answer scripts until the host closes its end
+void CLoopbackDevice::Run()
+{
+	unsigned char _Byte;
+
+	while (ReadByte(_Byte, true))
+	{
+		// Frame boundary
+		if (_Byte == FRAME_FLAG)
+		{
+			// End of frame
+			if (m_InFrame && !m_Script.empty() && !HandleScript())
+				return;
+			// Start of frame, discard anything received before
+			m_InFrame = true;
+			m_Escaped = false;
+			m_Script.clear();
+			continue;
+		}
+
+		// Ignore anything outside frames
+		if (!m_InFrame)
+			continue;
+
+		// Unescape
+		if (_Byte == FRAME_ESCAPE)
+		{
+			m_Escaped = true;
+			continue;
+		}
+		if (m_Escaped)
+		{
+			_Byte ^= FRAME_ESCAPE_MASK;
+			m_Escaped = false;
+		}
+
+		// Script too large: keep the size, the error is sent at the end of the frame
+		if (m_Script.size() < SCRIPT_BUFFER_LENGTH * sizeof(unsigned short) + 1)
+			m_Script.push_back(_Byte);
+	}
+} // Run
+
+// Read a byte, wait for it if Wait is true
+bool CLoopbackDevice::ReadByte(	unsigned char	&rByte,		// Byte read
+								bool			Wait)		// Wait for it
+{
+	if (m_RxStart == m_RxEnd)
+	{
+		ssize_t _BytesRead;
+		do
+			_BytesRead = recv(m_SocketHandle, m_RxBuffer, sizeof(m_RxBuffer), Wait ? 0 : MSG_DONTWAIT);
+		while ((_BytesRead < 0) && (errno == EINTR));
+		if (_BytesRead <= 0)
+			return false;
+		m_RxStart = 0;
+		m_RxEnd = _BytesRead;
+	}
+	rByte = m_RxBuffer[m_RxStart++];
+	return true;
+} // ReadByte
+
+// Handle a received frame
+bool CLoopbackDevice::HandleScript()
+{
+	unsigned int _Size = m_Script.size();
+	unsigned short _Words[SCRIPT_BUFFER_LENGTH];
+
+	// Script too large
+	if (_Size > SCRIPT_BUFFER_LENGTH * sizeof(unsigned short))
+		return SendResponse(0, 0, 0, kScriptLengthTooLargeError, _Size);
+
+	// Check size
+	memcpy(_Words, m_Script.data(), _Size);
+	if ((_Size < SCRIPT_BUFFER_ADDITIONAL_INFOS_LENGTH * sizeof(unsigned short)) ||
+		(_Size != _Words[0]))
+		return SendResponse(0, 0, 0, kNoValidDataFromHostError, _Size);
+
+	// Check CRC
+	unsigned short _Sequence = _Words[SCRIPT_SEQUENCE_INDEX];
+	if (!Crc16CheckFrame(_Words, _Size / sizeof(unsigned short)))
+		return SendResponse(_Sequence, 0, 0, kBadCrcError, 0);
+
+	const unsigned short *_pCommands = &_Words[SCRIPT_BUFFER_HEADER_LENGTH];
+	unsigned int _NbCommands = _Size / sizeof(unsigned short) - SCRIPT_BUFFER_ADDITIONAL_INFOS_LENGTH;
+
+	// Stream the rest of the script
+	if ((_NbCommands > 0) && ((_pCommands[0] >> 8) == MV2_CMD_START_STREAM))
+		return StreamScript(&_pCommands[1], _NbCommands - 1, _Sequence);
+
+	// Capture with the rest of the script
+	if ((_NbCommands > 0) && ((_pCommands[0] >> 8) == MV2_CMD_START_CAPTURE))
+		return CaptureScript(&_pCommands[1], _NbCommands - 1, _pCommands[0] & 0xFF, _Sequence);
+
+	// Wait for triggers with the rest of the script
+	if ((_NbCommands > 0) && ((_pCommands[0] >> 8) == MV2_CMD_START_TRIGGER))
+		return TriggerScript(&_pCommands[1], _NbCommands - 1, _pCommands[0] & 0xFF, _Sequence);
+
+	// Take a burst with the rest of the script
+	if ((_NbCommands > 0) && ((_pCommands[0] >> 8) == MV2_CMD_START_BURST))
+		return BurstScript(&_pCommands[1], _NbCommands - 1, _Sequence);
+
+	// Keep the rest of the script in a slot
+	if ((_NbCommands > 0) && ((_pCommands[0] >> 8) == MV2_CMD_STORE_SCRIPT))
+	{
+		unsigned int _Slot = _pCommands[0] & 0xFF;
+		if (_Slot >= SCRIPT_SLOT_COUNT)
+			return SendResponse(_Sequence, 0, 0, kScriptSlotError, 0);
+		m_ScriptSlots[_Slot].assign(&_pCommands[1], &_pCommands[_NbCommands]);
+		m_ScriptStored[_Slot] = true;
+		m_ScriptModes[_Slot] = GetScriptMode(&_pCommands[1], _NbCommands - 1);
+		return SendResponse(_Sequence, 0, 0, kNoError, 0);
+	}
+
+	// Execute the script of a slot
+	vector<unsigned short> _StoredCommands;
+	if ((_NbCommands > 0) && ((_pCommands[0] >> 8) == MV2_CMD_RUN_SCRIPT))
+	{
+		unsigned int _Slot = _pCommands[0] & 0xFF;
+		if ((_NbCommands != 1) || (_Slot >= SCRIPT_SLOT_COUNT) || !m_ScriptStored[_Slot])
+			return SendResponse(_Sequence, 0, 0, kScriptSlotError, 0);
+		if ((m_ScriptModes[_Slot] != LOOPBACK_ANY_MODE) && (m_ScriptModes[_Slot] != (m_AnalogMode ? kAnalogMode : kDigitalMode)))
+			return SendResponse(_Sequence, 0, 0, kModeError, 0);
+		_StoredCommands = m_ScriptSlots[_Slot];
+		_pCommands = _StoredCommands.data();
+		_NbCommands = _StoredCommands.size();
+	}
+
+	// Execute script
+	unsigned int _NbResults = 0;
+	unsigned short _Flags = 0;
+	unsigned short _IndexCommandError = 0;
+	unsigned short _Error = ExecuteScript(_pCommands, _NbCommands, _NbResults, _Flags, _IndexCommandError);
+	return SendResponse(_Sequence, _Flags, _NbResults, _Error, _IndexCommandError, GetScriptEncoding(_pCommands, _NbCommands));
+} // HandleScript
+
+// Execute a stream until the host sends anything
+bool CLoopbackDevice::StreamScript(	const unsigned short	*pCommands,		// Commands
+									unsigned int			NbCommands,		// Number of commands
+									unsigned short			Sequence)		// Sequence number
+{
+	unsigned short _Error;
+	unsigned char _Byte;
+	unsigned char _Encoding = GetScriptEncoding(pCommands, NbCommands);
+
+	do
+	{
+		unsigned int _NbResults = 0;
+		unsigned short _Flags = 0;
+		unsigned short _IndexCommandError = 0;
+		_Error = ExecuteScript(pCommands, NbCommands, _NbResults, _Flags, _IndexCommandError);
+		if (!SendResponse(Sequence, _Flags, _NbResults, _Error, _IndexCommandError, _Encoding))
+			return false;
+	} while ((_Error == kNoError) && !ReadByte(_Byte, false));
+
+	// An error response already ends the stream
+	if (_Error != kNoError)
+		return true;
+
+	// Discard the stop request and acknowledge it
+	m_RxStart = m_RxEnd;
+	m_InFrame = false;
+	return SendResponse(Sequence, 0, 0, kNoError, STREAM_END_ERROR_DESC);
+} // StreamScript
+
+// Execute a capture until the host sends anything
+bool CLoopbackDevice::CaptureScript(	const unsigned short	*pCommands,		// Register writes
+										unsigned int			NbCommands,		// Number of commands
+										unsigned int			NbSets,			// Number of Data Ready per response
+										unsigned short			Sequence)		// Sequence number
+{
+	unsigned char _Byte;
+
+	// Like the firmware: only register writes, in digital mode, and all sets fit in a response
+	if (NbSets == 0)
+		NbSets = 1;
+	if ((NbCommands == 0) || (NbCommands > CAPTURE_MAX_WORDS))
+		return SendResponse(Sequence, 0, 0, kSyntaxError, 0);
+	for (unsigned int _i = 0; _i < NbCommands; _i++)
+	{
+		eCommand _Command;
+		if ((GetCommand(pCommands[_i] >> 8, &_Command) != kNoError) ||
+			((_Command != kWriteRegister0) && (_Command != kWriteRegister1) && (_Command != kWriteRegister2)))
+			return SendResponse(Sequence, 0, 0, kSyntaxError, _i);
+		if (m_AnalogMode)
+			return SendResponse(Sequence, 0, 0, kModeError, _i);
+	}
+	if (NbCommands * NbSets > MAX_RESULTS_LENGTH)
+		return SendResponse(Sequence, 0, 0, kOutOfMemoryError, 0);
+
+	// Data Ready is immediate: each response holds NbSets executions of the commands
+	do
+	{
+		unsigned int _NbResults = 0;
+		unsigned short _Flags = 0;
+		unsigned short _IndexCommandError = 0;
+		for (unsigned int _j = 0; _j < NbSets; _j++)
+			ExecuteScript(pCommands, NbCommands, _NbResults, _Flags, _IndexCommandError);
+		if (!SendResponse(Sequence, 0, _NbResults, kNoError, 0))
+			return false;
+	} while (!ReadByte(_Byte, false));
+
+	// Discard the stop request and acknowledge it
+	m_RxStart = m_RxEnd;
+	m_InFrame = false;
+	return SendResponse(Sequence, 0, 0, kNoError, STREAM_END_ERROR_DESC);
+} // CaptureScript
+
+// Execute the trigger until the host sends anything
+bool CLoopbackDevice::TriggerScript(	const unsigned short	*pCommands,		// Commands of a sample
+										unsigned int			NbCommands,		// Number of commands
+										unsigned int			Trigger,		// Kind of trigger or'ed with the index of the result watched
+										unsigned short			Sequence)		// Sequence number
+{
+	unsigned char _Byte;
+	unsigned int _Level, _Pre, _Post;
+	GetScriptTrigger(pCommands, NbCommands, _Level, _Pre, _Post);
+	unsigned char _Encoding = GetScriptEncoding(pCommands, NbCommands) & ~RESULT_ENCODING_SHIFT_MASK;
+	unsigned int _Index = Trigger & TRIGGER_RESULT_MASK;
+	if ((_Post == 0) || ((Trigger & TRIGGER_KIND_MASK) > TRIGGER_SLOPE_FALLING))
+		return SendResponse(Sequence, 0, 0, kSyntaxError, 0);
+
+	// Samples in the order they were taken, the oldest first
+	vector< vector<unsigned short> > _Samples;
+	unsigned int _NbTaken = 0;
+	unsigned int _NbLeft = 0;
+	long _Previous = 0;
+	unsigned long _TriggerTime = 0;
+	chrono::steady_clock::time_point _LastResponse = chrono::steady_clock::now();
+	do
+	{
+		// Take a sample. The firmware checks the length of a sample before taking the first one.
+		unsigned long _SampleTime = GetMicros();
+		unsigned int _NbResults = 0;
+		unsigned short _Flags = 0;
+		unsigned short _IndexCommandError = 0;
+		unsigned short _Error = ExecuteScript(pCommands, NbCommands, _NbResults, _Flags, _IndexCommandError);
+		if (_Error != kNoError)
+			return SendResponse(Sequence, 0, 0, _Error, _IndexCommandError);
+		if (_Index >= _NbResults)
+			return SendResponse(Sequence, 0, 0, kSyntaxError, 0);
+		if ((_Pre + _Post) * _NbResults > MAX_RESULTS_LENGTH - TRIGGER_TIME_LENGTH)
+			return SendResponse(Sequence, 0, 0, kOutOfMemoryError, 0);
+		_Samples.push_back(vector<unsigned short>(&m_Response[RESPONSE_HEADER_LENGTH], &m_Response[RESPONSE_HEADER_LENGTH + _NbResults]));
+		if (_Samples.size() > _Pre + _Post)
+			_Samples.erase(_Samples.begin());
+		long _Value = _Samples.back()[_Index];
+
+		// Armed once the samples before the trigger are taken, with a previous result to compare to
+		if (_NbLeft == 0)
+		{
+			if ((_NbTaken >= _Pre) && (_NbTaken > 0) && IsTriggered(Trigger, _Previous, _Value, _Level))
+			{
+				_NbLeft = _Post;
+				_TriggerTime = _SampleTime;
+			}
+			else if ((_NbTaken < _Pre) || (_NbTaken == 0))
+				_NbTaken++;
+			_Previous = _Value;
+		}
+
+		// All samples are taken: the time of the trigger, then the samples
+		if ((_NbLeft > 0) && (--_NbLeft == 0))
+		{
+			unsigned int _NbSent = 0;
+			m_Response[RESPONSE_HEADER_LENGTH + _NbSent++] = _TriggerTime & 0xFFFF;
+			m_Response[RESPONSE_HEADER_LENGTH + _NbSent++] = _TriggerTime >> 16;
+			for (unsigned int _j = 0; _j < _Samples.size(); _j++)
+				for (unsigned int _k = 0; _k < _Samples[_j].size(); _k++)
+					m_Response[RESPONSE_HEADER_LENGTH + _NbSent++] = _Samples[_j][_k];
+			if (!SendResponse(Sequence, _Flags & RESPONSE_FLAG_AVERAGED, _NbSent, kNoError, 0, _Encoding))
+				return false;
+			_Samples.clear();
+			_NbTaken = 0;
+			_LastResponse = chrono::steady_clock::now();
+		}
+		// Tell the host the trigger is still armed
+		else if (chrono::steady_clock::now() - _LastResponse >= chrono::milliseconds(TRIGGER_HEARTBEAT_PERIOD))
+		{
+			if (!SendResponse(Sequence, 0, 0, kNoError, TRIGGER_ARMED_ERROR_DESC))
+				return false;
+			_LastResponse = chrono::steady_clock::now();
+		}
+	} while (!ReadByte(_Byte, false));
+
+	// Discard the stop request and acknowledge it
+	m_RxStart = m_RxEnd;
+	m_InFrame = false;
+	return SendResponse(Sequence, 0, 0, kNoError, STREAM_END_ERROR_DESC);
+} // TriggerScript
+
+// Take a burst and send it in one response
+bool CLoopbackDevice::BurstScript(	const unsigned short	*pCommands,		// Commands of a sample
+									unsigned int			NbCommands,		// Number of commands
+									unsigned short			Sequence)		// Sequence number
+{
+	unsigned char _Encoding = GetScriptEncoding(pCommands, NbCommands) & ~RESULT_ENCODING_SHIFT_MASK;
+	unsigned int _NbSamples = GetScriptBurstSamples(pCommands, NbCommands);
+
+	// Length of a sample, which contains no loop. Other errors are found when the first sample is taken.
+	unsigned int _SampleLength = 0;
+	for (unsigned int _i = 0; _i < NbCommands; _i++)
+	{
+		eCommand _Command;
+		if (GetCommand(pCommands[_i] >> 8, &_Command) != kNoError)
+			continue;
+		if ((_Command == kSetLoopStart) || (_Command == kSetAverageLoopStart))
+			return SendResponse(Sequence, 0, 0, kSyntaxError, _i);
+		if (MV2_CMD_INFO[_Command].ReturnsValue)
+			_SampleLength++;
+	}
+	if (_SampleLength == 0)
+		return SendResponse(Sequence, 0, 0, kSyntaxError, 0);
+	unsigned int _NbSamplesMax = (MAX_RESULTS_LENGTH - BURST_TIME_LENGTH) / _SampleLength;
+	if (_NbSamples == 0)
+		_NbSamples = _NbSamplesMax;
+	if ((_NbSamplesMax == 0) || (_NbSamples > _NbSamplesMax))
+		return SendResponse(Sequence, 0, 0, kOutOfMemoryError, 0);
+
+	// The time from the first sample to the last, then the samples
+	unsigned int _NbResults = BURST_TIME_LENGTH;
+	unsigned long _FirstTime = GetMicros();
+	unsigned long _LastTime = _FirstTime;
+	for (unsigned int _Sample = 0; _Sample < _NbSamples; _Sample++)
+	{
+		_LastTime = GetMicros();
+		unsigned short _Flags = 0;
+		unsigned short _IndexCommandError = 0;
+		unsigned short _Error = ExecuteScript(pCommands, NbCommands, _NbResults, _Flags, _IndexCommandError);
+		if (_Error != kNoError)
+			return SendResponse(Sequence, 0, 0, _Error, _IndexCommandError);
+	}
+	unsigned long _Time = _LastTime - _FirstTime;
+	m_Response[RESPONSE_HEADER_LENGTH] = _Time & 0xFFFF;
+	m_Response[RESPONSE_HEADER_LENGTH + 1] = (_Time >> 16) & 0xFFFF;
+	return SendResponse(Sequence, 0, _NbResults, kNoError, 0, _Encoding);
+} // BurstScript
+
+// Execute commands, append results to the response buffer
+unsigned short CLoopbackDevice::ExecuteScript(	const unsigned short	*pCommands,				// Commands
+												unsigned int			NbCommands,				// Number of commands
+												unsigned int			&rNbResults,			// Number of results
+												unsigned short			&rFlags,				// Response flags
+												unsigned short			&rIndexCommandError)	// Index of the command in error
+{
+	// High byte of the value of the next command: a loop count, a sample period, a trigger setting
+	// or a number of burst samples
+	bool _CountHigh = false;
+	unsigned int _LoopCount = 0;
+
+	rIndexCommandError = 0;
+
+	for (unsigned int _i = 0; _i < NbCommands; _i++)
+	{
+		unsigned char _CommandValue = pCommands[_i] & 0xFF;
+		eCommand _Command;
+
+		// Check command and mode
+		if (GetCommand(pCommands[_i] >> 8, &_Command) != kNoError)
+		{
+			rIndexCommandError = _i;
+			return kSyntaxError;
+		}
+		if ((!m_AnalogMode && (MV2_CMD_INFO[_Command].Type == kAnalog)) ||
+			(m_AnalogMode && (MV2_CMD_INFO[_Command].Type == kDigital)))
+		{
+			rIndexCommandError = _i;
+			return kModeError;
+		}
+
+		// The high byte of a value is followed by its command
+		if (_CountHigh && (_Command != kSetLoopStart) && (_Command != kSetAverageLoopStart) && (_Command != kStartSampleTimer) &&
+			(_Command != kSetTriggerLevel) && (_Command != kSetPreTrigger) && (_Command != kSetPostTrigger) &&
+			(_Command != kSetBurstSamples))
+		{
+			rIndexCommandError = _i;
+			return kSyntaxError;
+		}
+		if (_Command == kSetLoopCountHigh)
+		{
+			_CountHigh = true;
+			_LoopCount = _CommandValue << 8;
+			continue;
+		}
+
+		// Loop: execute the commands up to the matching end of the loop
+		if ((_Command == kSetLoopStart) || (_Command == kSetAverageLoopStart))
+		{
+			_LoopCount = _CountHigh ? (_LoopCount | _CommandValue) : _CommandValue;
+			_CountHigh = false;
+
+			// Find the end, check nesting like the firmware: MAX_LOOP_DEPTH levels, an averaged loop contains no loop
+			unsigned int _End;
+			unsigned int _Depth = 1;
+			unsigned int _MaxDepth = 1;
+			eCommand _LoopCommand;
+			unsigned short _Error = kUnspecifiedLoopError;
+			for (_End = _i + 1; _End < NbCommands; _End++)
+			{
+				if (GetCommand(pCommands[_End] >> 8, &_LoopCommand) != kNoError)
+					break;
+				if ((_LoopCommand == kSetLoopStart) || (_LoopCommand == kSetAverageLoopStart))
+					_MaxDepth = max(_MaxDepth, ++_Depth);
+				// Like the firmware, the mode can't change inside a loop
+				else if (_LoopCommand == kSetDigitalAnalogMode)
+				{
+					rIndexCommandError = _End;
+					return kModeError;
+				}
+				else if ((_LoopCommand == kSetLoopEnd) && (--_Depth == 0))
+				{
+					_Error = kNoError;
+					break;
+				}
+			}
+			if ((_Error == kNoError) && ((_MaxDepth > MAX_LOOP_DEPTH) || ((_MaxDepth > 1) && (_Command == kSetAverageLoopStart))))
+				_Error = kNestedLoopError;
+			if ((_Error == kNoError) && (_Command == kSetAverageLoopStart))
+				_Error = ExecuteAverageLoop(&pCommands[_i + 1], _End - _i - 1, _LoopCount, rNbResults, rFlags, rIndexCommandError);
+			else
+				for (unsigned int _j = 0; (_Error == kNoError) && (_j < _LoopCount); _j++)
+					_Error = ExecuteScript(&pCommands[_i + 1], _End - _i - 1, rNbResults, rFlags, rIndexCommandError);
+			if (_Error != kNoError)
+			{
+				rIndexCommandError = _i;
+				return _Error;
+			}
+			_i = _End;
+			continue;
+		}
+
+		// Execute command, append its value. The period of the sample timer, the trigger settings and the
+		// number of burst samples have 16 bits.
+		unsigned short _Value = 0;
+		unsigned short _Error = ExecuteCommand(_Command, _CountHigh ? (_LoopCount | _CommandValue) : _CommandValue, _Value);
+		_CountHigh = false;
+		if (_Error != kNoError)
+			return _Error;
+		// Like the firmware, results that don't fit in a response are sent in chunks
+		if (MV2_CMD_INFO[_Command].ReturnsValue)
+		{
+			if (RESPONSE_HEADER_LENGTH + rNbResults >= m_Response.size())
+				m_Response.resize(2 * m_Response.size());
+			m_Response[RESPONSE_HEADER_LENGTH + rNbResults++] = _Value;
+		}
+	}
+
+	// High byte of a loop count without loop
+	if (_CountHigh)
+	{
+		rIndexCommandError = NbCommands - 1;
+		return kSyntaxError;
+	}
+	return kNoError;
+} // ExecuteScript
+
+// Execute an averaged loop, append the average of each result to the response buffer
+unsigned short CLoopbackDevice::ExecuteAverageLoop(	const unsigned short	*pCommands,				// Commands of the loop
+													unsigned int			NbCommands,				// Number of commands
+													unsigned int			Count,					// Number of iterations
+													unsigned int			&rNbResults,			// Number of results
+													unsigned short			&rFlags,				// Response flags
+													unsigned short			&rIndexCommandError)	// Index of the command in error
+{
+	// Like the firmware, sum each result in 32 bits, then round
+	vector<unsigned long> _Sums;
+	for (unsigned int _j = 0; _j < Count; _j++)
+	{
+		unsigned int _NbResults = rNbResults;
+		unsigned short _Error = ExecuteScript(pCommands, NbCommands, _NbResults, rFlags, rIndexCommandError);
+		if (_Error != kNoError)
+			return _Error;
+		_Sums.resize(_NbResults - rNbResults, 0);
+		for (unsigned int _k = 0; _k < _Sums.size(); _k++)
+			_Sums[_k] += m_Response[RESPONSE_HEADER_LENGTH + rNbResults + _k];
+	}
+
+	// No iteration, no average
+	if (Count == 0)
+		return kNoError;
+	for (unsigned int _k = 0; _k < _Sums.size(); _k++)
+		m_Response[RESPONSE_HEADER_LENGTH + rNbResults++] = static_cast<unsigned short>((_Sums[_k] + Count / 2) / Count);
+	rFlags |= RESPONSE_FLAG_AVERAGED;
+	return kNoError;
+} // ExecuteAverageLoop
+
+// Time since the start, like the 32-bit micros() of the Arduino
+unsigned long CLoopbackDevice::GetMicros()
+{
+	return static_cast<unsigned long>(chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - m_StartTime).count()) & 0xFFFFFFFFUL;
+} // GetMicros
+
+// Execute one command
+unsigned short CLoopbackDevice::ExecuteCommand(	unsigned int	Command,			// Index in MV2_CMD_INFO
+												unsigned short	CommandValue,		// Parameter
+												unsigned short	&rValue)			// Returned value
+{
+	switch (Command)
+	{
+		// Measurements return consecutive values
+		case kReadRegister0:
+		case kReadRegister1:
+		case kReadRegister2:
+		case kWriteRegister0:
+		case kWriteRegister1:
+		case kWriteRegister2:
+			rValue = m_NextValue++;
+			return kNoError;
+
+		// Like the firmware, the low bits of analog values are 0
+		case kDigitizeBx:
+		case kDigitizeBy:
+		case kDigitizeBz:
+		case kDigitizeTemp:
+			rValue = (m_NextValue++) << LOOPBACK_ANALOG_SHIFT;
+			return kNoError;
+
+		case kSetDigitalAnalogMode:
+			m_AnalogMode = (CommandValue != 0);
+			return kNoError;
+
+		case kGetFwVersion:
+			rValue = FW_VERSION;
+			return kNoError;
+
+		// Like the firmware, with the 32-bit micros() of the Arduino
+		case kGetTimestamp:
+		{
+			if (CommandValue > TIMESTAMP_MAX_SHIFT)
+				return kSyntaxError;
+			unsigned long _Now = GetMicros();
+			unsigned long _Delta = ((_Now - m_LastTimestamp) & 0xFFFFFFFFUL) >> CommandValue;
+			if (_Delta < TIMESTAMP_SATURATED)
+			{
+				rValue = static_cast<unsigned short>(_Delta);
+				m_LastTimestamp = (m_LastTimestamp + (_Delta << CommandValue)) & 0xFFFFFFFFUL;
+			}
+			else
+			{
+				rValue = TIMESTAMP_SATURATED;
+				m_LastTimestamp = _Now;
+			}
+			return kNoError;
+		}
+
+		// Like the firmware, the period is the nearest one of the timer clock not longer
+		case kStartSampleTimer:
+		{
+			if ((CommandValue != 0) && (CommandValue < SAMPLE_PERIOD_MIN))
+				return kSyntaxError;
+			unsigned long _Cycles = static_cast<unsigned long>(CommandValue) * LOOPBACK_CPU_MHZ;
+			unsigned int _Shift = ((_Cycles >> LOOPBACK_SAMPLE_SHIFT_FAST) > 0x10000) ? LOOPBACK_SAMPLE_SHIFT_SLOW : LOOPBACK_SAMPLE_SHIFT_FAST;
+			m_SamplePeriod = ((_Cycles >> _Shift) << _Shift) / LOOPBACK_CPU_MHZ;
+			m_SampleTimerStart = chrono::steady_clock::now();
+			m_SampleTicksTaken = 0;
+			m_SampleTickTaken = false;
+			m_SampleOverruns = 0;
+			rValue = m_SamplePeriod;
+			return kNoError;
+		}
+
+		// Wait for the next tick, count the ticks missed before it
+		case kWaitForSampleTick:
+		{
+			if (m_SamplePeriod == 0)
+				return kSampleTimerError;
+			chrono::microseconds _Period(m_SamplePeriod);
+			unsigned long _Ticks = (chrono::steady_clock::now() - m_SampleTimerStart) / _Period;
+			if (_Ticks == m_SampleTicksTaken)
+			{
+				this_thread::sleep_until(m_SampleTimerStart + (m_SampleTicksTaken + 1) * _Period);
+				_Ticks = m_SampleTicksTaken + 1;
+			}
+			if (m_SampleTickTaken)
+				m_SampleOverruns = static_cast<unsigned short>(min<unsigned long>(m_SampleOverruns + _Ticks - m_SampleTicksTaken - 1, 0xFFFF));
+			m_SampleTicksTaken = _Ticks;
+			m_SampleTickTaken = true;
+			return kNoError;
+		}
+
+		case kGetSampleOverruns:
+			rValue = m_SampleOverruns;
+			return kNoError;
+
+		// Nothing is timed: every word is 0
+		case kGetDiagnostics:
+			rValue = 0;
+			return ((CommandValue < DIAG_LENGTH) || (CommandValue == DIAG_RESET)) ? kNoError : kSyntaxError;
+
+		// Nothing to switch
+		case kSetBaudRate:
+			return (CommandValue < NB_MV2_BAUD_RATES) ? kNoError : kSyntaxError;
+
+		// No action to perform
+		case kSetInitBit:
+		case kWaitForDrInterrupt:
+		case kSetOptions:
+		case kSetLoopEnd:
+		case kSetAverageLoopStart:
+		case kSetLoopCountHigh:
+		case kSetResultEncoding:
+		case kSetTriggerLevel:
+		case kSetPreTrigger:
+		case kSetPostTrigger:
+		case kSetBurstSamples:
+			return kNoError;
+
+		// Stream, capture, trigger and burst are only allowed as first command
+		default:
+			return kSyntaxError;
+	}
+} // ExecuteCommand
+
+// Send the response buffer, in chunks if the results don't fit in a response
+bool CLoopbackDevice::SendResponse(	unsigned short	Sequence,		// Sequence number
+									unsigned short	Flags,			// Response flags
+									unsigned int	NbResults,		// Number of results
+									unsigned short	Error,			// Error code
+									unsigned short	ErrorDesc,		// Error description
+									unsigned char	Encoding)		// Results encoding
+{
+	const unsigned short *_pResults = &m_Response[RESPONSE_HEADER_LENGTH];
+
+	if (NbResults <= MAX_RESULTS_LENGTH)
+		return SendFrame(Sequence, Flags, _pResults, NbResults, Error, ErrorDesc, Encoding);
+
+	// Chunks numbered by their error description, then their number and the status
+	unsigned short _NbChunks = 0;
+	for (unsigned int _First = 0; _First < NbResults; _First += MAX_RESULTS_LENGTH)
+		if (!SendFrame(Sequence, RESPONSE_FLAG_CHUNK, _pResults + _First, min<unsigned int>(NbResults - _First, MAX_RESULTS_LENGTH),
+					   kNoError, _NbChunks++, Encoding))
+			return false;
+	return SendFrame(Sequence, Flags | RESPONSE_FLAG_CHUNK_END, &_NbChunks, 1, Error, ErrorDesc, RESULT_ENCODING_RAW);
+} // SendResponse
+
+// Send a response frame
+bool CLoopbackDevice::SendFrame(	unsigned short			Sequence,		// Sequence number
+									unsigned short			Flags,			// Response flags
+									const unsigned short	*pResults,		// Results
+									unsigned int			NbResults,		// Number of results
+									unsigned short			Error,			// Error code
+									unsigned short			ErrorDesc,		// Error description
+									unsigned char			Encoding)		// Results encoding
+{
+	// Words sent: header, results encoded like MV2HostOutput.cpp, status
+	vector<unsigned short> _Words(RESPONSE_HEADER_LENGTH);
+	_Words[RESPONSE_SEQUENCE_INDEX] = Sequence;
+	_Words[RESPONSE_FLAGS_INDEX] = Flags | (Encoding << RESPONSE_FLAGS_ENCODING_SHIFT);
+	if (Encoding == RESULT_ENCODING_RAW)
+		_Words.insert(_Words.end(), pResults, pResults + NbResults);
+	else
+	{
+		unsigned int _Shift = Encoding & RESULT_ENCODING_SHIFT_MASK;
+		unsigned int _Stride = (Encoding >> RESULT_ENCODING_STRIDE_SHIFT) + 1;
+		unsigned long _Bits = 0;
+		unsigned int _NbBits = 0;
+
+		_Words.push_back(NbResults);
+		for (unsigned int _i = 0; _i <= NbResults; _i++)
+		{
+			// Complete the last word with 0
+			if (_i == NbResults)
+				_NbBits = (_NbBits + 15) / 16 * 16;
+			else if (!(Encoding & RESULT_ENCODING_DELTA))
+			{
+				_Bits |= static_cast<unsigned long>(pResults[_i] >> _Shift) << _NbBits;
+				_NbBits += 16 - _Shift;
+			}
+			else
+			{
+				long _Delta = static_cast<long>(pResults[_i] >> _Shift);
+				if (_i >= _Stride)
+					_Delta -= static_cast<long>(pResults[_i - _Stride] >> _Shift);
+				unsigned long _Zigzag = (_Delta < 0) ? ((static_cast<unsigned long>(-_Delta) << 1) - 1) : (static_cast<unsigned long>(_Delta) << 1);
+				do
+				{
+					_Bits |= ((_Zigzag & 0x7F) | ((_Zigzag >= 0x80) ? 0x80 : 0)) << _NbBits;
+					_NbBits += 8;
+					_Zigzag >>= 7;
+				} while (_Zigzag != 0);
+			}
+			for (; _NbBits >= 16; _NbBits -= 16, _Bits >>= 16)
+				_Words.push_back(static_cast<unsigned short>(_Bits));
+		}
+	}
+	_Words.push_back(Error);
+	_Words.push_back(ErrorDesc);
+	unsigned int _Length = _Words.size() + RESPONSE_CRC_LENGTH;
+	_Words[0] = _Length * sizeof(unsigned short);
+
+	// Escape the response and its CRC
+	unsigned short _Crc = CRC16_INIT;
+	m_TxBuffer.clear();
+	m_TxBuffer.push_back(FRAME_FLAG);
+	for (unsigned int _i = 0; _i < _Length; _i++)
+	{
+		unsigned short _Word = (_i < _Length - RESPONSE_CRC_LENGTH) ? _Words[_i] : _Crc;
+		unsigned char _Bytes[2] = { static_cast<unsigned char>(_Word), static_cast<unsigned char>(_Word >> 8) };
+		for (int _j = 0; _j < 2; _j++)
+		{
+			_Crc = Crc16Update(_Crc, _Bytes[_j]);
+			if ((_Bytes[_j] == FRAME_FLAG) || (_Bytes[_j] == FRAME_ESCAPE))
+			{
+				m_TxBuffer.push_back(FRAME_ESCAPE);
+				m_TxBuffer.push_back(_Bytes[_j] ^ FRAME_ESCAPE_MASK);
+			}
+			else
+				m_TxBuffer.push_back(_Bytes[_j]);
+		}
+	}
+	m_TxBuffer.push_back(FRAME_FLAG);
+
+	// Blocks while the host does not read
+	for (unsigned int _Sent = 0; _Sent < m_TxBuffer.size(); )
+	{
+		ssize_t _BytesSent = send(m_SocketHandle, &m_TxBuffer[_Sent], m_TxBuffer.size() - _Sent, MSG_NOSIGNAL);
+		if (_BytesSent < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		_Sent += _BytesSent;
+	}
+	return true;
+} // SendFrame
+
+//----------------------------------------------------------------------------
+// CLoopbackTransport
+
+// Start a simulated Arduino
+CLoopbackTransport *CLoopbackTransport::Create()
+{
+	File_t _Handles[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, _Handles) != 0)
+	{
+		string _ErrorMsg = CREATE_SOCKET_PAIR_EXCEPTION_MSG + GetLastErrorStdStr();
+		throw CMV2HostException(_ErrorMsg);
+	}
+	return new CLoopbackTransport(_Handles[0], _Handles[1]);
+} // Create
+
+// Constructor
+CLoopbackTransport::CLoopbackTransport(	File_t	HostHandle,			// Host end
+										File_t	DeviceHandle)		// Device end
+	: CSocketTransport(HostHandle)
+{
+	m_DeviceHandle = DeviceHandle;
+#ifdef SO_NOSIGPIPE
+	int _NoSigPipe = 1;
+	setsockopt(m_DeviceHandle, SOL_SOCKET, SO_NOSIGPIPE, &_NoSigPipe, sizeof(_NoSigPipe));
+#endif
+	m_pDevice = new CLoopbackDevice(m_DeviceHandle);
+	m_DeviceThread = thread(&CLoopbackDevice::Run, m_pDevice);
+} // Constructor
+
+// Destructor
+CLoopbackTransport::~CLoopbackTransport()
+{
+	// The simulated Arduino stops once the host end is shut down
+	shutdown(GetHandle(), SHUT_RDWR);
+	m_DeviceThread.join();
+	delete m_pDevice;
+	close(m_DeviceHandle);
+} // Destructor
+
+} // namespace MV2Host
+
+#endif // WIN32
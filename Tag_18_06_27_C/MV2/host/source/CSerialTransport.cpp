@@ -0,0 +1,500 @@
+// Name:
+//	CSerialTransport.cpp
+//
+// Purpose:
+//	See CSerialTransport.h
+//
+// Description:
+//
+// Coding Conventions:
+//	- Variable names use the "InterCaps" convention
+//	- Local variables are prefixed with an underscore, '_'
+//	- Private class members are prefixed with 'm_'
+//	- Private class methods are prefixed with an underscore, '_'
+//	- Pointer variables are prefixed with 'p'
+//	- Reference variables are prefixed with 'r'
+//	- Enumerated types are prefixed with 'e'
+//	- Enumerated type values are prefixed with 'k'
+//	- Classes are prefixed with 'C'
+//	- Constants are all uppercase
+//	The above conventions can also be combined:
+//	- A local pointer variable would be prefixed '_p'
+//	- A private class pointer member would be prefixed 'm_p'
+//
+// Change log:
+//	17.10.26 MB	Original version, moved from CArduinoSerialPort.cpp
+//	17.10.26 MB	Clear HUPCL to leave the Arduino running, reset it by pulsing DTR
+//
+// Copyright (c) 2016 Metrolab Technology SA, Geneva,
+//	Switzerland
+
+// Include files
+#include <CSerialTransport.h>
+#include <CMV2HostException.h>
+#include <MV2HostCommands.h>
+#include <string.h>
+
+#ifndef WIN32
+	#include <sys/ioctl.h>
+#endif
+
+#ifdef __linux__
+	#include <asm/ioctls.h>
+
+	// Same as struct termios2 in <asm/termbits.h>, which conflicts with <termios.h>
+	struct termios2
+	{
+		tcflag_t	c_iflag;
+		tcflag_t	c_oflag;
+		tcflag_t	c_cflag;
+		tcflag_t	c_lflag;
+		cc_t		c_line;
+		cc_t		c_cc[19];
+		speed_t		c_ispeed;
+		speed_t		c_ospeed;
+	};
+	#ifndef BOTHER
+		#define BOTHER	0010000
+	#endif
+	#ifndef IBSHIFT
+		#define IBSHIFT	16
+	#endif
+#endif
+
+// Time (ms) DTR is cleared to reboot the Arduino
+#define DTR_RESET_PULSE							50
+
+// Exceptions messages
+#define OPENING_SERIAL_PORT_EXCEPTION_MSG		"CSerialTransport: Unable to open serial port."
+#define GET_SERIAL_PORT_SETTINGS_EXCEPTION_MSG	"CSerialTransport: Unable to get serial port settings."
+#define SET_SERIAL_PORT_SETTINGS_EXCEPTION_MSG	"CSerialTransport: Unable to set serial port settings."
+#define FLUSH_SERIAL_PORT_EXCEPTION_MSG			"CSerialTransport: Unable to flush serial port settings."
+#define WRITE_SERIAL_PORT_EXCEPTION_MSG			"CSerialTransport: Unable to write to the serial port."
+#define READ_SERIAL_PORT_EXCEPTION_MSG			"CSerialTransport: Unable to read serial port."
+#define HUNG_UP_EXCEPTION_MSG					"CSerialTransport: Serial port hung up."
+#define UNSUPPORTED_BAUD_RATE_EXCEPTION_MSG		"CSerialTransport: Unsupported baud rate."
+
+// Our namespace
+namespace MV2Host
+{
+
+#if !defined(WIN32) && !defined(__linux__)
+// Get the termios speed of a baud rate
+static bool GetSpeed(unsigned long BaudRate, speed_t &rSpeed)
+{
+	switch (BaudRate)
+	{
+		case 57600:		rSpeed = B57600;	return true;
+		case 115200:	rSpeed = B115200;	return true;
+	#ifdef B500000
+		case 500000:	rSpeed = B500000;	return true;
+	#endif
+	#ifdef B1000000
+		case 1000000:	rSpeed = B1000000;	return true;
+	#endif
+	#ifdef B2000000
+		case 2000000:	rSpeed = B2000000;	return true;
+	#endif
+		default:		return false;
+	}
+}
+#endif
+
+// Constructor
+CSerialTransport::CSerialTransport(	const char	*pPortName,			// Port name
+									bool		DtrResets,			// DTR reboots the Arduino
+									eOpenMode	OpenMode)			// How to open the port
+{
+	m_DtrResets = DtrResets;
+	m_RebootsOnOpen = DtrResets && (OpenMode != kOpenNoReset);
+#ifdef WIN32
+	m_ReadTimeout = MAXDWORD;
+#endif
+
+	#ifdef WIN32
+		// Prefix portname with "\\\\.\\".
+		// (see https://support.microsoft.com/en-us/help/115831/howto-specify-serial-ports-larger-than-com9)
+		char _PortName[20] = "\\\\.\\";				// 20 allows for portnames up to COM999999999
+		strncat(_PortName, pPortName, 12);
+
+		m_PortHandle = CreateFile(_PortName,		// Specify port device
+			GENERIC_READ | GENERIC_WRITE,			// Specify mode that open device.
+			0,										// the device isn't shared.
+			0,										// the object gets a default security.
+			OPEN_EXISTING,							// Specify which action to take on file.
+			FILE_ATTRIBUTE_NORMAL,					// default.
+			0);										// default.
+		if (m_PortHandle == INVALID_HANDLE_VALUE)
+		{
+			string _ErrorMsg = OPENING_SERIAL_PORT_EXCEPTION_MSG + GetLastErrorStdStr();
+			throw CMV2HostException(_ErrorMsg);
+		}
+	#else
+		// Non-blocking: waits are done with poll, up to a deadline
+		m_PortHandle = open(pPortName, O_RDWR | O_NOCTTY | O_NONBLOCK);
+		if (m_PortHandle < 0)
+		{
+			string _ErrorMsg = OPENING_SERIAL_PORT_EXCEPTION_MSG + GetLastErrorStdStr();
+			throw CMV2HostException(_ErrorMsg);
+		}
+	#endif
+
+	// Set serial port settings
+	try
+	{
+		SetSerialPortSettings(OpenMode);
+	}
+	catch (CMV2HostException &)
+	{
+#ifdef WIN32
+		CloseHandle(m_PortHandle);
+#else
+		close(m_PortHandle);
+#endif
+		throw;
+	}
+} // Constructor
+
+// Destructor
+CSerialTransport::~CSerialTransport()
+{
+#ifdef WIN32
+	CloseHandle(m_PortHandle);
+#else
+	close(m_PortHandle);
+#endif
+} // Destructor
+
+// Set serial port settings 8N1, 57600 bauds
+void CSerialTransport::SetSerialPortSettings(eOpenMode OpenMode)		// How to open the port
+{
+#ifdef WIN32
+	DCB _DcbSerialParams;
+
+	// Get serial port settings
+	if (!GetCommState(m_PortHandle, &_DcbSerialParams))
+	{
+		string _ErrorMsg = GET_SERIAL_PORT_SETTINGS_EXCEPTION_MSG + GetLastErrorStdStr();
+		throw CMV2HostException(_ErrorMsg);
+	}
+
+	_DcbSerialParams.fDtrControl = DTR_CONTROL_ENABLE;
+	_DcbSerialParams.BaudRate = MV2_BAUD_RATES[MV2_DEFAULT_BAUD_RATE_INDEX];
+	_DcbSerialParams.ByteSize = 8;
+	_DcbSerialParams.StopBits = ONESTOPBIT;
+	_DcbSerialParams.Parity = NOPARITY;
+
+	// Set serial port settings. Resets Arduino, because DTR is set: Windows cleared it
+	// when the port was closed, so this happens with kOpenNoReset too.
+	if (!SetCommState(m_PortHandle, &_DcbSerialParams))
+	{
+		string _ErrorMsg = SET_SERIAL_PORT_SETTINGS_EXCEPTION_MSG + GetLastErrorStdStr();
+		throw CMV2HostException(_ErrorMsg);
+	}
+
+	// Set read timeout: reads return at once
+	SetReadTimeout(0);
+
+	// Wait for the reset.
+	if (m_DtrResets && (OpenMode == kOpenReset))
+		WaitForReboot();
+
+	// Flush anything already in the serial buffer
+	if (!PurgeComm(m_PortHandle, PURGE_RXABORT | PURGE_RXCLEAR | PURGE_TXABORT | PURGE_TXCLEAR))
+	{
+		string _ErrorMsg = FLUSH_SERIAL_PORT_EXCEPTION_MSG + GetLastErrorStdStr();
+		throw CMV2HostException(_ErrorMsg);
+	}
+#else
+	struct termios _PortSettings;
+
+	// Get serial port settings
+	if (tcgetattr(m_PortHandle, &_PortSettings) != 0)
+	{
+		string _ErrorMsg = GET_SERIAL_PORT_SETTINGS_EXCEPTION_MSG + GetLastErrorStdStr();
+		throw CMV2HostException(_ErrorMsg);
+	}
+	 // Set baud rates
+	cfsetispeed(&_PortSettings, B57600);
+	cfsetospeed(&_PortSettings, B57600);
+
+	// Set 8N1
+	_PortSettings.c_cflag &= ~PARENB;
+	_PortSettings.c_cflag &= ~CSTOPB;
+	_PortSettings.c_cflag &= ~CSIZE;
+	_PortSettings.c_cflag |= CS8;
+
+	// Enable receiver, ignore status line
+	_PortSettings.c_cflag |= (CREAD | CLOCAL | CRTSCTS);
+	// Diable canonical input, disable echo, disable visually erase chars,
+	// disable terminal-generated signals
+	_PortSettings.c_lflag &= ~(ICANON | ECHO | ECHOE | ISIG);
+	// Disable hardware flow control
+	_PortSettings.c_cflag &= ~CRTSCTS;
+	// Disable input/output flow control, disable restart chars
+	_PortSettings.c_iflag &= ~(IXON | IXOFF | IXANY);
+	// Disable output processing
+	_PortSettings.c_oflag &= ~OPOST;
+	// Opening the port rebooted the Arduino only if DTR dropped when it was last closed.
+	// Keep DTR on close to leave the Arduino running for the next open.
+	bool _Rebooted = (_PortSettings.c_cflag & HUPCL) != 0;
+	if (OpenMode == kOpenNoReset)
+		_PortSettings.c_cflag &= ~HUPCL;
+	else
+		_PortSettings.c_cflag |= HUPCL;
+	// Reads return at once, the port is non-blocking anyway
+	_PortSettings.c_cc[VMIN] = 0;
+	_PortSettings.c_cc[VTIME] = 0;
+	// Set serial port settings
+	if (tcsetattr(m_PortHandle, TCSANOW, &_PortSettings) != 0)
+	{
+		string _ErrorMsg = SET_SERIAL_PORT_SETTINGS_EXCEPTION_MSG + GetLastErrorStdStr();
+		throw CMV2HostException(_ErrorMsg);
+	}
+
+	if (m_DtrResets && (OpenMode != kOpenNoReset))
+	{
+		// The previous session left the Arduino running: reboot it now
+		if (!_Rebooted)
+			PulseDtr();
+		// *NIX OS reboot Arduino so we have to wait
+		if (OpenMode == kOpenReset)
+			WaitForReboot();
+	}
+
+	// Flush anything already in the serial buffer
+	if (tcflush(m_PortHandle, TCIFLUSH) != 0)
+	{
+		string _ErrorMsg = FLUSH_SERIAL_PORT_EXCEPTION_MSG + GetLastErrorStdStr();
+		throw CMV2HostException(_ErrorMsg);
+	}
+
+#endif
+} // SetSerialPortSettings
+
+// Clear DTR for DTR_RESET_PULSE, then set it again
+bool CSerialTransport::PulseDtr()
+{
+#ifdef WIN32
+	if (!EscapeCommFunction(m_PortHandle, CLRDTR))
+		return false;
+	Sleep(DTR_RESET_PULSE);
+	return EscapeCommFunction(m_PortHandle, SETDTR) != 0;
+#else
+	// Pseudo-terminals have no modem lines
+	int _Dtr = TIOCM_DTR;
+	if (ioctl(m_PortHandle, TIOCMBIC, &_Dtr) != 0)
+		return false;
+	usleep(DTR_RESET_PULSE * 1000);
+	return ioctl(m_PortHandle, TIOCMBIS, &_Dtr) == 0;
+#endif
+} // PulseDtr
+
+// Wait until the Arduino is ready after a reboot
+void CSerialTransport::WaitForReboot()
+{
+#ifdef WIN32
+	Sleep(WAIT_FOR_ARDUINO_REBOOT);
+#else
+	sleep(WAIT_FOR_ARDUINO_REBOOT);
+#endif
+} // WaitForReboot
+
+// Reboot the Arduino by clearing DTR, wait until it is ready
+bool CSerialTransport::Reset()
+{
+	if (!m_DtrResets || !PulseDtr())
+		return false;
+	WaitForReboot();
+
+	// Drop what the Arduino sent before it rebooted
+	Flush();
+	return true;
+} // Reset
+
+// Check whether the serial port supports a baud rate
+bool CSerialTransport::IsBaudRateSupported(unsigned long BaudRate)		// Baud rate
+{
+#if defined(WIN32) || defined(__linux__)
+	// Any baud rate
+	return true;
+#else
+	speed_t _Speed;
+	return GetSpeed(BaudRate, _Speed);
+#endif
+} // IsBaudRateSupported
+
+// Set serial port baud rate
+void CSerialTransport::SetBaudRate(unsigned long BaudRate)				// Baud rate
+{
+#ifdef WIN32
+	DCB _DcbSerialParams;
+
+	if (!GetCommState(m_PortHandle, &_DcbSerialParams))
+	{
+		string _ErrorMsg = GET_SERIAL_PORT_SETTINGS_EXCEPTION_MSG + GetLastErrorStdStr();
+		throw CMV2HostException(_ErrorMsg);
+	}
+	_DcbSerialParams.BaudRate = BaudRate;
+	if (!SetCommState(m_PortHandle, &_DcbSerialParams))
+	{
+		string _ErrorMsg = SET_SERIAL_PORT_SETTINGS_EXCEPTION_MSG + GetLastErrorStdStr();
+		throw CMV2HostException(_ErrorMsg);
+	}
+#elif defined(__linux__)
+	struct termios2 _PortSettings;
+
+	// termios2 allows any baud rate
+	if (ioctl(m_PortHandle, TCGETS2, &_PortSettings) != 0)
+	{
+		string _ErrorMsg = GET_SERIAL_PORT_SETTINGS_EXCEPTION_MSG + GetLastErrorStdStr();
+		throw CMV2HostException(_ErrorMsg);
+	}
+	_PortSettings.c_cflag &= ~(CBAUD | (CBAUD << IBSHIFT));
+	_PortSettings.c_cflag |= BOTHER | (BOTHER << IBSHIFT);
+	_PortSettings.c_ispeed = BaudRate;
+	_PortSettings.c_ospeed = BaudRate;
+	if (ioctl(m_PortHandle, TCSETS2, &_PortSettings) != 0)
+	{
+		string _ErrorMsg = SET_SERIAL_PORT_SETTINGS_EXCEPTION_MSG + GetLastErrorStdStr();
+		throw CMV2HostException(_ErrorMsg);
+	}
+#else
+	struct termios _PortSettings;
+	speed_t _Speed;
+
+	if (!GetSpeed(BaudRate, _Speed))
+		throw CMV2HostException(UNSUPPORTED_BAUD_RATE_EXCEPTION_MSG);
+	if (tcgetattr(m_PortHandle, &_PortSettings) != 0)
+	{
+		string _ErrorMsg = GET_SERIAL_PORT_SETTINGS_EXCEPTION_MSG + GetLastErrorStdStr();
+		throw CMV2HostException(_ErrorMsg);
+	}
+	cfsetispeed(&_PortSettings, _Speed);
+	cfsetospeed(&_PortSettings, _Speed);
+	if (tcsetattr(m_PortHandle, TCSANOW, &_PortSettings) != 0)
+	{
+		string _ErrorMsg = SET_SERIAL_PORT_SETTINGS_EXCEPTION_MSG + GetLastErrorStdStr();
+		throw CMV2HostException(_ErrorMsg);
+	}
+#endif
+} // SetBaudRate
+
+#ifdef WIN32
+// Set read timeout: wait up to TimeOut for the first byte, 0 to return at once
+void CSerialTransport::SetReadTimeout(unsigned int TimeOut)				// Time out (ms)
+{
+	COMMTIMEOUTS _TimeOuts = {0};
+
+	// Avoid reconfiguring the port before every read
+	if (TimeOut == m_ReadTimeout)
+		return;
+
+	// Return available bytes at once, or wait up to TimeOut for the first byte
+	_TimeOuts.ReadIntervalTimeout = MAXDWORD;
+	_TimeOuts.ReadTotalTimeoutMultiplier = (TimeOut == 0) ? 0 : MAXDWORD;
+	_TimeOuts.ReadTotalTimeoutConstant = TimeOut;
+	if (!SetCommTimeouts(m_PortHandle, &_TimeOuts))
+	{
+		string _ErrorMsg = SET_SERIAL_PORT_SETTINGS_EXCEPTION_MSG + GetLastErrorStdStr();
+		throw CMV2HostException(_ErrorMsg);
+	}
+	m_ReadTimeout = TimeOut;
+} // SetReadTimeout
+#endif
+
+// Discard bytes received and not read yet
+void CSerialTransport::Flush()
+{
+#ifdef WIN32
+	if (!PurgeComm(m_PortHandle, PURGE_RXABORT | PURGE_RXCLEAR))
+#else
+	if (tcflush(m_PortHandle, TCIFLUSH) != 0)
+#endif
+	{
+		string _ErrorMsg = FLUSH_SERIAL_PORT_EXCEPTION_MSG + GetLastErrorStdStr();
+		throw CMV2HostException(_ErrorMsg);
+	}
+} // Flush
+
+// Write a buffer, wait for room until the deadline
+unsigned int CSerialTransport::Write(	const void			*pBuffer,		// Buffer to write
+										unsigned int		Size,			// Size of buffer
+										const CDeadline		&rDeadline)		// Deadline
+{
+#ifdef WIN32
+	NoOfBytes_t _NoOfBytesWritten = 0;
+	if (!WriteFile(m_PortHandle, pBuffer, Size, &_NoOfBytesWritten, NULL))
+	{
+		string _ErrorMsg = WRITE_SERIAL_PORT_EXCEPTION_MSG + GetLastErrorStdStr();
+		throw CMV2HostException(_ErrorMsg);
+	}
+	return _NoOfBytesWritten;
+#else
+	const unsigned char *_pBuffer = static_cast<const unsigned char *>(pBuffer);
+	unsigned int _Written = 0;
+
+	while (_Written < Size)
+	{
+		NoOfBytes_t _NoOfBytesWritten = write(m_PortHandle, _pBuffer + _Written, Size - _Written);
+		if (_NoOfBytesWritten < 0)
+		{
+			if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+			{
+				string _ErrorMsg = WRITE_SERIAL_PORT_EXCEPTION_MSG + GetLastErrorStdStr();
+				throw CMV2HostException(_ErrorMsg);
+			}
+			// Output buffer full: wait for room
+			if (rDeadline.IsExpired())
+				break;
+			WaitForHandle(m_PortHandle, POLLOUT, rDeadline, HUNG_UP_EXCEPTION_MSG);
+			continue;
+		}
+		_Written += _NoOfBytesWritten;
+	}
+	return _Written;
+#endif
+} // Write
+
+// Read available bytes, wait for at least one until the deadline
+unsigned int CSerialTransport::Read(	void				*pBuffer,		// Buffer
+										unsigned int		Size,			// Size of buffer
+										const CDeadline		*pDeadline)		// Deadline, or NULL
+{
+	for (;;)
+	{
+		NoOfBytes_t _BytesRead = 0;
+#ifdef WIN32
+		// Wait for the first byte until the deadline
+		SetReadTimeout((pDeadline == NULL) ? 0 : pDeadline->GetRemainingMs());
+		if (!ReadFile(m_PortHandle, pBuffer, Size, &_BytesRead, NULL))
+		{
+			string _ErrorMsg = READ_SERIAL_PORT_EXCEPTION_MSG + GetLastErrorStdStr();
+			throw CMV2HostException(_ErrorMsg);
+		}
+		return _BytesRead;
+#else
+		_BytesRead = read(m_PortHandle, pBuffer, Size);
+		// Check error
+		if (_BytesRead < 0)
+		{
+			if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+			{
+				string _ErrorMsg = READ_SERIAL_PORT_EXCEPTION_MSG + GetLastErrorStdStr();
+				throw CMV2HostException(_ErrorMsg);
+			}
+			_BytesRead = 0;
+		}
+		// With VMIN = 0, nothing available reads 0 bytes. WaitForHandle detects a hang up.
+		if (_BytesRead > 0)
+			return _BytesRead;
+
+		// Nothing available yet
+		if ((pDeadline == NULL) || pDeadline->IsExpired())
+			return 0;
+		WaitForHandle(m_PortHandle, POLLIN, *pDeadline, HUNG_UP_EXCEPTION_MSG);
+#endif
+	}
+} // Read
+
+} // namespace MV2Host
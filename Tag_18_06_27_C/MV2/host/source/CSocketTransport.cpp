@@ -0,0 +1,230 @@
+// Name:
+//	CSocketTransport.cpp
+//
+// Purpose:
+//	See CSocketTransport.h
+//
+// Description:
+//
+// Coding Conventions:
+//	- Variable names use the "InterCaps" convention
+//	- Local variables are prefixed with an underscore, '_'
+//	- Private class members are prefixed with 'm_'
+//	- Private class methods are prefixed with an underscore, '_'
+//	- Pointer variables are prefixed with 'p'
+//	- Reference variables are prefixed with 'r'
+//	- Enumerated types are prefixed with 'e'
+//	- Enumerated type values are prefixed with 'k'
+//	- Classes are prefixed with 'C'
+//	- Constants are all uppercase
+//	The above conventions can also be combined:
+//	- A local pointer variable would be prefixed '_p'
+//	- A private class pointer member would be prefixed 'm_p'
+//
+// Change log:
+//	17.10.26 MB	Original version
+//
+// Copyright (c) 2016 Metrolab Technology SA, Geneva,
+//	Switzerland
+
+// Include files
+#include <CSocketTransport.h>
+
+#ifndef WIN32
+
+#include <CMV2HostException.h>
+#include <MV2HostCommands.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+// A closed peer must not raise SIGPIPE
+#ifndef MSG_NOSIGNAL
+	#define MSG_NOSIGNAL	0
+#endif
+
+// Exceptions messages
+#define CREATE_SOCKET_EXCEPTION_MSG				"CSocketTransport: Unable to create socket."
+#define BAD_ADDRESS_EXCEPTION_MSG				"CSocketTransport: Bad socket address: "
+#define CONNECT_EXCEPTION_MSG					"CSocketTransport: Unable to connect: "
+#define WRITE_SOCKET_EXCEPTION_MSG				"CSocketTransport: Unable to write to the socket."
+#define READ_SOCKET_EXCEPTION_MSG				"CSocketTransport: Unable to read socket."
+#define HUNG_UP_EXCEPTION_MSG					"CSocketTransport: Connection closed."
+
+// Our namespace
+namespace MV2Host
+{
+
+// Connect to a Unix socket
+CSocketTransport *CSocketTransport::CreateUnix(const char *pPath)		// Socket path
+{
+	struct sockaddr_un _Address;
+
+	memset(&_Address, 0, sizeof(_Address));
+	_Address.sun_family = AF_UNIX;
+	if (strlen(pPath) >= sizeof(_Address.sun_path))
+		throw CMV2HostException(string(BAD_ADDRESS_EXCEPTION_MSG) + pPath);
+	strcpy(_Address.sun_path, pPath);
+
+	File_t _SocketHandle = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (_SocketHandle < 0)
+	{
+		string _ErrorMsg = CREATE_SOCKET_EXCEPTION_MSG + GetLastErrorStdStr();
+		throw CMV2HostException(_ErrorMsg);
+	}
+	if (connect(_SocketHandle, reinterpret_cast<struct sockaddr *>(&_Address), sizeof(_Address)) != 0)
+	{
+		string _ErrorMsg = CONNECT_EXCEPTION_MSG + string(pPath) + ": " + GetLastErrorStdStr();
+		close(_SocketHandle);
+		throw CMV2HostException(_ErrorMsg);
+	}
+	return new CSocketTransport(_SocketHandle);
+} // CreateUnix
+
+// Connect to a TCP socket
+CSocketTransport *CSocketTransport::CreateTcp(const char *pAddress)		// "<host>:<port>"
+{
+	// Port is after the last colon
+	string _Address(pAddress);
+	size_t _Colon = _Address.rfind(':');
+	if ((_Colon == string::npos) || (_Colon == 0) || (_Colon + 1 == _Address.size()))
+		throw CMV2HostException(string(BAD_ADDRESS_EXCEPTION_MSG) + pAddress);
+	string _Host = _Address.substr(0, _Colon);
+	string _Port = _Address.substr(_Colon + 1);
+
+	struct addrinfo _Hints;
+	struct addrinfo *_pAddresses;
+	memset(&_Hints, 0, sizeof(_Hints));
+	_Hints.ai_family = AF_UNSPEC;
+	_Hints.ai_socktype = SOCK_STREAM;
+	int _Error = getaddrinfo(_Host.c_str(), _Port.c_str(), &_Hints, &_pAddresses);
+	if (_Error != 0)
+		throw CMV2HostException(string(BAD_ADDRESS_EXCEPTION_MSG) + pAddress + ": " + gai_strerror(_Error));
+
+	// Try every address of the host
+	File_t _SocketHandle = -1;
+	string _ErrorMsg;
+	for (struct addrinfo *_pAddress = _pAddresses; _pAddress != NULL; _pAddress = _pAddress->ai_next)
+	{
+		_SocketHandle = socket(_pAddress->ai_family, _pAddress->ai_socktype, _pAddress->ai_protocol);
+		if (_SocketHandle < 0)
+		{
+			_ErrorMsg = CREATE_SOCKET_EXCEPTION_MSG + GetLastErrorStdStr();
+			continue;
+		}
+		if (connect(_SocketHandle, _pAddress->ai_addr, _pAddress->ai_addrlen) == 0)
+			break;
+		_ErrorMsg = CONNECT_EXCEPTION_MSG + string(pAddress) + ": " + GetLastErrorStdStr();
+		close(_SocketHandle);
+		_SocketHandle = -1;
+	}
+	freeaddrinfo(_pAddresses);
+	if (_SocketHandle < 0)
+		throw CMV2HostException(_ErrorMsg);
+
+	// Scripts and stop requests are small: send them at once
+	int _NoDelay = 1;
+	setsockopt(_SocketHandle, IPPROTO_TCP, TCP_NODELAY, &_NoDelay, sizeof(_NoDelay));
+
+	return new CSocketTransport(_SocketHandle);
+} // CreateTcp
+
+// Constructor
+CSocketTransport::CSocketTransport(File_t SocketHandle)		// Socket handle
+{
+	m_SocketHandle = SocketHandle;
+
+	// Non-blocking: waits are done with poll, up to a deadline
+	fcntl(m_SocketHandle, F_SETFL, fcntl(m_SocketHandle, F_GETFL) | O_NONBLOCK);
+#ifdef SO_NOSIGPIPE
+	int _NoSigPipe = 1;
+	setsockopt(m_SocketHandle, SOL_SOCKET, SO_NOSIGPIPE, &_NoSigPipe, sizeof(_NoSigPipe));
+#endif
+} // Constructor
+
+// Destructor
+CSocketTransport::~CSocketTransport()
+{
+	close(m_SocketHandle);
+} // Destructor
+
+// Check whether the link supports a baud rate
+bool CSocketTransport::IsBaudRateSupported(unsigned long BaudRate)		// Baud rate
+{
+	// The bridge owns the serial link
+	return BaudRate == MV2_BAUD_RATES[MV2_DEFAULT_BAUD_RATE_INDEX];
+} // IsBaudRateSupported
+
+// Discard bytes received and not read yet
+void CSocketTransport::Flush()
+{
+	unsigned char _Buffer[256];
+
+	while (recv(m_SocketHandle, _Buffer, sizeof(_Buffer), 0) > 0)
+		;
+} // Flush
+
+// Write a buffer, wait for room until the deadline
+unsigned int CSocketTransport::Write(	const void			*pBuffer,		// Buffer to write
+										unsigned int		Size,			// Size of buffer
+										const CDeadline		&rDeadline)		// Deadline
+{
+	const unsigned char *_pBuffer = static_cast<const unsigned char *>(pBuffer);
+	unsigned int _Written = 0;
+
+	while (_Written < Size)
+	{
+		NoOfBytes_t _NoOfBytesWritten = send(m_SocketHandle, _pBuffer + _Written, Size - _Written, MSG_NOSIGNAL);
+		if (_NoOfBytesWritten < 0)
+		{
+			if (errno == EPIPE)
+				throw CMV2HostException(HUNG_UP_EXCEPTION_MSG);
+			if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+			{
+				string _ErrorMsg = WRITE_SOCKET_EXCEPTION_MSG + GetLastErrorStdStr();
+				throw CMV2HostException(_ErrorMsg);
+			}
+			// Socket buffer full: wait for room
+			if (rDeadline.IsExpired())
+				break;
+			WaitForHandle(m_SocketHandle, POLLOUT, rDeadline, HUNG_UP_EXCEPTION_MSG);
+			continue;
+		}
+		_Written += _NoOfBytesWritten;
+	}
+	return _Written;
+} // Write
+
+// Read available bytes, wait for at least one until the deadline
+unsigned int CSocketTransport::Read(	void				*pBuffer,		// Buffer
+										unsigned int		Size,			// Size of buffer
+										const CDeadline		*pDeadline)		// Deadline, or NULL
+{
+	for (;;)
+	{
+		NoOfBytes_t _BytesRead = recv(m_SocketHandle, pBuffer, Size, 0);
+		if (_BytesRead > 0)
+			return _BytesRead;
+
+		// Unlike a serial port, reading nothing means the peer closed
+		if (_BytesRead == 0)
+			throw CMV2HostException(HUNG_UP_EXCEPTION_MSG);
+		if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+		{
+			string _ErrorMsg = READ_SOCKET_EXCEPTION_MSG + GetLastErrorStdStr();
+			throw CMV2HostException(_ErrorMsg);
+		}
+
+		// Nothing available yet
+		if ((pDeadline == NULL) || pDeadline->IsExpired())
+			return 0;
+		WaitForHandle(m_SocketHandle, POLLIN, *pDeadline, HUNG_UP_EXCEPTION_MSG);
+	}
+} // Read
+
+} // namespace MV2Host
+
+#endif // WIN32
@@ -0,0 +1,135 @@
+// Name:
+//	CTransport.cpp
+//
+// Purpose:
+//	See CTransport.h
+//
+// Description:
+//
+// Coding Conventions:
+//	- Variable names use the "InterCaps" convention
+//	- Local variables are prefixed with an underscore, '_'
+//	- Private class members are prefixed with 'm_'
+//	- Private class methods are prefixed with an underscore, '_'
+//	- Pointer variables are prefixed with 'p'
+//	- Reference variables are prefixed with 'r'
+//	- Enumerated types are prefixed with 'e'
+//	- Enumerated type values are prefixed with 'k'
+//	- Classes are prefixed with 'C'
+//	- Constants are all uppercase
+//	The above conventions can also be combined:
+//	- A local pointer variable would be prefixed '_p'
+//	- A private class pointer member would be prefixed 'm_p'
+//
+// Change log:
+//	17.10.26 MB	Original version, GetLastErrorStdStr moved from CArduinoSerialPort.cpp
+//	17.10.26 MB	Open serial ports with an eOpenMode
+//
+// Copyright (c) 2016 Metrolab Technology SA, Geneva,
+//	Switzerland
+
+// Include files
+#include <CTransport.h>
+#include <CSerialTransport.h>
+#include <CSocketTransport.h>
+#include <CLoopbackTransport.h>
+#include <CMV2HostException.h>
+#include <string.h>
+
+// Exceptions messages
+#define UNSUPPORTED_TRANSPORT_EXCEPTION_MSG		"CTransport: Only serial ports are supported on Windows."
+#define WAIT_EXCEPTION_MSG						"CTransport: Unable to wait for the port."
+
+// Our namespace
+namespace MV2Host
+{
+
+// Create a string with last error message
+string GetLastErrorStdStr()
+{
+	#ifdef WIN32
+		DWORD _Error = GetLastError();
+		if (_Error)
+		{
+			LPVOID lpMsgBuf;
+			DWORD bufLen = FormatMessage(
+				FORMAT_MESSAGE_ALLOCATE_BUFFER |
+				FORMAT_MESSAGE_FROM_SYSTEM |
+				FORMAT_MESSAGE_IGNORE_INSERTS,
+				NULL,
+				_Error,
+				MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),
+				(LPTSTR) &lpMsgBuf,
+				0, NULL );
+			if (bufLen)
+			{
+			  LPCSTR lpMsgStr = (LPCSTR)lpMsgBuf;
+			  string result(lpMsgStr, lpMsgStr+bufLen);
+
+			  LocalFree(lpMsgBuf);
+
+			  return result;
+			}
+		}
+		return string();
+	#else
+		return string (strerror(errno));
+	#endif
+}
+
+// Open the transport of a port name
+CTransport *CTransport::Create(	const char	*pPortName,			// Port name
+								eOpenMode	OpenMode)			// How to open a serial port
+{
+	// A pseudo-terminal is configured as a serial port, but nothing reboots
+	if (strncmp(pPortName, PTY_PORT_PREFIX, strlen(PTY_PORT_PREFIX)) == 0)
+		return new CSerialTransport(pPortName + strlen(PTY_PORT_PREFIX), false, OpenMode);
+
+#ifdef WIN32
+	if ((strncmp(pPortName, UNIX_PORT_PREFIX, strlen(UNIX_PORT_PREFIX)) == 0) ||
+		(strncmp(pPortName, TCP_PORT_PREFIX, strlen(TCP_PORT_PREFIX)) == 0) ||
+		(strcmp(pPortName, LOOPBACK_PORT_NAME) == 0))
+		throw CMV2HostException(UNSUPPORTED_TRANSPORT_EXCEPTION_MSG);
+#else
+	if (strncmp(pPortName, UNIX_PORT_PREFIX, strlen(UNIX_PORT_PREFIX)) == 0)
+		return CSocketTransport::CreateUnix(pPortName + strlen(UNIX_PORT_PREFIX));
+
+	if (strncmp(pPortName, TCP_PORT_PREFIX, strlen(TCP_PORT_PREFIX)) == 0)
+		return CSocketTransport::CreateTcp(pPortName + strlen(TCP_PORT_PREFIX));
+
+	if (strcmp(pPortName, LOOPBACK_PORT_NAME) == 0)
+		return CLoopbackTransport::Create();
+#endif
+
+	return new CSerialTransport(pPortName, true, OpenMode);
+} // Create
+
+#ifndef WIN32
+// Wait until a file descriptor is ready or the deadline expires
+void CTransport::WaitForHandle(	File_t				Handle,				// File descriptor
+								short				Events,				// poll events
+								const CDeadline		&rDeadline,			// Deadline
+								const char			*pHungUpMessage)	// Exception message if hung up
+{
+	struct pollfd _PollFd;
+	_PollFd.fd = Handle;
+	_PollFd.events = Events;
+	_PollFd.revents = 0;
+
+	int _Ret;
+	do
+		_Ret = poll(&_PollFd, 1, rDeadline.GetRemainingMs());
+	while ((_Ret < 0) && (errno == EINTR));
+	if (_Ret < 0)
+	{
+		string _ErrorMsg = WAIT_EXCEPTION_MSG + GetLastErrorStdStr();
+		throw CMV2HostException(_ErrorMsg);
+	}
+
+	// Device unplugged, or peer closed
+	if ((_PollFd.revents & (POLLERR | POLLHUP | POLLNVAL)) && !(_PollFd.revents & Events))
+		throw CMV2HostException(pHungUpMessage);
+} // WaitForHandle
+#endif
+
+} // namespace MV2Host
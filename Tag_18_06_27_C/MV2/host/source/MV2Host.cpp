@@ -49,15 +49,32 @@
 //	11.07.17 PK	Catch SIGINT in order to cleanly shut down serial port
 //				Add code to catch ^C in Windows envirnment
 //	25.05.20 PK	Add __CYGWIN__ for MSYS2
+//	17.10.26 MB	Stream the measurement script if requested by the script file
+//				Otherwise, submit the next measurement script before reading the results
+//	17.10.26 MB	Negotiate baud rate
+//	17.10.26 MB	Report scripts sent again after transmission errors
+//	17.10.26 MB	Acquire from several devices if several COM ports are given
+//	17.10.26 MB	Describe the port names of the other transports in the usage
+//	17.10.26 MB	Add option --no-reset to leave the Arduino running between invocations
+//	17.10.26 MB	Report the sample period achieved and the sample timer ticks missed
+//	17.10.26 MB	Report the time of each trigger of a trigger measurement script
+//	17.10.26 MB	Add option --diagnostics to report the performance counters of the Arduino
+//	17.10.26 MB	Report the number and the interval of the samples of a burst measurement script
+//	17.10.26 MB	Report the number of stream responses dropped after transmission errors
 //
 // Copyright (c) 2016 Metrolab Technology SA, Geneva,
 //	Switzerland
 
 #include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <string.h>
 
 #include <CMxrFile.h>
 #include <CArduinoSerialPort.h>
 #include <CHostScript.h>
+#include <CDevicePool.h>
 #include <MV2HostSoftwareVersion.h>
 #include <CMV2HostException.h>
 
@@ -76,13 +93,21 @@
 
 using namespace MV2Host;
 
+// Option leaving the Arduino running instead of rebooting it
+#define NO_RESET_OPTION		"--no-reset"
+// Option reporting where the time of the Arduino goes during the measurements
+#define DIAGNOSTICS_OPTION	"--diagnostics"
+
 // Display usage informations
 void usage(const char *pName)
 {
 	// Display version
 	cout << "Version " << MV2HOST_SOFTWARE_VERSION_MAJOR << "." << MV2HOST_SOFTWARE_VERSION_MINOR << endl;
 	// Display usage
-	cout << "Usage: " << pName << " <MV2ScriptXml-file> <MV2ScriptSchemaXsd-file> <COM port> [MXR-file]" << endl;
+	cout << "Usage: " << pName << " [" << NO_RESET_OPTION << "] [" << DIAGNOSTICS_OPTION << "] <MV2ScriptXml-file> <MV2ScriptSchemaXsd-file> <COM port>[,<COM port>...] [MXR-file]" << endl;
+	cout << "COM port: serial port, pty:<path>, unix:<path>, tcp:<host>:<port> or " << LOOPBACK_PORT_NAME << endl;
+	cout << NO_RESET_OPTION << ": do not reboot the Arduino if it answers, it keeps the state of the previous run" << endl;
+	cout << DIAGNOSTICS_OPTION << ": report the performance counters of the Arduino for the measurements (one COM port only, firmware built with DIAGNOSTICS=1)" << endl;
 }
 
 // Catch SIGINT signal (^C).
@@ -109,9 +134,66 @@ void usage(const char *pName)
 	}
 #endif
 
+// Acquire from several devices: the results of all devices are merged, prefixed
+// with the index of the device and the time they were received
+static void RunDevicePool(	const vector<string>	&rPortNames,		// Port names
+							const char				*pScriptFileName,	// Script filename
+							const char				*pSchemaFileName,	// Schema filename
+							eOpenMode				OpenMode,			// How to open the serial ports
+							CMxrFile				*pMxrFile)			// MXR file, or NULL
+{
+#ifdef WIN32
+	throw CMV2HostException("Several COM ports are not supported on Windows");
+#else
+	CDevicePool _Pool(rPortNames, pScriptFileName, pSchemaFileName, OpenMode);
+	_Pool.Initialize(MAX_BAUD_RATE);
+	_Pool.Start();
+
+	bool _Running = true;
+	while (_Running)
+	{
+		// Check whether we received ^C.
+		if (_InterruptReceived)
+		{
+			cout << "Interrupt received!\n";
+			break;
+		}
+
+		_Running = _Pool.Run();
+
+		// Display results and write them to the MXR file
+		tPoolSample _Sample;
+		while (_Pool.GetSample(_Sample))
+		{
+			cout << _Sample.CsvResults.c_str();
+			if (pMxrFile != NULL)
+				pMxrFile->WriteResults(_Sample.CsvResults.c_str(), _Sample.CsvHeadings.c_str());
+		}
+	}
+
+	_Pool.Stop();
+#endif
+}
+
 // Main program
 int main(int argc, char **argv)
 {
+	// Options --no-reset and --diagnostics: skip them, the arguments follow
+	eOpenMode _OpenMode = kOpenReset;
+	bool _Diagnostics = false;
+	while (argc > 1)
+	{
+		if (strcmp(argv[1], NO_RESET_OPTION) == 0)
+			_OpenMode = kOpenNoReset;
+		else if (strcmp(argv[1], DIAGNOSTICS_OPTION) == 0)
+			_Diagnostics = true;
+		else
+			break;
+		argv[1] = argv[0];
+		argv++;
+		argc--;
+	}
+
 	// Check command line
 	// Argument 5 is optional (MXR file)
 	if ((argc < 4) || (argc > 5))
@@ -138,16 +220,46 @@ int main(int argc, char **argv)
 		if (argc == 5)
 			_pMxrFile = new CMxrFile(argv[4]);
 
+		// Several COM ports: acquire from all devices at once
+		vector<string> _PortNames;
+		istringstream _PortList(argv[3]);
+		string _PortName;
+		while (getline(_PortList, _PortName, ','))
+			if (!_PortName.empty())
+				_PortNames.push_back(_PortName);
+		if (_PortNames.size() > 1)
+		{
+			RunDevicePool(_PortNames, argv[1], argv[2], _OpenMode, _pMxrFile);
+			if (_pMxrFile != NULL)
+				delete _pMxrFile;
+			return 0;
+		}
+
 		// Create CArduinoSerialPort object
-		CArduinoSerialPort *_pArduino = new CArduinoSerialPort(argv[3]);
+		CArduinoSerialPort *_pArduino = new CArduinoSerialPort(argv[3], _OpenMode);
+
+		// Use the fastest baud rate supported by both ends
+		_pArduino->NegotiateBaudRate(MAX_BAUD_RATE);
 
 		// Create CHostScript object
 		CHostScript *_pHostScript = new CHostScript(_pArduino, argv[1], argv[2]);
 
 		// Execute initialization script
 		_pHostScript->ExecuteInitializationScript();
+		if (_pHostScript->GetSamplePeriod() > 0)
+			cerr << "Sample period: " << _pHostScript->GetSamplePeriod() << " us" << endl;
+
+		// Count from the first measurement on
+		if (_Diagnostics)
+			_pHostScript->ResetDiagnostics();
+
+		// Start the stream: the Arduino executes the measurement script until we stop it
+		bool _Stream = _pHostScript->GetStreamMeasurementScript();
+		if (_Stream)
+			_pHostScript->StartMeasurementStream();
 
 		// Execute measurement script
+		int _SubmitCounter = 0;
 		for (int _RepeatCounter = 0;
 				(_pHostScript->GetRepeatMeasurementScript() == 0) || (_RepeatCounter < _pHostScript->GetRepeatMeasurementScript());
 				_RepeatCounter++)
@@ -159,8 +271,36 @@ int main(int argc, char **argv)
 				break;
 			}
 			
+			// Get next measurement of the stream
+			if (_Stream)
+			{
+				if (!_pHostScript->ReadMeasurementStream())
+					break;
+
+				// No trigger yet: not a measurement
+				if (_pHostScript->IsTriggerArmed())
+				{
+					_RepeatCounter--;
+					continue;
+				}
+				if (_pHostScript->GetTriggerMeasurementScript())
+					cerr << "Trigger at " << _pHostScript->GetTriggerTime() << " us" << endl;
+			}
 			// Execute measurement script
-			_pHostScript->ExecuteMeasurementScript();
+			else
+			{
+				// Keep the next measurement script on the Arduino while it executes the current one
+				while ((_pHostScript->GetNbPendingMeasurementScripts() < SCRIPT_BUFFER_COUNT) &&
+						((_pHostScript->GetRepeatMeasurementScript() == 0) || (_SubmitCounter < _pHostScript->GetRepeatMeasurementScript())))
+				{
+					_pHostScript->SubmitMeasurementScript();
+					_SubmitCounter++;
+				}
+				_pHostScript->CompleteMeasurementScript();
+				if (_pHostScript->GetBurstMeasurementScript() && (_pHostScript->GetBurstSampleLength() > 0))
+					cerr << "Burst: " << _pHostScript->GetBurst().size() / _pHostScript->GetBurstSampleLength() << " samples every " <<
+						_pHostScript->GetBurstSampleInterval() << " us" << endl;
+			}
 			
 			// Display results
 			cout << _pHostScript->GetCsvResults().c_str();
@@ -170,6 +310,32 @@ int main(int argc, char **argv)
 				_pMxrFile->WriteResults(_pHostScript->GetCsvResults().c_str(), _pHostScript->GetCsvHeadings().c_str());
 		}
 
+		// Stop the stream
+		if (_Stream)
+			_pHostScript->StopMeasurementStream();
+
+		// Discard results of measurement scripts still pending
+		while (_pHostScript->GetNbPendingMeasurementScripts() > 0)
+			_pHostScript->CompleteMeasurementScript();
+
+		// Samples taken late, the sample grid has gaps
+		if (_pHostScript->GetSamplePeriod() > 0)
+		{
+			unsigned int _Overruns = _pHostScript->ReadSampleOverruns();
+			if (_Overruns > 0)
+				cerr << "Warning: " << _Overruns << " sample timer tick(s) missed." << endl;
+		}
+
+		// Where the time of the Arduino went
+		if (_Diagnostics)
+			cerr << CHostScript::ConvertDiagnosticsToText(_pHostScript->ReadDiagnostics());
+
+		// Transmission errors were recovered, but the link may need attention
+		if (_pArduino->GetNbRetransmissions() > 0)
+			cerr << "Warning: " << _pArduino->GetNbRetransmissions() << " script(s) sent again after transmission errors." << endl;
+		if (_pArduino->GetNbDroppedFrames() > 0)
+			cerr << "Warning: " << _pArduino->GetNbDroppedFrames() << " corrupted or truncated response(s) of the stream dropped." << endl;
+
 		// Clean up memory
 		delete _pHostScript;
 		delete _pArduino;
@@ -29,6 +29,26 @@
 //				At startup, MV2 mode is now set to digital.
 //	07.07.16 SD Fix previous comment : Switch from analog to digital mode works, INV analog bit must be set to default
 //  03.04.17 PK List free memory
+//	17.10.26 MB Add streaming acquisition mode (script starting with MV2_CMD_START_STREAM)
+//	17.10.26 MB Receive the next script while executing the current one (see MV2HostInput.h)
+//	17.10.26 MB Handle baud rate negotiation
+//	17.10.26 MB Check CRC-16/CCITT of scripts
+//	17.10.26 MB Answer a script sent again with the same sequence number with the kept response
+//	17.10.26 MB Flag responses of averaged loops
+//	17.10.26 MB Add capture mode (script starting with MV2_CMD_START_CAPTURE)
+//	17.10.26 MB Keep the SPI transaction open while a script, stream or capture runs
+//	17.10.26 MB Decode the script once after the CRC check, before executing anything
+//	17.10.26 MB Store decoded scripts in slots (MV2_CMD_STORE_SCRIPT), execute them with MV2_CMD_RUN_SCRIPT
+//	17.10.26 MB Send the results of scripts and streams while executing them (ExecuteAndSendScript)
+//	17.10.26 MB Encode the results of scripts with kSetResultEncoding
+//	17.10.26 MB Send the results that don't fit in the response buffer in chunks, not kept
+//	17.10.26 MB Add trigger mode (script starting with MV2_CMD_START_TRIGGER)
+//	17.10.26 MB Time the handling of the scripts for the diagnostics (see MV2Diagnostics.h)
+//	17.10.26 MB Add burst mode (script starting with MV2_CMD_START_BURST)
+//	17.10.26 MB Send the response of a script in chunks also if its averaged loops have no room for their sums
+//	17.10.26 MB A script stored with an error leaves its slot unchanged
+//	17.10.26 MB Trigger: take the samples with an averaged loop where the sums have room, flag their responses
+//	17.10.26 MB A stored script is run in the mode its first commands were decoded for, or in any mode if it sets the mode first
 //
 // Copyright (c) 2016 Metrolab Technology SA, Geneva,
 //	Switzerland
@@ -36,18 +56,35 @@
 #include <SPI.h> //Librairie SPI
 #include "MV2HostCommands.h"
 #include "MV2HostOutput.h"
+#include "MV2HostInput.h"
 #include "MV2ScriptUtility.h"
 #include "MV2Utility.h"
+#include "MV2Crc.h"
 #include "MV2Hal.h"
 #include "MV2HostConstants.h"
+#include "MV2Diagnostics.h"
 
 #define DEBUG 0
 
+// Response buffer
+static uint16_t _pResponse[MAX_RESPONSE_LENGTH];
+// The response buffer holds the response of the last script executed, with this sequence number
+static bool _ResponseKept = false;
+static uint16_t _ResponseSequence;
+// Script decoded once, then executed without checking its commands again
+static tScriptOp _pScriptOps[MAX_SCRIPT_OPS];
+// Scripts decoded once, then executed each time the host sends MV2_CMD_RUN_SCRIPT
+static tScriptSlot _pScriptSlots[SCRIPT_SLOT_COUNT];
+
 /*
 	Forward declaration
 */
 
-eError ReadDataFromHost(uint8_t *pBuffer, uint16_t Size, long TimeOut);
+eError ExecuteAndSendScript(const tScriptOp *pOps, uint16_t NbOps, uint16_t Sequence, uint16_t *pResponse);
+void StreamScript(const tScriptOp *pOps, uint16_t NbOps, uint16_t Sequence, uint16_t *pResponse);
+void CaptureScript(const tScriptOp *pOps, uint16_t NbOps, uint8_t NbSets, uint16_t Sequence, uint16_t *pResponse);
+void TriggerScript(const tScriptOp *pOps, uint16_t NbOps, uint8_t Trigger, uint16_t Sequence, uint16_t *pResponse);
+void BurstScript(const tScriptOp *pOps, uint16_t NbOps, uint16_t Sequence, uint16_t *pResponse);
 
 /*
 	Initialization
@@ -58,7 +95,7 @@ void setup()
 	MiscSetDigitalAnalogMode(kDigitalMode);
 
 	// Initialize serial communication
-	Serial.begin(57600, SERIAL_8N1);
+	Serial.begin(GetBaudRate(MV2_DEFAULT_BAUD_RATE_INDEX), SERIAL_8N1);
 }
 
 /*
@@ -66,98 +103,559 @@ void setup()
 */
 void loop()
 {
-	// Error
-	eError _Error = kNoError;
-	// Script buffer, cast transmission buffer to uint16_t. Assume Endianness is little endian both on Arduino and Host.
-	uint16_t _pScriptBuffer[SCRIPT_BUFFER_LENGTH];
-	// Pointer to the commands buffer
-	uint16_t *_pCommandsBuffer = &_pScriptBuffer[SCRIPT_BUFFER_HEADER_LENGTH];
-	// Response buffer
-	uint16_t _pResponse[MAX_RESPONSE_LENGTH];
-	// pointer to the results buffer
-	uint16_t *_pResultsBuffer = &_pResponse[RESPONSE_HEADER_LENGTH];
-
     // Debug: list free memory.
 #if DEBUG
     Serial.print ("freeRam()=");
     Serial.println (freeRam());
 #endif
 
-	// Wait for a new message. First, get header with the transfer length
-	_Error = ReadDataFromHost(	reinterpret_cast<uint8_t*>(&_pScriptBuffer[0]),
-								SCRIPT_BUFFER_HEADER_LENGTH * sizeof(uint16_t),
-								HOST_TO_MV2_TRANSFER_LONG_TIMEOUT);
+	// Wait for a new message
+	HostInputPoll();
+	tHostScript *_pScript = HostInputGetScript();
+	if (_pScript == NULL)
+		return;
+	DiagnosticsBeginBusy();
+
+	// Pointer to the commands buffer
+	uint16_t *_pCommandsBuffer = &_pScript->Buffer[SCRIPT_BUFFER_HEADER_LENGTH];
+
+	// Sequence number, only meaningful if the script was received without error
+	uint16_t _Sequence = _pScript->Buffer[SCRIPT_SEQUENCE_INDEX];
+
+	// Check CRC
+	bool _CrcOk = (_pScript->Error == kNoError) && Crc16CheckFrame(&_pScript->Buffer[0], _pScript->Buffer[0] / sizeof(uint16_t));
+
+	// A valid script confirms a new baud rate
+	HostInputConfirmBaudRate(_CrcOk);
 
-	// No error 
-	if (_Error == kNoError)
+	// Handle reception error
+	if (_pScript->Error != kNoError)
 	{
-		// Check size
-		if (_pScriptBuffer[0] > (SCRIPT_BUFFER_LENGTH * sizeof(uint16_t)))
+		SendResponse(_pResponse, _Sequence, 0, 0, _pScript->Error, _pScript->ErrorDesc);
+		_ResponseKept = false;
+	}
+	// Handle bad CRC
+	else if (!_CrcOk)
+	{
+		SendResponse(_pResponse, _Sequence, 0, 0, kBadCrcError, 0);
+		_ResponseKept = false;
+	}
+	// Host did not receive the response of the last script: send it again
+	else if (_ResponseKept && (_Sequence == _ResponseSequence))
+		ResendResponse(_pResponse);
+	// If CRC is ok, execute script
+	else
+	{
+		uint16_t _IndexCommandError = 0;
+		uint16_t _CommandsNb = _pScript->Buffer[0] / sizeof(uint16_t) - SCRIPT_BUFFER_ADDITIONAL_INFOS_LENGTH;
+
+		// A stream, a capture, a trigger, a burst or a script to store is started by the first command, with the rest of the script
+		MV2_CMD _Start = (_CommandsNb > 0) ? (_pCommandsBuffer[0] >> 8) : 0;
+		bool _Continuous = (_Start == MV2_CMD_START_STREAM) || (_Start == MV2_CMD_START_CAPTURE) || (_Start == MV2_CMD_START_TRIGGER);
+		uint16_t _NbOps = (_Continuous || (_Start == MV2_CMD_START_BURST) || (_Start == MV2_CMD_STORE_SCRIPT)) ? _CommandsNb - 1 : _CommandsNb;
+		uint8_t _Slot = _pCommandsBuffer[0] & 0xFF;
+		const tScriptOp *_pOps = _pScriptOps;
+		eError _Error;
+
+		// Execute a stored script. Its first commands were decoded for the mode it was stored in, the
+		// script may set another mode for the next ones.
+		if (_Start == MV2_CMD_RUN_SCRIPT)
 		{
-			// Clear serial buffer
-			while (Serial.available() > 0)
-				Serial.read();
-			// Send response with error code
-			SendResponse(_pResponse, 0, kScriptLengthTooLargeError, _pScriptBuffer[0]);
+			_Error = kNoError;
+			if ((_CommandsNb != 1) || (_Slot >= SCRIPT_SLOT_COUNT) || !_pScriptSlots[_Slot].Stored)
+				_Error = kScriptSlotError;
+			else if ((_pScriptSlots[_Slot].Mode != SCRIPT_ANY_MODE) && (_pScriptSlots[_Slot].Mode != GetMV2Mode()))
+				_Error = kModeError;
+			else
+			{
+				_pOps = _pScriptSlots[_Slot].Ops;
+				_NbOps = _pScriptSlots[_Slot].NbOps;
+			}
 		}
-		else
-		// Read script
-		{
-			// Read data from host
-			_Error = ReadDataFromHost(	reinterpret_cast<uint8_t*>(_pCommandsBuffer),
-										_pScriptBuffer[0] - SCRIPT_BUFFER_HEADER_LENGTH * sizeof(uint16_t),
-										HOST_TO_MV2_TRANSFER_SHORT_TIMEOUT);
-			// Handle transmission error
-			if (_Error != kNoError)
-				SendResponse(_pResponse, 0, _Error, 0);
-			// Check CRC
-			else if (!CheckCrc(&_pScriptBuffer[0], _pScriptBuffer[0] / sizeof(uint16_t)))
-				SendResponse(_pResponse, 0, kBadCrcError, 0);
-			// If CRC is ok, execute script
+		// Decode the rest of the script, execute nothing. Only a script decoded without error replaces
+		// the script of its slot.
+		else if (_Start == MV2_CMD_STORE_SCRIPT)
+		{
+			if (_Slot >= SCRIPT_SLOT_COUNT)
+				_Error = kScriptSlotError;
 			else
 			{
-				uint16_t _NumberOfResults = 0;
-				uint16_t _IndexCommandError = 0;
-				uint16_t _CommandsNb = _pScriptBuffer[0] / sizeof(uint16_t) - SCRIPT_BUFFER_ADDITIONAL_INFOS_LENGTH;
-
-				// Execute script
-				eError _Error = ExecuteScript(	_pCommandsBuffer,
-												_CommandsNb,
-												_pResultsBuffer,
-												MAX_RESULTS_LENGTH,
-												&_NumberOfResults,
-												&_IndexCommandError);
-				// Send response to the host
-				SendResponse(_pResponse, _NumberOfResults, _Error, _IndexCommandError);
-			} // If CRC is ok
-		} // Read script
-		
-	} // No error 
-	else
-		SendResponse(_pResponse, 0, _Error, 0);
+				_Error = DecodeScript(&_pCommandsBuffer[1], _NbOps, _pScriptOps, &_IndexCommandError);
+				if (_Error == kNoError)
+				{
+					memcpy(_pScriptSlots[_Slot].Ops, _pScriptOps, _NbOps * sizeof(tScriptOp));
+					_pScriptSlots[_Slot].NbOps = _NbOps;
+					_pScriptSlots[_Slot].Mode = GetScriptMode(_pScriptOps, _NbOps);
+					_pScriptSlots[_Slot].Stored = true;
+				}
+			}
+			_NbOps = 0;
+		}
+		// Check all commands and resolve the loops once, before any hardware is touched
+		else
+			_Error = DecodeScript(&_pCommandsBuffer[_CommandsNb - _NbOps], _NbOps, _pScriptOps, &_IndexCommandError);
+
+		// A stream, a capture or a trigger with an error is not started
+		if (_Continuous && (_Error != kNoError))
+		{
+			SendResponse(_pResponse, _Sequence, 0, 0, _Error, _IndexCommandError);
+			_ResponseKept = false;
+		}
+		// Stream the rest of the script
+		else if (_Start == MV2_CMD_START_STREAM)
+		{
+			StreamScript(_pScriptOps, _NbOps, _Sequence, _pResponse);
+			_ResponseKept = false;
+		}
+		// Capture with the rest of the script
+		else if (_Start == MV2_CMD_START_CAPTURE)
+		{
+			CaptureScript(_pScriptOps, _NbOps, _pCommandsBuffer[0] & 0xFF, _Sequence, _pResponse);
+			_ResponseKept = false;
+		}
+		// Wait for triggers with the rest of the script
+		else if (_Start == MV2_CMD_START_TRIGGER)
+		{
+			TriggerScript(_pScriptOps, _NbOps, _pCommandsBuffer[0] & 0xFF, _Sequence, _pResponse);
+			_ResponseKept = false;
+		}
+		// Take a burst with the rest of the script, send its response to the host and keep it
+		else if ((_Start == MV2_CMD_START_BURST) && (_Error == kNoError))
+		{
+			_ResponseKept = true;
+			_ResponseSequence = _Sequence;
+			BurstScript(_pScriptOps, _NbOps, _Sequence, _pResponse);
+		}
+		else
+		{
+			// Execute script, send response to the host and keep it, unless it is chunked
+			_ResponseKept = true;
+			_ResponseSequence = _Sequence;
+			if (_Error == kNoError)
+			{
+				DigitalBeginSpiSession();
+				ExecuteAndSendScript(_pOps, _NbOps, _Sequence, _pResponse);
+				DigitalEndSpiSession();
+			}
+			else
+				SendResponse(_pResponse, _Sequence, 0, 0, _Error, _IndexCommandError);
+		}
+	} // If CRC is ok
+
+	// Switch baud rate if requested by the script
+	HostInputApplyBaudRate();
+
+	// Script buffer can receive the next script
+	HostInputReleaseScript();
+	DiagnosticsEndBusy();
 }
 
 /*
-	Read data from host
+	Execute a decoded script and send its response. If all the results fit in the response,
+	the header is sent first and the results while the script is executed. Otherwise they are
+	sent in chunks (see RESPONSE_FLAG_CHUNK), and the response is not kept.
 	Parameters:
-		[in/out]	pBuffer	: Pointer to the first element of the buffer
-		[in]		Size	: Buffer's size
-		[in]		TimeOut	: Time out
+		[in]		pOps			: pointer to the first decoded command to execute
+		[in]		NbOps			: number of commands
+		[in]		Sequence		: sequence number of the script
+		[in/out]	pResponse		: pointer to the response buffer
 	Returns:
 		eError
 */
-eError ReadDataFromHost(uint8_t *pBuffer, uint16_t Size, long TimeOut)
+eError ExecuteAndSendScript(const tScriptOp *pOps, uint16_t NbOps, uint16_t Sequence, uint16_t *pResponse)
 {
-	uint16_t _NbBytesRead = 0;
-	// Set timeout
-	Serial.setTimeout(TimeOut);
-	// Read bytes
-	_NbBytesRead = Serial.readBytes(pBuffer, Size);
-	// Test _NbBytesRead
-	if (_NbBytesRead < 0)
-		return kNoValidDataFromHostError;
-	else if (_NbBytesRead < Size)
-		return kTransmissionError;
+	uint16_t _NumberOfResults = 0;
+	uint16_t _Flags = 0;
+	uint16_t _IndexCommandError = 0;
+
+	// The length of delta coded results is only known once they are all returned.
+	uint8_t _Encoding = GetScriptEncoding(pOps, NbOps);
+	// A script whose averaged loops have no room for their sums is also chunked (see ExecuteScript)
+	uint16_t _Room;
+	uint16_t _NbExpectedResults = CountScriptResults(pOps, NbOps, &_Flags, &_Room);
+	bool _Chunked = (_Room > MAX_RESULTS_LENGTH);
+	bool _Started = !_Chunked && !(_Encoding & RESULT_ENCODING_DELTA);
+	if (_Started)
+		StartResponse(pResponse, Sequence, _Flags, _NbExpectedResults, _Encoding);
+	else if (_Chunked)
+	{
+		StartChunkedResponse(pResponse, Sequence, _Flags, _Encoding);
+		_ResponseKept = false;
+	}
+
+	// Execute script
+	eError _Error = ExecuteScript(	pOps,
+									NbOps,
+									&pResponse[RESPONSE_HEADER_LENGTH],
+									MAX_RESULTS_LENGTH,
+									&_NumberOfResults,
+									&_Flags,
+									&_IndexCommandError);
+
+	// Send the rest of the response to the host
+	if (_Started)
+		EndResponse(_NumberOfResults, _Error, _IndexCommandError);
+	else if (_Chunked)
+		EndChunkedResponse(_NumberOfResults, _Error, _IndexCommandError);
 	else
-		return kNoError;
+	{
+		StartResponse(pResponse, Sequence, _Flags, _NumberOfResults, _Encoding);
+		EndResponse(_NumberOfResults, _Error, _IndexCommandError);
+	}
+	return _Error;
+}
+
+/*
+	Execute a script over and over and send one response per execution,
+	until the host sends any data or an error occurs
+	Parameters:
+		[in]		pOps			: pointer to the first decoded command to execute
+		[in]		NbOps			: number of commands
+		[in]		Sequence		: sequence number of the script
+		[in/out]	pResponse		: pointer to the response buffer
+	Returns:
+		void
+*/
+void StreamScript(const tScriptOp *pOps, uint16_t NbOps, uint16_t Sequence, uint16_t *pResponse)
+{
+	eError _Error;
+
+	DigitalBeginSpiSession();
+	do
+	{
+		// Execute script and send response to the host
+		_Error = ExecuteAndSendScript(pOps, NbOps, Sequence, pResponse);
+	} while ((_Error == kNoError) && !HostInputAvailable());
+	DigitalEndSpiSession();
+
+	// An error response already ends the stream
+	if (_Error != kNoError)
+		return;
+
+	// Discard the stop request and acknowledge it
+	HostInputFlush();
+	SendResponse(pResponse, Sequence, 0, 0, kNoError, STREAM_END_ERROR_DESC);
+}
+
+/*
+	Capture: on each Data Ready, an interrupt writes the commands on SPI and keeps the values read
+	in a ring buffer. Send one response each NbSets Data Ready, until the host sends any data or
+	an error occurs.
+	Parameters:
+		[in]		pOps			: pointer to the first decoded command, only kWriteRegister0..2
+		[in]		NbOps			: number of commands
+		[in]		NbSets			: number of Data Ready per response, 0 is 1
+		[in]		Sequence		: sequence number of the script
+		[in/out]	pResponse		: pointer to the response buffer
+	Returns:
+		void
+*/
+void CaptureScript(const tScriptOp *pOps, uint16_t NbOps, uint8_t NbSets, uint16_t Sequence, uint16_t *pResponse)
+{
+	uint16_t _Data[CAPTURE_MAX_WORDS];
+	uint16_t *_pResults = &pResponse[RESPONSE_HEADER_LENGTH];
+	uint16_t _NumberOfResults = 0;
+	eError _Error = kNoError;
+	uint16_t _ErrorDesc = 0;
+
+	if (NbSets == 0)
+		NbSets = 1;
+
+	// Only register writes are done in the interrupt
+	if ((NbOps == 0) || (NbOps > CAPTURE_MAX_WORDS))
+		_Error = kSyntaxError;
+	for (uint16_t _i = 0; (_i < NbOps) && (_Error == kNoError); _i++)
+	{
+		if ((pOps[_i].Command != kWriteRegister0) && (pOps[_i].Command != kWriteRegister1) && (pOps[_i].Command != kWriteRegister2))
+		{
+			_Error = kSyntaxError;
+			_ErrorDesc = _i;
+		}
+		else
+			_Data[_i] = ((uint16_t)GetCommandCode((eCommand)pOps[_i].Command) << 8) | pOps[_i].Value;
+	}
+	if ((_Error == kNoError) && ((uint32_t)NbOps * NbSets > MAX_RESULTS_LENGTH))
+		_Error = kOutOfMemoryError;
+	if (_Error != kNoError)
+	{
+		SendResponse(pResponse, Sequence, 0, 0, _Error, _ErrorDesc);
+		return;
+	}
+
+	// The main loop only moves values to the response and sends it
+	DigitalBeginSpiSession();
+	DigitalStartCapture(_Data, NbOps);
+	unsigned long _LastDataReady = millis();
+	while (!HostInputAvailable())
+	{
+		if (DigitalCaptureOverruns() != 0)
+		{
+			_Error = kCaptureOverrunError;
+			break;
+		}
+		if (DigitalCaptureAvailable() >= NbOps)
+		{
+			for (uint16_t _i = 0; _i < NbOps; _i++)
+				_pResults[_NumberOfResults++] = DigitalReadCapture();
+			_LastDataReady = millis();
+			if (_NumberOfResults == NbOps * NbSets)
+			{
+				SendResponse(pResponse, Sequence, 0, _NumberOfResults, kNoError, 0);
+				_NumberOfResults = 0;
+			}
+		}
+		else if (millis() - _LastDataReady > A_D_CONVERSION_TIMEOUT)
+		{
+			_Error = kAdcTimeOutError;
+			break;
+		}
+	}
+	DigitalStopCapture();
+	DigitalEndSpiSession();
+
+	// An error response ends the capture, with the number of Data Ready lost
+	if (_Error != kNoError)
+	{
+		SendResponse(pResponse, Sequence, 0, 0, _Error, DigitalCaptureOverruns());
+		return;
+	}
+
+	// Discard the stop request and acknowledge it
+	HostInputFlush();
+	SendResponse(pResponse, Sequence, 0, 0, kNoError, STREAM_END_ERROR_DESC);
+}
+
+/*
+	Check whether the result of a sample fires the trigger
+	Parameters:
+		[in]		Trigger			: kind of trigger (TRIGGER_RISING...), other bits ignored
+		[in]		Previous		: result of the previous sample
+		[in]		Value			: result of the sample
+		[in]		Level			: level crossed, or rise or fall of a slope
+	Returns:
+		true if the trigger fires
+*/
+static bool IsTriggered(uint8_t Trigger, uint16_t Previous, uint16_t Value, uint16_t Level)
+{
+	switch (Trigger & TRIGGER_KIND_MASK)
+	{
+		case TRIGGER_RISING:
+			return (Previous < Level) && (Value >= Level);
+		case TRIGGER_FALLING:
+			return (Previous > Level) && (Value <= Level);
+		case TRIGGER_SLOPE_RISING:
+			return (int32_t)Value - Previous >= (int32_t)Level;
+		case TRIGGER_SLOPE_FALLING:
+			return (int32_t)Previous - Value >= (int32_t)Level;
+		default:
+			return false;
+	}
+}
+
+/*
+	Reverse the words [First, End) of a buffer
+	Parameters:
+		[in/out]	pBuffer			: pointer to the buffer
+		[in]		First			: index of the first word
+		[in]		End				: index after the last word
+	Returns:
+		void
+*/
+static void ReverseWords(uint16_t *pBuffer, uint16_t First, uint16_t End)
+{
+	while (First + 1 < End)
+	{
+		uint16_t _Word = pBuffer[First];
+		pBuffer[First++] = pBuffer[--End];
+		pBuffer[End] = _Word;
+	}
+}
+
+/*
+	Trigger: execute the script over and over, one sample per execution, into a ring buffer in the
+	response buffer. When the trigger fires, send the samples before and from the trigger on with the
+	time of the trigger, then arm again. Until the host sends any data or an error occurs.
+	A sample with an averaged loop is taken after the ring buffer, where the sums have room (see
+	ExecuteScript), then copied into its slot.
+	Parameters:
+		[in]		pOps			: pointer to the first decoded command to execute
+		[in]		NbOps			: number of commands
+		[in]		Trigger			: kind of trigger or'ed with the index of the result watched
+		[in]		Sequence		: sequence number of the script
+		[in/out]	pResponse		: pointer to the response buffer
+	Returns:
+		void
+*/
+void TriggerScript(const tScriptOp *pOps, uint16_t NbOps, uint8_t Trigger, uint16_t Sequence, uint16_t *pResponse)
+{
+	uint16_t *_pResults = &pResponse[RESPONSE_HEADER_LENGTH];
+	uint16_t *_pSamples = &_pResults[TRIGGER_TIME_LENGTH];
+	uint16_t _Armed[RESPONSE_MINIMUM_LENGTH];
+	uint16_t _Flags;
+	uint16_t _Level, _Pre, _Post;
+	eError _Error = kNoError;
+	uint16_t _IndexCommandError = 0;
+
+	// The time is sent with the samples: it can't lose its low bits
+	uint8_t _Encoding = GetScriptEncoding(pOps, NbOps) & ~RESULT_ENCODING_SHIFT_MASK;
+	uint16_t _SampleRoom;
+	uint16_t _SampleLength = CountScriptResults(pOps, NbOps, &_Flags, &_SampleRoom);
+	uint16_t _ScratchLength = (_SampleRoom > _SampleLength) ? _SampleRoom : 0;
+	uint8_t _Index = Trigger & TRIGGER_RESULT_MASK;
+	GetScriptTrigger(pOps, NbOps, &_Level, &_Pre, &_Post);
+	uint32_t _NbSamples = (uint32_t)_Pre + _Post;
+	if ((_Index >= _SampleLength) || (_Post == 0) || ((Trigger & TRIGGER_KIND_MASK) > TRIGGER_SLOPE_FALLING))
+		_Error = kSyntaxError;
+	else if (_NbSamples * _SampleLength + _ScratchLength > MAX_RESULTS_LENGTH - TRIGGER_TIME_LENGTH)
+		_Error = kOutOfMemoryError;
+	if (_Error != kNoError)
+	{
+		SendResponse(pResponse, Sequence, 0, 0, _Error, 0);
+		return;
+	}
+	uint16_t _NbResults = TRIGGER_TIME_LENGTH + _NbSamples * _SampleLength;
+	uint16_t *_pScratch = &_pSamples[_NbSamples * _SampleLength];
+
+	DigitalBeginSpiSession();
+	uint16_t _Slot = 0;				// Slot of the next sample in the ring buffer
+	uint16_t _NbTaken = 0;			// Samples taken since armed, counted up to the samples before the trigger
+	uint16_t _NbLeft = 0;			// Samples left to take once triggered, 0 if not triggered
+	uint16_t _Previous = 0;			// Result watched of the previous sample
+	uint32_t _TriggerTime = 0;
+	unsigned long _LastResponse = millis();
+	while (!HostInputAvailable())
+	{
+		// Take a sample into its slot
+		uint32_t _SampleTime = micros();
+		uint16_t *_pSample = &_pSamples[_Slot * _SampleLength];
+		uint16_t _NumberOfResults = 0;
+		if (_ScratchLength > 0)
+		{
+			_Error = ExecuteScript(pOps, NbOps, _pScratch, _ScratchLength, &_NumberOfResults, &_Flags, &_IndexCommandError);
+			memcpy(_pSample, _pScratch, _SampleLength * sizeof(uint16_t));
+		}
+		else
+			_Error = ExecuteScript(pOps, NbOps, _pSample, _SampleLength, &_NumberOfResults, &_Flags, &_IndexCommandError);
+		if (_Error != kNoError)
+			break;
+		if (++_Slot == _NbSamples)
+			_Slot = 0;
+
+		// Armed once the samples before the trigger are taken, with a previous result to compare to
+		if (_NbLeft == 0)
+		{
+			if ((_NbTaken >= _Pre) && (_NbTaken > 0) && IsTriggered(Trigger, _Previous, _pSample[_Index], _Level))
+			{
+				_NbLeft = _Post;
+				_TriggerTime = _SampleTime;
+			}
+			else if ((_NbTaken < _Pre) || (_NbTaken == 0))
+				_NbTaken++;
+			_Previous = _pSample[_Index];
+		}
+
+		// All samples are taken: the oldest is in the next slot, rotate it to the start
+		if ((_NbLeft > 0) && (--_NbLeft == 0))
+		{
+			ReverseWords(_pSamples, 0, _Slot * _SampleLength);
+			ReverseWords(_pSamples, _Slot * _SampleLength, _NbResults - TRIGGER_TIME_LENGTH);
+			ReverseWords(_pSamples, 0, _NbResults - TRIGGER_TIME_LENGTH);
+			_pResults[0] = _TriggerTime & 0xFFFF;
+			_pResults[1] = _TriggerTime >> 16;
+			StartResponse(pResponse, Sequence, _Flags, _NbResults, _Encoding);
+			EndResponse(_NbResults, kNoError, 0);
+			_Slot = 0;
+			_NbTaken = 0;
+			_LastResponse = millis();
+		}
+		// Tell the host the trigger is still armed
+		else if (millis() - _LastResponse >= TRIGGER_HEARTBEAT_PERIOD)
+		{
+			SendResponse(_Armed, Sequence, 0, 0, kNoError, TRIGGER_ARMED_ERROR_DESC);
+			_LastResponse = millis();
+		}
+	}
+	DigitalEndSpiSession();
+
+	// An error response ends the trigger
+	if (_Error != kNoError)
+	{
+		SendResponse(pResponse, Sequence, 0, 0, _Error, _IndexCommandError);
+		return;
+	}
+
+	// Discard the stop request and acknowledge it
+	HostInputFlush();
+	SendResponse(pResponse, Sequence, 0, 0, kNoError, STREAM_END_ERROR_DESC);
+}
+
+/*
+	Burst: execute the script over and over, one sample per execution, as fast as it runs, into the
+	response buffer without receiving or sending anything, then send all the samples in one response
+	with the time from the first sample to the last.
+	Parameters:
+		[in]		pOps			: pointer to the first decoded command to execute, no loop
+		[in]		NbOps			: number of commands
+		[in]		Sequence		: sequence number of the script
+		[in/out]	pResponse		: pointer to the response buffer
+	Returns:
+		void
+*/
+void BurstScript(const tScriptOp *pOps, uint16_t NbOps, uint16_t Sequence, uint16_t *pResponse)
+{
+	uint16_t *_pResults = &pResponse[RESPONSE_HEADER_LENGTH];
+	uint16_t _Flags;
+	eError _Error = kNoError;
+	uint16_t _IndexCommandError = 0;
+
+	// The time is sent with the samples: it can't lose its low bits
+	uint8_t _Encoding = GetScriptEncoding(pOps, NbOps) & ~RESULT_ENCODING_SHIFT_MASK;
+	uint16_t _SampleLength = CountScriptResults(pOps, NbOps, &_Flags, NULL);
+	uint16_t _NbSamplesMax = (_SampleLength > 0) ? (MAX_RESULTS_LENGTH - BURST_TIME_LENGTH) / _SampleLength : 0;
+	uint16_t _NbSamples = GetScriptBurstSamples(pOps, NbOps);
+	if (_NbSamples == 0)
+		_NbSamples = _NbSamplesMax;
+	for (uint16_t _i = 0; (_i < NbOps) && (_Error == kNoError); _i++)
+	{
+		if ((pOps[_i].Command == kSetLoopStart) || (pOps[_i].Command == kSetAverageLoopStart))
+		{
+			_Error = kSyntaxError;
+			_IndexCommandError = _i;
+		}
+	}
+	if ((_Error == kNoError) && (_SampleLength == 0))
+		_Error = kSyntaxError;
+	else if ((_Error == kNoError) && ((_NbSamplesMax == 0) || (_NbSamples > _NbSamplesMax)))
+		_Error = kOutOfMemoryError;
+	if (_Error != kNoError)
+	{
+		SendResponse(pResponse, Sequence, 0, 0, _Error, _IndexCommandError);
+		return;
+	}
+
+	// Take the samples back to back
+	uint16_t _NumberOfResults = BURST_TIME_LENGTH;
+	uint32_t _FirstTime = 0;
+	uint32_t _LastTime = 0;
+	DigitalBeginSpiSession();
+	for (uint16_t _Sample = 0; (_Sample < _NbSamples) && (_Error == kNoError); _Sample++)
+	{
+		_LastTime = micros();
+		if (_Sample == 0)
+			_FirstTime = _LastTime;
+		_Error = ExecuteBurstSample(pOps, NbOps, _pResults, &_NumberOfResults, &_IndexCommandError);
+	}
+	DigitalEndSpiSession();
+	if (_Error != kNoError)
+	{
+		SendResponse(pResponse, Sequence, 0, 0, _Error, _IndexCommandError);
+		return;
+	}
+
+	// Send the time and the samples at once
+	uint32_t _Time = _LastTime - _FirstTime;
+	_pResults[0] = _Time & 0xFFFF;
+	_pResults[1] = _Time >> 16;
+	StartResponse(pResponse, Sequence, 0, _NumberOfResults, _Encoding);
+	EndResponse(_NumberOfResults, kNoError, 0);
 }
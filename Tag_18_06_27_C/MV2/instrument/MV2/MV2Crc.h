@@ -0,0 +1,81 @@
+// Name:
+//	MV2Crc.h
+//
+// Purpose:
+// CRC-16/CCITT shared by host and Arduino
+//
+// Description:
+// Polynomial 0x1021, initial value 0xFFFF, no reflection (CRC-16/CCITT-FALSE).
+// Table driven: one table lookup per byte. On the Arduino the table is in flash.
+// The CRC of a frame covers its bytes in transmission order, header included,
+// and is transmitted in the last word of the frame.
+//
+// Coding Conventions:
+//	- Variable names use the "InterCaps" convention
+//	- Local variables are prefixed with an underscore, '_'
+//	- Pointer variables are prefixed with 'p'
+//	- Enumerated types are prefixed with 'e'
+//	- Enumerated type values are prefixed with 'k'
+//	- Constants are all uppercase
+//	The above conventions can also be combined:
+//	- A local pointer variable would be prefixed '_p'
+//
+//
+// Change log:
+//	17.10.26 MB	Original version
+//
+// Copyright (c) 2016 Metrolab Technology SA, Geneva,
+//	Switzerland
+
+#ifndef MV2_CRC_H
+#define MV2_CRC_H
+
+#include <stdint.h>
+
+#ifdef ARDUINO
+	#include <avr/pgmspace.h>
+	#define CRC16_TABLE_READ(Index)		pgm_read_word(&CRC16_TABLE[Index])
+#else
+	#define PROGMEM
+	#define CRC16_TABLE_READ(Index)		CRC16_TABLE[Index]
+#endif
+
+// Initial value
+#define CRC16_INIT						0xFFFF
+
+extern const uint16_t CRC16_TABLE[256] PROGMEM;
+
+/*
+	Update CRC with one byte
+	Parameters:
+		[in]	Crc : current CRC
+		[in]	Byte : next byte
+	Returns:
+		uint16_t : updated CRC
+*/
+inline uint16_t Crc16Update(uint16_t Crc, uint8_t Byte)
+{
+	return (Crc << 8) ^ CRC16_TABLE_READ((Crc >> 8) ^ Byte);
+}
+
+/*
+	Compute CRC of a message
+	Parameters:
+		[in]	pMessage : pointer to the message
+		[in]	Size : size of the message (bytes)
+	Returns:
+		uint16_t
+*/
+uint16_t Crc16(const void *pMessage, uint16_t Size);
+
+/*
+	Check the CRC of a frame: the last word is the CRC of the previous ones
+	Parameters:
+		[in]	pFrame : pointer to the frame
+		[in]	Size : size of the frame (words)
+	Returns:
+		bool
+*/
+bool Crc16CheckFrame(const uint16_t *pFrame, uint16_t Size);
+
+#endif // MV2_CRC_H
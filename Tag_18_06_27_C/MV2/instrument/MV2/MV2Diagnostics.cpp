@@ -0,0 +1,261 @@
+// Name:
+//	MV2Diagnostics.cpp
+//
+// Purpose:
+// Performance counters of the firmware
+//
+// Description:
+// See MV2Diagnostics.h
+//
+// Coding Conventions:
+//	- Variable names use the "InterCaps" convention
+//	- Local variables are prefixed with an underscore, '_'
+//	- Pointer variables are prefixed with 'p'
+//	- Enumerated types are prefixed with 'e'
+//	- Enumerated type values are prefixed with 'k'
+//	- Constants are all uppercase
+//	The above conventions can also be combined:
+//	- A local pointer variable would be prefixed '_p'
+//
+//
+// Change log:
+//	17.10.26 MB	Original version
+//	17.10.26 MB	Count the polls that found the serial transmit buffer empty (DIAG_TX_EMPTY)
+//	17.10.26 MB	Count the SPI words instead of timing them, read and clear the counters with interrupts off
+//	17.10.26 MB	Compile out the snapshot with the counters
+//
+// Copyright (c) 2016 Metrolab Technology SA, Geneva,
+//	Switzerland
+
+#include "MV2Diagnostics.h"
+#include "MV2HostConstants.h"
+#include "MV2Hal.h"
+#include "MV2Utility.h"
+
+#if DIAGNOSTICS
+
+// Words returned by MV2_CMD_GET_DIAGNOSTICS, taken when word 0 is read
+static uint16_t _Snapshot[DIAG_LENGTH];
+
+// Sum of the times of each category (us)
+static uint32_t _Times[kNbDiagTimes];
+// Words transferred on SPI, and the time of one (us)
+static uint32_t _SpiWords = 0;
+#define SPI_WORD_TIME		(16 * 1000000UL / MV2_SPI_CLK_FREQ)
+// Time the counters were cleared, start of the script being handled (us)
+static uint32_t _ResetTime = 0;
+static uint32_t _BusyStart;
+static bool _Handling = false;
+// High-water marks
+static int _RamFreeMin = 0x7FFF;
+static uint8_t _TxQueuedMax = 0;
+static uint16_t _ResponseMax = 0;
+// Polls that found the serial transmit buffer empty, at most 0xFFFF
+static uint16_t _TxEmpty = 0;
+
+/*
+	Add the time elapsed since the start of an operation to its category
+	Parameters:
+		[in]	Time : category of the operation
+		[in]	Start : start of the operation (DiagnosticsStart)
+	Returns:
+		void
+*/
+void DiagnosticsAddTime(eDiagTime Time, uint32_t Start)
+{
+	_Times[Time] += micros() - Start;
+}
+
+/*
+	Count a word transferred on SPI
+	Parameters:
+
+	Returns:
+		void
+*/
+void DiagnosticsCountSpiWord()
+{
+	_SpiWords++;
+}
+
+/*
+	Start the handling of a script
+	Parameters:
+
+	Returns:
+		void
+*/
+void DiagnosticsBeginBusy()
+{
+	_BusyStart = micros();
+	_Handling = true;
+}
+
+/*
+	End the handling of a script
+	Parameters:
+
+	Returns:
+		void
+*/
+void DiagnosticsEndBusy()
+{
+	DiagnosticsAddTime(kDiagBusy, _BusyStart);
+	_Handling = false;
+}
+
+/*
+	Update the lowest free RAM
+	Parameters:
+
+	Returns:
+		void
+*/
+void DiagnosticsSampleRam()
+{
+	int _RamFree = freeRam();
+	if (_RamFree < _RamFreeMin)
+		_RamFreeMin = _RamFree;
+}
+
+/*
+	Update the most bytes queued in the serial transmit buffer
+	Parameters:
+		[in]	Room : room left in the serial transmit buffer (Serial.availableForWrite)
+	Returns:
+		void
+*/
+void DiagnosticsSampleTxQueue(int Room)
+{
+	// One byte of the ring buffer is always free
+	uint8_t _Queued = SERIAL_TX_BUFFER_SIZE - 1 - Room;
+	if (_Queued > _TxQueuedMax)
+		_TxQueuedMax = _Queued;
+}
+
+/*
+	Update the most results in a response
+	Parameters:
+		[in]	NumberOfResults : number of results of a response sent
+	Returns:
+		void
+*/
+void DiagnosticsSampleResponse(uint16_t NumberOfResults)
+{
+	if (NumberOfResults > _ResponseMax)
+		_ResponseMax = NumberOfResults;
+}
+
+/*
+	Count a poll that found the serial transmit buffer empty with results left to send
+	Parameters:
+
+	Returns:
+		void
+*/
+void DiagnosticsCountTxEmpty()
+{
+	if (_TxEmpty < 0xFFFF)
+		_TxEmpty++;
+}
+
+/*
+	Clear the counters
+	Parameters:
+
+	Returns:
+		void
+*/
+static void ResetDiagnostics()
+{
+	for (uint8_t _i = 0; _i < kNbDiagTimes; _i++)
+		_Times[_i] = 0;
+	_SpiWords = 0;
+	_ResetTime = micros();
+	_BusyStart = _ResetTime;
+	_RamFreeMin = 0x7FFF;
+	_TxQueuedMax = 0;
+	_ResponseMax = 0;
+	_TxEmpty = 0;
+}
+
+/*
+	Store a time in two words of the snapshot, low word first
+	Parameters:
+		[in]	Index : index of the first word (DIAG_*)
+		[in]	Time : time (us)
+	Returns:
+		void
+*/
+static void SnapshotTime(uint8_t Index, uint32_t Time)
+{
+	_Snapshot[Index] = Time & 0xFFFF;
+	_Snapshot[Index + 1] = Time >> 16;
+}
+
+/*
+	Take a snapshot of the counters: the script being handled counts up to now
+	Parameters:
+
+	Returns:
+		void
+*/
+static void TakeSnapshot()
+{
+	uint32_t _Now = micros();
+	uint32_t _Busy = _Times[kDiagBusy] + (_Handling ? _Now - _BusyStart : 0);
+	uint32_t _Spi = _SpiWords * SPI_WORD_TIME;
+	uint32_t _Waits = _Spi + _Times[kDiagDataReady] + _Times[kDiagAdc] + _Times[kDiagTx] + _Times[kDiagSampleTick];
+
+	SnapshotTime(DIAG_SPI, _Spi);
+	SnapshotTime(DIAG_DATA_READY, _Times[kDiagDataReady]);
+	SnapshotTime(DIAG_ADC, _Times[kDiagAdc]);
+	SnapshotTime(DIAG_TX, _Times[kDiagTx]);
+	SnapshotTime(DIAG_IDLE, (_Now - _ResetTime) - _Busy + _Times[kDiagSampleTick]);
+	SnapshotTime(DIAG_DISPATCH, (_Busy > _Waits) ? _Busy - _Waits : 0);
+	_Snapshot[DIAG_RAM_FREE_MIN] = _RamFreeMin;
+	_Snapshot[DIAG_TX_QUEUED_MAX] = _TxQueuedMax;
+	_Snapshot[DIAG_RESPONSE_MAX] = _ResponseMax;
+	_Snapshot[DIAG_TX_EMPTY] = _TxEmpty;
+}
+
+#endif // DIAGNOSTICS
+
+/*
+	Get a word of the diagnostics (DIAG_*, see MV2HostConstants.h). Word 0 takes a snapshot of
+	the counters, the other words are read from it. DIAG_RESET clears the counters.
+	Parameters:
+		[in]	Index : index of the word, or DIAG_RESET
+		[out]	pValue : pointer to the word
+	Returns:
+		eError : kSyntaxError if the index is out of range
+*/
+eError DiagnosticsGetWord(uint16_t Index, uint16_t *pValue)
+{
+	if (Index == DIAG_RESET)
+	{
+#if DIAGNOSTICS
+		noInterrupts();
+		ResetDiagnostics();
+		interrupts();
+#endif
+		*pValue = 0;
+		return kNoError;
+	}
+	if (Index >= DIAG_LENGTH)
+		return kSyntaxError;
+
+#if DIAGNOSTICS
+	// The counters are multi-byte: take them all at once
+	if (Index == 0)
+	{
+		noInterrupts();
+		TakeSnapshot();
+		interrupts();
+	}
+	*pValue = _Snapshot[Index];
+#else
+	*pValue = 0;
+#endif
+	return kNoError;
+}
@@ -0,0 +1,170 @@
+// Name:
+//	MV2Diagnostics.h
+//
+// Purpose:
+// Performance counters of the firmware, read by the host with MV2_CMD_GET_DIAGNOSTICS
+//
+// Description:
+// Times (us, micros()) are summed per category while a script, stream, capture or trigger is
+// handled: waits for Data Ready, waits for the ADC, waits for room in the serial transmit buffer,
+// and waits for the sample timer. Only waits and whole scripts are timed. SPI transfers are
+// counted, not timed, as they are too short to time: their time is the words transferred at
+// MV2_SPI_CLK_FREQ, without selecting the chip. The time outside the handling of a script
+// plus the waits for the sample timer is idle time; the rest of the handling is the time the
+// firmware itself takes (decoding, dispatching the commands, encoding and copying the results).
+// micros() has a 4 us resolution: a single short transfer may count 0 or 4 us, the sums over
+// many transfers are right on average. The sums wrap around after about 71 minutes.
+// High-water marks: lowest free RAM (freeRam) seen when a script is executed, most bytes queued
+// in the serial transmit buffer at the end of a frame, most results in a response.
+// Polls that found the serial transmit buffer empty with results left to send (DIAG_TX_EMPTY).
+// The words transferred by the Data Ready interrupt of a capture are counted when the main loop
+// reads them (DigitalReadCapture): the counters are only updated by the main loop. They are
+// still read and cleared with interrupts off.
+// The counters are compiled out by default: MV2_CMD_GET_DIAGNOSTICS then returns 0. Set
+// DIAGNOSTICS to 1 below to compile them in.
+//
+// Coding Conventions:
+//	- Variable names use the "InterCaps" convention
+//	- Local variables are prefixed with an underscore, '_'
+//	- Pointer variables are prefixed with 'p'
+//	- Enumerated types are prefixed with 'e'
+//	- Enumerated type values are prefixed with 'k'
+//	- Constants are all uppercase
+//	The above conventions can also be combined:
+//	- A local pointer variable would be prefixed '_p'
+//
+//
+// Change log:
+//	17.10.26 MB	Original version
+//	17.10.26 MB	Add DiagnosticsCountTxEmpty
+//	17.10.26 MB	Compiled out by default, count the SPI words instead of timing them (DiagnosticsCountSpiWord)
+//
+// Copyright (c) 2016 Metrolab Technology SA, Geneva,
+//	Switzerland
+
+#ifndef MV2_DIAGNOSTICS_H
+#define MV2_DIAGNOSTICS_H
+
+#include "Arduino.h"
+#include "MV2HostCommands.h"
+
+// Performance counters compiled in
+#ifndef DIAGNOSTICS
+	#define DIAGNOSTICS		0
+#endif
+
+// Enumeration of the time categories
+typedef enum {
+	kDiagDataReady = 0,
+	kDiagAdc,
+	kDiagTx,
+	kDiagSampleTick,
+	kDiagBusy,
+	kNbDiagTimes
+} eDiagTime;
+
+#if DIAGNOSTICS
+
+/*
+	Get the start of a timed operation
+	Parameters:
+
+	Returns:
+		uint32_t : micros()
+*/
+inline uint32_t DiagnosticsStart()
+{
+	return micros();
+}
+
+/*
+	Add the time elapsed since the start of an operation to its category
+	Parameters:
+		[in]	Time : category of the operation
+		[in]	Start : start of the operation (DiagnosticsStart)
+	Returns:
+		void
+*/
+void DiagnosticsAddTime(eDiagTime Time, uint32_t Start);
+
+/*
+	Count a word transferred on SPI
+	Parameters:
+
+	Returns:
+		void
+*/
+void DiagnosticsCountSpiWord();
+
+/*
+	Start and end the handling of a script: the time outside is idle
+	Parameters:
+
+	Returns:
+		void
+*/
+void DiagnosticsBeginBusy();
+void DiagnosticsEndBusy();
+
+/*
+	Update the lowest free RAM
+	Parameters:
+
+	Returns:
+		void
+*/
+void DiagnosticsSampleRam();
+
+/*
+	Update the most bytes queued in the serial transmit buffer
+	Parameters:
+		[in]	Room : room left in the serial transmit buffer (Serial.availableForWrite)
+	Returns:
+		void
+*/
+void DiagnosticsSampleTxQueue(int Room);
+
+/*
+	Update the most results in a response
+	Parameters:
+		[in]	NumberOfResults : number of results of a response sent
+	Returns:
+		void
+*/
+void DiagnosticsSampleResponse(uint16_t NumberOfResults);
+
+/*
+	Count a poll that found the serial transmit buffer empty with results left to send
+	Parameters:
+
+	Returns:
+		void
+*/
+void DiagnosticsCountTxEmpty();
+
+#else
+
+inline uint32_t DiagnosticsStart() { return 0; }
+inline void DiagnosticsAddTime(eDiagTime, uint32_t) {}
+inline void DiagnosticsCountSpiWord() {}
+inline void DiagnosticsBeginBusy() {}
+inline void DiagnosticsEndBusy() {}
+inline void DiagnosticsSampleRam() {}
+inline void DiagnosticsSampleTxQueue(int) {}
+inline void DiagnosticsSampleResponse(uint16_t) {}
+inline void DiagnosticsCountTxEmpty() {}
+
+#endif // DIAGNOSTICS
+
+/*
+	Get a word of the diagnostics (DIAG_*, see MV2HostConstants.h). Word 0 takes a snapshot of
+	the counters, the other words are read from it. DIAG_RESET clears the counters.
+	Parameters:
+		[in]	Index : index of the word, or DIAG_RESET
+		[out]	pValue : pointer to the word
+	Returns:
+		eError : kSyntaxError if the index is out of range
+*/
+eError DiagnosticsGetWord(uint16_t Index, uint16_t *pValue);
+
+#endif // MV2_DIAGNOSTICS_H
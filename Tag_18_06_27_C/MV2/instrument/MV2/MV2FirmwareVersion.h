@@ -24,8 +24,24 @@
 //  31.03.17 PK Bump firmware version: Add support for Arduino MEGA
 //  22.08.17 PK Bump firmware version: Fix bug switching from digital to serial mode
 //  11.09.18 PK Bump firmware version: Slow down SPI bit rate, to allow for long cables
+//	17.10.26 MB Bump firmware version: Add streaming acquisition mode
+//	17.10.26 MB Bump firmware version: Add baud rate negotiation
+//	17.10.26 MB Bump firmware version: Frames with flags and CRC-16/CCITT
+//	17.10.26 MB Bump firmware version: Sequence numbers, send the last response again
+//	17.10.26 MB Bump firmware version: Average loops on the Arduino
+//	17.10.26 MB Bump firmware version: Capture Data Ready by interrupt
+//	17.10.26 MB Bump firmware version: Direct port access to CS and DR, SPI session per script
+//	17.10.26 MB Bump firmware version: Nested loops, 16-bit loop counts
+//	17.10.26 MB Bump firmware version: Script slots, results sent during execution, encoded results
+//	17.10.26 MB Bump firmware version: Timestamps
+//	17.10.26 MB Bump firmware version: Chunked responses
+//	17.10.26 MB Bump firmware version: Analog channels scanned by the ADC interrupt
+//	17.10.26 MB Bump firmware version: Sample timer
+//	17.10.26 MB Bump firmware version: Trigger
+//	17.10.26 MB Bump firmware version: Diagnostics
+//	17.10.26 MB Bump firmware version: Burst
 //
 // Copyright (c) 2016 Metrolab Technology SA, Geneva,
 //	Switzerland
 
-#define FW_VERSION 0x0105
+#define FW_VERSION 0x0115
@@ -40,6 +40,13 @@
 //				  - Identify additional pin configurations common to analog/digital
 //	22.08.17 ST - Fix MiscSetDigitalAnalogMode. Avoid initializing SPI multiple times
 //  22.08.17 PK - More code cleanup: consolidate initialization of pins and their output values
+//	17.10.26 MB Add capture of Data Ready by interrupt into a ring buffer (DigitalStartCapture...)
+//	17.10.26 MB Access CS and DR through the port registers, keep the SPI transaction open for a session
+//	17.10.26 MB Scan the analog channels with the ADC in free running mode instead of analogRead,
+//				subtract a filtered REF value
+//	17.10.26 MB Add sample timer on Timer1 (MiscStartSampleTimer, MiscTakeSampleTick...)
+//	17.10.26 MB Time the SPI transfers and the waits for Data Ready and the ADC (see MV2Diagnostics.h)
+//	17.10.26 MB Don't time each SPI transfer, count the words captured when they are read (DigitalReadCapture)
 //
 // Copyright (c) 2016 Metrolab Technology SA, Geneva,
 //	Switzerland
@@ -47,6 +54,42 @@
 #define _GLOBAL_MV2_MODE_
 
 #include "MV2Hal.h"
+#include "MV2Diagnostics.h"
+
+// SPI settings of the MV2
+#define MV2_SPI_SETTINGS		SPISettings(MV2_SPI_CLK_FREQ, MSBFIRST, SPI_MODE0)
+
+// SPI transaction kept open by DigitalBeginSpiSession
+static bool _SpiSession = false;
+
+// Capture: words to transfer on each Data Ready
+static uint16_t _CaptureData[CAPTURE_MAX_WORDS];
+static uint8_t _CaptureNbData = 0;
+// Capture ring buffer. The interrupt only writes _CaptureHead, the main loop only writes _CaptureTail:
+// single byte indexes are read and written atomically, no lock is needed.
+static uint16_t _CaptureBuffer[CAPTURE_BUFFER_LENGTH];
+static volatile uint8_t _CaptureHead = 0;
+static volatile uint8_t _CaptureTail = 0;
+static volatile uint16_t _CaptureOverruns = 0;
+
+// Analog acquisition: last value of each channel, channels converted and not read yet,
+// REF filtered (x 2^ANALOG_REF_FILTER_SHIFT), valid once REF has been converted
+static volatile uint16_t _AnalogValues[ANALOG_NB_CHANNELS];
+static volatile uint8_t _AnalogFresh = 0;
+static volatile uint16_t _AnalogRef;
+static volatile bool _AnalogRefValid = false;
+static volatile uint8_t _AnalogDiscard = 0;
+// Channel of the conversion running, channel selected for the next one
+static uint8_t _AnalogConverting;
+static uint8_t _AnalogSelected;
+
+// Sample timer: ticks counted by the compare match interrupt, last tick taken by MiscTakeSampleTick,
+// a tick was taken since the start, ticks missed
+static volatile uint16_t _SampleTicks = 0;
+static uint16_t _SampleTicksTaken = 0;
+static bool _SampleTickTaken = false;
+static bool _SampleTimerRunning = false;
+static uint16_t _SampleOverruns = 0;
 
 // MV2 mode
 static enum {kUnconfigured, kConfiguredAnalog, kConfiguredDigital} _MV2Mode = kUnconfigured;
@@ -59,6 +102,41 @@ eMode GetMV2Mode()
 	return (digitalRead(NDIGITAL_ANALOG_PIN) ? kAnalogMode : kDigitalMode);
 }
 
+/*
+	DIGITAL function
+	Begin an SPI session: the SPI transaction stays open until DigitalEndSpiSession,
+	instead of being opened and closed for every word. Only in digital mode.
+	Parameters:
+
+	Returns:
+		void
+*/
+void DigitalBeginSpiSession()
+{
+	if ((_MV2Mode != kConfiguredDigital) || _SpiSession)
+		return;
+
+	SPI.beginTransaction(MV2_SPI_SETTINGS);
+	_SpiSession = true;
+}
+
+/*
+	DIGITAL function
+	End the SPI session begun by DigitalBeginSpiSession
+	Parameters:
+
+	Returns:
+		void
+*/
+void DigitalEndSpiSession()
+{
+	if (!_SpiSession)
+		return;
+
+	_SpiSession = false;
+	SPI.endTransaction();
+}
+
 /*
 	DIGITAL function
 	Write data (Register address, value) and read previously selected data value
@@ -70,18 +148,19 @@ eMode GetMV2Mode()
 */
 eError DigitalWriteAndRead(uint16_t Data, uint16_t *pReturnValue)
 {
-	eError _Error = kNoError;
-
-    // Begin the SPI transaction(s).
-    SPI.beginTransaction(SPISettings(MV2_SPI_CLK_FREQ, MSBFIRST, SPI_MODE0));
+	// Begin the SPI transaction, unless a session keeps it open
+	bool _Transaction = !_SpiSession;
+	if (_Transaction)
+		SPI.beginTransaction(MV2_SPI_SETTINGS);
 	// Select chip
-	digitalWrite(D_CHIP_SELECT_PIN, LOW);
+	tChipSelectPin::Clear();
 	// Write _value and read previously selected data value
 	*pReturnValue = SPI.transfer16(Data);
 	// Unselect chip
-	digitalWrite(D_CHIP_SELECT_PIN, HIGH);
-    // Close the SPI transaction.
-    SPI.endTransaction();
+	tChipSelectPin::Set();
+	// Close the SPI transaction
+	if (_Transaction)
+		SPI.endTransaction();
 	
 	return kNoError;
 }
@@ -98,18 +177,21 @@ uint8_t DigitalReadRegister(uint8_t Register)
 {
 	uint8_t _Value;
 
-    // Begin the SPI transaction(s).
-    SPI.beginTransaction(SPISettings(MV2_SPI_CLK_FREQ, MSBFIRST, SPI_MODE0));
+	// Begin the SPI transaction, unless a session keeps it open
+	bool _Transaction = !_SpiSession;
+	if (_Transaction)
+		SPI.beginTransaction(MV2_SPI_SETTINGS);
 	// Select chip
-	digitalWrite(D_CHIP_SELECT_PIN, LOW);
+	tChipSelectPin::Clear();
 	// read dummy, address=reg to read the content of register 
 	SPI.transfer(Register);
 	// read content of register 
 	_Value = SPI.transfer(0);
 	// Unselect chip
-	digitalWrite(D_CHIP_SELECT_PIN, HIGH);
-    // Close the SPI transaction.
-    SPI.endTransaction();
+	tChipSelectPin::Set();
+	// Close the SPI transaction
+	if (_Transaction)
+		SPI.endTransaction();
 
 	return _Value;
 }
@@ -128,12 +210,13 @@ eError DigitalWaitForDataReady()
 	eError _Error = kNoError;
 
 	// Configure timeout
+	uint32_t _Start = DiagnosticsStart();
 	unsigned long _TimeOut = millis() + A_D_CONVERSION_TIMEOUT;
 
 	// Wait for end of conversion or timeout
 	while (true) 
 	{
-		if (digitalRead(D_DR_PIN) == HIGH)
+		if (tDataReadyPin::IsSet())
 			break;
 		else if (millis() >= _TimeOut)
 		{
@@ -141,6 +224,7 @@ eError DigitalWaitForDataReady()
 			break;
 		}
 	}
+	DiagnosticsAddTime(kDiagDataReady, _Start);
 	return _Error;
 }
 
@@ -164,56 +248,296 @@ void DigitalSetInitBit(uint8_t Value)
     }
 }
 
+/*
+	DIGITAL function
+	Interrupt Service Routine of Data Ready: transfer the capture words on SPI,
+	store the values read in the ring buffer
+	Parameters:
+
+	Returns:
+		void
+*/
+static void DigitalCaptureDataReady()
+{
+	uint8_t _Head = _CaptureHead;
+
+	// Not enough room for all values: this conversion is lost
+	if ((uint8_t)(_Head - _CaptureTail) > CAPTURE_BUFFER_LENGTH - _CaptureNbData)
+	{
+		_CaptureOverruns++;
+		return;
+	}
+
+	for (uint8_t _i = 0; _i < _CaptureNbData; _i++)
+	{
+		DigitalWriteAndRead(_CaptureData[_i], &_CaptureBuffer[_Head & (CAPTURE_BUFFER_LENGTH - 1)]);
+		_Head++;
+	}
+
+	// Publish all values of this Data Ready at once
+	_CaptureHead = _Head;
+}
+
+/*
+	DIGITAL function
+	Start capture: on each rising edge of Data Ready, transfer data on SPI and keep the values read
+	Parameters:
+		[in]	pData : data to write on each Data Ready
+		[in]	NbData : number of data
+	Returns:
+		eError : kSyntaxError if NbData is 0 or larger than CAPTURE_MAX_WORDS
+*/
+eError DigitalStartCapture(const uint16_t *pData, uint8_t NbData)
+{
+	if ((NbData == 0) || (NbData > CAPTURE_MAX_WORDS))
+		return kSyntaxError;
+
+	for (uint8_t _i = 0; _i < NbData; _i++)
+		_CaptureData[_i] = pData[_i];
+	_CaptureNbData = NbData;
+	_CaptureHead = 0;
+	_CaptureTail = 0;
+	_CaptureOverruns = 0;
+
+	noInterrupts();
+	attachInterrupt(digitalPinToInterrupt(D_DR_PIN), DigitalCaptureDataReady, RISING);
+	// A conversion already waiting to be read gives no rising edge: read it now
+	if (tDataReadyPin::IsSet())
+		DigitalCaptureDataReady();
+	interrupts();
+
+	return kNoError;
+}
+
+/*
+	DIGITAL function
+	Stop capture
+	Parameters:
+
+	Returns:
+		void
+*/
+void DigitalStopCapture()
+{
+	detachInterrupt(digitalPinToInterrupt(D_DR_PIN));
+}
+
+/*
+	DIGITAL function
+	Number of values captured and not read yet
+	Parameters:
+
+	Returns:
+		uint8_t : number of values
+*/
+uint8_t DigitalCaptureAvailable()
+{
+	return _CaptureHead - _CaptureTail;
+}
+
+/*
+	DIGITAL function
+	Read the oldest value captured. Call only if DigitalCaptureAvailable() is not 0.
+	Parameters:
+
+	Returns:
+		uint16_t : value
+*/
+uint16_t DigitalReadCapture()
+{
+	uint8_t _Tail = _CaptureTail;
+	uint16_t _Value = _CaptureBuffer[_Tail & (CAPTURE_BUFFER_LENGTH - 1)];
+
+	// Free the slot once read
+	_CaptureTail = _Tail + 1;
+	// Counted here rather than in the interrupt
+	DiagnosticsCountSpiWord();
+	return _Value;
+}
+
+/*
+	DIGITAL function
+	Number of Data Ready lost because the ring buffer was full
+	Parameters:
+
+	Returns:
+		uint16_t : number of Data Ready lost
+*/
+uint16_t DigitalCaptureOverruns()
+{
+	uint16_t _Overruns;
+
+	// 16 bits are not read atomically
+	noInterrupts();
+	_Overruns = _CaptureOverruns;
+	interrupts();
+	return _Overruns;
+}
+
 /*
 	ANALOG function
-	Digitize Bx, subtract the digitized REF value
+	Interrupt Service Routine of the ADC conversion complete: keep the value of the channel
+	converted. In free running mode, the next conversion has already started with the channel
+	selected before: select the channel of the conversion after it, once the next conversion
+	has run for at least one ADC clock.
 	Parameters:
 
 	Returns:
-		uint16_t : Bx digitized
+		void
 */
-uint16_t AnalogDigitizeBx()
+ISR(ADC_vect)
 {
-	return ((analogRead(A_BX_PIN) - analogRead(A_REF_PIN)) + ANALOG_OFFSET) << ANALOG_SHIFT;
+	uint16_t _Value = ADC;
+	uint8_t _Channel = _AnalogConverting;
+
+	if (_AnalogDiscard > 0)
+		_AnalogDiscard--;
+	else
+	{
+		// REF: first order low-pass filter
+		if (_Channel == A_REF_PIN - A0)
+		{
+			if (_AnalogRefValid)
+				_AnalogRef += ((int16_t)(_Value << ANALOG_REF_FILTER_SHIFT) - (int16_t)_AnalogRef) >> ANALOG_REF_FILTER_SHIFT;
+			else
+				_AnalogRef = _Value << ANALOG_REF_FILTER_SHIFT;
+			_AnalogRefValid = true;
+		}
+		_AnalogValues[_Channel] = _Value;
+		_AnalogFresh |= _BV(_Channel);
+	}
+
+	_AnalogConverting = _AnalogSelected;
+	if (++_AnalogSelected >= ANALOG_NB_CHANNELS)
+		_AnalogSelected = 0;
+	ADMUX = (ADMUX & ~ANALOG_MUX_MASK) | _AnalogSelected;
 }
 
 /*
 	ANALOG function
-	Digitize By, subtract the digitized REF value
+	Start converting the analog channels in turn. The first two conversions are of channel 0,
+	so that the channel of each conversion is known.
 	Parameters:
 
 	Returns:
-		uint16_t : By digitized
+		void
+*/
+static void AnalogStartAcquisition()
+{
+	noInterrupts();
+	_AnalogFresh = 0;
+	_AnalogRefValid = false;
+	_AnalogDiscard = 0;
+	_AnalogConverting = 0;
+	_AnalogSelected = 0;
+	// Reference set by analogReference, result right adjusted, channel 0
+	ADMUX = EXTERNAL << REFS0;
+	// Free running, MUX5 cleared on the MEGA
+	ADCSRB = 0;
+	ADCSRA = _BV(ADEN) | _BV(ADSC) | _BV(ADATE) | _BV(ADIF) | _BV(ADIE) | ANALOG_ADC_PRESCALER;
+	interrupts();
+}
+
+/*
+	ANALOG function
+	Stop converting the analog channels
+	Parameters:
+
+	Returns:
+		void
+*/
+static void AnalogStopAcquisition()
+{
+	ADCSRA &= ~(_BV(ADATE) | _BV(ADIE));
+}
+
+/*
+	ANALOG function
+	Read the last conversion of a channel not read yet, wait for it if needed
+	Parameters:
+		[in]	Pin : analog pin of the channel
+		[in]	Referenced : subtract the filtered REF value
+		[out]	pValue : value digitized, in a 16 bits format
+	Returns:
+		eError : kAdcTimeOutError if no conversion completes within A_D_CONVERSION_TIMEOUT
+*/
+static eError AnalogReadChannel(uint8_t Pin, bool Referenced, uint16_t *pValue)
+{
+	uint8_t _Channel = Pin - A0;
+	uint32_t _WaitStart = DiagnosticsStart();
+	unsigned long _Start = millis();
+
+	while (!(_AnalogFresh & _BV(_Channel)) || (Referenced && !_AnalogRefValid))
+		if (millis() - _Start >= A_D_CONVERSION_TIMEOUT)
+		{
+			DiagnosticsAddTime(kDiagAdc, _WaitStart);
+			return kAdcTimeOutError;
+		}
+	DiagnosticsAddTime(kDiagAdc, _WaitStart);
+
+	// 16 bits are not read atomically
+	noInterrupts();
+	int16_t _Value = _AnalogValues[_Channel];
+	uint16_t _Ref = _AnalogRef;
+	_AnalogFresh &= ~_BV(_Channel);
+	interrupts();
+
+	if (Referenced)
+		_Value = _Value - (int16_t)((_Ref + _BV(ANALOG_REF_FILTER_SHIFT - 1)) >> ANALOG_REF_FILTER_SHIFT) + ANALOG_OFFSET;
+	*pValue = (uint16_t)_Value << ANALOG_SHIFT;
+	return kNoError;
+}
+
+/*
+	ANALOG function
+	Digitize Bx, subtract the digitized REF value
+	Parameters:
+		[out]	pValue : Bx digitized
+	Returns:
+		eError
 */
-uint16_t AnalogDigitizeBy()
+eError AnalogDigitizeBx(uint16_t *pValue)
 {
-	return ((analogRead(A_BY_PIN) - analogRead(A_REF_PIN)) + ANALOG_OFFSET) << ANALOG_SHIFT;
+	return AnalogReadChannel(A_BX_PIN, true, pValue);
 }
 
 /*
 	ANALOG function
-		Digitize Bz, subtract the digitized REF value
+	Digitize By, subtract the digitized REF value
 	Parameters:
+		[out]	pValue : By digitized
+	Returns:
+		eError
+*/
+eError AnalogDigitizeBy(uint16_t *pValue)
+{
+	return AnalogReadChannel(A_BY_PIN, true, pValue);
+}
 
+/*
+	ANALOG function
+	Digitize Bz, subtract the digitized REF value
+	Parameters:
+		[out]	pValue : Bz digitized
 	Returns:
-		uint16_t : Bz digitized
+		eError
 */
-uint16_t AnalogDigitizeBz()
+eError AnalogDigitizeBz(uint16_t *pValue)
 {
-	return ((analogRead(A_BZ_PIN) - analogRead(A_REF_PIN)) + ANALOG_OFFSET) << ANALOG_SHIFT;
+	return AnalogReadChannel(A_BZ_PIN, true, pValue);
 }
 
 /*
 	ANALOG function
 	Digitize temperature
 	Parameters:
-	
+		[out]	pValue : temperature digitized
 	Returns:
-		uint16_t : temperature digitized
+		eError
 */
-uint16_t AnalogDigitizeTemp()
+eError AnalogDigitizeTemp(uint16_t *pValue)
 {
-	return analogRead(A_TEMPERATURE_PIN) << ANALOG_SHIFT;
+	return AnalogReadChannel(A_TEMPERATURE_PIN, false, pValue);
 }
 
 /*
@@ -233,6 +557,12 @@ void AnalogSetOptions(uint8_t Options)
 	digitalWrite(A_LP_PIN,	bitRead(Options, B_LP));
 	digitalWrite(A_INV_PIN, bitRead(Options, B_INV));
 	digitalWrite(A_EMR_PIN, bitRead(Options, B_EMR));
+
+	// Conversions started before are not read
+	noInterrupts();
+	_AnalogFresh = 0;
+	_AnalogDiscard = ANALOG_SETTLING_CONVERSIONS;
+	interrupts();
 }
 
 /*
@@ -252,6 +582,9 @@ void MiscSetDigitalAnalogMode(eMode Mode)
 			// If not already configured in this mode
 			if (_MV2Mode != kConfiguredDigital)
 			{
+				// The ADC is not used in digital mode
+				if (_MV2Mode == kConfiguredAnalog)
+					AnalogStopAcquisition();
 				// Configure digital mode pin
 				MiscConfigureDigitalModePin();		
 				//Start SPI
@@ -266,15 +599,20 @@ void MiscSetDigitalAnalogMode(eMode Mode)
 			// If not already configured in this mode
 			if (_MV2Mode != kConfiguredAnalog)
 			{
-				// Ensure SPI is disabled
+				// Ensure SPI is disabled, a session ends with the digital mode
 		        if (_MV2Mode == kConfiguredDigital)
+		        {
+		            DigitalEndSpiSession();
 		            SPI.end();
+		        }
 				// Configure analog mode PIN
 				MiscConfigureAnalogModePin();
 				// Set analog reference to external
 				analogReference(EXTERNAL);
                 // Settling time
                 delay(1);
+				// Convert the analog channels in turn
+				AnalogStartAcquisition();
 				// Update variable _MV2Mode
 				_MV2Mode = kConfiguredAnalog;
 			}
@@ -368,3 +706,129 @@ void MiscConfigureDigitalModePin()
     // Initialize INIT to low
     digitalWrite(D_INIT_PIN, LOW);
 }
+
+
+/*
+	MISCELLANEOUS function
+	Interrupt Service Routine of the Timer1 compare match: count the sample timer ticks
+	Parameters:
+
+	Returns:
+		void
+*/
+ISR(TIMER1_COMPA_vect)
+{
+	_SampleTicks++;
+}
+
+/*
+	MISCELLANEOUS function
+	Start the sample timer, or stop it. The period achieved is the nearest one not longer than
+	the period requested that the timer clock divides: the same at 16 MHz up to 32768 us,
+	a multiple of 4 us above. Overruns are counted from 0 again.
+	Parameters:
+		[in]	Period : period of the ticks (us), 0 to stop the timer
+		[out]	pPeriod : period achieved (us), 0 if stopped
+	Returns:
+		eError : kSyntaxError if Period is shorter than SAMPLE_PERIOD_MIN
+*/
+eError MiscStartSampleTimer(uint16_t Period, uint16_t *pPeriod)
+{
+	if ((Period != 0) && (Period < SAMPLE_PERIOD_MIN))
+		return kSyntaxError;
+
+	// Stop the timer
+	TIMSK1 &= ~_BV(OCIE1A);
+	TCCR1B = 0;
+	_SampleTimerRunning = false;
+	*pPeriod = 0;
+	if (Period == 0)
+		return kNoError;
+
+	// Slower timer clock if the period doesn't fit in 16 bits
+	uint32_t _Cycles = (uint32_t)Period * (F_CPU / 1000000UL);
+	uint8_t _Clock = SAMPLE_TIMER_CLOCK_FAST;
+	uint8_t _Shift = SAMPLE_TIMER_SHIFT_FAST;
+	if ((_Cycles >> _Shift) > 0x10000UL)
+	{
+		_Clock = SAMPLE_TIMER_CLOCK_SLOW;
+		_Shift = SAMPLE_TIMER_SHIFT_SLOW;
+	}
+	uint32_t _TimerTicks = _Cycles >> _Shift;
+
+	noInterrupts();
+	_SampleTicks = 0;
+	interrupts();
+	_SampleTicksTaken = 0;
+	_SampleTickTaken = false;
+	_SampleOverruns = 0;
+
+	// CTC mode: the counter restarts from 0 on the compare match
+	TCCR1A = 0;
+	TCNT1 = 0;
+	OCR1A = _TimerTicks - 1;
+	TIFR1 = _BV(OCF1A);
+	TIMSK1 |= _BV(OCIE1A);
+	TCCR1B = _BV(WGM12) | _Clock;
+	_SampleTimerRunning = true;
+
+	*pPeriod = (_TimerTicks << _Shift) / (F_CPU / 1000000UL);
+	return kNoError;
+}
+
+/*
+	MISCELLANEOUS function
+	Check whether the sample timer is running
+	Parameters:
+
+	Returns:
+		bool : true if started by MiscStartSampleTimer
+*/
+bool MiscSampleTimerRunning()
+{
+	return _SampleTimerRunning;
+}
+
+/*
+	MISCELLANEOUS function
+	Take the tick elapsed since the last one taken, if any. The ticks elapsed before it are counted
+	as missed, except before the first tick taken since the start.
+	Parameters:
+
+	Returns:
+		bool : true if a tick elapsed
+*/
+bool MiscTakeSampleTick()
+{
+	uint16_t _Ticks;
+
+	// 16 bits are not read atomically
+	noInterrupts();
+	_Ticks = _SampleTicks;
+	interrupts();
+
+	if (_Ticks == _SampleTicksTaken)
+		return false;
+
+	if (_SampleTickTaken)
+	{
+		uint16_t _Missed = _Ticks - _SampleTicksTaken - 1;
+		_SampleOverruns = (_Missed < 0xFFFF - _SampleOverruns) ? _SampleOverruns + _Missed : 0xFFFF;
+	}
+	_SampleTicksTaken = _Ticks;
+	_SampleTickTaken = true;
+	return true;
+}
+
+/*
+	MISCELLANEOUS function
+	Number of ticks missed since the sample timer started
+	Parameters:
+
+	Returns:
+		uint16_t : number of ticks missed, 0xFFFF at most
+*/
+uint16_t MiscSampleOverruns()
+{
+	return _SampleOverruns;
+}
@@ -30,6 +30,12 @@
 //  31.03.17 PK - Add support for Arduino MEGA
 //	21.08.17 PK - Rename ﻿DIGITAL_TO_ANALOG to NDIGITAL_ANALOG_PIN
 //				- Define ﻿MV2_SPI_CLK_FREQ
+//	17.10.26 MB Add capture of Data Ready by interrupt (RISING edge) into a ring buffer
+//	17.10.26 MB Add direct port access to CS and DR, SPI session (DigitalBeginSpiSession)
+//	17.10.26 MB Analog acquisition by the ADC in free running mode, scanned by interrupt:
+//				AnalogDigitize* return an eError, kAdcTimeOutError if no conversion completes
+//	17.10.26 MB Add sample timer on Timer1 (MiscStartSampleTimer...)
+//	17.10.26 MB CS and DR port bits are typed descriptors (tPortBit) instead of macros
 //
 // Copyright (c) 2016 Metrolab Technology SA, Geneva,
 //	Switzerland
@@ -39,6 +45,7 @@
 
 #include "Arduino.h"
 #include "MV2HostCommands.h"
+#include "MV2HostConstants.h"
 #include "SPI.h"
 
 // Magnetic field outputs are referenced to VCC/2 available on the REF pin
@@ -52,6 +59,33 @@
 // Maximum conversion time is with a 16 bits resolution. The refresh rate is 0.375KHz (3ms)
 #define A_D_CONVERSION_TIMEOUT	5 // ms
 
+// Analog acquisition: in analog mode, the ADC converts A_BX_PIN..A_REF_PIN (A0..A4, channels 0..4)
+// in turn, in free running mode, with a prescaler of 32: 26 us per conversion at 16 MHz instead
+// of 104 us with the prescaler of analogRead. The conversion complete interrupt keeps the last
+// value of each channel, and REF filtered over about 2^ANALOG_REF_FILTER_SHIFT conversions, so
+// AnalogDigitize* only wait for a conversion of their channel not read yet.
+#define ANALOG_NB_CHANNELS		5
+#define ANALOG_ADC_PRESCALER	(_BV(ADPS2) | _BV(ADPS0))
+#define ANALOG_MUX_MASK			0x1F
+#define ANALOG_REF_FILTER_SHIFT	3
+// Conversions discarded after the options changed: the one completing and the one started
+#define ANALOG_SETTLING_CONVERSIONS	2
+
+// Capture: on each rising edge of Data Ready, an interrupt transfers up to CAPTURE_MAX_WORDS words
+// on SPI and stores the values read in a ring buffer of CAPTURE_BUFFER_LENGTH words (a power of 2)
+#if defined(__AVR_ATmega2560__)
+	#define CAPTURE_BUFFER_LENGTH	128
+#else
+	#define CAPTURE_BUFFER_LENGTH	64
+#endif
+
+// Sample timer: Timer1 in CTC mode, clocked at F_CPU / 8 (0.5 us at 16 MHz), or F_CPU / 64 for
+// the periods that don't fit in 16 bits. Timer1 is used on both the UNO and the MEGA.
+#define SAMPLE_TIMER_CLOCK_FAST		_BV(CS11)
+#define SAMPLE_TIMER_SHIFT_FAST		3
+#define SAMPLE_TIMER_CLOCK_SLOW		(_BV(CS11) | _BV(CS10))
+#define SAMPLE_TIMER_SHIFT_SLOW		6
+
 /*
 PIN CONFIGURATION
 
@@ -65,6 +99,18 @@ PIN CONFIGURATION
 #define VDD_PIN					A5 
 
 // DIGITAL MODE
+// Chip select and Data Ready are accessed for every SPI word: they are typed descriptors of their
+// port bit (tChipSelectPin, tDataReadyPin), resolved at compile time, instead of digitalWrite/
+// digitalRead which look up the pin at run time (single bit accesses compile to sbi/cbi/sbis)
+template <class Port, uint8_t Bit>
+struct tPortBit
+{
+	static void Clear()		{ Port::Register() &= ~_BV(Bit); }
+	static void Set()		{ Port::Register() |= _BV(Bit); }
+	static bool IsSet()		{ return (Port::Register() & _BV(Bit)) != 0; }
+};
+struct tPortB { static volatile uint8_t &Register() { return PORTB; } };
+
 #define MV2_SPI_CLK_FREQ        1000000
 #define D_DR_PIN				2
 #define D_INIT_PIN				7
@@ -73,11 +119,17 @@ PIN CONFIGURATION
     #define D_SPI_MOSI				11
     #define D_SPI_MISO				12
     #define D_SPI_CLK               13
+    struct tPinD { static volatile uint8_t &Register() { return PIND; } };
+    typedef tPortBit<tPortB, 2>	tChipSelectPin;		// D_CHIP_SELECT_PIN is PB2
+    typedef tPortBit<tPinD, 2>	tDataReadyPin;		// D_DR_PIN is PD2
 #elif defined(__AVR_ATmega2560__)   // MEGA 2560
     #define D_CHIP_SELECT_PIN       53
     #define D_SPI_MOSI              51
     #define D_SPI_MISO              50
     #define D_SPI_CLK               52
+    struct tPinE { static volatile uint8_t &Register() { return PINE; } };
+    typedef tPortBit<tPortB, 0>	tChipSelectPin;		// D_CHIP_SELECT_PIN is PB0
+    typedef tPortBit<tPinE, 4>	tDataReadyPin;		// D_DR_PIN is PE4
 #else
     #error "Unknown board"
 #endif
@@ -121,22 +173,33 @@ FORWARD DECLARATION for DIGITAL and ANALOG mode, MISCELLANEOUS
 */
 
 // DIGITAL
+void			DigitalBeginSpiSession();									// Keep the SPI transaction open, e.g. for a whole script
+void			DigitalEndSpiSession();										// Close the SPI transaction
 eError			DigitalWaitForDataReady();									// Wait for Data Ready
 eError			DigitalWriteAndRead(uint16_t Data, uint16_t *pReturnValue);	// Write value and read the previous selected data
 uint8_t			DigitalReadRegister(uint8_t Register);						// Read register
 void			DigitalSetInitBit(uint8_t Value);							// Set INIT bit
+eError			DigitalStartCapture(const uint16_t *pData, uint8_t NbData);	// Transfer data on SPI on each Data Ready, keep the values read
+void			DigitalStopCapture();										// Stop transferring data on Data Ready
+uint8_t			DigitalCaptureAvailable();									// Number of values captured and not read yet
+uint16_t		DigitalReadCapture();										// Read the oldest value captured
+uint16_t		DigitalCaptureOverruns();									// Number of Data Ready lost because the ring buffer was full
 
 // ANALOG
-uint16_t		AnalogDigitizeBx();											// Digitize Bx
-uint16_t		AnalogDigitizeBy();											// Digitize By
-uint16_t		AnalogDigitizeBz();											// Digitize Bz
-uint16_t		AnalogDigitizeTemp();										// Digitize Temperature
+eError			AnalogDigitizeBx(uint16_t *pValue);							// Digitize Bx
+eError			AnalogDigitizeBy(uint16_t *pValue);							// Digitize By
+eError			AnalogDigitizeBz(uint16_t *pValue);							// Digitize Bz
+eError			AnalogDigitizeTemp(uint16_t *pValue);						// Digitize Temperature
 void			AnalogSetOptions(uint8_t Options);							// Set OPTIONS bits (RA0, RA1, MA0, MA1, LP, INV, EMR)
 
 // MISCELLANEOUS
 void			MiscSetDigitalAnalogMode(eMode Mode);						// Set analog or digital mode
 void			MiscConfigureAnalogModePin();								// Configure PIN for analoge mode
 void			MiscConfigureDigitalModePin();								// Configure PIN for digital mode
+eError			MiscStartSampleTimer(uint16_t Period, uint16_t *pPeriod);	// Start the sample timer, return the period achieved
+bool			MiscSampleTimerRunning();									// Check whether the sample timer is running
+bool			MiscTakeSampleTick();										// Take the tick elapsed since the last one taken, if any
+uint16_t		MiscSampleOverruns();										// Number of ticks missed since the sample timer started
 
 // Return MV2 mode
 eMode GetMV2Mode();
@@ -5,7 +5,7 @@
 // Interface definition between host and Arduino
 //
 // Description:
-// See MV2HostCommands.cpp
+// See MV2HostCommands.h
 //
 // Coding Conventions:
 //	- Variable names use the "InterCaps" convention
@@ -20,12 +20,80 @@
 // Change log:
 //	01.02.16 SD	Original version
 //	19.04.16 SD Add SIZE_OF_MV2_CMD_INFO constant
+//	17.10.26 MB Define MV2_CMD_INFO and MV2_BAUD_RATES here, in program memory on the Arduino
+//	17.10.26 MB Add GetCommandType, GetCommandReturnsValue, GetCommandCode and GetBaudRate
 //
 // Copyright (c) 2016 Metrolab Technology SA, Geneva,
 //	Switzerland
 
 #include "MV2HostCommands.h"
 
+// On the Arduino, constant tables are copied to SRAM unless they are kept in program memory,
+// where they are read with pgm_read_*. On the host they are ordinary constants.
+#if defined(__AVR__)
+	#include <avr/pgmspace.h>
+#endif
+#ifndef PROGMEM
+	#define PROGMEM
+#endif
+#ifndef pgm_read_byte
+	#define pgm_read_byte(p)		(*(const unsigned char *)(p))
+#endif
+#ifndef pgm_read_dword
+	#define pgm_read_dword(p)		(*(const unsigned long *)(p))
+#endif
+
+const tCommandInfo MV2_CMD_INFO[] PROGMEM =
+{
+//		Type		ContainsData	ReturnsValue				MV2_CMD	
+	{ kDigital,			false,			true,			MV2_CMD_READ_REGISTER_0			},		// kReadRegister0
+	{ kDigital,			false,			true,			MV2_CMD_READ_REGISTER_1			},		// kReadRegister1
+	{ kDigital,			false,			true,			MV2_CMD_READ_REGISTER_2			},		// kReadRegister2
+	{ kDigital,			true,			true,			MV2_CMD_WRITE_REGISTER_0		},		// kWriteRegister0
+	{ kDigital,			true,			true,			MV2_CMD_WRITE_REGISTER_1		},		// kWriteRegister1
+	{ kDigital,			true,			true,			MV2_CMD_WRITE_REGISTER_2		},		// kWriteRegister2
+	{ kDigital,			true,			false,			MV2_CMD_SET_INIT_BIT			},		// kSetInitBit
+	{ kDigital,			false,			false,			MV2_WAIT_FOR_DR_INTERRUPT		},		// kWaitForDrInterrupt
+	{ kAnalog,			false,			true,			MV2_CMD_DIGITIZE_B_X			},		// kDigitizeBx
+	{ kAnalog,			false,			true,			MV2_CMD_DIGITIZE_B_Y			},		// kDigitizeBy
+	{ kAnalog,			false,			true,			MV2_CMD_DIGITIZE_B_Z			},		// kDigitizeBz
+	{ kAnalog,			false,			true,			MV2_CMD_DIGITIZE_TEMP			},		// kDigitizeTemp
+	{ kAnalog,			true,			false,			MV2_CMD_SET_OPTIONS				},		// kSetOptions
+	{ kMisc,			true,			false,			MV2_CMD_SET_DIGITAL_ANALOG_MODE	},		// kSetDigitalAnalogMode
+	{ kMisc,			true,			false,			MV2_CMD_SET_LOOP_START			},		// kSetLoopStart
+	{ kMisc,			false,			false,			MV2_CMD_SET_LOOP_END			},		// kSetLoopEnd
+	{ kMisc,			false,			true,			MV2_CMD_GET_FW_VERSION			},		// kGetFwVersion
+	{ kMisc,			false,			false,			MV2_CMD_START_STREAM			},		// kStartStream
+	{ kMisc,			true,			false,			MV2_CMD_SET_BAUD_RATE			},		// kSetBaudRate
+	{ kMisc,			true,			false,			MV2_CMD_SET_AVERAGE_LOOP_START	},		// kSetAverageLoopStart
+	{ kMisc,			true,			false,			MV2_CMD_START_CAPTURE			},		// kStartCapture
+	{ kMisc,			true,			false,			MV2_CMD_SET_LOOP_COUNT_HIGH		},		// kSetLoopCountHigh
+	{ kMisc,			true,			false,			MV2_CMD_STORE_SCRIPT			},		// kStoreScript
+	{ kMisc,			true,			false,			MV2_CMD_RUN_SCRIPT				},		// kRunScript
+	{ kMisc,			true,			false,			MV2_CMD_SET_RESULT_ENCODING		},		// kSetResultEncoding
+	{ kMisc,			true,			true,			MV2_CMD_GET_TIMESTAMP			},		// kGetTimestamp
+	{ kMisc,			true,			true,			MV2_CMD_START_SAMPLE_TIMER		},		// kStartSampleTimer
+	{ kMisc,			false,			false,			MV2_CMD_WAIT_FOR_SAMPLE_TICK	},		// kWaitForSampleTick
+	{ kMisc,			false,			true,			MV2_CMD_GET_SAMPLE_OVERRUNS		},		// kGetSampleOverruns
+	{ kMisc,			true,			false,			MV2_CMD_START_TRIGGER			},		// kStartTrigger
+	{ kMisc,			true,			false,			MV2_CMD_SET_TRIGGER_LEVEL		},		// kSetTriggerLevel
+	{ kMisc,			true,			false,			MV2_CMD_SET_PRE_TRIGGER			},		// kSetPreTrigger
+	{ kMisc,			true,			false,			MV2_CMD_SET_POST_TRIGGER		},		// kSetPostTrigger
+	{ kMisc,			true,			true,			MV2_CMD_GET_DIAGNOSTICS			},		// kGetDiagnostics
+	{ kMisc,			true,			false,			MV2_CMD_START_BURST				},		// kStartBurst
+	{ kMisc,			true,			false,			MV2_CMD_SET_BURST_SAMPLES		}		// kSetBurstSamples
+};
+
+const unsigned long MV2_BAUD_RATES[NB_MV2_BAUD_RATES] PROGMEM =
+{
+	57600,
+	115200,
+	250000,
+	500000,
+	1000000,
+	2000000
+};
+
 #define SIZE_OF_MV2_CMD_INFO sizeof(MV2_CMD_INFO) / sizeof(MV2_CMD_INFO[0])
 
 /*
@@ -40,11 +108,58 @@ eError GetCommand(MV2_CMD Command, eCommand *pCommand)
 {
 	for (unsigned short _i = 0; _i < SIZE_OF_MV2_CMD_INFO; _i++)
 	{
-		if (MV2_CMD_INFO[_i].Command == Command)
+		if (pgm_read_byte(&MV2_CMD_INFO[_i].Command) == Command)
 		{
 			*pCommand = static_cast<eCommand>(_i);
 			return kNoError;
 		}
 	}
 	return kSyntaxError;
-}
\ No newline at end of file
+}
+/*
+	Get the type of a command
+	Parameters:
+		[in]	Command : command
+	Returns:
+		eCommandType
+*/
+eCommandType GetCommandType(eCommand Command)
+{
+	return static_cast<eCommandType>(pgm_read_byte(&MV2_CMD_INFO[Command].Type));
+}
+
+/*
+	Check whether a command returns a value
+	Parameters:
+		[in]	Command : command
+	Returns:
+		bool
+*/
+bool GetCommandReturnsValue(eCommand Command)
+{
+	return pgm_read_byte(&MV2_CMD_INFO[Command].ReturnsValue) != 0;
+}
+
+/*
+	Get the raw command of a command
+	Parameters:
+		[in]	Command : command
+	Returns:
+		MV2_CMD
+*/
+MV2_CMD GetCommandCode(eCommand Command)
+{
+	return pgm_read_byte(&MV2_CMD_INFO[Command].Command);
+}
+
+/*
+	Get a baud rate of the serial link
+	Parameters:
+		[in]	BaudRateIndex : index in MV2_BAUD_RATES, less than NB_MV2_BAUD_RATES
+	Returns:
+		unsigned long : baud rate
+*/
+unsigned long GetBaudRate(unsigned char BaudRateIndex)
+{
+	return pgm_read_dword(&MV2_BAUD_RATES[BaudRateIndex]);
+}
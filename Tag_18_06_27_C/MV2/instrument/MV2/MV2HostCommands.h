@@ -24,6 +24,20 @@
 //	25.04.16 SD Delete errors constants
 //  07.07.16 PK Delete kTimeoutError, kUnknownError
 //	12.09.16 SD Add GetFwVersion command
+//	17.10.26 MB Add StartStream command
+//	17.10.26 MB Add SetBaudRate command and MV2_BAUD_RATES
+//	17.10.26 MB Add SetAverageLoopStart command
+//	17.10.26 MB Add StartCapture command and kCaptureOverrunError
+//	17.10.26 MB Add SetLoopCountHigh command
+//	17.10.26 MB Add StoreScript and RunScript commands, kScriptSlotError
+//	17.10.26 MB Add SetResultEncoding command
+//	17.10.26 MB Add GetTimestamp command
+//	17.10.26 MB Add StartSampleTimer, WaitForSampleTick and GetSampleOverruns commands, kSampleTimerError
+//	17.10.26 MB Add StartTrigger, SetTriggerLevel, SetPreTrigger and SetPostTrigger commands
+//	17.10.26 MB Add GetDiagnostics command
+//	17.10.26 MB Add StartBurst and SetBurstSamples commands
+//	17.10.26 MB Define MV2_CMD_INFO and MV2_BAUD_RATES once in MV2HostCommands.cpp, in program memory
+//				on the Arduino, add GetCommandType, GetCommandReturnsValue, GetCommandCode and GetBaudRate
 //
 // Copyright (c) 2016 Metrolab Technology SA, Geneva,
 //	Switzerland
@@ -52,6 +66,25 @@ typedef unsigned char					MV2_CMD;
 #define MV2_CMD_SET_LOOP_START			0xC2
 #define MV2_CMD_SET_LOOP_END			0xC3
 #define MV2_CMD_GET_FW_VERSION			0xC4
+#define MV2_CMD_START_STREAM			0xC5
+#define MV2_CMD_SET_BAUD_RATE			0xC6
+#define MV2_CMD_SET_AVERAGE_LOOP_START	0xC7
+#define MV2_CMD_START_CAPTURE			0xC8
+#define MV2_CMD_SET_LOOP_COUNT_HIGH		0xC9
+#define MV2_CMD_STORE_SCRIPT			0xCA
+#define MV2_CMD_RUN_SCRIPT				0xCB
+#define MV2_CMD_SET_RESULT_ENCODING		0xCC
+#define MV2_CMD_GET_TIMESTAMP			0xCD
+#define MV2_CMD_START_SAMPLE_TIMER		0xCE
+#define MV2_CMD_WAIT_FOR_SAMPLE_TICK	0xCF
+#define MV2_CMD_GET_SAMPLE_OVERRUNS		0xD0
+#define MV2_CMD_START_TRIGGER			0xD1
+#define MV2_CMD_SET_TRIGGER_LEVEL		0xD2
+#define MV2_CMD_SET_PRE_TRIGGER			0xD3
+#define MV2_CMD_SET_POST_TRIGGER		0xD4
+#define MV2_CMD_GET_DIAGNOSTICS			0xD5
+#define MV2_CMD_START_BURST				0xD6
+#define MV2_CMD_SET_BURST_SAMPLES		0xD7
 
 // Enumeration of errors
 typedef enum {
@@ -61,11 +94,14 @@ typedef enum {
 	kOutOfMemoryError					= 103,
 	kNestedLoopError					= 104,
 	kUnspecifiedLoopError				= 105, 
+	kScriptSlotError					= 106,
 	kBadCrcError						= 201,
 	kScriptLengthTooLargeError			= 202,
 	kNoValidDataFromHostError			= 203,
 	kTransmissionError					= 204,
 	kAdcTimeOutError					= 301,
+	kCaptureOverrunError				= 302,
+	kSampleTimerError					= 303,
 } eError;
 
 // Enumeration of command numbers
@@ -86,7 +122,26 @@ typedef enum {
 	kSetDigitalAnalogMode,
 	kSetLoopStart,
 	kSetLoopEnd,
-	kGetFwVersion
+	kGetFwVersion,
+	kStartStream,
+	kSetBaudRate,
+	kSetAverageLoopStart,
+	kStartCapture,
+	kSetLoopCountHigh,
+	kStoreScript,
+	kRunScript,
+	kSetResultEncoding,
+	kGetTimestamp,
+	kStartSampleTimer,
+	kWaitForSampleTick,
+	kGetSampleOverruns,
+	kStartTrigger,
+	kSetTriggerLevel,
+	kSetPreTrigger,
+	kSetPostTrigger,
+	kGetDiagnostics,
+	kStartBurst,
+	kSetBurstSamples
 } eCommand;
 
 // Enumeration of command type
@@ -104,35 +159,27 @@ typedef enum {
 
 
 /*
-	Structure MV2_CMD_INFO contains all informations about each command
+	Structure MV2_CMD_INFO contains all informations about each command, indexed by eCommand.
+	On the Arduino it is kept in program memory (PROGMEM): the firmware reads it with
+	GetCommandType, GetCommandReturnsValue and GetCommandCode.
 */
-const struct
+typedef struct
 {
-	eCommandType		Type;
+	unsigned char		Type;				// eCommandType
 	bool				ContainsData;
-	bool				ReturnsValue;		
+	bool				ReturnsValue;
 	MV2_CMD				Command;
-} MV2_CMD_INFO[] =
-{
-//		Type		ContainsData	ReturnsValue				MV2_CMD	
-	{ kDigital,			false,			true,			MV2_CMD_READ_REGISTER_0			},		// kReadRegister0
-	{ kDigital,			false,			true,			MV2_CMD_READ_REGISTER_1			},		// kReadRegister1
-	{ kDigital,			false,			true,			MV2_CMD_READ_REGISTER_2			},		// kReadRegister2
-	{ kDigital,			true,			true,			MV2_CMD_WRITE_REGISTER_0		},		// kWriteRegister0
-	{ kDigital,			true,			true,			MV2_CMD_WRITE_REGISTER_1		},		// kWriteRegister1
-	{ kDigital,			true,			true,			MV2_CMD_WRITE_REGISTER_2		},		// kWriteRegister2
-	{ kDigital,			true,			false,			MV2_CMD_SET_INIT_BIT			},		// kSetInitBit
-	{ kDigital,			false,			false,			MV2_WAIT_FOR_DR_INTERRUPT		},		// kWaitForDrInterrupt
-	{ kAnalog,			false,			true,			MV2_CMD_DIGITIZE_B_X			},		// kDigitizeBx
-	{ kAnalog,			false,			true,			MV2_CMD_DIGITIZE_B_Y			},		// kDigitizeBy
-	{ kAnalog,			false,			true,			MV2_CMD_DIGITIZE_B_Z			},		// kDigitizeBz
-	{ kAnalog,			false,			true,			MV2_CMD_DIGITIZE_TEMP			},		// kDigitizeTemp
-	{ kAnalog,			true,			false,			MV2_CMD_SET_OPTIONS				},		// kSetOptions
-	{ kMisc,			true,			false,			MV2_CMD_SET_DIGITAL_ANALOG_MODE	},		// kSetDigitalAnalogMode
-	{ kMisc,			true,			false,			MV2_CMD_SET_LOOP_START			},		// kSetLoopStart
-	{ kMisc,			false,			false,			MV2_CMD_SET_LOOP_END			},		// kSetLoopEnd
-	{ kMisc,			false,			true,			MV2_CMD_GET_FW_VERSION			}		// kGetFwVersion
-};															
+} tCommandInfo;
+extern const tCommandInfo MV2_CMD_INFO[];
+
+/*
+	Baud rates of the serial link, selected by the value of MV2_CMD_SET_BAUD_RATE.
+	The link always starts at the default baud rate.
+	On the Arduino they are kept in program memory (PROGMEM): the firmware reads them with GetBaudRate.
+*/
+#define NB_MV2_BAUD_RATES				6
+#define MV2_DEFAULT_BAUD_RATE_INDEX		0
+extern const unsigned long MV2_BAUD_RATES[NB_MV2_BAUD_RATES];
 
 /*
 	Get command
@@ -144,4 +191,9 @@ const struct
 */
 eError GetCommand(MV2_CMD Command, eCommand *pCommand);
 
+eCommandType GetCommandType(eCommand Command);
+bool GetCommandReturnsValue(eCommand Command);
+MV2_CMD GetCommandCode(eCommand Command);
+unsigned long GetBaudRate(unsigned char BaudRateIndex);
+
 #endif // MV2_HOST_COMMANDS_H
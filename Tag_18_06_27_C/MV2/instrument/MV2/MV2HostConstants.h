@@ -21,6 +21,27 @@
 //	25.02.16 SD	Original version
 //	07.07.16 SD Fix comments
 //  02.04.17 PK Increase MAX_RESPONSE_LENGTH for Arduino MEGA
+//	17.10.26 MB Add STREAM_END_ERROR_DESC
+//	17.10.26 MB Add SCRIPT_BUFFER_COUNT, reduce MAX_RESPONSE_LENGTH accordingly
+//				Remove HOST_TO_MV2_TRANSFER_LONG_TIMEOUT: scripts are received without blocking
+//	17.10.26 MB Add BAUD_RATE_CONFIRM_TIMEOUT
+//	17.10.26 MB Add RESPONSE_MINIMUM_LENGTH
+//	17.10.26 MB Add framing constants, CRC is now CRC-16/CCITT (see MV2Crc.h)
+//	17.10.26 MB Add sequence number to script and response headers
+//	17.10.26 MB Add flags to the response header: RESPONSE_FLAG_AVERAGED
+//	17.10.26 MB Add CAPTURE_MAX_WORDS
+//	17.10.26 MB Reduce MAX_RESPONSE_LENGTH by the size of the decoded script (see MV2ScriptUtility.h)
+//	17.10.26 MB Add MAX_LOOP_DEPTH, loops with 16-bit counts. Reduce MAX_RESPONSE_LENGTH for the larger decoded script
+//	17.10.26 MB Add SCRIPT_SLOT_COUNT, reduce MAX_RESPONSE_LENGTH by the size of the script slots
+//	17.10.26 MB Add result encodings (RESULT_ENCODING_*)
+//	17.10.26 MB Add TIMESTAMP_MAX_SHIFT and TIMESTAMP_SATURATED
+//	17.10.26 MB Add chunked responses: RESPONSE_FLAG_CHUNK, RESPONSE_FLAG_CHUNK_END
+//	17.10.26 MB Add SAMPLE_PERIOD_MIN, MV2_CMD_SET_LOOP_COUNT_HIGH also precedes MV2_CMD_START_SAMPLE_TIMER
+//	17.10.26 MB Add trigger constants (TRIGGER_*), MV2_CMD_SET_LOOP_COUNT_HIGH also precedes the trigger settings
+//	17.10.26 MB Add diagnostics words (DIAG_*)
+//	17.10.26 MB Add burst constants (BURST_*), MV2_CMD_SET_LOOP_COUNT_HIGH also precedes MV2_CMD_SET_BURST_SAMPLES
+//	17.10.26 MB Add DIAG_TX_EMPTY
+//	17.10.26 MB Increase MAX_RESPONSE_LENGTH by the SRAM copies of MV2_CMD_INFO and MV2_BAUD_RATES, now in program memory
 //
 // Copyright (c) 2016 Metrolab Technology SA, Geneva,
 //	Switzerland
@@ -28,48 +49,218 @@
 #ifndef MV2_HOST_CONSTANTS_H
 #define MV2_HOST_CONSTANTS_H
 
+/* Scripts and responses are sent as frames:
+--------------------
+|     FLAG          | 1 byte
+--------------------
+|     CONTENTS      | script buffer or response, escaped
+--------------------
+|     FLAG          | 1 byte
+--------------------
+A FLAG or ESCAPE byte of the contents is sent as ESCAPE followed by the byte XOR ESCAPE_MASK,
+so FLAG only appears at frame boundaries: after a lost or corrupted byte the receiver
+discards the current frame and resynchronizes on the next FLAG.
+*/
+#define FRAME_FLAG								0x7E
+#define FRAME_ESCAPE							0x7D
+#define FRAME_ESCAPE_MASK						0x20
+
 /* Script buffer is defined as follows:
 --------------------
-|     HEADER        | 1 word
+|     HEADER        | 2 words: length (bytes), sequence number
 --------------------
 |     SCRIPT        | BUFFER_LENGTH words
 --------------------
-|     CRC           | 1 word
+|     CRC           | 1 word, CRC-16/CCITT of header and script
 --------------------
 */
 // Define script buffer constants. Expressed as 16-bit word
 #define SCRIPT_BUFFER_LENGTH					64
-#define SCRIPT_BUFFER_HEADER_LENGTH				1
+#define SCRIPT_BUFFER_HEADER_LENGTH				2
 #define SCRIPT_BUFFER_CRC_LENGTH				1
 #define SCRIPT_BUFFER_ADDITIONAL_INFOS_LENGTH	(SCRIPT_BUFFER_HEADER_LENGTH + SCRIPT_BUFFER_CRC_LENGTH)
+#define SCRIPT_SEQUENCE_INDEX					1
+
+// The host numbers its scripts, the response of a script carries the same sequence number.
+// The Arduino keeps the response of the last script it executed: when the host sends a script
+// again with the same sequence number because the response was lost or corrupted, the Arduino
+// sends that response again instead of executing the script a second time.
+
+// Loops (MV2_CMD_SET_LOOP_START or MV2_CMD_SET_AVERAGE_LOOP_START ... MV2_CMD_SET_LOOP_END) nest up
+// to MAX_LOOP_DEPTH levels; an averaged loop contains no loop. The value of the loop start is the
+// low byte of the count; MV2_CMD_SET_LOOP_COUNT_HIGH just before it gives the high byte.
+// It gives the high byte of the period of MV2_CMD_START_SAMPLE_TIMER, and of the values of
+// MV2_CMD_SET_TRIGGER_LEVEL, MV2_CMD_SET_PRE_TRIGGER, MV2_CMD_SET_POST_TRIGGER and
+// MV2_CMD_SET_BURST_SAMPLES the same way.
+#define MAX_LOOP_DEPTH							8
+
+// A script starting with MV2_CMD_STORE_SCRIPT (its value is the slot) is decoded and kept in a slot
+// instead of being executed. A script made of MV2_CMD_RUN_SCRIPT alone executes the script of its slot,
+// so a script executed many times is sent once. A script decoded with an error leaves its slot unchanged.
+// Each slot takes the size of a decoded script.
+#if defined(__AVR_ATmega328P__)     // UNO
+    #define SCRIPT_SLOT_COUNT					1
+#elif defined(__AVR_ATmega2560__)   // MEGA 2560
+    #define SCRIPT_SLOT_COUNT					4
+#else
+    #error "Unknown board"
+#endif
+
+// Number of script buffers: one script is executed while the next one is received.
+// This is also the maximum number of scripts the host may submit without reading the responses.
+#define SCRIPT_BUFFER_COUNT						2
 
-// Define transfer timeout
-#define HOST_TO_MV2_TRANSFER_LONG_TIMEOUT		100000000
+// Define transfer timeout (ms): maximum time between two bytes of a script
 #define HOST_TO_MV2_TRANSFER_SHORT_TIMEOUT		2000
 
+// After switching baud rate, the Arduino reverts to the default baud rate unless it receives
+// a valid script within this time (ms)
+#define BAUD_RATE_CONFIRM_TIMEOUT				500
+
 /* Response is defined as follows:
 --------------------
-|     HEADER        | 1 word
+|     HEADER        | 3 words: length (bytes), sequence number of the script, flags
 --------------------
 |     RESULTS       | RESULTS_LENGTH words
 --------------------
 |     STATUS        | 2 words
 --------------------
-|     CRC           | 1 word
+|     CRC           | 1 word, CRC-16/CCITT of header, results and status
 --------------------
 */
 // Define constant. Expressed as 16-bits word.
 // Note: should leave 512B free (check by setting DEBUG to 1 in MV2.ino).
+// MV2_CMD_INFO and MV2_BAUD_RATES are in program memory (see MV2HostCommands.cpp): their SRAM copies,
+// one per file using them (588 bytes), are given back to the response.
 #if defined(__AVR_ATmega328P__)     // UNO
-    #define MAX_RESPONSE_LENGTH                        500 
+    #define MAX_RESPONSE_LENGTH                        483 
 #elif defined(__AVR_ATmega2560__)   // MEGA 2560
-    #define MAX_RESPONSE_LENGTH                        3565 
+    #define MAX_RESPONSE_LENGTH                        3176 
 #else
     #error "Unknown board"
 #endif
-#define RESPONSE_HEADER_LENGTH					1
+#define RESPONSE_HEADER_LENGTH					3
+#define RESPONSE_SEQUENCE_INDEX					1
+#define RESPONSE_FLAGS_INDEX					2
 #define RESPONSE_STATUS_LENGTH					2
 #define RESPONSE_CRC_LENGTH						1
 #define MAX_RESULTS_LENGTH						(MAX_RESPONSE_LENGTH-RESPONSE_HEADER_LENGTH-RESPONSE_STATUS_LENGTH-RESPONSE_CRC_LENGTH)
+#define RESPONSE_MINIMUM_LENGTH					(RESPONSE_HEADER_LENGTH+RESPONSE_STATUS_LENGTH+RESPONSE_CRC_LENGTH)
+
+// Results encoding, value of MV2_CMD_SET_RESULT_ENCODING, for the response of its script.
+// RESULT_ENCODING_RAW: one word per result. Otherwise the results are preceded by their number
+// and sent as a stream of bits, low bits first, completed with 0 up to a word:
+//	- bits 0..3: number of low bits always 0 in every result (e.g. ANALOG_SHIFT), not sent.
+//	  Without RESULT_ENCODING_DELTA, each result then takes the 16 - shift bits left.
+//	- bit 4, RESULT_ENCODING_DELTA: each result is the difference to the result stride positions
+//	  before (0 for the first ones), zigzag coded (0, -1, 1, -2... as 0, 1, 2, 3...), then sent as
+//	  a varint: bytes of 7 bits, low bits first, bit 7 set if another byte follows.
+//	- bits 5..7: stride - 1, e.g. the number of results of one set of measurements.
+#define RESULT_ENCODING_RAW						0x00
+#define RESULT_ENCODING_SHIFT_MASK				0x0F
+#define RESULT_ENCODING_DELTA					0x10
+#define RESULT_ENCODING_STRIDE_SHIFT			5
+
+// Timestamps: MV2_CMD_GET_TIMESTAMP returns the time elapsed since the previous timestamp, in
+// units of 2^value us (value at most TIMESTAMP_MAX_SHIFT). The time left over by the units is
+// carried to the next timestamp, so the sum of the timestamps follows the Arduino clock.
+// A longer time returns TIMESTAMP_SATURATED, and the next timestamp starts from there.
+#define TIMESTAMP_MAX_SHIFT						15
+#define TIMESTAMP_SATURATED						0xFFFF
+
+// Sample timer: MV2_CMD_START_SAMPLE_TIMER starts a hardware timer ticking every value us (at least
+// SAMPLE_PERIOD_MIN, 0 stops it) and returns the period it achieves, the nearest one not longer.
+// MV2_CMD_WAIT_FOR_SAMPLE_TICK waits for the next tick, so the commands after it start at a fixed
+// rate whatever the time the script takes. When more than one tick elapsed since the previous
+// wait, the ticks before the last one are missed: MV2_CMD_GET_SAMPLE_OVERRUNS returns their
+// number since the timer started.
+#define SAMPLE_PERIOD_MIN						50
+
+// Response flags
+// The loops started with MV2_CMD_SET_AVERAGE_LOOP_START returned one value per command:
+// the average of the values of all iterations, instead of the value of every iteration
+#define RESPONSE_FLAG_AVERAGED					0x0001
+// High byte of the flags: encoding of the results (RESULT_ENCODING_*), so that the responses
+// sent raw, e.g. when the script is rejected, are told apart
+#define RESPONSE_FLAGS_ENCODING_SHIFT			8
+
+// A script returning more than MAX_RESULTS_LENGTH results sends them in chunks, each in a frame
+// of its own, with its own encoding, flag RESPONSE_FLAG_CHUNK, error code kNoError and the index
+// of the chunk (0, 1...) as error description. It ends with a response with the flags of the
+// script and RESPONSE_FLAG_CHUNK_END: its only result is the number of chunks sent, then the
+// status of the script. Its results are those of the chunks, in order.
+// A chunked response is not kept: a script sent again is executed again.
+#define RESPONSE_FLAG_CHUNK						0x0002
+#define RESPONSE_FLAG_CHUNK_END					0x0004
+
+// A stream (script starting with MV2_CMD_START_STREAM) sends one response per execution
+// of the script. It ends with an error response, or with a response without results,
+// error code kNoError and this error description.
+#define STREAM_END_ERROR_DESC					0xFFFF
+
+// A capture (script starting with MV2_CMD_START_CAPTURE, its value is the number of Data Ready
+// per response) writes the other commands, at most CAPTURE_MAX_WORDS register writes, on each
+// Data Ready. It ends like a stream; kCaptureOverrunError has the number of Data Ready lost.
+#define CAPTURE_MAX_WORDS						8
+
+// A trigger (script starting with MV2_CMD_START_TRIGGER) executes the other commands over and over,
+// one execution being a sample, and keeps the last samples in a ring buffer. Its value is the kind
+// of trigger (TRIGGER_*) or'ed with the index of the result of a sample it watches:
+//	- TRIGGER_RISING, TRIGGER_FALLING: the result crosses the level,
+//	- TRIGGER_SLOPE_RISING, TRIGGER_SLOPE_FALLING: the result rises, or falls, by at least the level
+//	  since the previous sample.
+// MV2_CMD_SET_TRIGGER_LEVEL, MV2_CMD_SET_PRE_TRIGGER and MV2_CMD_SET_POST_TRIGGER in the script set
+// the level (0 by default), the number of samples kept before the trigger (0) and from the trigger
+// on (1). Once the samples before the trigger are taken, the trigger is armed; when it fires, one
+// response sends the time of the sample that fired (micros(), low word first) then the samples in
+// the order they were taken, and the trigger is armed again. The encoding of the script applies
+// without its shift, so that the time is not truncated. While waiting, a response without results,
+// error code kNoError and TRIGGER_ARMED_ERROR_DESC is sent every TRIGGER_HEARTBEAT_PERIOD (ms).
+// It ends like a stream.
+#define TRIGGER_RISING							0x00
+#define TRIGGER_FALLING							0x10
+#define TRIGGER_SLOPE_RISING					0x20
+#define TRIGGER_SLOPE_FALLING					0x30
+#define TRIGGER_KIND_MASK						0xF0
+#define TRIGGER_RESULT_MASK						0x0F
+#define TRIGGER_TIME_LENGTH						2
+#define TRIGGER_ARMED_ERROR_DESC				0xFFFE
+#define TRIGGER_HEARTBEAT_PERIOD				1000
+
+// Diagnostics (see MV2Diagnostics.h): MV2_CMD_GET_DIAGNOSTICS returns the word of its value.
+// Reading DIAG_SPI takes a snapshot of the counters, so a script reads DIAG_SPI first, then the
+// other words. Times are in us, 32 bits, low word first, summed since the Arduino started or since
+// MV2_CMD_GET_DIAGNOSTICS with DIAG_RESET:
+//	- DIAG_SPI: SPI transfers, the words transferred at MV2_SPI_CLK_FREQ (counted, not timed),
+//	- DIAG_DATA_READY: waits for Data Ready,
+//	- DIAG_ADC: waits for the ADC,
+//	- DIAG_TX: waits for room in the serial transmit buffer,
+//	- DIAG_IDLE: waits for a script or for the sample timer,
+//	- DIAG_DISPATCH: the rest of the time scripts are handled, the firmware itself.
+// Their sum is the time elapsed. Then the high-water marks: lowest free RAM (bytes), most bytes
+// queued in the serial transmit buffer, most results in a response. Then the number of times the
+// results of a started response were sent while the serial transmit buffer had run empty: the link
+// was idle, waiting for the firmware (see HostOutputPoll).
+#define DIAG_SPI								0
+#define DIAG_DATA_READY							2
+#define DIAG_ADC								4
+#define DIAG_TX									6
+#define DIAG_IDLE								8
+#define DIAG_DISPATCH							10
+#define DIAG_RAM_FREE_MIN						12
+#define DIAG_TX_QUEUED_MAX						13
+#define DIAG_RESPONSE_MAX						14
+#define DIAG_TX_EMPTY							15
+#define DIAG_LENGTH								16
+#define DIAG_RESET								0xFF
+
+// A burst (script starting with MV2_CMD_START_BURST) executes the other commands, one execution
+// being a sample, as fast as they run: the samples fill the response buffer without any serial
+// transfer in between, then one response sends them all. MV2_CMD_SET_BURST_SAMPLES in the script
+// sets the number of samples, 0 (the default) for as many as fit. The samples contain no loop.
+// The response starts with the time from the first sample to the last (us, low word first), so
+// the interval of the samples is that time divided by their number minus one. The encoding of
+// the script applies without its shift, like a trigger. The response is kept like the one of a script.
+#define BURST_TIME_LENGTH						2
 
 #endif // MV2_HOST_CONSTANTS_H
@@ -0,0 +1,282 @@
+// Name:
+//	MV2HostInput.cpp
+//
+// Purpose:
+// Receive scripts from the host
+//
+// Description:
+// See MV2HostInput.h
+//
+// Coding Conventions:
+//	- Variable names use the "InterCaps" convention
+//	- Local variables are prefixed with an underscore, '_'
+//	- Pointer variables are prefixed with 'p'
+//	- Enumerated types are prefixed with 'e'
+//	- Enumerated type values are prefixed with 'k'
+//	- Constants are all uppercase
+//	The above conventions can also be combined:
+//	- A local pointer variable would be prefixed '_p'
+//
+//
+// Change log:
+//	17.10.26 MB	Original version
+//	17.10.26 MB	Add baud rate negotiation
+//	17.10.26 MB	Receive scripts as frames, resynchronize on FRAME_FLAG after an error
+//	17.10.26 MB	Check the length as soon as it is received, the header also holds a sequence number
+//	17.10.26 MB	Check the baud rate confirm timeout also while all script buffers are in use
+//	17.10.26 MB	Read the baud rates with GetBaudRate
+//
+// Copyright (c) 2016 Metrolab Technology SA, Geneva,
+//	Switzerland
+
+#include "MV2HostInput.h"
+
+// State of a script buffer
+typedef enum {
+	kReceiving = 0,
+	kReady,
+	kExecuting
+} eScriptState;
+
+// Script buffers
+static tHostScript	_Scripts[SCRIPT_BUFFER_COUNT];
+static eScriptState	_ScriptStates[SCRIPT_BUFFER_COUNT];
+// Index of the buffer receiving the next script
+static uint8_t		_ReceivingIndex = 0;
+// Index of the next script to execute
+static uint8_t		_ExecutingIndex = 0;
+// A frame is being received: a FRAME_FLAG was received
+static bool			_InFrame = false;
+// The previous byte was FRAME_ESCAPE
+static bool			_Escaped = false;
+// Baud rate requested by the host, applied after the response is sent
+static int8_t		_RequestedBaudRateIndex = -1;
+// Baud rate is being tested until the host confirms it
+static bool			_BaudRateConfirmPending = false;
+static unsigned long	_BaudRateConfirmStart;
+
+/*
+	Clear serial buffer
+*/
+static void ClearSerialBuffer()
+{
+	while (Serial.available() > 0)
+		Serial.read();
+}
+
+/*
+	Mark the script being received as ready and receive the next one in the other buffer
+	Parameters:
+		[in]		Error : reception error
+		[in]		ErrorDesc : reception error description
+	Returns:
+		void
+*/
+static void EndReception(eError Error, uint16_t ErrorDesc)
+{
+	_Scripts[_ReceivingIndex].Error = Error;
+	_Scripts[_ReceivingIndex].ErrorDesc = ErrorDesc;
+	_ScriptStates[_ReceivingIndex] = kReady;
+	_ReceivingIndex = (_ReceivingIndex + 1) % SCRIPT_BUFFER_COUNT;
+
+	// After an error, ignore the rest of the frame
+	_InFrame = false;
+}
+
+/*
+	Move the bytes received from the host into the free script buffer
+	Parameters:
+	Returns:
+		void
+*/
+void HostInputPoll()
+{
+	tHostScript *_pScript = &_Scripts[_ReceivingIndex];
+	uint8_t *_pBytes = reinterpret_cast<uint8_t*>(_pScript->Buffer);
+
+	// Host did not confirm the new baud rate, even while all buffers are in use
+	if (_BaudRateConfirmPending && (millis() - _BaudRateConfirmStart > BAUD_RATE_CONFIRM_TIMEOUT))
+		HostInputConfirmBaudRate(false);
+
+	// All buffers are in use, leave data in the serial buffer
+	if (_ScriptStates[_ReceivingIndex] != kReceiving)
+		return;
+
+	while (Serial.available() > 0)
+	{
+		uint8_t _Byte = Serial.read();
+
+		// Frame boundary
+		if (_Byte == FRAME_FLAG)
+		{
+			// End of frame: check size
+			if (_InFrame && (_pScript->NbBytesReceived > 0))
+			{
+				if ((_pScript->NbBytesReceived < SCRIPT_BUFFER_ADDITIONAL_INFOS_LENGTH * sizeof(uint16_t)) ||
+					(_pScript->NbBytesReceived != _pScript->Buffer[0]))
+					EndReception(kNoValidDataFromHostError, _pScript->NbBytesReceived);
+				else
+					EndReception(kNoError, 0);
+				return;
+			}
+			// Start of frame, discard anything received before
+			_InFrame = true;
+			_Escaped = false;
+			_pScript->NbBytesReceived = 0;
+			_pScript->LastByteTime = millis();
+			continue;
+		}
+
+		// Ignore anything outside frames
+		if (!_InFrame)
+			continue;
+
+		// Unescape
+		if (_Byte == FRAME_ESCAPE)
+		{
+			_Escaped = true;
+			continue;
+		}
+		if (_Escaped)
+		{
+			_Byte ^= FRAME_ESCAPE_MASK;
+			_Escaped = false;
+		}
+
+		// Script too large
+		if (_pScript->NbBytesReceived >= SCRIPT_BUFFER_LENGTH * sizeof(uint16_t))
+		{
+			EndReception(kScriptLengthTooLargeError, _pScript->Buffer[0]);
+			return;
+		}
+
+		_pBytes[_pScript->NbBytesReceived++] = _Byte;
+		_pScript->LastByteTime = millis();
+
+		// Length received: check size
+		if ((_pScript->NbBytesReceived == sizeof(uint16_t)) &&
+			(_pScript->Buffer[0] > (SCRIPT_BUFFER_LENGTH * sizeof(uint16_t))))
+		{
+			EndReception(kScriptLengthTooLargeError, _pScript->Buffer[0]);
+			return;
+		}
+	}
+
+	// Transmission stopped in the middle of a script
+	if (_InFrame && (_pScript->NbBytesReceived > 0) &&
+		(millis() - _pScript->LastByteTime > HOST_TO_MV2_TRANSFER_SHORT_TIMEOUT))
+		EndReception(kTransmissionError, 0);
+}
+
+/*
+	Get the next received script
+	Parameters:
+	Returns:
+		tHostScript* : pointer to the script, NULL if no script is complete
+*/
+tHostScript *HostInputGetScript()
+{
+	if (_ScriptStates[_ExecutingIndex] != kReady)
+		return NULL;
+
+	_ScriptStates[_ExecutingIndex] = kExecuting;
+	return &_Scripts[_ExecutingIndex];
+}
+
+/*
+	Release the script returned by HostInputGetScript, its buffer is reused for reception
+	Parameters:
+	Returns:
+		void
+*/
+void HostInputReleaseScript()
+{
+	if (_ScriptStates[_ExecutingIndex] != kExecuting)
+		return;
+
+	_Scripts[_ExecutingIndex].NbBytesReceived = 0;
+	_ScriptStates[_ExecutingIndex] = kReceiving;
+	_ExecutingIndex = (_ExecutingIndex + 1) % SCRIPT_BUFFER_COUNT;
+}
+
+/*
+	Check whether the host has started a frame or sent data not processed yet
+	Parameters:
+	Returns:
+		bool
+*/
+bool HostInputAvailable()
+{
+	return	((_ScriptStates[_ReceivingIndex] == kReceiving) && _InFrame) ||
+			(Serial.available() > 0);
+}
+
+/*
+	Discard the script being received and any pending data from the host
+	Parameters:
+	Returns:
+		void
+*/
+void HostInputFlush()
+{
+	if (_ScriptStates[_ReceivingIndex] == kReceiving)
+		_Scripts[_ReceivingIndex].NbBytesReceived = 0;
+	_InFrame = false;
+	ClearSerialBuffer();
+}
+
+/*
+	Request a new baud rate. It is applied by HostInputApplyBaudRate.
+	Parameters:
+		[in]		BaudRateIndex : index in MV2_BAUD_RATES
+	Returns:
+		void
+*/
+void HostInputRequestBaudRate(uint8_t BaudRateIndex)
+{
+	_RequestedBaudRateIndex = BaudRateIndex;
+}
+
+/*
+	Apply the requested baud rate, once the response has been sent
+	Parameters:
+	Returns:
+		void
+*/
+void HostInputApplyBaudRate()
+{
+	if (_RequestedBaudRateIndex < 0)
+		return;
+
+	// Wait for the end of the response
+	Serial.flush();
+	Serial.begin(GetBaudRate(_RequestedBaudRateIndex), SERIAL_8N1);
+	_RequestedBaudRateIndex = -1;
+
+	// Wait for the host to confirm
+	_BaudRateConfirmPending = true;
+	_BaudRateConfirmStart = millis();
+}
+
+/*
+	Confirm or reject the baud rate being tested, according to the first script received
+	Parameters:
+		[in]		Valid : true if the script was received without error
+	Returns:
+		void
+*/
+void HostInputConfirmBaudRate(bool Valid)
+{
+	if (!_BaudRateConfirmPending)
+		return;
+
+	_BaudRateConfirmPending = false;
+
+	// Restore default baud rate and discard anything received at the wrong baud rate
+	if (!Valid)
+	{
+		Serial.flush();
+		Serial.begin(GetBaudRate(MV2_DEFAULT_BAUD_RATE_INDEX), SERIAL_8N1);
+		HostInputFlush();
+	}
+}
@@ -0,0 +1,118 @@
+// Name:
+//	MV2HostInput.h
+//
+// Purpose:
+// Receive scripts from the host
+//
+// Description:
+// Scripts are received without blocking into two script buffers, so that the
+// next script can be received while the current one is executed.
+// HostInputPoll must be called often enough to keep the serial receive buffer
+// from overflowing, e.g. between two commands of a script.
+//
+// Coding Conventions:
+//	- Variable names use the "InterCaps" convention
+//	- Local variables are prefixed with an underscore, '_'
+//	- Pointer variables are prefixed with 'p'
+//	- Enumerated types are prefixed with 'e'
+//	- Enumerated type values are prefixed with 'k'
+//	- Constants are all uppercase
+//	The above conventions can also be combined:
+//	- A local pointer variable would be prefixed '_p'
+//
+//
+// Change log:
+//	17.10.26 MB	Original version
+//	17.10.26 MB	Add baud rate negotiation
+//	17.10.26 MB	Scripts are received as frames (see MV2HostConstants.h)
+//
+// Copyright (c) 2016 Metrolab Technology SA, Geneva,
+//	Switzerland
+
+#ifndef MV2_HOST_INPUT_H
+#define MV2_HOST_INPUT_H
+
+#include "Arduino.h"
+#include "MV2HostCommands.h"
+#include "MV2HostConstants.h"
+
+// Script received from the host
+typedef struct
+{
+	// Script buffer, cast transmission buffer to uint16_t. Assume Endianness is little endian both on Arduino and Host.
+	uint16_t		Buffer[SCRIPT_BUFFER_LENGTH];
+	uint16_t		NbBytesReceived;		// Number of bytes received
+	unsigned long	LastByteTime;			// Time of the last byte received (ms)
+	eError			Error;					// Reception error
+	uint16_t		ErrorDesc;				// Reception error description
+} tHostScript;
+
+/*
+	Move the bytes received from the host into the free script buffer
+	Parameters:
+	Returns:
+		void
+*/
+void HostInputPoll();
+
+/*
+	Get the next received script
+	Parameters:
+	Returns:
+		tHostScript* : pointer to the script, NULL if no script is complete
+*/
+tHostScript *HostInputGetScript();
+
+/*
+	Release the script returned by HostInputGetScript, its buffer is reused for reception
+	Parameters:
+	Returns:
+		void
+*/
+void HostInputReleaseScript();
+
+/*
+	Check whether the host has started a frame or sent data not processed yet
+	Parameters:
+	Returns:
+		bool
+*/
+bool HostInputAvailable();
+
+/*
+	Discard the script being received and any pending data from the host
+	Parameters:
+	Returns:
+		void
+*/
+void HostInputFlush();
+
+/*
+	Request a new baud rate. It is applied by HostInputApplyBaudRate.
+	Parameters:
+		[in]		BaudRateIndex : index in MV2_BAUD_RATES
+	Returns:
+		void
+*/
+void HostInputRequestBaudRate(uint8_t BaudRateIndex);
+
+/*
+	Apply the requested baud rate, once the response has been sent.
+	Unless HostInputConfirmBaudRate is called within BAUD_RATE_CONFIRM_TIMEOUT,
+	the default baud rate is restored.
+	Parameters:
+	Returns:
+		void
+*/
+void HostInputApplyBaudRate();
+
+/*
+	Confirm or reject the baud rate being tested, according to the first script received
+	Parameters:
+		[in]		Valid : true if the script was received without error
+	Returns:
+		void
+*/
+void HostInputConfirmBaudRate(bool Valid);
+
+#endif // MV2_HOST_INPUT_H
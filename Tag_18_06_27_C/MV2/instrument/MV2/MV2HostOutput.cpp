@@ -22,6 +22,15 @@
 //	01.02.16 SD	Original version
 //	01.03.16 SD Fix bugs
 //	25.04.16 SD Handle error code only with eError
+//	17.10.26 MB Keep receiving the next script while sending the response
+//	17.10.26 MB Send the response as a frame (see MV2HostConstants.h) with a CRC-16/CCITT
+//	17.10.26 MB Add sequence number to the response, add ResendResponse
+//	17.10.26 MB Add flags to the response header
+//	17.10.26 MB Send the results while the script is executed (StartResponse, HostOutputPoll, EndResponse)
+//	17.10.26 MB Encode the results of started responses (RESULT_ENCODING_*)
+//	17.10.26 MB Send the results that don't fit in the response buffer in chunks
+//	17.10.26 MB Time the waits for room in the serial transmit buffer, sample its use and the response length
+//	17.10.26 MB Count the polls that find the serial transmit buffer empty, check that it takes a result
 //
 // Copyright (c) 2016 Metrolab Technology SA, Geneva,
 //	Switzerland
@@ -29,18 +38,116 @@
 #define _GLOBAL_RESPONSE_
 
 #include "MV2HostOutput.h"
+#include "MV2Diagnostics.h"
+
+// Response being sent while the script is executed, NULL if none
+static uint16_t *_pStartedResponse = NULL;
+// CRC of the words of the started response sent
+static uint16_t _StartedCrc;
+// Encoding and number of results of the last response, to send it again
+static uint8_t _Encoding = RESULT_ENCODING_RAW;
+static uint16_t _NbResults;
+// Number of results of the started response encoded, bits encoded and not sent yet
+static uint16_t _NbResultsEncoded;
+static uint32_t _Bits;
+static uint8_t _NbBits;
+// Chunked response: response buffer, NULL if none, sequence number, flags and encoding of the
+// script, number of chunks sent
+static uint16_t *_pChunkedResponse = NULL;
+static uint16_t _ChunkedSequence;
+static uint16_t _ChunkedFlags;
+static uint8_t _ChunkedEncoding;
+static uint16_t _NbChunks;
+
+// Room for a word in the serial transmit buffer: 2 bytes, both may be escaped
+#define WORD_MAX_FRAME_BYTES		4
+// A result is encoded in at most 2 words: 3 varint bytes after 15 bits not sent yet
+#define RESULT_MAX_FRAME_BYTES		(2 * WORD_MAX_FRAME_BYTES)
+// HostOutputPoll sends nothing unless the serial transmit buffer (one byte always free) takes a result
+#if (SERIAL_TX_BUFFER_SIZE - 1 < RESULT_MAX_FRAME_BYTES)
+	#error "SERIAL_TX_BUFFER_SIZE too small"
+#endif
+
+/*
+	Write a byte on the serial port, time the wait if the transmit buffer is full
+	Parameters:
+		[in]		Byte : byte to write
+	Returns:
+		void
+*/
+static void WriteByte(uint8_t Byte)
+{
+	if (!DIAGNOSTICS || (Serial.availableForWrite() > 0))
+	{
+		Serial.write(Byte);
+		return;
+	}
+	uint32_t _Start = DiagnosticsStart();
+	Serial.write(Byte);
+	DiagnosticsAddTime(kDiagTx, _Start);
+}
+
+/*
+	End a frame: write its last FRAME_FLAG
+	Parameters:
+
+	Returns:
+		void
+*/
+static void EndFrame()
+{
+	WriteByte(FRAME_FLAG);
+	// The transmit buffer is the fullest once the whole frame is written
+	DiagnosticsSampleTxQueue(Serial.availableForWrite());
+}
+
+/*
+	Send a byte of a frame, escaped if needed
+	Parameters:
+		[in]		Byte : byte to send
+	Returns:
+		void
+*/
+static void SendFrameByte(uint8_t Byte)
+{
+	if ((Byte == FRAME_FLAG) || (Byte == FRAME_ESCAPE))
+	{
+		WriteByte(FRAME_ESCAPE);
+		Byte ^= FRAME_ESCAPE_MASK;
+	}
+	WriteByte(Byte);
+}
+
+/*
+	Send a word of a frame, low byte first, and update the CRC
+	Parameters:
+		[in]		Word : word to send
+		[in/out]	pCrc : CRC of the words sent before
+	Returns:
+		void
+*/
+static void SendFrameWord(uint16_t Word, uint16_t *pCrc)
+{
+	uint8_t _Low = Word;
+	uint8_t _High = Word >> 8;
+	*pCrc = Crc16Update(Crc16Update(*pCrc, _Low), _High);
+	SendFrameByte(_Low);
+	SendFrameByte(_High);
+}
 
 /*
 	Send Response to the host
 	Parameters:
 		[in]		pResponseBuffer : pointer to the first element of the response buffer
+		[in]		Sequence : sequence number of the script
+		[in]		Flags : response flags (RESPONSE_FLAG_*)
 		[in]		NumberOfResults : size of the response (bytes)
 		[in]		Error : error code
 		[in]		ErrorDesc : error description
 	Returns:
 		void
 */
-void SendResponse(uint16_t *pResponseBuffer, uint16_t NumberOfResults, eError Error, uint16_t ErrorDesc)
+void SendResponse(uint16_t *pResponseBuffer, uint16_t Sequence, uint16_t Flags, uint16_t NumberOfResults, eError Error, uint16_t ErrorDesc)
 {
 	
 	// Compute response length in bytes
@@ -49,13 +156,14 @@ void SendResponse(uint16_t *pResponseBuffer, uint16_t NumberOfResults, eError Er
 								RESPONSE_STATUS_LENGTH	+
 								RESPONSE_CRC_LENGTH;
 
-	// Add response size to the header
+	// Add response size, sequence number and flags to the header
 	pResponseBuffer[0] = _ResponseLength * sizeof(uint16_t);
+	pResponseBuffer[RESPONSE_SEQUENCE_INDEX] = Sequence;
+	pResponseBuffer[RESPONSE_FLAGS_INDEX] = Flags;
 
 	// Compute index
 	uint16_t _IndexErrorCode	= RESPONSE_HEADER_LENGTH + NumberOfResults;
 	uint16_t _IndexErrorDesc	= RESPONSE_HEADER_LENGTH + NumberOfResults + 1;
-	uint16_t _IndexCrc			= RESPONSE_HEADER_LENGTH + NumberOfResults + RESPONSE_STATUS_LENGTH;
 
 	// Error code
 	pResponseBuffer[_IndexErrorCode] = static_cast<uint16_t>(Error);
@@ -63,13 +171,301 @@ void SendResponse(uint16_t *pResponseBuffer, uint16_t NumberOfResults, eError Er
 	// Error description
 	pResponseBuffer[_IndexErrorDesc] = ErrorDesc;
 
-	// Generate CRC
-	pResponseBuffer[_IndexCrc] = GenerateCrc(pResponseBuffer, _IndexCrc);
-	
 	// Send response to the host
-	for (uint16_t _i = 0; _i < _ResponseLength; _i++)
+	_Encoding = RESULT_ENCODING_RAW;
+	_NbResults = NumberOfResults;
+	ResendResponse(pResponseBuffer);
+}
+
+/*
+	Compute the zigzag coded difference of a result to the result stride positions before
+	Parameters:
+		[in]		pResults : pointer to the first result
+		[in]		Index : index of the result
+	Returns:
+		zigzag coded difference
+*/
+static uint32_t ZigzagDelta(const uint16_t *pResults, uint16_t Index)
+{
+	uint8_t _Shift = _Encoding & RESULT_ENCODING_SHIFT_MASK;
+	uint8_t _Stride = (_Encoding >> RESULT_ENCODING_STRIDE_SHIFT) + 1;
+
+	int32_t _Delta = (int32_t)(pResults[Index] >> _Shift);
+	if (Index >= _Stride)
+		_Delta -= (int32_t)(pResults[Index - _Stride] >> _Shift);
+	return ((uint32_t)_Delta << 1) ^ (uint32_t)(_Delta >> 31);
+}
+
+/*
+	Add bits to the encoded results, send the words completed
+	Parameters:
+		[in]		Value : bits to add, low bits first
+		[in]		NbBits : number of bits, at most 16
+	Returns:
+		void
+*/
+static void EncodeBits(uint32_t Value, uint8_t NbBits)
+{
+	_Bits |= Value << _NbBits;
+	_NbBits += NbBits;
+	while (_NbBits >= 16)
+	{
+		SendFrameWord((uint16_t)_Bits, &_StartedCrc);
+		_Bits >>= 16;
+		_NbBits -= 16;
+	}
+}
+
+/*
+	Encode a result of the started response (see RESULT_ENCODING_*)
+	Parameters:
+		[in]		pResults : pointer to the first result
+		[in]		Index : index of the result
+	Returns:
+		void
+*/
+static void EncodeResult(const uint16_t *pResults, uint16_t Index)
+{
+	uint8_t _Shift = _Encoding & RESULT_ENCODING_SHIFT_MASK;
+
+	// Packed: the bits that aren't always 0
+	if (!(_Encoding & RESULT_ENCODING_DELTA))
+	{
+		EncodeBits(pResults[Index] >> _Shift, 16 - _Shift);
+		return;
+	}
+
+	// Delta: varint of the zigzag coded difference
+	uint32_t _Zigzag = ZigzagDelta(pResults, Index);
+	while (_Zigzag >= 0x80)
+	{
+		EncodeBits((_Zigzag & 0x7F) | 0x80, 8);
+		_Zigzag >>= 7;
+	}
+	EncodeBits(_Zigzag, 8);
+}
+
+/*
+	Compute the length of the encoded results, their number included
+	Parameters:
+		[in]		pResults : pointer to the first result, only read with RESULT_ENCODING_DELTA
+		[in]		NumberOfResults : number of results
+	Returns:
+		length (words)
+*/
+static uint16_t EncodedLength(const uint16_t *pResults, uint16_t NumberOfResults)
+{
+	uint32_t _NbBits = 0;
+
+	if (!(_Encoding & RESULT_ENCODING_DELTA))
+		_NbBits = (uint32_t)NumberOfResults * (16 - (_Encoding & RESULT_ENCODING_SHIFT_MASK));
+	else
+	{
+		for (uint16_t _i = 0; _i < NumberOfResults; _i++)
+		{
+			uint32_t _Zigzag = ZigzagDelta(pResults, _i);
+			do
+			{
+				_NbBits += 8;
+				_Zigzag >>= 7;
+			} while (_Zigzag != 0);
+		}
+	}
+	return 1 + (_NbBits + 15) / 16;
+}
+
+/*
+	Send again the last response, left unchanged in the response buffer
+	Parameters:
+		[in]		pResponseBuffer : pointer to the first element of the response buffer
+	Returns:
+		void
+*/
+void ResendResponse(uint16_t *pResponseBuffer)
+{
+	// Encoded: encode it again
+	if (_Encoding != RESULT_ENCODING_RAW)
 	{
-		Serial.write(pResponseBuffer[_i]);
-		Serial.write(pResponseBuffer[_i] >> 8);
+		uint16_t _IndexErrorCode = RESPONSE_HEADER_LENGTH + _NbResults;
+		StartResponse(pResponseBuffer, pResponseBuffer[RESPONSE_SEQUENCE_INDEX], pResponseBuffer[RESPONSE_FLAGS_INDEX], _NbResults, _Encoding);
+		EndResponse(_NbResults, static_cast<eError>(pResponseBuffer[_IndexErrorCode]), pResponseBuffer[_IndexErrorCode + 1]);
+		return;
 	}
-}
\ No newline at end of file
+
+	// CRC is the last word
+	uint16_t _IndexCrc = pResponseBuffer[0] / sizeof(uint16_t) - RESPONSE_CRC_LENGTH;
+
+	// Send response to the host, compute the CRC on the fly
+	DiagnosticsSampleResponse(_NbResults);
+	uint16_t _Crc = CRC16_INIT;
+	WriteByte(FRAME_FLAG);
+	for (uint16_t _i = 0; _i < _IndexCrc; _i++)
+	{
+		SendFrameWord(pResponseBuffer[_i], &_Crc);
+		HostInputPoll();
+	}
+	SendFrameByte(_Crc);
+	SendFrameByte(_Crc >> 8);
+	EndFrame();
+}
+
+/*
+	Start sending a response while the script is executed: send the header
+	Parameters:
+		[in]		pResponseBuffer : pointer to the first element of the response buffer
+		[in]		Sequence : sequence number of the script
+		[in]		Flags : response flags (RESPONSE_FLAG_*)
+		[in]		NumberOfResults : number of results the script returns without error
+		[in]		Encoding : results encoding (RESULT_ENCODING_*). With RESULT_ENCODING_DELTA,
+								the results must be in the response buffer already.
+	Returns:
+		void
+*/
+void StartResponse(uint16_t *pResponseBuffer, uint16_t Sequence, uint16_t Flags, uint16_t NumberOfResults, uint8_t Encoding)
+{
+	_Encoding = Encoding;
+	_NbResults = NumberOfResults;
+	_NbResultsEncoded = 0;
+	_Bits = 0;
+	_NbBits = 0;
+
+	// The length is sent first: it is the length without error
+	uint16_t _ResultsLength = (Encoding == RESULT_ENCODING_RAW) ? NumberOfResults : EncodedLength(&pResponseBuffer[RESPONSE_HEADER_LENGTH], NumberOfResults);
+	pResponseBuffer[0] = (RESPONSE_HEADER_LENGTH + _ResultsLength + RESPONSE_STATUS_LENGTH + RESPONSE_CRC_LENGTH) * sizeof(uint16_t);
+	pResponseBuffer[RESPONSE_SEQUENCE_INDEX] = Sequence;
+	pResponseBuffer[RESPONSE_FLAGS_INDEX] = (Flags & 0xFF) | ((uint16_t)Encoding << RESPONSE_FLAGS_ENCODING_SHIFT);
+
+	_pStartedResponse = pResponseBuffer;
+	_StartedCrc = CRC16_INIT;
+	WriteByte(FRAME_FLAG);
+	for (uint16_t _i = 0; _i < RESPONSE_HEADER_LENGTH; _i++)
+		SendFrameWord(pResponseBuffer[_i], &_StartedCrc);
+
+	// Encoded results are preceded by their number
+	if (Encoding != RESULT_ENCODING_RAW)
+		SendFrameWord(NumberOfResults, &_StartedCrc);
+}
+
+/*
+	Send the results of the started response already in the response buffer, as many as
+	the serial transmit buffer takes without waiting. Does nothing if no response is started.
+	Parameters:
+		[in]		NumberOfResults : number of results in the response buffer that won't change
+	Returns:
+		void
+*/
+void HostOutputPoll(uint16_t NumberOfResults)
+{
+	if (_pStartedResponse == NULL)
+		return;
+
+	// Never send the status before EndResponse
+	if (NumberOfResults > _NbResults)
+		NumberOfResults = _NbResults;
+
+	// The link was idle since the buffer ran empty (one byte of the ring buffer is always free)
+	if (DIAGNOSTICS && (_NbResultsEncoded < NumberOfResults) && (Serial.availableForWrite() == SERIAL_TX_BUFFER_SIZE - 1))
+		DiagnosticsCountTxEmpty();
+
+	while ((_NbResultsEncoded < NumberOfResults) && (Serial.availableForWrite() >= RESULT_MAX_FRAME_BYTES))
+		EncodeResult(&_pStartedResponse[RESPONSE_HEADER_LENGTH], _NbResultsEncoded++);
+}
+
+/*
+	End the started response: send the results left, the status and the CRC.
+	After an error, the results the script didn't return are sent as 0.
+	Parameters:
+		[in]		NumberOfResults : number of results in the response buffer
+		[in]		Error : error code
+		[in]		ErrorDesc : error description
+	Returns:
+		void
+*/
+void EndResponse(uint16_t NumberOfResults, eError Error, uint16_t ErrorDesc)
+{
+	uint16_t *_pResults = &_pStartedResponse[RESPONSE_HEADER_LENGTH];
+
+	// The response buffer is left as sent, so that ResendResponse sends it again
+	for (uint16_t _i = NumberOfResults; _i < _NbResults; _i++)
+		_pResults[_i] = 0;
+	_pResults[_NbResults] = static_cast<uint16_t>(Error);
+	_pResults[_NbResults + 1] = ErrorDesc;
+
+	// Send the rest, waiting for room in the serial transmit buffer
+	while (_NbResultsEncoded < _NbResults)
+	{
+		EncodeResult(_pResults, _NbResultsEncoded++);
+		HostInputPoll();
+	}
+	if (_NbBits > 0)
+		EncodeBits(0, 16 - _NbBits);
+	for (uint16_t _i = 0; _i < RESPONSE_STATUS_LENGTH; _i++)
+		SendFrameWord(_pResults[_NbResults + _i], &_StartedCrc);
+	SendFrameByte(_StartedCrc);
+	SendFrameByte(_StartedCrc >> 8);
+	EndFrame();
+
+	// Once the script is executed: a script reading the diagnostics doesn't count its own response
+	DiagnosticsSampleResponse(_NbResults);
+	_pStartedResponse = NULL;
+}
+
+/*
+	Start a chunked response (see RESPONSE_FLAG_CHUNK): nothing is sent until the results buffer
+	is full (see SendChunk) or EndChunkedResponse
+	Parameters:
+		[in]		pResponseBuffer : pointer to the first element of the response buffer
+		[in]		Sequence : sequence number of the script
+		[in]		Flags : response flags of the script (RESPONSE_FLAG_*)
+		[in]		Encoding : results encoding of each chunk (RESULT_ENCODING_*)
+	Returns:
+		void
+*/
+void StartChunkedResponse(uint16_t *pResponseBuffer, uint16_t Sequence, uint16_t Flags, uint8_t Encoding)
+{
+	_pChunkedResponse = pResponseBuffer;
+	_ChunkedSequence = Sequence;
+	_ChunkedFlags = Flags;
+	_ChunkedEncoding = Encoding;
+	_NbChunks = 0;
+}
+
+/*
+	Send the results in the response buffer as the next chunk of the chunked response, so that
+	the script can go on from the start of the results buffer
+	Parameters:
+		[in]		NumberOfResults : number of results in the response buffer
+	Returns:
+		false if no chunked response is started
+*/
+bool SendChunk(uint16_t NumberOfResults)
+{
+	if (_pChunkedResponse == NULL)
+		return false;
+
+	// Delta coded results are read from the response buffer
+	StartResponse(_pChunkedResponse, _ChunkedSequence, RESPONSE_FLAG_CHUNK, NumberOfResults, _ChunkedEncoding);
+	EndResponse(NumberOfResults, kNoError, _NbChunks++);
+	return true;
+}
+
+/*
+	End the chunked response: send the results left as the last chunk, then the number of
+	chunks and the status
+	Parameters:
+		[in]		NumberOfResults : number of results in the response buffer
+		[in]		Error : error code
+		[in]		ErrorDesc : error description
+	Returns:
+		void
+*/
+void EndChunkedResponse(uint16_t NumberOfResults, eError Error, uint16_t ErrorDesc)
+{
+	if (NumberOfResults > 0)
+		SendChunk(NumberOfResults);
+
+	uint16_t *_pResponse = _pChunkedResponse;
+	_pChunkedResponse = NULL;
+	_pResponse[RESPONSE_HEADER_LENGTH] = _NbChunks;
+	SendResponse(_pResponse, _ChunkedSequence, _ChunkedFlags | RESPONSE_FLAG_CHUNK_END, 1, Error, ErrorDesc);
+}
@@ -5,7 +5,19 @@
 // Fetch and format results
 //
 // Description:
-// 
+// A response is either sent at once by SendResponse, or sent while the script is
+// executed: StartResponse sends the header, HostOutputPoll the results already
+// final, EndResponse the rest. HostOutputPoll only fills the serial transmit
+// buffer, emptied by the UART interrupt, so it never waits. That buffer is the
+// one of the Arduino core: SERIAL_TX_BUFFER_SIZE bytes (64), sent in 320 us at
+// 2 Mbaud. It is filled once per command of the script: a command longer than
+// that leaves the link idle until the next poll. The polls that find it empty
+// are counted (DIAG_TX_EMPTY, see MV2Diagnostics.h). A larger buffer is a build
+// option of the core, e.g. -DSERIAL_TX_BUFFER_SIZE=256 in compiler.cpp.extra_flags
+// (platform.local.txt), as a sketch can't change it. The results of a
+// started response are encoded (see RESULT_ENCODING_* in MV2HostConstants.h).
+// Results that don't fit in the response buffer are sent in chunks: SendChunk
+// sends the results buffer once it is full, EndChunkedResponse the rest.
 // Coding Conventions:
 //	- Variable names use the "InterCaps" convention
 //	- Local variables are prefixed with an underscore, '_'
@@ -21,6 +33,14 @@
 //	01.02.16 SD	Original version
 //	01.03.16 SD Move constants to MV2HostConstants.h
 //	19.04.16 SD Delete global variable
+//	17.10.26 MB Include MV2HostInput.h
+//	17.10.26 MB Include MV2Crc.h instead of MV2Utility.h
+//	17.10.26 MB Add sequence number to SendResponse, add ResendResponse
+//	17.10.26 MB Add flags to SendResponse
+//	17.10.26 MB Add StartResponse, HostOutputPoll and EndResponse
+//	17.10.26 MB Add the results encoding to StartResponse
+//	17.10.26 MB Add StartChunkedResponse, SendChunk and EndChunkedResponse
+//	17.10.26 MB Document the limit of the serial transmit buffer
 //
 // Copyright (c) 2016 Metrolab Technology SA, Geneva,
 //	Switzerland
@@ -29,19 +49,102 @@
 #define MV2_HOST_OUTPUT_H
 
 #include "MV2HostCommands.h"
-#include "MV2Utility.h"
+#include "MV2Crc.h"
 #include "MV2HostConstants.h"
+#include "MV2HostInput.h"
 
 /*
 	Send Response to the host
 	Parameters:
 		[in]		pResponseBuffer : pointer to the first element of the response buffer
+		[in]		Sequence : sequence number of the script
+		[in]		Flags : response flags (RESPONSE_FLAG_*)
 		[in]		NumberOfResults : size of the response (bytes)
 		[in]		Error : error code
 		[in]		ErrorDesc : error description
 	Returns:
 		void
 */
-void SendResponse(uint16_t *pResponseBuffer, uint16_t NumberOfResults, eError Error, uint16_t ErrorDesc);
+void SendResponse(uint16_t *pResponseBuffer, uint16_t Sequence, uint16_t Flags, uint16_t NumberOfResults, eError Error, uint16_t ErrorDesc);
+
+/*
+	Start sending a response while the script is executed: send the header
+	Parameters:
+		[in]		pResponseBuffer : pointer to the first element of the response buffer
+		[in]		Sequence : sequence number of the script
+		[in]		Flags : response flags (RESPONSE_FLAG_*)
+		[in]		NumberOfResults : number of results the script returns without error
+		[in]		Encoding : results encoding (RESULT_ENCODING_*). With RESULT_ENCODING_DELTA,
+								the results must be in the response buffer already.
+	Returns:
+		void
+*/
+void StartResponse(uint16_t *pResponseBuffer, uint16_t Sequence, uint16_t Flags, uint16_t NumberOfResults, uint8_t Encoding);
+
+/*
+	Send the results of the started response already in the response buffer, as many as
+	the serial transmit buffer takes without waiting. Does nothing if no response is started.
+	Parameters:
+		[in]		NumberOfResults : number of results in the response buffer that won't change
+	Returns:
+		void
+*/
+void HostOutputPoll(uint16_t NumberOfResults);
+
+/*
+	End the started response: send the results left, the status and the CRC.
+	After an error, the results the script didn't return are sent as 0.
+	Parameters:
+		[in]		NumberOfResults : number of results in the response buffer
+		[in]		Error : error code
+		[in]		ErrorDesc : error description
+	Returns:
+		void
+*/
+void EndResponse(uint16_t NumberOfResults, eError Error, uint16_t ErrorDesc);
+
+/*
+	Send again the last response, left unchanged in the response buffer
+	Parameters:
+		[in]		pResponseBuffer : pointer to the first element of the response buffer
+	Returns:
+		void
+*/
+void ResendResponse(uint16_t *pResponseBuffer);
+
+/*
+	Start a chunked response (see RESPONSE_FLAG_CHUNK): nothing is sent until the results buffer
+	is full (see SendChunk) or EndChunkedResponse
+	Parameters:
+		[in]		pResponseBuffer : pointer to the first element of the response buffer
+		[in]		Sequence : sequence number of the script
+		[in]		Flags : response flags of the script (RESPONSE_FLAG_*)
+		[in]		Encoding : results encoding of each chunk (RESULT_ENCODING_*)
+	Returns:
+		void
+*/
+void StartChunkedResponse(uint16_t *pResponseBuffer, uint16_t Sequence, uint16_t Flags, uint8_t Encoding);
+
+/*
+	Send the results in the response buffer as the next chunk of the chunked response, so that
+	the script can go on from the start of the results buffer
+	Parameters:
+		[in]		NumberOfResults : number of results in the response buffer
+	Returns:
+		false if no chunked response is started
+*/
+bool SendChunk(uint16_t NumberOfResults);
+
+/*
+	End the chunked response: send the results left as the last chunk, then the number of
+	chunks and the status
+	Parameters:
+		[in]		NumberOfResults : number of results in the response buffer
+		[in]		Error : error code
+		[in]		ErrorDesc : error description
+	Returns:
+		void
+*/
+void EndChunkedResponse(uint16_t NumberOfResults, eError Error, uint16_t ErrorDesc);
 
 #endif //MV2_HOST_OUTPUT_H
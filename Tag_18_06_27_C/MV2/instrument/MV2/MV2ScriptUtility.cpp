@@ -25,23 +25,57 @@
 //	06.07.16 SD Handle error with commands kWriteRegister0, kWriteRegister1 and kWriteRegister2 in ExecuteCommand function
 //	12.09.16 SD Handle kGetFwVersion command
 //  03.04.17 PK Add freeRam
+//	17.10.26 MB Reject kStartStream inside a script
+//	17.10.26 MB Keep receiving the next script between commands
+//	17.10.26 MB Handle kSetBaudRate command
+//	17.10.26 MB Average loops started with kSetAverageLoopStart in 32-bit sums, only return the averages
+//	17.10.26 MB Reject kStartCapture inside a script
+//	17.10.26 MB Decode scripts once (DecodeScript), ExecuteScript executes decoded commands
+//	17.10.26 MB DecodeScript checks the mode of each command against the mode set before it in the script
+//	17.10.26 MB Nested loops with 16-bit counts, executed with a loop stack instead of recursion
+//	17.10.26 MB Reject kStoreScript and kRunScript inside a script
+//	17.10.26 MB Add CountScriptResults, send the results while executing the script (HostOutputPoll)
+//	17.10.26 MB Add GetScriptEncoding, handle kSetResultEncoding command
+//	17.10.26 MB Handle kGetTimestamp command
+//	17.10.26 MB ExecuteScript sends the full results buffer as a chunk of a chunked response
+//	17.10.26 MB Analog digitize commands return the errors of AnalogDigitize*
+//	17.10.26 MB Handle kStartSampleTimer, kWaitForSampleTick and kGetSampleOverruns commands,
+//				kSetLoopCountHigh also gives the high byte of the period of kStartSampleTimer,
+//				ExecuteCommand takes 16-bit values
+//	17.10.26 MB Add GetScriptTrigger, reject kStartTrigger inside a script, kSetLoopCountHigh also gives
+//				the high byte of the values of kSetTriggerLevel, kSetPreTrigger and kSetPostTrigger
+//	17.10.26 MB Handle kGetDiagnostics command, time the waits for the sample timer
+//	17.10.26 MB Add GetScriptBurstSamples and ExecuteBurstSample, reject kStartBurst inside a script, kSetLoopCountHigh also gives
+//				the high byte of the value of kSetBurstSamples
+//	17.10.26 MB CountScriptResults also returns the room needed for the sums of averaged loops
+//	17.10.26 MB Count the SPI words for the diagnostics, sample the free RAM once per script instead of per command
+//	17.10.26 MB Read MV2_CMD_INFO with GetCommandType, GetCommandReturnsValue and GetCommandCode
+//	17.10.26 MB Remove CheckCommand (DecodeScript checks the commands), reject kSetDigitalAnalogMode inside a loop
+//	17.10.26 MB Add GetScriptMode
 //
 // Copyright (c) 2016 Metrolab Technology SA, Geneva,
 //	Switzerland
 
 #include "MV2ScriptUtility.h"
 #include "MV2FirmwareVersion.h"
+#include "MV2HostInput.h"
+#include "MV2HostOutput.h"
+#include "MV2HostConstants.h"
+#include "MV2Diagnostics.h"
+
+// Time of the last timestamp (us), see kGetTimestamp
+static uint32_t _LastTimestamp = 0;
 
 /*
 	Execute command
 	Parameters:
 		[in]		Command		: command to execute
-		[in]		CommandVal	: command parameter
+		[in]		CommandVal	: command parameter, 16 bits for kStartSampleTimer and the trigger settings
 		[out]		pRetVal		: pointer to the return value
 	Returns:
 		eError
 */
-eError ExecuteCommand(eCommand Command, uint8_t CommandVal, uint16_t *pRetVal)
+eError ExecuteCommand(eCommand Command, uint16_t CommandVal, uint16_t *pRetVal)
 {
 	eError _Error = kNoError;
 
@@ -51,13 +85,15 @@ eError ExecuteCommand(eCommand Command, uint8_t CommandVal, uint16_t *pRetVal)
 		case kReadRegister0:
 		case kReadRegister1:
 		case kReadRegister2:
-			*pRetVal = DigitalReadRegister(MV2_CMD_INFO[Command].Command);
+			*pRetVal = DigitalReadRegister(GetCommandCode(Command));
+			DiagnosticsCountSpiWord();
 			break;
 
 		case kWriteRegister0:
 		case kWriteRegister1:
 		case kWriteRegister2:
-			_Error = DigitalWriteAndRead(MV2_CMD_INFO[Command].Command << 8 | CommandVal, pRetVal);
+			_Error = DigitalWriteAndRead(GetCommandCode(Command) << 8 | CommandVal, pRetVal);
+			DiagnosticsCountSpiWord();
 			break;
 
 		case kSetInitBit:
@@ -69,19 +105,19 @@ eError ExecuteCommand(eCommand Command, uint8_t CommandVal, uint16_t *pRetVal)
 			break;
 
 		case kDigitizeBx:
-			*pRetVal = AnalogDigitizeBx();
+			_Error = AnalogDigitizeBx(pRetVal);
 			break;
 
 		case kDigitizeBy:
-			*pRetVal = AnalogDigitizeBy();
+			_Error = AnalogDigitizeBy(pRetVal);
 			break;
 
 		case kDigitizeBz:
-			*pRetVal = AnalogDigitizeBz();
+			_Error = AnalogDigitizeBz(pRetVal);
 			break;
 
 		case kDigitizeTemp:
-			*pRetVal = AnalogDigitizeTemp();
+			_Error = AnalogDigitizeTemp(pRetVal);
 			break;
 
 		case kSetOptions:
@@ -94,13 +130,96 @@ eError ExecuteCommand(eCommand Command, uint8_t CommandVal, uint16_t *pRetVal)
 
 		// No action to perform
 		case kSetLoopStart:
+		case kSetAverageLoopStart:
 		case kSetLoopEnd:
+		case kSetLoopCountHigh:
+			break;
+
+		// Results encoding is read before the script is executed (GetScriptEncoding)
+		case kSetResultEncoding:
+			break;
+
+		// Trigger settings are read before the trigger is armed (GetScriptTrigger)
+		case kSetTriggerLevel:
+		case kSetPreTrigger:
+		case kSetPostTrigger:
+			break;
+
+		// Number of samples is read before the burst is taken (GetScriptBurstSamples)
+		case kSetBurstSamples:
 			break;
 			
 		case kGetFwVersion:
 			*pRetVal = FW_VERSION;
 			break;
 
+		// Time since the last timestamp, in units of 2^CommandVal us
+		case kGetTimestamp:
+			if (CommandVal <= TIMESTAMP_MAX_SHIFT)
+			{
+				uint32_t _Now = micros();
+				uint32_t _Delta = (_Now - _LastTimestamp) >> CommandVal;
+				if (_Delta < TIMESTAMP_SATURATED)
+				{
+					*pRetVal = _Delta;
+					_LastTimestamp += _Delta << CommandVal;
+				}
+				else
+				{
+					*pRetVal = TIMESTAMP_SATURATED;
+					_LastTimestamp = _Now;
+				}
+			}
+			else
+				_Error = kSyntaxError;
+			break;
+
+		// Period (us) with its high byte merged by DecodeScript
+		case kStartSampleTimer:
+			_Error = MiscStartSampleTimer(CommandVal, pRetVal);
+			break;
+
+		// Receive the next script while waiting for the tick
+		case kWaitForSampleTick:
+		{
+			if (!MiscSampleTimerRunning())
+			{
+				_Error = kSampleTimerError;
+				break;
+			}
+			uint32_t _Start = DiagnosticsStart();
+			while (!MiscTakeSampleTick())
+				HostInputPoll();
+			DiagnosticsAddTime(kDiagSampleTick, _Start);
+			break;
+		}
+
+		case kGetDiagnostics:
+			_Error = DiagnosticsGetWord(CommandVal, pRetVal);
+			break;
+
+		case kGetSampleOverruns:
+			*pRetVal = MiscSampleOverruns();
+			break;
+
+		// Baud rate is changed once the response is sent
+		case kSetBaudRate:
+			if (CommandVal < NB_MV2_BAUD_RATES)
+				HostInputRequestBaudRate(CommandVal);
+			else
+				_Error = kSyntaxError;
+			break;
+
+		// Stream, capture, trigger, burst and script slots are only allowed as first command, handled in MV2.ino
+		case kStartStream:
+		case kStartCapture:
+		case kStartTrigger:
+		case kStartBurst:
+		case kStoreScript:
+		case kRunScript:
+			_Error = kSyntaxError;
+			break;
+
 		default:
 			_Error = kSyntaxError;
 			break;
@@ -109,196 +228,495 @@ eError ExecuteCommand(eCommand Command, uint8_t CommandVal, uint16_t *pRetVal)
 }
 
 /*
-	Check Command
+	Decode script: check all commands and match the loops once, before any command is executed.
+	The mode of a command is the mode set by the last kSetDigitalAnalogMode before it, the
+	current mode if none. The mode can't change inside a loop: its next iterations would be
+	executed in another mode than the one checked.
 	Parameters:
-		[in]		Command : raw command to check
-		[out]		pCmd : if command is correctly checked, *pCmd contains command
+		[in]		pCommandsBuffer : pointer to the first element of the commands array
+		[in]		CommandsBufferLength : length of commands array, at most MAX_SCRIPT_OPS
+		[out]		pOps : decoded commands
+		[out]		pIndexCommandError : index where an error has occured
 	Returns:
 		eError
 */
-eError CheckCommand(uint8_t Command, eCommand *pCmd)
+eError DecodeScript (	const uint16_t *pCommandsBuffer,
+						uint16_t CommandsBufferLength,
+						tScriptOp *pOps,
+						uint16_t *pIndexCommandError)
 {
 	eError _Error = kNoError;
+	eCommand _Cmd;
+	// Loops started and not ended yet
+	uint8_t _OpenLoops[MAX_LOOP_DEPTH];
+	uint8_t _Depth = 0;
+	// High byte of the value of the next command: a loop count, a sample period, a trigger setting
+	// or a number of burst samples
+	bool _CountHigh = false;
+	// Mode the commands are executed in
+	eMode _Mode = GetMV2Mode();
+
+	*pIndexCommandError = 0;
+	if (CommandsBufferLength > MAX_SCRIPT_OPS)
+		return kScriptLengthTooLargeError;
+
+	for (uint16_t _i = 0; _i < CommandsBufferLength; _i++)
+	{
+		// Check command and mode
+		_Error = GetCommand(pCommandsBuffer[_i] >> 8, &_Cmd);
+		if ((_Error == kNoError) &&
+			(((_Mode == kDigitalMode) && (GetCommandType(_Cmd) == kAnalog)) ||
+			 ((_Mode == kAnalogMode) && (GetCommandType(_Cmd) == kDigital))))
+			_Error = kModeError;
+		// Stream, capture, trigger, burst and script slots are only allowed as first command, handled in MV2.ino
+		if ((_Error == kNoError) &&
+			((_Cmd == kStartStream) || (_Cmd == kStartCapture) || (_Cmd == kStartTrigger) || (_Cmd == kStartBurst) ||
+			 (_Cmd == kStoreScript) || (_Cmd == kRunScript)))
+			_Error = kSyntaxError;
+		// The high byte of a value is followed by its command
+		if ((_Error == kNoError) && _CountHigh &&
+			(_Cmd != kSetLoopStart) && (_Cmd != kSetAverageLoopStart) && (_Cmd != kStartSampleTimer) &&
+			(_Cmd != kSetTriggerLevel) && (_Cmd != kSetPreTrigger) && (_Cmd != kSetPostTrigger) &&
+			(_Cmd != kSetBurstSamples))
+			_Error = kSyntaxError;
+		if (_Error != kNoError)
+		{
+			*pIndexCommandError = _i;
+			return _Error;
+		}
+		pOps[_i].Command = _Cmd;
+		pOps[_i].Value = pCommandsBuffer[_i] & 0xFF;
+		pOps[_i].Jump = NO_LOOP_JUMP;
+
+		switch (_Cmd)
+		{
+			case kSetDigitalAnalogMode:
+				if (_Depth > 0)
+				{
+					*pIndexCommandError = _i;
+					return kModeError;
+				}
+				_Mode = (pOps[_i].Value == 0) ? kDigitalMode : kAnalogMode;
+				break;
+
+			case kSetLoopCountHigh:
+				_CountHigh = true;
+				break;
+
+			case kStartSampleTimer:
+			case kSetTriggerLevel:
+			case kSetPreTrigger:
+			case kSetPostTrigger:
+			case kSetBurstSamples:
+				if (_CountHigh)
+					pOps[_i].Value |= (pCommandsBuffer[_i - 1] & 0xFF) << 8;
+				_CountHigh = false;
+				break;
+
+			// Push the loop. An averaged loop contains no loop.
+			case kSetLoopStart:
+			case kSetAverageLoopStart:
+				if ((_Depth == MAX_LOOP_DEPTH) ||
+					((_Depth > 0) && (pOps[_OpenLoops[_Depth - 1]].Command == kSetAverageLoopStart)))
+				{
+					*pIndexCommandError = _i;
+					return kNestedLoopError;
+				}
+				if (_CountHigh)
+					pOps[_i].Value |= (pCommandsBuffer[_i - 1] & 0xFF) << 8;
+				_CountHigh = false;
+				_OpenLoops[_Depth++] = _i;
+				break;
+
+			// Link the loop end and the loop start. An end without loop does nothing.
+			case kSetLoopEnd:
+				if (_Depth > 0)
+				{
+					_Depth--;
+					pOps[_OpenLoops[_Depth]].Jump = _i;
+					pOps[_i].Jump = _OpenLoops[_Depth];
+				}
+				break;
+
+			default:
+				break;
+		}
+	}
 
-	// Check if command exists
-	if ( (_Error = GetCommand(Command, pCmd)) != kNoError)
-		return _Error;
-
-	// Get MV2 mdoe
-	eMode _MV2Mode = GetMV2Mode();
-	// Safety check
-	// Analog command must be executed only in analog mode
-	if ((_MV2Mode == kDigitalMode) && (MV2_CMD_INFO[*pCmd].Type == kAnalog))
-		return kModeError;
-	// Digital command must be executed only in digital mode
-	else if ((_MV2Mode == kAnalogMode) && (MV2_CMD_INFO[*pCmd].Type == kDigital))
-		return kModeError;
-	else
-		return kNoError;
+	// Loop without end
+	if (_Depth > 0)
+	{
+		*pIndexCommandError = _OpenLoops[_Depth - 1];
+		return kUnspecifiedLoopError;
+	}
+	if (_CountHigh)
+	{
+		*pIndexCommandError = CommandsBufferLength - 1;
+		return kSyntaxError;
+	}
+
+	return kNoError;
 }
 
 /*
-	SearchForEndLoopIndex
+	Count the results a decoded script (see DecodeScript) returns if no error occurs,
+	so that the response can be sent while the script is executed.
+	ExecuteScript also needs room for the sums of an averaged loop: the results buffer holds at
+	most all the results and the sums of the largest averaged loop.
 	Parameters:
-		[in]		pCommandsBuffer : commands buffer
-		[in]		Length : script buffer size
-		[in]		IndexStart : index to start search
-		[out]		pIndexEndLoop : if found, index of end loop
+		[in]		pOps : pointer to the first decoded command
+		[in]		NbOps : number of decoded commands
+		[out]		pFlags : response flags, RESPONSE_FLAG_AVERAGED if a loop is averaged
+		[out]		pRoom : length of results buffer needed to execute the script without chunks,
+					MAX_RESULTS_LENGTH + 1 if it doesn't fit in the response. Can be NULL.
 	Returns:
-		eError
+		number of results, MAX_RESULTS_LENGTH + 1 if they don't fit in the response
 */
-eError SearchForEndLoopIndex(	uint16_t *pCommandsBuffer,
-								uint16_t Length,
-								uint16_t IndexStart,
-								uint16_t *pIndexEndLoop)
+uint16_t CountScriptResults (	const tScriptOp *pOps,
+								uint16_t NbOps,
+								uint16_t *pFlags,
+								uint16_t *pRoom)
 {
-	eError _Error = kNoError;
-	eCommand _Cmd;
-	*pIndexEndLoop = -1;
+	// Iterations of the commands at each loop depth, at most MAX_RESULTS_LENGTH + 1
+	uint32_t _Iterations[MAX_LOOP_DEPTH + 1];
+	uint8_t _Depth = 0;
+	uint32_t _NbResults = 0;
+	// Words of the sums of the largest averaged loop
+	uint16_t _NbSums = 0;
 
-	for (uint16_t _i = IndexStart; _i < Length; _i++)
+	*pFlags = 0;
+	_Iterations[0] = 1;
+	for (uint16_t _i = 0; (_i < NbOps) && (_NbResults <= MAX_RESULTS_LENGTH); _i++)
 	{
-		// Get command
-		_Error = GetCommand(pCommandsBuffer[_i] >> 8, &_Cmd);
-		// Handle error
-		if (_Error != kNoError)
-			break;
-		// Handle error
-		else
+		switch (pOps[_i].Command)
 		{
-			if (_Cmd == kSetLoopEnd)
-			{
-				*pIndexEndLoop = _i;
+			// An averaged loop returns one value per command
+			case kSetLoopStart:
+			case kSetAverageLoopStart:
+				_Iterations[_Depth + 1] = _Iterations[_Depth] * pOps[_i].Value;
+				if ((pOps[_i].Command == kSetAverageLoopStart) && (_Iterations[_Depth + 1] > 0))
+				{
+					_Iterations[_Depth + 1] = _Iterations[_Depth];
+					*pFlags |= RESPONSE_FLAG_AVERAGED;
+					uint16_t _NbValues = 0;
+					for (uint16_t _j = _i + 1; _j < pOps[_i].Jump; _j++)
+						if (GetCommandReturnsValue((eCommand)pOps[_j].Command))
+							_NbValues++;
+					if (2 * _NbValues > _NbSums)
+						_NbSums = 2 * _NbValues;
+				}
+				if (_Iterations[_Depth + 1] > MAX_RESULTS_LENGTH + 1)
+					_Iterations[_Depth + 1] = MAX_RESULTS_LENGTH + 1;
+				_Depth++;
 				break;
-			}
-			if (_Cmd == kSetLoopStart)
-			{
-				*pIndexEndLoop = _i;
-				_Error = kNestedLoopError;
+
+			case kSetLoopEnd:
+				if (pOps[_i].Jump != NO_LOOP_JUMP)
+					_Depth--;
+				break;
+
+			default:
+				if (GetCommandReturnsValue((eCommand)pOps[_i].Command))
+					_NbResults += _Iterations[_Depth];
 				break;
-			}
 		}
 	}
-	if (*pIndexEndLoop == -1)
-		_Error = kUnspecifiedLoopError;
 
-	return _Error;
+	if (pRoom != NULL)
+		*pRoom = (_NbResults + _NbSums <= MAX_RESULTS_LENGTH) ? _NbResults + _NbSums : MAX_RESULTS_LENGTH + 1;
+	return (_NbResults <= MAX_RESULTS_LENGTH) ? _NbResults : MAX_RESULTS_LENGTH + 1;
 }
 
 /*
-	Execute script
+	Get the encoding of the results of a decoded script (see DecodeScript): the value of its last
+	kSetResultEncoding command, RESULT_ENCODING_RAW if none
 	Parameters:
-		[in/out]	pCommandsBuffer : pointer to the first element of the commands array
-		[in]		CommandsBufferLength : length of commands array
+		[in]		pOps : pointer to the first decoded command
+		[in]		NbOps : number of decoded commands
+	Returns:
+		results encoding (RESULT_ENCODING_*)
+*/
+uint8_t GetScriptEncoding (	const tScriptOp *pOps,
+							uint16_t NbOps)
+{
+	uint8_t _Encoding = RESULT_ENCODING_RAW;
+
+	for (uint16_t _i = 0; _i < NbOps; _i++)
+		if (pOps[_i].Command == kSetResultEncoding)
+			_Encoding = pOps[_i].Value;
+	return _Encoding;
+}
+
+/*
+	Get the mode a decoded script (see DecodeScript) must be started in: the mode of the first command
+	of a type other than kMisc before its first kSetDigitalAnalogMode command. The commands after a
+	kSetDigitalAnalogMode command were checked against the mode it sets.
+	Parameters:
+		[in]		pOps : pointer to the first decoded command
+		[in]		NbOps : number of decoded commands
+	Returns:
+		eMode, SCRIPT_ANY_MODE if the script can be started in any mode
+*/
+uint8_t GetScriptMode (	const tScriptOp *pOps,
+						uint16_t NbOps)
+{
+	for (uint16_t _i = 0; _i < NbOps; _i++)
+	{
+		if (pOps[_i].Command == kSetDigitalAnalogMode)
+			break;
+		if (GetCommandType((eCommand)pOps[_i].Command) == kDigital)
+			return kDigitalMode;
+		if (GetCommandType((eCommand)pOps[_i].Command) == kAnalog)
+			return kAnalogMode;
+	}
+	return SCRIPT_ANY_MODE;
+}
+
+/*
+	Get the trigger settings of a decoded script (see DecodeScript): the values of its last
+	kSetTriggerLevel, kSetPreTrigger and kSetPostTrigger commands, the defaults if none
+	Parameters:
+		[in]		pOps : pointer to the first decoded command
+		[in]		NbOps : number of decoded commands
+		[out]		pLevel : trigger level, 0 by default
+		[out]		pPre : number of samples kept before the trigger, 0 by default
+		[out]		pPost : number of samples kept from the trigger on, 1 by default
+	Returns:
+		void
+*/
+void GetScriptTrigger (	const tScriptOp *pOps,
+						uint16_t NbOps,
+						uint16_t *pLevel,
+						uint16_t *pPre,
+						uint16_t *pPost)
+{
+	*pLevel = 0;
+	*pPre = 0;
+	*pPost = 1;
+	for (uint16_t _i = 0; _i < NbOps; _i++)
+	{
+		if (pOps[_i].Command == kSetTriggerLevel)
+			*pLevel = pOps[_i].Value;
+		else if (pOps[_i].Command == kSetPreTrigger)
+			*pPre = pOps[_i].Value;
+		else if (pOps[_i].Command == kSetPostTrigger)
+			*pPost = pOps[_i].Value;
+	}
+}
+
+/*
+	Get the number of samples of a burst in a decoded script (see DecodeScript): the value of its
+	last kSetBurstSamples command, 0 (as many as fit) if none
+	Parameters:
+		[in]		pOps : pointer to the first decoded command
+		[in]		NbOps : number of decoded commands
+	Returns:
+		number of samples, 0 for as many as fit
+*/
+uint16_t GetScriptBurstSamples (	const tScriptOp *pOps,
+								uint16_t NbOps)
+{
+	uint16_t _NbSamples = 0;
+
+	for (uint16_t _i = 0; _i < NbOps; _i++)
+		if (pOps[_i].Command == kSetBurstSamples)
+			_NbSamples = pOps[_i].Value;
+	return _NbSamples;
+}
+
+/*
+	Execute a decoded script (see DecodeScript): commands are not checked again.
+	Loops are executed with a stack of the loops started: a loop end jumps back to its loop start
+	until the count is reached.
+	An averaged loop sums the values of each command returning a value in 32 bits over all
+	iterations, and only their rounded averages are appended to the output buffer. The sums
+	(2 words per command), then the values of the current iteration, are kept in the free part of
+	the output buffer, so the number of iterations is not limited by its length.
+	If a chunked response is started (see StartChunkedResponse), the results buffer is sent as
+	a chunk when it is full, or when an averaged loop has no room for its sums, and filled again.
+	Parameters:
+		[in]		pOps : pointer to the first decoded command
+		[in]		NbOps : number of decoded commands
 		[in/out]	pOutputBuffer : pointer to the output buffer
 		[in]		ResultsBufferLength : length of results buffer
 		[in/out]	pResultsBufferIndex : index of the results buffer
+		[in/out]	pFlags : response flags, RESPONSE_FLAG_AVERAGED is set if a loop was averaged
 		[out]		pIndexCommandError : index where an error has occured
 	Returns:
 		eError
 */
-eError ExecuteScript (	uint16_t *pCommandsBuffer,
-						uint16_t CommandsBufferLength,
+eError ExecuteScript (	const tScriptOp *pOps,
+						uint16_t NbOps,
 						uint16_t *pOutputBuffer,
 						uint16_t ResultsBufferLength,
 						uint16_t *pResultsBufferIndex,
+						uint16_t *pFlags,
 						uint16_t *pIndexCommandError)
 {
 	// Initialize error
 	eError _Error = kNoError;
-	// Current command
-	eCommand _Cmd;
-	// Current command value
-	uint8_t _CmdValue;
 	// Command return value
 	uint16_t _CmdRetVal;
-	// Handle loop start and end index
-	uint16_t _IndexLoopStart = 0;
-	uint16_t _IndexEndLoop;
+	// Iterations left of the loops started
+	uint16_t _LoopsLeft[MAX_LOOP_DEPTH];
+	uint8_t _Depth = 0;
+	// Averaged loop: index of the sums, of the values of the current iteration, number of values
+	uint16_t _IndexSums = 0;
+	uint16_t _IndexValues = 0;
+	uint16_t _NbValues = 0;
+	bool _Averaging = false;
 	// Index of the command where an error occured
 	*pIndexCommandError = 0;
+	DiagnosticsSampleRam();
 
 	// Main loop
-	for (uint16_t _i = 0; _i < CommandsBufferLength; _i++)
+	for (uint16_t _i = 0; _i < NbOps; _i++)
 	{
-		// Get command value
-		_CmdValue =  (uint8_t)pCommandsBuffer[_i] & 0xFF;
+		// Receive next script, send the results already final: not the sums of an averaged loop
+		HostInputPoll();
+		HostOutputPoll(_Averaging ? _IndexSums : *pResultsBufferIndex);
 
-		// Check Command
-		_Error = CheckCommand(pCommandsBuffer[_i] >> 8, &_Cmd);
+		const tScriptOp *_pOp = &pOps[_i];
 
-		// Handle error
-		if (_Error != 0)
+		switch (_pOp->Command)
 		{
-			*pIndexCommandError = _i;
-			return _Error;
-		}
-		
-		// Loop detected
-		else if (_Cmd == kSetLoopStart)
-		{
-			// Ckeck loop and search for end loop index
-			_IndexLoopStart = _i + 1;
-			_Error = SearchForEndLoopIndex(pCommandsBuffer, CommandsBufferLength, _IndexLoopStart, &_IndexEndLoop);
-			// Handle error
-			if (_Error != kNoError)
-			{
-				*pIndexCommandError = _i;
-				return _Error;
-			} // Handle error
-			// Execute loop
-			else
-			{
-				// Loop
-				for (uint16_t _j = 0; _j < _CmdValue; _j++)
+			// Loop start: no iteration skips the loop
+			case kSetLoopStart:
+			case kSetAverageLoopStart:
+				if (_pOp->Value == 0)
+				{
+					_i = _pOp->Jump;
+					break;
+				}
+				// Averaged loop: count the values of one iteration, clear the sums
+				if (_pOp->Command == kSetAverageLoopStart)
 				{
-					// Execute script
-					_Error = ExecuteScript(	&pCommandsBuffer[_IndexLoopStart],
-											_IndexEndLoop - _IndexLoopStart,
-											pOutputBuffer,
-											ResultsBufferLength,
-											pResultsBufferIndex,
-											pIndexCommandError);
-					// Handle any errors
-					if (_Error != kNoError)
+					_NbValues = 0;
+					for (uint16_t _j = _i + 1; _j < _pOp->Jump; _j++)
+						if (GetCommandReturnsValue((eCommand)pOps[_j].Command))
+							_NbValues++;
+					if ((*pResultsBufferIndex + 3 * _NbValues > ResultsBufferLength) &&
+						(*pResultsBufferIndex > 0) && SendChunk(*pResultsBufferIndex))
+						*pResultsBufferIndex = 0;
+					_IndexSums = *pResultsBufferIndex;
+					_IndexValues = _IndexSums + 2 * _NbValues;
+					if (_IndexValues + _NbValues > ResultsBufferLength)
 					{
 						*pIndexCommandError = _i;
-						return _Error;
+						return kOutOfMemoryError;
 					}
-				} // Loop
-				// Update current main loop index _i to next index after end loop
-				_i = _IndexEndLoop;
-			} // Execute loop
-		} // Loop detected
-		// Execute command
-		else
-		{
+					for (uint16_t _k = 0; _k < 2 * _NbValues; _k++)
+						pOutputBuffer[_IndexSums + _k] = 0;
+					*pResultsBufferIndex = _IndexValues;
+					_Averaging = true;
+				}
+				_LoopsLeft[_Depth++] = _pOp->Value;
+				break;
+
+			// Loop end: next iteration, or end of the loop
+			case kSetLoopEnd:
+				if (_pOp->Jump == NO_LOOP_JUMP)
+					break;
+				// Averaged loop: add the values to the sums, low word first
+				if (pOps[_pOp->Jump].Command == kSetAverageLoopStart)
+				{
+					for (uint16_t _k = 0; _k < _NbValues; _k++)
+					{
+						uint32_t _Sum = ((uint32_t)pOutputBuffer[_IndexSums + 2 * _k + 1] << 16) | pOutputBuffer[_IndexSums + 2 * _k];
+						_Sum += pOutputBuffer[_IndexValues + _k];
+						pOutputBuffer[_IndexSums + 2 * _k] = (uint16_t)_Sum;
+						pOutputBuffer[_IndexSums + 2 * _k + 1] = (uint16_t)(_Sum >> 16);
+					}
+					*pResultsBufferIndex = _IndexValues;
+				}
+				if (--_LoopsLeft[_Depth - 1] > 0)
+				{
+					_i = _pOp->Jump;
+					break;
+				}
+				_Depth--;
+				// Averaged loop: replace the sums by the rounded averages.
+				// Average _k is written before sum _k + 1 is read.
+				if (pOps[_pOp->Jump].Command == kSetAverageLoopStart)
+				{
+					uint16_t _Count = pOps[_pOp->Jump].Value;
+					for (uint16_t _k = 0; _k < _NbValues; _k++)
+					{
+						uint32_t _Sum = ((uint32_t)pOutputBuffer[_IndexSums + 2 * _k + 1] << 16) | pOutputBuffer[_IndexSums + 2 * _k];
+						pOutputBuffer[_IndexSums + _k] = (uint16_t)((_Sum + _Count / 2) / _Count);
+					}
+					*pResultsBufferIndex = _IndexSums + _NbValues;
+					*pFlags |= RESPONSE_FLAG_AVERAGED;
+					_Averaging = false;
+				}
+				break;
+
 			// Execute command
-			_Error = ExecuteCommand(_Cmd, _CmdValue, &_CmdRetVal);
-			// Handle error
-			if (_Error != kNoError)
-				return _Error;
-			// Append command return value to the output buffer
-			else
-			{
-				// Check if command returns a value
-				if (MV2_CMD_INFO[_Cmd].ReturnsValue)
+			default:
+				_Error = ExecuteCommand((eCommand)_pOp->Command, _pOp->Value, &_CmdRetVal);
+				// Handle error
+				if (_Error != kNoError)
 				{
-					// Add command response to the output buffer
+					*pIndexCommandError = _i;
+					return _Error;
+				}
+				// Add command response to the output buffer if it returns a value
+				if (GetCommandReturnsValue((eCommand)_pOp->Command))
+				{
+					// Chunked response: send the full results buffer
+					if ((*pResultsBufferIndex >= ResultsBufferLength) && SendChunk(*pResultsBufferIndex))
+						*pResultsBufferIndex = 0;
 					// Check memory
 					if (*pResultsBufferIndex < ResultsBufferLength)
 					{
 						pOutputBuffer[*pResultsBufferIndex] = _CmdRetVal;
 						(*pResultsBufferIndex)++;
-					} // Check memory
+					}
 					// Out of memory error
 					else
+					{
+						*pIndexCommandError = _i;
 						return kOutOfMemoryError;
-				} // Check if command returns a value
-			} // Append command return value to the output buffer
-		} // Execute command
+					}
+				}
+				break;
+		}
 	} // Main loop
 
 	return _Error;
 }
 
+/*
+	Execute a decoded script without loops (see DecodeScript) as one sample of a burst: nothing is
+	received or sent between the commands, the results are appended to the output buffer, which
+	has room for them (see CountScriptResults).
+	Parameters:
+		[in]		pOps : pointer to the first decoded command, no loop
+		[in]		NbOps : number of decoded commands
+		[in/out]	pOutputBuffer : pointer to the output buffer
+		[in/out]	pResultsBufferIndex : index of the results buffer
+		[out]		pIndexCommandError : index where an error has occured
+	Returns:
+		eError
+*/
+eError ExecuteBurstSample (	const tScriptOp *pOps,
+							uint16_t NbOps,
+							uint16_t *pOutputBuffer,
+							uint16_t *pResultsBufferIndex,
+							uint16_t *pIndexCommandError)
+{
+	uint16_t _CmdRetVal;
+
+	for (uint16_t _i = 0; _i < NbOps; _i++)
+	{
+		eError _Error = ExecuteCommand((eCommand)pOps[_i].Command, pOps[_i].Value, &_CmdRetVal);
+		if (_Error != kNoError)
+		{
+			*pIndexCommandError = _i;
+			return _Error;
+		}
+		if (GetCommandReturnsValue((eCommand)pOps[_i].Command))
+			pOutputBuffer[(*pResultsBufferIndex)++] = _CmdRetVal;
+	}
+	return kNoError;
+}
@@ -20,6 +20,16 @@
 //
 // Change log:
 //	01.02.16 SD	Original version
+//	17.10.26 MB Add pFlags to ExecuteScript
+//	17.10.26 MB Add DecodeScript, ExecuteScript executes decoded commands (tScriptOp)
+//	17.10.26 MB tScriptOp: 16-bit value, loop start and end linked by their index
+//	17.10.26 MB Add tScriptSlot
+//	17.10.26 MB Add CountScriptResults
+//	17.10.26 MB Add GetScriptEncoding
+//	17.10.26 MB Add GetScriptTrigger
+//	17.10.26 MB Add GetScriptBurstSamples and ExecuteBurstSample
+//	17.10.26 MB CountScriptResults returns the room needed to execute the script
+//	17.10.26 MB Add GetScriptMode, tScriptSlot keeps the mode the script must be started in
 //
 // Copyright (c) 2016 Metrolab Technology SA, Geneva,
 //	Switzerland
@@ -30,12 +40,71 @@
 #include "Arduino.h"
 #include "MV2HostCommands.h"
 #include "MV2Hal.h"
+#include "MV2HostConstants.h"
 
-eError ExecuteScript(uint16_t *pScriptBuffer,
+// Maximum number of commands of a script
+#define MAX_SCRIPT_OPS			(SCRIPT_BUFFER_LENGTH - SCRIPT_BUFFER_ADDITIONAL_INFOS_LENGTH)
+
+// Jump of a loop end without loop start
+#define NO_LOOP_JUMP			0xFF
+
+// Mode of a script that doesn't depend on the mode it is started in
+#define SCRIPT_ANY_MODE			0xFF
+
+// Decoded command
+typedef struct
+{
+	uint8_t		Command;		// eCommand, index in MV2_CMD_INFO
+	uint8_t		Jump;			// Loop start: index of its end. Loop end: index of its start, or NO_LOOP_JUMP
+	uint16_t	Value;			// Command value, count of a loop
+} tScriptOp;
+
+// Script kept by MV2_CMD_STORE_SCRIPT, executed by MV2_CMD_RUN_SCRIPT
+typedef struct
+{
+	bool		Stored;					// The slot holds a script decoded without error
+	uint8_t		Mode;					// eMode the script must be started in, SCRIPT_ANY_MODE if any (GetScriptMode)
+	uint16_t	NbOps;					// Number of commands
+	tScriptOp	Ops[MAX_SCRIPT_OPS];	// Decoded commands
+} tScriptSlot;
+
+eError DecodeScript(const uint16_t *pScriptBuffer,
 	uint16_t sizeScriptBuffer,
+	tScriptOp *pOps,
+	uint16_t *pIndexScriptError);
+
+uint16_t CountScriptResults(const tScriptOp *pOps,
+	uint16_t NbOps,
+	uint16_t *pFlags,
+	uint16_t *pRoom);
+
+uint8_t GetScriptEncoding(const tScriptOp *pOps,
+	uint16_t NbOps);
+
+uint8_t GetScriptMode(const tScriptOp *pOps,
+	uint16_t NbOps);
+
+void GetScriptTrigger(const tScriptOp *pOps,
+	uint16_t NbOps,
+	uint16_t *pLevel,
+	uint16_t *pPre,
+	uint16_t *pPost);
+
+uint16_t GetScriptBurstSamples(const tScriptOp *pOps,
+	uint16_t NbOps);
+
+eError ExecuteScript(const tScriptOp *pOps,
+	uint16_t NbOps,
 	uint16_t *pOutputBuffer,
 	uint16_t sizeOutputBuffer,
 	uint16_t *pNbEltOutputBuffer,
+	uint16_t *pFlags,
+	uint16_t *pIndexScriptError);
+
+eError ExecuteBurstSample(const tScriptOp *pOps,
+	uint16_t NbOps,
+	uint16_t *pOutputBuffer,
+	uint16_t *pNbEltOutputBuffer,
 	uint16_t *pIndexScriptError);
 
 #endif // MV2_SCRIPT_UTILIY_H
\ No newline at end of file
@@ -20,49 +20,13 @@
 //
 // Change log:
 //	01.02.16 SD	Original version
+//	17.10.26 MB Move CRC functions to MV2Crc.cpp
 //
 // Copyright (c) 2016 Metrolab Technology SA, Geneva,
 //	Switzerland
 
 #include "MV2Utility.h"
 
-/*
-	Generate CRC
-	Parameters:
-		[in]		pMessage	: pointer to the message
-		[in]		Size		: size of the message
-	Returns:
-		uint16_t
-*/
-
-uint16_t GenerateCrc(uint16_t *pMessage, uint16_t Size)
-{
-	uint16_t _Result = 0;
-
-	for (uint16_t _i = 0; _i<Size; _i++)
-		_Result ^= pMessage[_i];
-
-	return _Result;
-}
-
-/*
-	Check CRC
-	Parameters:
-		[in]		pBuffer		: pointer to the buffer
-		[in]		Size		: size of the buffer
-	Returns:
-		bool
-*/
-bool CheckCrc(uint16_t *pBuffer, uint16_t Size)
-{
-	uint16_t _Result = 0;
-
-	for (uint16_t _i = 0; _i<Size; _i++)
-		_Result ^= pBuffer[_i];
-
-	return (_Result == 0);
-}
-
 /*
     Return free memory
     Parameters:
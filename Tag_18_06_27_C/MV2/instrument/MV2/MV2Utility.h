@@ -5,7 +5,7 @@
 // Utility function
 //
 // Description:
-// Handle CRC 
+// Free memory. CRC is handled in MV2Crc.h
 //
 // Coding Conventions:
 //	- Variable names use the "InterCaps" convention
@@ -21,6 +21,7 @@
 // Change log:
 //	01.02.16 SD	Original version
 //  03.04.17 PK Add freeRam
+//	17.10.26 MB Move CRC functions to MV2Crc.h, the CRC is now CRC-16/CCITT
 //
 // Copyright (c) 2016 Metrolab Technology SA, Geneva,
 //	Switzerland
@@ -30,8 +31,6 @@
 
 #include "Arduino.h"
 
-uint16_t GenerateCrc(uint16_t *pMessage, uint16_t Size);
-bool CheckCrc(uint16_t *pBuffer, uint16_t Size);
 int freeRam (void);
 
 
@@ -7,7 +7,7 @@ comPort = "/dev/ttyACM0"
 mxrFolderPath = "./mxr_files/"
 
 def applyScriptMV2Host(scriptXMLFile, schemaXMLFile=schemaXMLFile):
-    result = subprocess.check_output([exePath, scriptXMLFile, schemaXMLFile, comPort, getNewMXRPath()])
+    result = subprocess.check_output([exePath, "--no-reset", scriptXMLFile, schemaXMLFile, comPort, getNewMXRPath()])
     return [int(x) for x in result.decode("utf-8").rstrip().split(',')]
 
 def modifyScriptXML(scriptXMLFile, newScriptXMLFile, keys=[], values=[]):